@@ -0,0 +1,985 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "bvh.hpp"
+#include "camera.hpp"
+#include "color.hpp"
+#include "compiled_scene.hpp"
+#include "denoise.hpp"
+#include "frozen_scene.hpp"
+#include "hittable.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+#include "random.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "sphere.hpp"
+#include "sphere_set.hpp"
+#include "vec3.hpp"
+
+// Microbenchmarks for the hot paths of the renderer.
+//
+// Every benchmark is calibrated until one repetition takes at least --min-time seconds, run
+// --warmup times untimed, then --repetitions times. The thread's generator is reseeded from
+// --seed before each of those runs, so every repetition does exactly the same work and
+// results from different commits can be compared. --json writes the results for CI.
+
+template <typename T>
+inline void do_not_optimize(const T &value) {
+    // Makes the compiler assume value is read, so the work producing it cannot be dropped.
+#ifdef __GNUC__
+    asm volatile("" : : "g"(&value) : "memory");
+#else
+    static volatile const void *sink;
+    sink = &value;
+#endif
+}
+
+class NullBuffer : public std::streambuf {
+    // Accepts and discards everything, so stream formatting still happens.
+    protected:
+        int overflow(int c) override { return c; }
+        std::streamsize xsputn(const char *, std::streamsize count) override { return count; }
+};
+
+struct Benchmark {
+    std::string name;
+    std::function<void()> setup;                // Builds the inputs, only when the benchmark is selected
+    std::function<uint64_t(uint64_t)> run;      // Runs n iterations and returns the items processed
+    std::function<void()> teardown;             // Frees what setup built
+    std::string unit = "op";                    // What one item is, for the throughput column
+};
+
+struct BenchResult {
+    std::string name;
+    std::string unit;
+    uint64_t iterations = 0;        // Iterations in every repetition
+    std::vector<double> ns_per_op;  // One entry per repetition
+    double items_per_second = 0;    // Over all repetitions
+
+    double mean() const {
+        double sum = 0;
+        for (double ns : ns_per_op) sum += ns;
+        return sum / ns_per_op.size();
+    }
+
+    double median() const {
+        std::vector<double> sorted(ns_per_op);
+        std::sort(sorted.begin(), sorted.end());
+        size_t n = sorted.size();
+        return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    }
+
+    double min() const { return *std::min_element(ns_per_op.begin(), ns_per_op.end()); }
+    double max() const { return *std::max_element(ns_per_op.begin(), ns_per_op.end()); }
+
+    double stddev() const {
+        // Sample standard deviation, 0 for a single repetition.
+        if (ns_per_op.size() < 2) {
+            return 0;
+        }
+        double m = mean(), sum = 0;
+        for (double ns : ns_per_op) sum += (ns - m) * (ns - m);
+        return std::sqrt(sum / (ns_per_op.size() - 1));
+    }
+};
+
+struct BenchOptions {
+    uint64_t seed = 1;
+    int warmup = 1;
+    int repetitions = 5;
+    double min_time = 0.1;  // Seconds per repetition
+    int list_max = 1000000; // Largest HittableList benchmarked
+    int frame_width = 160;
+    int frame_spp = 4;
+    int threads = 1;
+};
+
+class BenchRunner {
+    public:
+        explicit BenchRunner(const BenchOptions &options) : _options(options) {}
+
+        BenchResult run(const Benchmark &bench) const {
+            BenchResult result;
+            result.name = bench.name;
+            result.unit = bench.unit;
+
+            if (bench.setup) {
+                reseed();
+                bench.setup();
+            }
+
+            // Double the iteration count until one repetition is long enough to time.
+            uint64_t iterations = 1;
+            while (true) {
+                double seconds = time(bench, iterations, nullptr);
+                if (seconds >= _options.min_time || iterations >= (uint64_t(1) << 40)) {
+                    break;
+                }
+                double scale = seconds > 0 ? 1.2 * _options.min_time / seconds : 16;
+                iterations = static_cast<uint64_t>(iterations * std::min(16.0, std::max(2.0, scale)));
+            }
+            result.iterations = iterations;
+
+            for (int i = 0; i < _options.warmup; ++i) {
+                time(bench, iterations, nullptr);
+            }
+
+            double total_seconds = 0;
+            uint64_t total_items = 0;
+            for (int i = 0; i < _options.repetitions; ++i) {
+                uint64_t items = 0;
+                double seconds = time(bench, iterations, &items);
+                result.ns_per_op.push_back(seconds * 1e9 / iterations);
+                total_seconds += seconds;
+                total_items += items;
+            }
+            result.items_per_second = total_seconds > 0 ? total_items / total_seconds : 0;
+
+            if (bench.teardown) {
+                bench.teardown();
+            }
+            return result;
+        }
+
+    private:
+        BenchOptions _options;
+
+        void reseed() const {
+            thread_rng().seed(_options.seed);
+            thread_rng_wide().seed(_options.seed);
+        }
+
+        double time(const Benchmark &bench, uint64_t iterations, uint64_t *items) const {
+            reseed();
+            auto start = std::chrono::steady_clock::now();
+            uint64_t processed = bench.run(iterations);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (items) {
+                *items = processed;
+            }
+            return elapsed.count();
+        }
+};
+
+static std::vector<ray> random_rays(size_t count, const point3 &target, float spread) {
+    // Rays from a ring around the origin at distance 10, aimed within spread of target.
+    std::vector<ray> rays;
+    rays.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        point3 origin = 10 * random_unit_vector();
+        point3 aim = target + spread * random_in_unit_sphere();
+        rays.push_back(ray(origin, aim - origin));
+    }
+    return rays;
+}
+
+static std::shared_ptr<HittableList> random_sphere_list(int count) {
+    // count small diffuse spheres scattered through a cube, sized so about the same fraction
+    // of rays hit something at every count.
+    auto list = std::make_shared<HittableList>();
+    auto material = std::make_shared<Lambertian>(color(0.5, 0.5, 0.5));
+    float radius = 2.0f / std::cbrt(static_cast<float>(count));
+    list->objects.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        list->add(std::make_shared<Sphere>(vec3::random(-5, 5), radius, material));
+    }
+    return list;
+}
+
+static std::shared_ptr<TriangleMesh> quad_grid_mesh(int cells) {
+    // Two sheets of cells x cells unit squares, each split along a diagonal, at y = 0 and
+    // y = -1, so a ray through the top sheet's edges also passes a farther triangle.
+    auto mesh = std::make_shared<TriangleMesh>(std::make_shared<Lambertian>(color(0.5, 0.5, 0.5)));
+    for (int layer = 0; layer < 2; ++layer) {
+        uint32_t base = static_cast<uint32_t>(mesh->vertex_count());
+        for (int j = 0; j <= cells; ++j) {
+            for (int i = 0; i <= cells; ++i) {
+                mesh->add_vertex(point3(i, -layer, j));
+            }
+        }
+        for (int j = 0; j < cells; ++j) {
+            for (int i = 0; i < cells; ++i) {
+                uint32_t a = base + j * (cells + 1) + i;
+                uint32_t c = a + cells + 1;
+                mesh->add_triangle(a, a + 1, c + 1);
+                mesh->add_triangle(a, c + 1, c);
+            }
+        }
+    }
+    std::string error;
+    mesh->build(1, error);
+    return mesh;
+}
+
+static std::vector<ray> shared_edge_rays(int cells) {
+    // Rays through the top sheet of quad_grid_mesh() exactly at its inner vertices, on its
+    // edges and on the diagonals, straight down and slanted, all reaching the sheet at t = 2.
+    const vec3 directions[] = {vec3(0, -1, 0), vec3(0.3f, -1, 0.2f), vec3(-0.2f, -1, 0.45f)};
+    const float offsets[][2] = {{0, 0}, {0.5f, 0}, {0, 0.5f}, {0.25f, 0.25f}, {0.5f, 0.5f}, {0.75f, 0.75f}};
+    std::vector<ray> rays;
+    for (int j = 1; j < cells; ++j) {
+        for (int i = 1; i < cells; ++i) {
+            for (const auto &offset : offsets) {
+                point3 p(i + offset[0], 0, j + offset[1]);
+                for (const vec3 &d : directions) {
+                    rays.push_back(ray(p - 2 * d, d));
+                }
+            }
+        }
+    }
+    return rays;
+}
+
+static bool check_mesh_edges(std::ostream &out) {
+    // Every triangle test path has to find the near sheet for every ray through its shared
+    // edges and vertices, and the paths have to agree on where.
+    const int cells = 8;
+    std::shared_ptr<TriangleMesh> mesh = quad_grid_mesh(cells);
+    std::vector<ray> rays = shared_edge_rays(cells);
+    struct Path { const char *name; TriangleMesh::LeafTest test; };
+    const Path paths[] = {{"scalar", TriangleMesh::LeafTest::Scalar}, {"sse", TriangleMesh::LeafTest::Sse},
+                          {"avx2", TriangleMesh::LeafTest::Avx2}};
+
+    std::vector<float> scalar_t(rays.size());
+    bool ok = true;
+    for (const Path &path : paths) {
+        mesh->leaf_test = path.test;
+        size_t misses = 0, disagreements = 0;
+        for (size_t k = 0; k < rays.size(); ++k) {
+            HitRecord rec;
+            float t = rec.t = -1;
+            if (mesh->intersect(rays[k], Interval(0.001f, infinity), rec)) {
+                t = rec.t;
+            }
+            if (fabsf(t - 2) > 1e-4f) {
+                ++misses;
+            }
+            if (path.test == TriangleMesh::LeafTest::Scalar) {
+                scalar_t[k] = t;
+            } else if (t != scalar_t[k]) {
+                ++disagreements;
+            }
+        }
+        out << "mesh shared edges, " << path.name << ": " << rays.size() << " rays, " << misses << " missed, "
+            << disagreements << " differing from scalar\n";
+        ok = ok && misses == 0 && disagreements == 0;
+    }
+    mesh->leaf_test = TriangleMesh::LeafTest::Widest;
+    return ok;
+}
+
+static std::vector<Benchmark> make_benchmarks(const BenchOptions &options) {
+    std::vector<Benchmark> benches;
+    const size_t ray_count = 1024; // Inputs are cycled through, small enough to stay in cache
+
+    // Sphere::hit
+    {
+        auto sphere = std::make_shared<Sphere>(point3(0, 0, 0), 1.0f, std::make_shared<Lambertian>(color(1, 1, 1)));
+        auto hit_rays = std::make_shared<std::vector<ray>>();
+        auto miss_rays = std::make_shared<std::vector<ray>>();
+
+        Benchmark hit;
+        hit.name = "sphere/hit";
+        hit.setup = [=]() { *hit_rays = random_rays(ray_count, point3(0, 0, 0), 0.5f); };
+        hit.run = [=](uint64_t n) {
+            HitRecord rec;
+            uint64_t hits = 0;
+            for (uint64_t i = 0; i < n; ++i) {
+                hits += sphere->hit((*hit_rays)[i % ray_count], Interval(0.001f, infinity), rec);
+                do_not_optimize(rec);
+            }
+            do_not_optimize(hits);
+            return n;
+        };
+        benches.push_back(hit);
+
+        Benchmark miss;
+        miss.name = "sphere/miss";
+        miss.setup = [=]() { *miss_rays = random_rays(ray_count, point3(0, 5, 0), 0.5f); };
+        miss.run = [=](uint64_t n) {
+            HitRecord rec;
+            uint64_t hits = 0;
+            for (uint64_t i = 0; i < n; ++i) {
+                hits += sphere->hit((*miss_rays)[i % ray_count], Interval(0.001f, infinity), rec);
+                do_not_optimize(rec);
+            }
+            do_not_optimize(hits);
+            return n;
+        };
+        benches.push_back(miss);
+    }
+
+    // HittableList::hit, a linear scan over N spheres
+    for (int count = 10; count <= options.list_max; count *= 10) {
+        auto list = std::make_shared<std::shared_ptr<HittableList>>();
+        auto rays = std::make_shared<std::vector<ray>>();
+
+        Benchmark bench;
+        bench.name = "hittable_list/hit/" + std::to_string(count);
+        bench.unit = "sphere";
+        bench.setup = [=]() {
+            *list = random_sphere_list(count);
+            *rays = random_rays(ray_count, point3(0, 0, 0), 5.0f);
+        };
+        bench.run = [=](uint64_t n) {
+            HitRecord rec;
+            for (uint64_t i = 0; i < n; ++i) {
+                bool hit = (*list)->hit((*rays)[i % ray_count], Interval(0.001f, infinity), rec);
+                do_not_optimize(hit);
+                do_not_optimize(rec);
+            }
+            return n * count;
+        };
+        bench.teardown = [=]() { list->reset(); };
+        benches.push_back(bench);
+
+        // The same rays asking only whether anything is in the way
+        Benchmark any_hit = bench;
+        any_hit.name = "hittable_list/occluded/" + std::to_string(count);
+        any_hit.run = [=](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                bool hit = (*list)->occluded((*rays)[i % ray_count], Interval(0.001f, infinity));
+                do_not_optimize(hit);
+            }
+            return n * count;
+        };
+        benches.push_back(any_hit);
+    }
+
+    // Closest hits among list_max spheres with a material each, as main.cpp's scenes have:
+    // a Bvh over shared_ptr objects, then the same spheres frozen into an arena. The
+    // /occluded variants ask the any-hit question of the same rays.
+    {
+        auto list = std::make_shared<std::shared_ptr<HittableList>>();
+        auto bvh = std::make_shared<std::unique_ptr<Bvh>>();
+        auto frozen = std::make_shared<std::unique_ptr<FrozenScene>>();
+        auto rays = std::make_shared<std::vector<ray>>();
+        int count = options.list_max;
+        auto make_list = [=]() {
+            *list = random_sphere_list(count);
+            for (auto &object : (*list)->objects) {
+                const Sphere &sphere = static_cast<const Sphere&>(*object);
+                object = std::make_shared<Sphere>(sphere.center(), sphere.radius(),
+                                                  std::make_shared<Lambertian>(color::random()));
+            }
+            *rays = random_rays(ray_count, point3(0, 0, 0), 5.0f);
+        };
+
+        Benchmark shared;
+        shared.name = "scene/shared_ptr_bvh/" + std::to_string(count);
+        shared.unit = "ray";
+        shared.setup = [=]() {
+            make_list();
+            bvh->reset(new Bvh(**list, options.threads));
+        };
+        shared.run = [=](uint64_t n) {
+            HitRecord rec;
+            for (uint64_t i = 0; i < n; ++i) {
+                bool hit = (*bvh)->hit((*rays)[i % ray_count], Interval(0.001f, infinity), rec);
+                do_not_optimize(hit);
+                do_not_optimize(rec);
+            }
+            return n;
+        };
+        shared.teardown = [=]() {
+            bvh->reset();
+            list->reset();
+        };
+        benches.push_back(shared);
+
+        Benchmark shared_any = shared;
+        shared_any.name = "scene/shared_ptr_bvh/" + std::to_string(count) + "/occluded";
+        shared_any.run = [=](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                bool hit = (*bvh)->occluded((*rays)[i % ray_count], Interval(0.001f, infinity));
+                do_not_optimize(hit);
+            }
+            return n;
+        };
+        benches.push_back(shared_any);
+
+        Benchmark arena;
+        arena.name = "scene/frozen/" + std::to_string(count);
+        arena.unit = "ray";
+        arena.setup = [=]() {
+            make_list();
+            SceneBuilder builder;
+            std::string error;
+            builder.add(**list, error);
+            list->reset();
+            *frozen = builder.freeze(options.threads);
+        };
+        arena.run = [=](uint64_t n) {
+            HitRecord rec;
+            for (uint64_t i = 0; i < n; ++i) {
+                bool hit = (*frozen)->hit((*rays)[i % ray_count], Interval(0.001f, infinity), rec);
+                do_not_optimize(hit);
+                do_not_optimize(rec);
+            }
+            return n;
+        };
+        arena.teardown = [=]() { frozen->reset(); };
+        benches.push_back(arena);
+
+        Benchmark arena_any = arena;
+        arena_any.name = "scene/frozen/" + std::to_string(count) + "/occluded";
+        arena_any.run = [=](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                bool hit = (*frozen)->occluded((*rays)[i % ray_count], Interval(0.001f, infinity));
+                do_not_optimize(hit);
+            }
+            return n;
+        };
+        benches.push_back(arena_any);
+    }
+
+    // TriangleMesh::intersect through each leaf test path, on the rays of check_mesh_edges()
+    {
+        const int cells = 8;
+        auto mesh = std::make_shared<std::shared_ptr<TriangleMesh>>();
+        auto rays = std::make_shared<std::vector<ray>>();
+        struct Path { const char *name; TriangleMesh::LeafTest test; };
+        const Path paths[] = {{"scalar", TriangleMesh::LeafTest::Scalar}, {"sse", TriangleMesh::LeafTest::Sse},
+                              {"avx2", TriangleMesh::LeafTest::Avx2}};
+        for (const Path &path : paths) {
+            TriangleMesh::LeafTest test = path.test;
+            Benchmark bench;
+            bench.name = std::string("mesh/shared_edges/") + path.name;
+            bench.unit = "ray";
+            bench.setup = [=]() {
+                *mesh = quad_grid_mesh(cells);
+                (*mesh)->leaf_test = test;
+                *rays = shared_edge_rays(cells);
+            };
+            bench.run = [=](uint64_t n) {
+                HitRecord rec;
+                for (uint64_t i = 0; i < n; ++i) {
+                    bool hit = (*mesh)->intersect((*rays)[i % rays->size()], Interval(0.001f, infinity), rec);
+                    do_not_optimize(hit);
+                    do_not_optimize(rec);
+                }
+                return n;
+            };
+            bench.teardown = [=]() { mesh->reset(); };
+            benches.push_back(bench);
+        }
+    }
+
+    // IMaterial::scatter, through the virtual call the renderer makes
+    {
+        struct MaterialCase { const char *name; std::shared_ptr<IMaterial> material; };
+        std::vector<MaterialCase> materials = {
+            {"lambertian", std::make_shared<Lambertian>(color(0.5, 0.5, 0.5))},
+            {"metal", std::make_shared<Metal>(color(0.7, 0.6, 0.5), 0.3)},
+            {"dielectric", std::make_shared<Dielectric>(1.5f)},
+        };
+        for (const auto &entry : materials) {
+            auto material = entry.material;
+            auto sphere = std::make_shared<Sphere>(point3(0, 0, 0), 1.0f, material);
+            auto rays = std::make_shared<std::vector<ray>>();
+            auto hits = std::make_shared<std::vector<HitRecord>>();
+
+            Benchmark bench;
+            bench.name = std::string("material/scatter/") + entry.name;
+            bench.setup = [=]() {
+                // Real hits on a unit sphere, front and back faces alike.
+                *rays = random_rays(ray_count, point3(0, 0, 0), 0.9f);
+                hits->clear();
+                for (const ray &r : *rays) {
+                    HitRecord rec;
+                    if (sphere->hit(r, Interval(-infinity, infinity), rec)) {
+                        hits->push_back(rec);
+                    }
+                }
+            };
+            bench.run = [=](uint64_t n) {
+                size_t count = hits->size();
+                color attenuation;
+                ray scattered;
+                for (uint64_t i = 0; i < n; ++i) {
+                    const HitRecord &rec = (*hits)[i % count];
+                    bool scatters = rec.mat->scatter((*rays)[i % count], rec, attenuation, scattered);
+                    do_not_optimize(scatters);
+                    do_not_optimize(scattered);
+                }
+                return n;
+            };
+            benches.push_back(bench);
+        }
+    }
+
+    // Sampling helpers
+    {
+        Benchmark unit_vector;
+        unit_vector.name = "random/unit_vector";
+        unit_vector.run = [](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                vec3 v = random_unit_vector();
+                do_not_optimize(v);
+            }
+            return n;
+        };
+        benches.push_back(unit_vector);
+
+        Benchmark unit_disk;
+        unit_disk.name = "random/in_unit_disk";
+        unit_disk.run = [](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                vec3 v = random_in_unit_disk();
+                do_not_optimize(v);
+            }
+            return n;
+        };
+        benches.push_back(unit_disk);
+
+        // One float per call against whole blocks from the wide generator.
+        Benchmark scalar_floats;
+        scalar_floats.name = "random/float";
+        scalar_floats.run = [](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                float x = random_float();
+                do_not_optimize(x);
+            }
+            return n;
+        };
+        benches.push_back(scalar_floats);
+
+        Benchmark bulk_floats;
+        bulk_floats.name = "random/floats";
+        bulk_floats.run = [](uint64_t n) {
+            float block[256];
+            for (uint64_t done = 0; done < n; done += 256) {
+                random_floats(block, 256);
+                do_not_optimize(block);
+            }
+            return (n + 255) / 256 * 256;
+        };
+        benches.push_back(bulk_floats);
+
+        const char *sampler_names[] = {"independent", "stratified", "sobol", "blue-noise"};
+        for (const char *name : sampler_names) {
+            SamplerType type = SamplerType::Independent;
+            parse_sampler_type(name, type);
+            auto sampler = make_sampler(type, 1, 64, 1920);
+
+            Benchmark bench;
+            bench.name = std::string("sampler/") + name + "/2d";
+            bench.run = [sampler](uint64_t n) {
+                for (uint64_t i = 0; i < n; ++i) {
+                    float u, v;
+                    sampler->get_2d(i >> 6, static_cast<uint32_t>(i & 63), 2, u, v);
+                    do_not_optimize(u);
+                    do_not_optimize(v);
+                }
+                return n;
+            };
+            benches.push_back(bench);
+        }
+    }
+
+    // vec3::unit
+    {
+        auto vectors = std::make_shared<std::vector<vec3>>();
+
+        Benchmark bench;
+        bench.name = "vec3/unit";
+        bench.setup = [=]() {
+            vectors->clear();
+            for (size_t i = 0; i < ray_count; ++i) {
+                vectors->push_back(vec3::random(-10, 10));
+            }
+        };
+        bench.run = [=](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                vec3 v = (*vectors)[i % ray_count].unit();
+                do_not_optimize(v);
+            }
+            return n;
+        };
+        benches.push_back(bench);
+    }
+
+    // vec3 arithmetic of the build's backend, one vector and one packet at a time
+    {
+        auto vectors = std::make_shared<std::vector<vec3>>();
+        auto fill = [=]() {
+            vectors->clear();
+            for (size_t i = 0; i < ray_count; ++i) {
+                vectors->push_back(vec3::random(-10, 10));
+            }
+        };
+
+        Benchmark dot;
+        dot.name = "vec3/dot";
+        dot.setup = fill;
+        dot.run = [=](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                float d = (*vectors)[i % ray_count].dot((*vectors)[(i + 1) % ray_count]);
+                do_not_optimize(d);
+            }
+            return n;
+        };
+        benches.push_back(dot);
+
+        Benchmark cross;
+        cross.name = "vec3/cross";
+        cross.setup = fill;
+        cross.run = [=](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                vec3 v = (*vectors)[i % ray_count].cross((*vectors)[(i + 1) % ray_count]);
+                do_not_optimize(v);
+            }
+            return n;
+        };
+        benches.push_back(cross);
+
+        Benchmark madd;
+        madd.name = "vec3/madd";
+        madd.setup = fill;
+        madd.run = [=](uint64_t n) {
+            // The a + t * b at the heart of ray.at() and the camera's pixel positions.
+            vec3 sum(0, 0, 0);
+            for (uint64_t i = 0; i < n; ++i) {
+                sum = sum + 0.5f * (*vectors)[i % ray_count];
+            }
+            do_not_optimize(sum);
+            return n;
+        };
+        benches.push_back(madd);
+
+        Benchmark packet;
+        packet.name = "vec3xN/unit";
+        packet.setup = fill;
+        packet.run = [=](uint64_t n) {
+            // Counts vectors, so the number is comparable with vec3/unit.
+            uint64_t packets = (n + vec3xN::width - 1) / vec3xN::width;
+            for (uint64_t p = 0; p < packets; ++p) {
+                vec3xN v;
+                for (int lane = 0; lane < vec3xN::width; ++lane) {
+                    v.set(lane, (*vectors)[(p * vec3xN::width + lane) % ray_count]);
+                }
+                vec3xN u = v.unit();
+                do_not_optimize(u);
+            }
+            return packets * vec3xN::width;
+        };
+        benches.push_back(packet);
+    }
+
+    // write_color, formatting included but into a discarding stream
+    {
+        auto colors = std::make_shared<std::vector<color>>();
+
+        Benchmark bench;
+        bench.name = "color/write_color";
+        bench.unit = "pixel";
+        bench.setup = [=]() {
+            colors->clear();
+            for (size_t i = 0; i < ray_count; ++i) {
+                colors->push_back(8 * color::random());
+            }
+        };
+        bench.run = [=](uint64_t n) {
+            NullBuffer buffer;
+            std::ostream out(&buffer);
+            for (uint64_t i = 0; i < n; ++i) {
+                write_color(out, (*colors)[i % ray_count], 8);
+            }
+            return n;
+        };
+        benches.push_back(bench);
+    }
+
+    // A whole frame of the random-spheres scene from main.cpp, through the Bvh
+    {
+        auto world = std::make_shared<HittableList>();
+        auto bvh = std::make_shared<std::unique_ptr<Bvh>>();
+        auto cam = std::make_shared<Camera>();
+
+        Benchmark bench;
+        bench.name = "frame/random_spheres/" + std::to_string(options.frame_width) + "x"
+                     + std::to_string(options.frame_spp) + "spp";
+        bench.unit = "ray";
+        bench.setup = [=]() {
+            world->clear();
+            random_spheres_scene(*world);
+            bvh->reset(new Bvh(*world, options.threads));
+
+            random_spheres_camera(*cam);
+            cam->image_width = options.frame_width;
+            cam->samples_per_pixel = options.frame_spp;
+            cam->thread_count = options.threads;
+            cam->seed = options.seed;
+        };
+        bench.run = [=](uint64_t n) {
+            // The renderer reports progress on std::clog, which would drown the results.
+            NullBuffer buffer;
+            std::streambuf *log = std::clog.rdbuf(&buffer);
+            uint64_t rays = 0;
+            for (uint64_t i = 0; i < n; ++i) {
+                Framebuffer image = cam->render_frame(**bvh);
+                do_not_optimize(image);
+                rays += cam->stats().rays;
+            }
+            std::clog.rdbuf(log);
+            return rays;
+        };
+        benches.push_back(bench);
+    }
+
+    // The same frame through the CompiledScene, the integrator instantiated for its types:
+    // side by side with the one above, the cost of the virtual calls
+    {
+        auto world = std::make_shared<HittableList>();
+        auto compiled = std::make_shared<CompiledScene>();
+        auto cam = std::make_shared<Camera>();
+
+        Benchmark bench;
+        bench.name = "frame/random_spheres_compiled/" + std::to_string(options.frame_width) + "x"
+                     + std::to_string(options.frame_spp) + "spp";
+        bench.unit = "ray";
+        bench.setup = [=]() {
+            world->clear();
+            random_spheres_scene(*world);
+            std::string error;
+            compiled->compile(*world, options.threads, error);
+
+            random_spheres_camera(*cam);
+            cam->image_width = options.frame_width;
+            cam->samples_per_pixel = options.frame_spp;
+            cam->thread_count = options.threads;
+            cam->seed = options.seed;
+        };
+        bench.run = [=](uint64_t n) {
+            NullBuffer buffer;
+            std::streambuf *log = std::clog.rdbuf(&buffer);
+            uint64_t rays = 0;
+            for (uint64_t i = 0; i < n; ++i) {
+                Framebuffer image = cam->render_frame(*compiled);
+                do_not_optimize(image);
+                rays += cam->stats().rays;
+            }
+            std::clog.rdbuf(log);
+            return rays;
+        };
+        benches.push_back(bench);
+    }
+
+    // The A-trous denoiser on a frame of the same scene, AOVs included
+    {
+        auto image = std::make_shared<Framebuffer>();
+        auto aovs = std::make_shared<AovBuffers>();
+
+        Benchmark bench;
+        bench.name = "denoise/random_spheres/" + std::to_string(options.frame_width) + "x"
+                     + std::to_string(options.frame_spp) + "spp";
+        bench.unit = "pixel";
+        bench.setup = [=]() {
+            HittableList world;
+            random_spheres_scene(world);
+            Bvh bvh(world, options.threads);
+            Camera cam;
+            random_spheres_camera(cam);
+            cam.image_width = options.frame_width;
+            cam.samples_per_pixel = options.frame_spp;
+            cam.thread_count = options.threads;
+            cam.seed = options.seed;
+            cam.collect_aovs = true;
+
+            NullBuffer buffer;
+            std::streambuf *log = std::clog.rdbuf(&buffer);
+            *image = cam.render_frame(bvh);
+            *aovs = cam.aovs();
+            std::clog.rdbuf(log);
+        };
+        bench.run = [=](uint64_t n) {
+            NullBuffer buffer;
+            std::streambuf *log = std::clog.rdbuf(&buffer);
+            Denoiser denoiser;
+            denoiser.thread_count = options.threads;
+            for (uint64_t i = 0; i < n; ++i) {
+                Framebuffer result = denoiser.denoise(*image, *aovs);
+                do_not_optimize(result);
+            }
+            std::clog.rdbuf(log);
+            return n * image->width() * image->height();
+        };
+        benches.push_back(bench);
+    }
+
+    return benches;
+}
+
+static std::string json_escape(const std::string &text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+static void write_json(std::ostream &out, const BenchOptions &options, const std::vector<BenchResult> &results) {
+    out << std::setprecision(9);
+    out << "{\n";
+    out << "  \"context\": {\n";
+    out << "    \"seed\": " << options.seed << ",\n";
+    out << "    \"warmup\": " << options.warmup << ",\n";
+    out << "    \"repetitions\": " << options.repetitions << ",\n";
+    out << "    \"min_time\": " << options.min_time << ",\n";
+    out << "    \"threads\": " << options.threads << ",\n";
+#ifdef RT_RNG_XOSHIRO128PLUS
+    out << "    \"rng\": \"xoshiro128plus\",\n";
+#else
+    out << "    \"rng\": \"pcg32\",\n";
+#endif
+#ifdef NDEBUG
+    out << "    \"optimized\": true,\n";
+#else
+    out << "    \"optimized\": false,\n";
+#endif
+#if defined(RT_VEC3_AVX)
+    out << "    \"vec3_backend\": \"avx\",\n";
+#elif defined(RT_VEC3_SSE)
+    out << "    \"vec3_backend\": \"sse\",\n";
+#else
+    out << "    \"vec3_backend\": \"scalar\",\n";
+#endif
+    out << "    \"sphere_set_simd_width\": " << SphereSet::simd_width() << "\n";
+    out << "  },\n";
+    out << "  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult &r = results[i];
+        out << (i ? ",\n" : "\n");
+        out << "    {\n";
+        out << "      \"name\": \"" << json_escape(r.name) << "\",\n";
+        out << "      \"iterations\": " << r.iterations << ",\n";
+        out << "      \"repetitions\": " << r.ns_per_op.size() << ",\n";
+        out << "      \"ns_per_op\": {\"mean\": " << r.mean() << ", \"median\": " << r.median()
+            << ", \"min\": " << r.min() << ", \"max\": " << r.max() << ", \"stddev\": " << r.stddev() << "},\n";
+        out << "      \"samples_ns_per_op\": [";
+        for (size_t k = 0; k < r.ns_per_op.size(); ++k) {
+            out << (k ? ", " : "") << r.ns_per_op[k];
+        }
+        out << "],\n";
+        out << "      \"unit\": \"" << json_escape(r.unit) << "\",\n";
+        out << "      \"items_per_second\": " << r.items_per_second << "\n";
+        out << "    }";
+    }
+    out << "\n  ]\n}\n";
+}
+
+static void print_result(std::ostream &out, const BenchResult &r) {
+    out << std::left << std::setw(36) << r.name << std::right << std::fixed << std::setprecision(2)
+        << std::setw(14) << r.median() << " ns"
+        << std::setw(10) << (r.mean() > 0 ? 100 * r.stddev() / r.mean() : 0) << " %"
+        << std::setw(14) << std::setprecision(3) << r.items_per_second / 1e6 << " M" << r.unit << "/s"
+        << std::defaultfloat << std::endl;
+}
+
+int main(int const argc, char const *const *const argv) {
+    BenchOptions options;
+    std::string filter;
+    std::string json;
+    bool list = false;
+    bool check = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json = argv[++i];
+        } else if (std::strcmp(argv[i], "--list") == 0) {
+            list = true;
+        } else if (std::strcmp(argv[i], "--check") == 0) {
+            check = true;
+        } else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            options.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            options.warmup = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc) {
+            options.repetitions = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            options.min_time = std::atof(argv[++i]);
+        } else if (std::strcmp(argv[i], "--list-max") == 0 && i + 1 < argc) {
+            options.list_max = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--frame-width") == 0 && i + 1 < argc) {
+            options.frame_width = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--frame-spp") == 0 && i + 1 < argc) {
+            options.frame_spp = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.threads = std::atoi(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << "\n"
+                      << "  [--list] [--check] [--filter SUBSTRING] [--json FILE|-]\n"
+                      << "                       (--check compares the SIMD paths and exits instead)\n"
+                      << "  [--seed N] [--warmup N] [--repetitions N] [--min-time SECONDS]\n"
+                      << "  [--list-max N] [--frame-width N] [--frame-spp N] [--threads N]\n";
+            return 1;
+        }
+    }
+
+    if (options.repetitions < 1 || options.warmup < 0) {
+        std::cerr << "Need at least one repetition and a non-negative warmup count\n";
+        return 1;
+    }
+
+    if (check) {
+        return check_mesh_edges(std::cout) ? 0 : 1;
+    }
+
+    std::vector<Benchmark> benches = make_benchmarks(options);
+    if (list) {
+        for (const Benchmark &bench : benches) {
+            std::cout << bench.name << "\n";
+        }
+        return 0;
+    }
+
+    // With --json -, stdout carries only the JSON and the table moves to stderr.
+    std::ostream &table = json == "-" ? std::cerr : std::cout;
+#ifndef NDEBUG
+    table << "Warning: benchmarks built without optimization, configure with -DCMAKE_BUILD_TYPE=Release\n";
+#endif
+    table << std::left << std::setw(36) << "benchmark" << std::right << std::setw(17) << "median/op"
+          << std::setw(12) << "stddev" << std::setw(22) << "throughput" << std::endl;
+
+    BenchRunner runner(options);
+    std::vector<BenchResult> results;
+    for (const Benchmark &bench : benches) {
+        if (!filter.empty() && bench.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        results.push_back(runner.run(bench));
+        print_result(table, results.back());
+    }
+
+    if (json == "-") {
+        write_json(std::cout, options, results);
+    } else if (!json.empty()) {
+        std::ofstream out(json);
+        if (!out) {
+            std::cerr << "Could not open " << json << " for writing\n";
+            return 1;
+        }
+        write_json(out, options, results);
+    }
+
+    return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include <cmath>
+
+#include "interval.hpp"
+#include "ray.hpp"
+#include "vec3.hpp"
+
+// Axis-aligned bounding box.
+class Aabb {
+    public:
+        point3 min, max;
+
+        Aabb() : min(+infinity, +infinity, +infinity), max(-infinity, -infinity, -infinity) {} // Empty box
+
+        Aabb(const point3 &a, const point3 &b)
+            : min(fminf(a.x, b.x), fminf(a.y, b.y), fminf(a.z, b.z)),
+              max(fmaxf(a.x, b.x), fmaxf(a.y, b.y), fmaxf(a.z, b.z)) {}
+
+        Aabb(const Aabb &a, const Aabb &b)
+            : min(fminf(a.min.x, b.min.x), fminf(a.min.y, b.min.y), fminf(a.min.z, b.min.z)),
+              max(fmaxf(a.max.x, b.max.x), fmaxf(a.max.y, b.max.y), fmaxf(a.max.z, b.max.z)) {}
+
+        bool is_empty() const {
+            return min.x > max.x || min.y > max.y || min.z > max.z;
+        }
+
+        void expand(const Aabb &b) { *this = Aabb(*this, b); }
+
+        void expand(const point3 &p) { *this = Aabb(*this, Aabb(p, p)); }
+
+        point3 centroid() const { return 0.5f * (min + max); }
+
+        vec3 extent() const { return max - min; }
+
+        float surface_area() const {
+            if (is_empty()) {
+                return 0;
+            }
+            vec3 d = extent();
+            return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+        }
+
+        int longest_axis() const {
+            vec3 d = extent();
+            if (d.x > d.y) {
+                return d.x > d.z ? 0 : 2;
+            }
+            return d.y > d.z ? 1 : 2;
+        }
+
+        bool hit(const point3 &origin, const vec3 &inv_direction, Interval ray_t, float &t_enter) const {
+            // Slab test against a ray given by its origin and the reciprocal of its direction.
+            // On a hit, t_enter is where the ray enters the box (clipped to ray_t).
+            // A NaN slab (a zero direction component with the origin on the plane) fails both
+            // comparisons and leaves the interval untouched.
+            for (int axis = 0; axis < 3; ++axis) {
+                float t0 = (min[axis] - origin[axis]) * inv_direction[axis];
+                float t1 = (max[axis] - origin[axis]) * inv_direction[axis];
+                if (inv_direction[axis] < 0) {
+                    float tmp = t0;
+                    t0 = t1;
+                    t1 = tmp;
+                }
+                ray_t.min = t0 > ray_t.min ? t0 : ray_t.min;
+                ray_t.max = t1 < ray_t.max ? t1 : ray_t.max;
+            }
+            t_enter = ray_t.min;
+            return ray_t.min <= ray_t.max;
+        }
+
+        bool hit(const ray &r, Interval ray_t) const {
+            vec3 d = r.direction();
+            float t_enter;
+            return hit(r.origin(), vec3(1 / d.x, 1 / d.y, 1 / d.z), ray_t, t_enter);
+        }
+};
+
+#endif // AABB_H
@@ -0,0 +1,47 @@
+#ifndef ALIGNED_H
+#define ALIGNED_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+// Allocator handing out storage aligned to `Alignment` bytes, for containers whose elements
+// should start on a cache line (BVH nodes) or on a SIMD register boundary (SoA arrays).
+// std::allocator only guarantees alignof(std::max_align_t) before C++17.
+template <typename T, size_t Alignment = 64>
+class AlignedAllocator {
+    public:
+        using value_type = T;
+
+        template <typename U>
+        struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+        AlignedAllocator() {}
+        template <typename U>
+        AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+        T* allocate(size_t n) {
+            // Over-allocates and stores the original pointer just in front of the aligned block.
+            size_t bytes = n * sizeof(T) + Alignment + sizeof(void*);
+            char *raw = static_cast<char*>(::operator new(bytes));
+            uintptr_t start = reinterpret_cast<uintptr_t>(raw + sizeof(void*));
+            uintptr_t aligned = (start + Alignment - 1) & ~static_cast<uintptr_t>(Alignment - 1);
+            reinterpret_cast<void**>(aligned)[-1] = raw;
+            return reinterpret_cast<T*>(aligned);
+        }
+
+        void deallocate(T *p, size_t) {
+            ::operator delete(reinterpret_cast<void**>(p)[-1]);
+        }
+
+        template <typename U>
+        bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+        template <typename U>
+        bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+template <typename T, size_t Alignment = 64>
+using aligned_vector = std::vector<T, AlignedAllocator<T, Alignment>>;
+
+#endif // ALIGNED_H
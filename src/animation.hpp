@@ -0,0 +1,472 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "bvh.hpp"
+#include "camera.hpp"
+#include "framebuffer.hpp"
+#include "hittable.hpp"
+#include "instance.hpp"
+#include "thread_pool.hpp"
+#include "transform.hpp"
+#include "vec3.hpp"
+
+// Camera and object keyframes, rendered as a sequence of frames over one persistent scene.
+//
+// The text form is one statement per line, '#' starts a comment:
+//
+//     frames 48
+//     camera 0 look_from 13 2 3 look_at 0 0 0 vfov 20
+//     camera 47 look_from 3 2 13 focus_dist 10 defocus_angle 0.6
+//     object 12 0 translate 0 0 0
+//     object 12 47 translate 0 2 0 rotate_y 90 scale 1.5
+//
+// A camera key sets any of look_from, look_at, vfov, focus_dist and defocus_angle at a
+// frame. An object key sets the translation, rotation about the vertical axis (degrees) and
+// uniform scale of the scene's object at INDEX, relative to where the scene put it and about
+// the centre of its bounds; what it leaves out is 0, 0 and 1. Each value is interpolated
+// linearly between the keys that set it and held before the first and after the last; camera
+// values never keyed keep the camera's own. Without a frames statement, the animation ends
+// at its last key.
+template<typename T>
+struct KeyTrack {
+    std::vector<std::pair<int, T>> keys; // Sorted by frame
+
+    bool empty() const { return keys.empty(); }
+
+    void set(int frame, const T &value) {
+        auto at = std::lower_bound(keys.begin(), keys.end(), frame,
+                                   [](const std::pair<int, T> &key, int f) { return key.first < f; });
+        if (at != keys.end() && at->first == frame) {
+            at->second = value;
+        } else {
+            keys.insert(at, std::make_pair(frame, value));
+        }
+    }
+
+    T at(int frame) const {
+        if (frame <= keys.front().first) {
+            return keys.front().second;
+        }
+        if (frame >= keys.back().first) {
+            return keys.back().second;
+        }
+        size_t next = 1;
+        while (keys[next].first < frame) {
+            ++next;
+        }
+        const auto &a = keys[next - 1];
+        const auto &b = keys[next];
+        float t = static_cast<float>(frame - a.first) / static_cast<float>(b.first - a.first);
+        return a.second * (1 - t) + b.second * t;
+    }
+};
+
+struct ObjectTrack {
+    size_t index; // Into the scene's objects
+    KeyTrack<vec3> translate;
+    KeyTrack<float> rotate_y;
+    KeyTrack<float> scale;
+
+    Transform at(int frame, const point3 &pivot) const {
+        // Placement relative to the object's own, about pivot.
+        return Transform::translate(pivot + translate.at(frame))
+             * Transform::rotate(vec3(0, 1, 0), rotate_y.at(frame))
+             * Transform::scale(scale.at(frame))
+             * Transform::translate(-pivot);
+    }
+};
+
+class Animation {
+    public:
+        int frames = 0;
+
+        KeyTrack<point3> look_from;
+        KeyTrack<point3> look_at;
+        KeyTrack<float> vfov;
+        KeyTrack<float> focus_dist;
+        KeyTrack<float> defocus_angle;
+
+        std::vector<ObjectTrack> objects; // By index
+
+        static Animation turntable(const Camera &cam, int frames) {
+            // One orbit of look_from around look_at, about the vertical axis.
+            Animation animation;
+            animation.frames = frames;
+            vec3 offset = cam.look_from - cam.look_at;
+            for (int frame = 0; frame < frames; ++frame) {
+                Transform spin = Transform::rotate(vec3(0, 1, 0), 360.0f * frame / frames);
+                animation.look_from.set(frame, cam.look_at + spin.apply_vector(offset));
+            }
+            return animation;
+        }
+
+        bool load(const std::string &path, std::string &error) {
+            std::ifstream in(path);
+            if (!in) {
+                error = "could not open " + path;
+                return false;
+            }
+            *this = Animation();
+            std::map<size_t, size_t> object_slots;
+            int last_key = -1;
+
+            std::string text;
+            for (int line = 1; std::getline(in, text); ++line) {
+                std::string message;
+                if (!parse_line(text, object_slots, last_key, message)) {
+                    error = path + ": line " + std::to_string(line) + ": " + message;
+                    return false;
+                }
+            }
+            if (frames == 0) {
+                frames = last_key + 1;
+            }
+            if (frames <= 0) {
+                error = path + ": no frames";
+                return false;
+            }
+            return true;
+        }
+
+        void apply(int frame, Camera &cam) const {
+            // The camera at frame, from cam's own settings and the keys.
+            if (!look_from.empty()) cam.look_from = look_from.at(frame);
+            if (!look_at.empty()) cam.look_at = look_at.at(frame);
+            if (!vfov.empty()) cam.vfov = vfov.at(frame);
+            if (!focus_dist.empty()) cam.focus_dist = focus_dist.at(frame);
+            if (!defocus_angle.empty()) cam.defocus_angle = defocus_angle.at(frame);
+        }
+
+    private:
+        bool parse_line(const std::string &text, std::map<size_t, size_t> &object_slots, int &last_key,
+                        std::string &message) {
+            std::istringstream line(text.substr(0, text.find('#')));
+            std::string statement;
+            if (!(line >> statement)) {
+                return true;
+            }
+
+            if (statement == "frames") {
+                if (!(line >> frames) || frames <= 0) {
+                    message = "frames takes a positive count";
+                    return false;
+                }
+                return at_end(line, message);
+            }
+
+            if (statement == "camera") {
+                int frame;
+                if (!(line >> frame) || frame < 0) {
+                    message = "camera takes a frame number first";
+                    return false;
+                }
+                last_key = std::max(last_key, frame);
+                std::string field;
+                bool any = false;
+                while (line >> field) {
+                    any = true;
+                    bool read;
+                    if (field == "look_from" || field == "look_at") {
+                        point3 p;
+                        read = static_cast<bool>(line >> p.x >> p.y >> p.z);
+                        (field == "look_from" ? look_from : look_at).set(frame, p);
+                    } else if (field == "vfov" || field == "focus_dist" || field == "defocus_angle") {
+                        float value = 0;
+                        read = static_cast<bool>(line >> value);
+                        (field == "vfov" ? vfov : field == "focus_dist" ? focus_dist : defocus_angle).set(frame, value);
+                    } else {
+                        message = "unknown camera field " + field;
+                        return false;
+                    }
+                    if (!read) {
+                        message = "missing value for " + field;
+                        return false;
+                    }
+                }
+                if (!any) {
+                    message = "camera key without fields";
+                    return false;
+                }
+                return true;
+            }
+
+            if (statement == "object") {
+                long long index;
+                int frame;
+                if (!(line >> index >> frame) || index < 0 || frame < 0) {
+                    message = "object takes an object index and a frame number first";
+                    return false;
+                }
+                last_key = std::max(last_key, frame);
+                vec3 offset(0, 0, 0);
+                float degrees = 0;
+                float factor = 1;
+                std::string field;
+                while (line >> field) {
+                    bool read;
+                    if (field == "translate") {
+                        read = static_cast<bool>(line >> offset.x >> offset.y >> offset.z);
+                    } else if (field == "rotate_y") {
+                        read = static_cast<bool>(line >> degrees);
+                    } else if (field == "scale") {
+                        read = static_cast<bool>(line >> factor);
+                    } else {
+                        message = "unknown object field " + field;
+                        return false;
+                    }
+                    if (!read) {
+                        message = "missing value for " + field;
+                        return false;
+                    }
+                }
+                auto slot = object_slots.emplace(static_cast<size_t>(index), objects.size());
+                if (slot.second) {
+                    objects.push_back(ObjectTrack());
+                    objects.back().index = static_cast<size_t>(index);
+                }
+                ObjectTrack &track = objects[slot.first->second];
+                track.translate.set(frame, offset);
+                track.rotate_y.set(frame, degrees);
+                track.scale.set(frame, factor);
+                return true;
+            }
+
+            message = "unknown statement " + statement;
+            return false;
+        }
+
+        static bool at_end(std::istringstream &line, std::string &message) {
+            std::string rest;
+            if (line >> rest) {
+                message = "unexpected " + rest;
+                return false;
+            }
+            return true;
+        }
+};
+
+struct FrameTiming {
+    double setup_seconds  = 0; // Camera, object transforms and acceleration structure update
+    double render_seconds = 0;
+    bool   rebuilt = false;    // The Bvh was rebuilt rather than refitted
+};
+
+struct AnimationStats {
+    std::vector<FrameTiming> frames;
+    double elapsed_seconds = 0;
+    int    refits = 0;
+    int    rebuilds = 0;
+};
+
+inline std::ostream& operator<<(std::ostream &out, const AnimationStats &stats) {
+    double setup = 0, render = 0;
+    for (const FrameTiming &frame : stats.frames) {
+        setup += frame.setup_seconds;
+        render += frame.render_seconds;
+    }
+    return out << "Animation: " << stats.frames.size() << " frames in " << stats.elapsed_seconds << "s, "
+               << setup << "s setup and " << render << "s rendering across frames, "
+               << stats.refits << " BVH refits, " << stats.rebuilds << " rebuilds";
+}
+
+inline bool expand_frame_pattern(const std::string &pattern, int frame, std::string &path) {
+    // Replaces the one %d of pattern, with optional flags and width, by frame; %% is a
+    // literal percent sign. False for patterns with no or several conversions, or any other.
+    // The pattern comes from the command line, so it never reaches printf as a format.
+    path.clear();
+    bool converted = false;
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        if (pattern[i] != '%') {
+            path += pattern[i];
+            continue;
+        }
+        if (i + 1 < pattern.size() && pattern[i + 1] == '%') {
+            path += '%';
+            ++i;
+            continue;
+        }
+        std::string spec = "%";
+        size_t k = i + 1;
+        while (k < pattern.size() && pattern[k] != '\0' && std::strchr("-+ 0#", pattern[k])
+               && spec.size() < 6) {
+            spec += pattern[k++];
+        }
+        size_t digits = 0;
+        while (k < pattern.size() && pattern[k] >= '0' && pattern[k] <= '9' && digits < 2) {
+            spec += pattern[k++];
+            ++digits;
+        }
+        if (converted || k >= pattern.size() || pattern[k] != 'd') {
+            return false;
+        }
+        spec += 'd';
+        char number[128];
+        std::snprintf(number, sizeof(number), spec.c_str(), frame);
+        path += number;
+        converted = true;
+        i = k;
+    }
+    return converted;
+}
+
+inline std::string frame_path(const std::string &pattern, int frame) {
+    // A pattern such as "out_%03d.png", or the frame number before the extension.
+    std::string path;
+    if (pattern.find('%') != std::string::npos && expand_frame_pattern(pattern, frame, path)) {
+        return path;
+    }
+    char number[32];
+    std::snprintf(number, sizeof(number), "_%04d", frame);
+    size_t slash = pattern.find_last_of("/\\");
+    size_t dot = pattern.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return pattern + number;
+    }
+    return pattern.substr(0, dot) + number + pattern.substr(dot);
+}
+
+// Renders an Animation's frames against one scene that stays loaded throughout.
+//
+// The objects it moves are wrapped in Instances by attach(), before the acceleration
+// structure is built over the scene. Each frame then only updates their transforms and
+// refits the Bvh; when the refitted tree's SAH cost has grown past rebuild_threshold times
+// that of the last build, it is rebuilt instead. Those frames render one after another with
+// every thread, as the scene changes under them. When only the camera moves, frames share the
+// scene untouched and frames_in_flight of them render at once, the threads split between
+// them, so the serial ends of one frame overlap with the work of the others.
+class AnimationRenderer {
+    public:
+        int   thread_count = 0;         // Threads across all frames, 0 uses every hardware thread
+        int   frames_in_flight = 2;     // Frames rendered at once when the scene is static
+        float rebuild_threshold = 1.5f; // Refitted over built SAH cost past which the Bvh is rebuilt
+
+        explicit AnimationRenderer(const Animation &animation) : _animation(animation) {}
+
+        bool attach(HittableList &world, std::string &error) {
+            // Wraps the animated objects in Instances that can be moved. Call before building
+            // an acceleration structure over world.
+            _tracks.clear();
+            for (const ObjectTrack &track : _animation.objects) {
+                if (track.index >= world.objects.size()) {
+                    error = "the animation moves object " + std::to_string(track.index) + " of a scene with "
+                          + std::to_string(world.objects.size());
+                    return false;
+                }
+                // An Instance is folded into the new one, keeping its placement.
+                auto instance = std::make_shared<Instance>(world.objects[track.index], Transform());
+                world.objects[track.index] = instance;
+                _tracks.push_back(Tracked{&track, instance, instance->world_to_object().inverse(),
+                                          instance->bounding_box().centroid()});
+            }
+            world.refit();
+            return true;
+        }
+
+        bool moves_objects() const { return !_tracks.empty(); }
+
+        void render(const Camera &base, HittableList &world, Bvh *bvh,
+                    const std::function<Framebuffer(Camera&)> &render_frame,
+                    const std::function<void(int, Framebuffer&&)> &done) {
+            // Renders every frame with render_frame and hands it to done, from several threads
+            // at once when the frames overlap. bvh is the structure over world, or null.
+            _stats = AnimationStats();
+            _stats.frames.resize(_animation.frames);
+            auto start = std::chrono::steady_clock::now();
+
+            if (moves_objects()) {
+                float built_cost = bvh ? bvh->stats().sah_cost : 0;
+                for (int frame = 0; frame < _animation.frames; ++frame) {
+                    FrameTiming &timing = _stats.frames[frame];
+                    auto setup_start = std::chrono::steady_clock::now();
+                    Camera cam = base;
+                    _animation.apply(frame, cam);
+                    for (const Tracked &tracked : _tracks) {
+                        tracked.instance->set_transform(tracked.track->at(frame, tracked.pivot) * tracked.base);
+                    }
+                    world.refit();
+                    if (bvh) {
+                        float cost = bvh->refit();
+                        ++_stats.refits;
+                        if (cost > rebuild_threshold * built_cost) {
+                            bvh->rebuild(thread_count);
+                            built_cost = bvh->stats().sah_cost;
+                            timing.rebuilt = true;
+                            ++_stats.rebuilds;
+                        }
+                    }
+                    timing.setup_seconds = seconds_since(setup_start);
+                    render_one(frame, cam, render_frame, done);
+                }
+            } else {
+                int total = thread_count > 0 ? thread_count : static_cast<int>(std::thread::hardware_concurrency());
+                int in_flight = std::max(1, std::min(frames_in_flight, _animation.frames));
+                int per_frame = std::max(1, total / in_flight);
+                std::atomic<int> next(0);
+                ThreadPool pool(in_flight);
+                for (int slot = 0; slot < in_flight; ++slot) {
+                    pool.submit([&]() {
+                        for (int frame = next++; frame < _animation.frames; frame = next++) {
+                            auto setup_start = std::chrono::steady_clock::now();
+                            Camera cam = base;
+                            cam.thread_count = per_frame;
+                            _animation.apply(frame, cam);
+                            _stats.frames[frame].setup_seconds = seconds_since(setup_start);
+                            render_one(frame, cam, render_frame, done);
+                        }
+                    });
+                }
+                pool.wait();
+            }
+            _stats.elapsed_seconds = seconds_since(start);
+        }
+
+        const AnimationStats& stats() const { return _stats; }
+
+    private:
+        struct Tracked {
+            const ObjectTrack *track;
+            std::shared_ptr<Instance> instance;
+            Transform base;  // The instance's object to world transform before animating
+            point3 pivot;    // Centre of its bounds there
+        };
+
+        const Animation &_animation;
+        std::vector<Tracked> _tracks;
+        AnimationStats _stats;
+
+        void render_one(int frame, Camera &cam, const std::function<Framebuffer(Camera&)> &render_frame,
+                        const std::function<void(int, Framebuffer&&)> &done) {
+            FrameTiming &timing = _stats.frames[frame];
+            auto render_start = std::chrono::steady_clock::now();
+            Framebuffer image = render_frame(cam);
+            timing.render_seconds = seconds_since(render_start);
+            std::clog << "Frame " << frame << ": setup " << timing.setup_seconds * 1000 << "ms"
+                      << (timing.rebuilt ? " (BVH rebuilt)" : "") << ", render " << timing.render_seconds << "s"
+                      << std::endl;
+            done(frame, std::move(image));
+        }
+
+        static double seconds_since(std::chrono::steady_clock::time_point start) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            return elapsed.count();
+        }
+};
+
+#endif // ANIMATION_H
@@ -0,0 +1,47 @@
+#ifndef AOV_H
+#define AOV_H
+
+#include "color.hpp"
+#include "framebuffer.hpp"
+#include "vec3.hpp"
+
+// Arbitrary output variables: what the camera rays hit first, averaged over each pixel's
+// samples like the beauty image. They are noise free away from glossy and defocused areas,
+// which makes them the edge-stopping guides of the denoiser.
+struct FirstHit {
+    color albedo;    // Material albedo, or the sky's color for rays that escape
+    vec3  normal;    // Shading normal, facing the ray; zero for rays that escape
+    float depth = 0; // Distance from the camera; zero for rays that escape
+};
+
+struct AovBuffers {
+    Framebuffer albedo;
+    Framebuffer normal;
+    Framebuffer depth; // Distance in every channel
+
+    AovBuffers() {}
+
+    AovBuffers(int width, int height) : albedo(width, height), normal(width, height), depth(width, height) {}
+
+    bool empty() const { return albedo.width() == 0; }
+
+    void add_samples(int i, int j, const color &albedo_sum, const vec3 &normal_sum, float depth_sum,
+                     uint32_t count) {
+        albedo.add_samples(i, j, albedo_sum, count);
+        normal.add_samples(i, j, normal_sum, count);
+        depth.add_samples(i, j, color(depth_sum, depth_sum, depth_sum), count);
+    }
+};
+
+inline Framebuffer normal_image(const Framebuffer &normal) {
+    // Normals mapped from [-1,1] to [0,1] per axis, the usual way to look at them.
+    Framebuffer image(normal.width(), normal.height());
+    for (int j = 0; j < normal.height(); ++j) {
+        for (int i = 0; i < normal.width(); ++i) {
+            image.add_samples(i, j, 0.5f * (normal.average(i, j) + color(1, 1, 1)), 1);
+        }
+    }
+    return image;
+}
+
+#endif // AOV_H
@@ -0,0 +1,97 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump allocator for objects that live and die together, such as a frozen scene's.
+//
+// Memory comes from large blocks and is handed out by moving a cursor, so consecutive
+// allocations sit next to each other and cost no more than the cursor update. Nothing is freed
+// on its own: the objects' destructors run, newest first, and the blocks are released when the
+// arena goes. Allocations larger than a quarter of a block get a block of their own.
+class Arena {
+    public:
+        explicit Arena(size_t block_size = size_t(1) << 20)
+            : _block_size(block_size), _cursor(nullptr), _end(nullptr), _used(0), _reserved(0),
+              _destructors(nullptr) {}
+
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        ~Arena() {
+            for (Destructor *d = _destructors; d; d = d->next) {
+                d->destroy(d->object);
+            }
+        }
+
+        void* allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+            // alignment is a power of two.
+            uintptr_t at = (reinterpret_cast<uintptr_t>(_cursor) + alignment - 1) & ~(uintptr_t(alignment) - 1);
+            if (!_cursor || at + size > reinterpret_cast<uintptr_t>(_end)) {
+                if (size + alignment > _block_size / 4) {
+                    char *block = add_block(size + alignment);
+                    _used += size;
+                    uintptr_t own = (reinterpret_cast<uintptr_t>(block) + alignment - 1) & ~(uintptr_t(alignment) - 1);
+                    return reinterpret_cast<void*>(own);
+                }
+                _cursor = add_block(_block_size);
+                _end = _cursor + _block_size;
+                at = (reinterpret_cast<uintptr_t>(_cursor) + alignment - 1) & ~(uintptr_t(alignment) - 1);
+            }
+            _cursor = reinterpret_cast<char*>(at + size);
+            _used += size;
+            return reinterpret_cast<void*>(at);
+        }
+
+        template<typename T, typename... Args>
+        T* create(Args&&... args) {
+            T *object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            if (!std::is_trivially_destructible<T>::value) {
+                Destructor *d = new (allocate(sizeof(Destructor), alignof(Destructor))) Destructor;
+                d->destroy = [](void *p) { static_cast<T*>(p)->~T(); };
+                d->object = object;
+                d->next = _destructors;
+                _destructors = d;
+            }
+            return object;
+        }
+
+        template<typename T>
+        T* allocate_array(size_t count) {
+            // Uninitialized room for count objects, which are never destroyed.
+            static_assert(std::is_trivially_destructible<T>::value, "arena arrays are not destroyed");
+            return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+        }
+
+        size_t bytes_used() const { return _used; }         // Handed out, alignment padding excluded
+        size_t bytes_reserved() const { return _reserved; } // Held in blocks
+
+    private:
+        struct Destructor {
+            void (*destroy)(void*);
+            void *object;
+            Destructor *next;
+        };
+
+        size_t _block_size;
+        char *_cursor;
+        char *_end;
+        size_t _used;
+        size_t _reserved;
+        Destructor *_destructors;
+        std::vector<std::unique_ptr<char[]>> _blocks;
+
+        char* add_block(size_t size) {
+            _blocks.emplace_back(new char[size]);
+            _reserved += size;
+            return _blocks.back().get();
+        }
+};
+
+#endif // ARENA_H
@@ -0,0 +1,917 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include "aabb.hpp"
+#include "aligned.hpp"
+#include "hittable.hpp"
+#include "instrument.hpp"
+#include "interval.hpp"
+#include "thread_pool.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define RT_BVH_X86 1
+#endif
+
+struct alignas(32) BvhNode {
+    // The bounds are plain floats rather than an Aabb, so a node stays 32 bytes whatever the
+    // layout of vec3.
+    float min[3], max[3];
+    uint32_t left_first; // Interior: index of the left child, the right one follows it. Leaf: first primitive
+    uint16_t count;      // Number of primitives in a leaf, 0 for interior nodes
+    uint16_t axis;       // Split axis of an interior node
+
+    bool is_leaf() const { return count > 0; }
+
+    Aabb bounds() const { return Aabb(point3(min[0], min[1], min[2]), point3(max[0], max[1], max[2])); }
+
+    void set_bounds(const Aabb &box) {
+        for (int axis = 0; axis < 3; ++axis) {
+            min[axis] = box.min[axis];
+            max[axis] = box.max[axis];
+        }
+    }
+
+    bool hit(const float *origin, const float *inv_direction, Interval ray_t, float &t_enter) const {
+        // Aabb::hit on the node's bounds.
+        for (int axis = 0; axis < 3; ++axis) {
+            float t0 = (min[axis] - origin[axis]) * inv_direction[axis];
+            float t1 = (max[axis] - origin[axis]) * inv_direction[axis];
+            if (inv_direction[axis] < 0) {
+                float tmp = t0;
+                t0 = t1;
+                t1 = tmp;
+            }
+            ray_t.min = t0 > ray_t.min ? t0 : ray_t.min;
+            ray_t.max = t1 < ray_t.max ? t1 : ray_t.max;
+        }
+        t_enter = ray_t.min;
+        return ray_t.min <= ray_t.max;
+    }
+};
+
+struct BvhStats {
+    size_t primitive_count = 0;
+    size_t node_count      = 0;
+    size_t leaf_count      = 0;
+    int    max_depth       = 0;
+    float  sah_cost        = 0; // Expected cost of tracing a ray through the tree, in primitive tests
+    double build_seconds   = 0;
+};
+
+inline std::ostream& operator<<(std::ostream &out, const BvhStats &stats) {
+    return out << "BVH: " << stats.primitive_count << " primitives, "
+               << stats.node_count << " nodes (" << stats.leaf_count << " leaves), "
+               << "depth " << stats.max_depth << ", "
+               << "SAH cost " << stats.sah_cost << ", "
+               << "built in " << stats.build_seconds * 1000 << " ms";
+}
+
+// Binned surface area heuristic builder over primitive bounds, shared by Bvh and the meshes.
+// Nodes end up in one flat, cache-aligned array with sibling pairs next to each other, laid
+// out depth first; order lists the primitives in the order the leaves refer to them.
+class BvhBuilder {
+    public:
+        static const int bin_count = 16;                 // SAH buckets per axis
+        static const int max_sah_depth = 64;             // Below this depth, nodes are split at the median
+        static const uint32_t parallel_threshold = 4096; // Smaller subtrees are built inline
+
+        int   max_leaf_size     = 8; // Leaves never hold more primitives than this
+        float traversal_cost    = 1.0f;
+        float intersection_cost = 1.0f;
+        int   thread_count      = 0;
+
+        void build(const std::vector<Aabb> &boxes, aligned_vector<BvhNode> &nodes, std::vector<uint32_t> &order,
+                   BvhStats &stats) const {
+            RT_TRACE_SCOPE("bvh build", "primitives", static_cast<int64_t>(boxes.size()));
+            auto start = std::chrono::steady_clock::now();
+            stats = BvhStats();
+            stats.primitive_count = boxes.size();
+            nodes.clear();
+            order.clear();
+            if (boxes.empty()) {
+                return;
+            }
+
+            size_t n = boxes.size();
+            BuildState state(2 * n - 1);
+            state.refs.resize(n);
+            for (size_t i = 0; i < n; ++i) {
+                state.refs[i] = PrimitiveRef(boxes[i], static_cast<uint32_t>(i));
+            }
+            state.node_count = 1;
+
+            {
+                ThreadPool pool(n > parallel_threshold ? thread_count : 1);
+                state.pool = &pool;
+                Bounds bounds, centroid_bounds;
+                span_bounds(state, 0, static_cast<uint32_t>(n), bounds, centroid_bounds);
+                pool.submit([this, &state, n, bounds, centroid_bounds]() {
+                    build_node(state, 0, 0, static_cast<uint32_t>(n), 0, bounds, centroid_bounds);
+                });
+                pool.wait();
+            }
+
+            order.resize(n);
+            for (size_t i = 0; i < n; ++i) {
+                order[i] = state.refs[i].index;
+            }
+            std::vector<PrimitiveRef>().swap(state.refs);
+            flatten(state.nodes, state.node_count, nodes, stats);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            stats.build_seconds = elapsed.count();
+        }
+
+    private:
+        struct alignas(16) PrimitiveRef {
+            // A primitive's bounds next to its index, so partitioning moves them together and
+            // every pass over a node's primitives reads memory in order. min and max each fill
+            // an SSE register, the fourth lanes unused.
+            float min[3];
+            uint32_t index;
+            float max[3];
+            float unused;
+
+            PrimitiveRef() {}
+
+            PrimitiveRef(const Aabb &box, uint32_t index) : index(index), unused(0) {
+                for (int axis = 0; axis < 3; ++axis) {
+                    min[axis] = box.min[axis];
+                    max[axis] = box.max[axis];
+                }
+            }
+
+            float centroid(int axis) const { return 0.5f * (min[axis] + max[axis]); } // As Aabb::centroid()
+
+            Aabb bounds() const { return Aabb(point3(min[0], min[1], min[2]), point3(max[0], max[1], max[2])); }
+        };
+
+        struct BuildState {
+            std::vector<PrimitiveRef> refs; // Partitioned in place while building
+            BvhNode *nodes;                 // Room for the worst case, so it never moves; pages
+            size_t capacity;                // past the nodes actually built are never touched
+            std::atomic<uint32_t> node_count;
+            ThreadPool *pool;
+
+            explicit BuildState(size_t capacity)
+                : nodes(AlignedAllocator<BvhNode>().allocate(capacity)), capacity(capacity),
+                  node_count(0), pool(nullptr) {}
+
+            ~BuildState() { AlignedAllocator<BvhNode>().deallocate(nodes, capacity); }
+
+            BuildState(const BuildState&) = delete;
+            BuildState& operator=(const BuildState&) = delete;
+        };
+
+        struct alignas(16) Bounds {
+            // A box as two SSE registers' worth of floats, the fourth lanes unused: the build
+            // spends its time growing boxes, which Aabb temporaries make several times slower.
+            float min[4] = {infinity, infinity, infinity, infinity};
+            float max[4] = {-infinity, -infinity, -infinity, -infinity};
+
+            void grow(const float *lo, const float *hi) {
+                // lo and hi are 16-byte aligned arrays of four.
+#ifdef RT_BVH_X86
+                _mm_store_ps(min, _mm_min_ps(_mm_load_ps(min), _mm_load_ps(lo)));
+                _mm_store_ps(max, _mm_max_ps(_mm_load_ps(max), _mm_load_ps(hi)));
+#else
+                for (int axis = 0; axis < 3; ++axis) {
+                    min[axis] = std::min(min[axis], lo[axis]);
+                    max[axis] = std::max(max[axis], hi[axis]);
+                }
+#endif
+            }
+
+            void grow(const Bounds &other) { grow(other.min, other.max); }
+            void grow(const PrimitiveRef &ref) { grow(ref.min, ref.max); }
+
+            void grow_centroid(const PrimitiveRef &ref) {
+                alignas(16) float centroid[4];
+                centroid_of(ref, centroid);
+                grow(centroid, centroid);
+            }
+
+            bool is_empty() const { return min[0] > max[0] || min[1] > max[1] || min[2] > max[2]; }
+
+            float surface_area() const {
+                // As Aabb::surface_area(), to the last bit.
+                if (is_empty()) {
+                    return 0;
+                }
+                float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+                return 2 * (dx * dy + dy * dz + dz * dx);
+            }
+
+            int longest_axis() const {
+                float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+                if (dx > dy) {
+                    return dx > dz ? 0 : 2;
+                }
+                return dy > dz ? 1 : 2;
+            }
+        };
+
+        struct Bin {
+            Bounds bounds;
+            uint32_t count = 0;
+        };
+
+        static void centroid_of(const PrimitiveRef &ref, float *centroid) {
+            // ref.centroid() on all three axes, into an aligned array of four.
+#ifdef RT_BVH_X86
+            // The index is masked out of the fourth lane first: as a float it is a denormal,
+            // which would slow the arithmetic down.
+            const __m128 xyz = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+            __m128 sum = _mm_add_ps(_mm_and_ps(_mm_load_ps(ref.min), xyz), _mm_load_ps(ref.max));
+            _mm_store_ps(centroid, _mm_mul_ps(_mm_set1_ps(0.5f), sum));
+#else
+            for (int axis = 0; axis < 3; ++axis) {
+                centroid[axis] = ref.centroid(axis);
+            }
+            centroid[3] = 0;
+#endif
+        }
+
+        static int bin_index(float centroid, float min, float scale) {
+            // Clamped before the conversion, which bin_indices() does four lanes at a time.
+            return static_cast<int>(std::min((centroid - min) * scale, static_cast<float>(bin_count - 1)));
+        }
+
+        static void bin_indices(const PrimitiveRef &ref, const float *min, const float *scale, int32_t *bins) {
+            // bin_index() on all three axes; min, scale and bins are aligned arrays of four.
+#ifdef RT_BVH_X86
+            alignas(16) float centroid[4];
+            centroid_of(ref, centroid);
+            __m128 position = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(centroid), _mm_load_ps(min)), _mm_load_ps(scale));
+            position = _mm_min_ps(position, _mm_set1_ps(static_cast<float>(bin_count - 1)));
+            _mm_store_si128(reinterpret_cast<__m128i*>(bins), _mm_cvttps_epi32(position));
+#else
+            for (int axis = 0; axis < 3; ++axis) {
+                bins[axis] = bin_index(ref.centroid(axis), min[axis], scale[axis]);
+            }
+#endif
+        }
+
+        static void span_bounds(const BuildState &state, uint32_t begin, uint32_t end, Bounds &bounds,
+                                Bounds &centroid_bounds) {
+            bounds = Bounds();
+            centroid_bounds = Bounds();
+            for (uint32_t i = begin; i < end; ++i) {
+                bounds.grow(state.refs[i]);
+                centroid_bounds.grow_centroid(state.refs[i]);
+            }
+        }
+
+        void build_node(BuildState &state, uint32_t node_index, uint32_t begin, uint32_t end, int depth,
+                        const Bounds &bounds, const Bounds &centroid_bounds) const {
+            // bounds and centroid_bounds are those of the primitives in [begin, end), worked
+            // out by the parent while it split them.
+            BvhNode &node = state.nodes[node_index];
+            uint32_t count = end - begin;
+            for (int axis = 0; axis < 3; ++axis) {
+                node.min[axis] = bounds.min[axis];
+                node.max[axis] = bounds.max[axis];
+            }
+            node.axis = 0;
+
+            if (count == 1) {
+                make_leaf(node, begin, count);
+                return;
+            }
+
+            // Bin the primitives along all three axes in one pass, then find the cheapest
+            // bucket boundary.
+            int best_axis = -1;
+            int best_split = 0;
+            float best_cost = infinity;
+            Bin bins[3][bin_count];
+            alignas(16) float scale[4] = {};
+
+            if (depth < max_sah_depth) {
+                for (int axis = 0; axis < 3; ++axis) {
+                    float extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+                    scale[axis] = extent > 0 ? bin_count / extent : 0;
+                }
+                for (uint32_t i = begin; i < end; ++i) {
+                    const PrimitiveRef &ref = state.refs[i];
+                    alignas(16) int32_t bin[4];
+                    bin_indices(ref, centroid_bounds.min, scale, bin);
+                    for (int axis = 0; axis < 3; ++axis) {
+                        bins[axis][bin[axis]].bounds.grow(ref);
+                        ++bins[axis][bin[axis]].count;
+                    }
+                }
+
+                for (int axis = 0; axis < 3; ++axis) {
+                    if (scale[axis] == 0) {
+                        continue;
+                    }
+                    float left_area[bin_count - 1];
+                    uint32_t left_count[bin_count - 1];
+                    Bounds accumulated;
+                    uint32_t accumulated_count = 0;
+                    for (int bin = 0; bin < bin_count - 1; ++bin) {
+                        accumulated.grow(bins[axis][bin].bounds);
+                        accumulated_count += bins[axis][bin].count;
+                        left_area[bin] = accumulated.surface_area();
+                        left_count[bin] = accumulated_count;
+                    }
+
+                    accumulated = Bounds();
+                    accumulated_count = 0;
+                    for (int split = bin_count - 1; split > 0; --split) {
+                        accumulated.grow(bins[axis][split].bounds);
+                        accumulated_count += bins[axis][split].count;
+                        if (left_count[split - 1] == 0 || accumulated_count == 0) {
+                            continue;
+                        }
+                        float cost = left_area[split - 1] * left_count[split - 1]
+                                   + accumulated.surface_area() * accumulated_count;
+                        if (cost < best_cost) {
+                            best_cost = cost;
+                            best_axis = axis;
+                            best_split = split;
+                        }
+                    }
+                }
+            }
+
+            uint32_t mid;
+            Bounds left_bounds, right_bounds, left_centroids, right_centroids;
+            if (best_axis >= 0) {
+                float parent_area = bounds.surface_area();
+                float split_cost = parent_area > 0
+                    ? traversal_cost + intersection_cost * best_cost / parent_area
+                    : infinity;
+                if (split_cost >= intersection_cost * count && count <= static_cast<uint32_t>(max_leaf_size)) {
+                    make_leaf(node, begin, count);
+                    return;
+                }
+
+                float axis_min = centroid_bounds.min[best_axis];
+                float axis_scale = scale[best_axis];
+                PrimitiveRef *split_point = std::partition(
+                    &state.refs[begin], &state.refs[0] + end,
+                    [&](const PrimitiveRef &ref) {
+                        return bin_index(ref.centroid(best_axis), axis_min, axis_scale) < best_split;
+                    });
+                mid = static_cast<uint32_t>(split_point - &state.refs[0]);
+                node.axis = static_cast<uint16_t>(best_axis);
+
+                // The children's bounds come from the bins; their centroid bounds take a pass.
+                for (int bin = 0; bin < bin_count; ++bin) {
+                    (bin < best_split ? left_bounds : right_bounds).grow(bins[best_axis][bin].bounds);
+                }
+                for (uint32_t i = begin; i < mid; ++i) {
+                    left_centroids.grow_centroid(state.refs[i]);
+                }
+                for (uint32_t i = mid; i < end; ++i) {
+                    right_centroids.grow_centroid(state.refs[i]);
+                }
+            } else {
+                // Every centroid coincides, or the tree got too deep for SAH to be trusted.
+                if (count <= static_cast<uint32_t>(max_leaf_size)) {
+                    make_leaf(node, begin, count);
+                    return;
+                }
+                int axis = centroid_bounds.is_empty() ? 0 : centroid_bounds.longest_axis();
+                mid = begin + count / 2;
+                std::nth_element(
+                    &state.refs[begin], &state.refs[0] + mid, &state.refs[0] + end,
+                    [&](const PrimitiveRef &a, const PrimitiveRef &b) { return a.centroid(axis) < b.centroid(axis); });
+                node.axis = static_cast<uint16_t>(axis);
+                span_bounds(state, begin, mid, left_bounds, left_centroids);
+                span_bounds(state, mid, end, right_bounds, right_centroids);
+            }
+
+            uint32_t left = state.node_count.fetch_add(2);
+            node.left_first = left;
+            node.count = 0;
+
+            if (count > parallel_threshold) {
+                state.pool->submit([this, &state, left, begin, mid, depth, left_bounds, left_centroids]() {
+                    build_node(state, left, begin, mid, depth + 1, left_bounds, left_centroids);
+                });
+            } else {
+                build_node(state, left, begin, mid, depth + 1, left_bounds, left_centroids);
+            }
+            build_node(state, left + 1, mid, end, depth + 1, right_bounds, right_centroids);
+        }
+
+        static void make_leaf(BvhNode &node, uint32_t first, uint32_t count) {
+            node.left_first = first;
+            node.count = static_cast<uint16_t>(count);
+        }
+
+        void flatten(const BvhNode *built, size_t node_count, aligned_vector<BvhNode> &nodes,
+                     BvhStats &stats) const {
+            // Copies the tree into depth-first order, which does not depend on how the parallel
+            // build happened to number its nodes, and gathers the statistics on the way.
+            nodes.reserve(node_count);
+            nodes.push_back(built[0]);
+
+            float root_area = built[0].bounds().surface_area();
+            float area_scale = root_area > 0 ? 1 / root_area : 0;
+
+            struct Pending {
+                uint32_t old_index;
+                uint32_t new_index;
+                int depth;
+            };
+            std::vector<Pending> stack;
+            stack.push_back({0, 0, 0});
+
+            while (!stack.empty()) {
+                Pending item = stack.back();
+                stack.pop_back();
+
+                const BvhNode &node = built[item.old_index];
+                float relative_area = node.bounds().surface_area() * area_scale;
+                stats.max_depth = std::max(stats.max_depth, item.depth);
+
+                if (node.is_leaf()) {
+                    ++stats.leaf_count;
+                    stats.sah_cost += relative_area * intersection_cost * node.count;
+                    continue;
+                }
+
+                stats.sah_cost += relative_area * traversal_cost;
+
+                uint32_t left = static_cast<uint32_t>(nodes.size());
+                nodes.push_back(built[node.left_first]);
+                nodes.push_back(built[node.left_first + 1]);
+                nodes[item.new_index].left_first = left;
+
+                stack.push_back({node.left_first + 1, left + 1, item.depth + 1});
+                stack.push_back({node.left_first, left, item.depth + 1});
+            }
+
+            stats.node_count = nodes.size();
+        }
+};
+
+template <bool AnyHit = false, typename LeafTest>
+inline bool traverse_bvh(const aligned_vector<BvhNode> &nodes, const ray &r, Interval ray_t, LeafTest &&leaf_test) {
+    // Front to back traversal with an explicit stack. leaf_test(first, count, ray_t) tests a
+    // leaf's primitives and returns whether one was hit, lowering ray_t.max to the hit. With
+    // AnyHit, the first leaf that reports a hit ends the traversal.
+    static const int stack_size = 128; // Deepest possible tree: max_sah_depth + log2(2^32)
+    if (nodes.empty()) {
+        return false;
+    }
+
+    point3 o = r.origin();
+    vec3 d = r.direction();
+    const float origin[3] = {o.x, o.y, o.z};
+    const float inv_direction[3] = {1 / d.x, 1 / d.y, 1 / d.z};
+
+    float t_root;
+    if (!nodes[0].hit(origin, inv_direction, ray_t, t_root)) {
+        return false;
+    }
+
+    struct StackEntry {
+        uint32_t node;
+        float t_enter;
+    };
+    StackEntry stack[stack_size];
+    int top = 0;
+
+    bool hit_anything = false;
+    uint32_t current = 0;
+
+    while (true) {
+        const BvhNode &node = nodes[current];
+        RT_COUNT(Counter::BvhNodesVisited);
+
+        if (node.is_leaf()) {
+            if (leaf_test(node.left_first, static_cast<uint32_t>(node.count), ray_t)) {
+                if (AnyHit) {
+                    return true;
+                }
+                hit_anything = true;
+            }
+        } else {
+            uint32_t near = node.left_first;
+            uint32_t far = near + 1;
+            float t_near, t_far;
+            bool hit_near = nodes[near].hit(origin, inv_direction, ray_t, t_near);
+            bool hit_far = nodes[far].hit(origin, inv_direction, ray_t, t_far);
+
+            if (hit_near && hit_far) {
+                // Visit the closer child first; the other one waits on the stack.
+                if (t_far < t_near) {
+                    std::swap(near, far);
+                    std::swap(t_near, t_far);
+                }
+                stack[top].node = far;
+                stack[top].t_enter = t_far;
+                ++top;
+                current = near;
+                continue;
+            }
+            if (hit_near || hit_far) {
+                current = hit_near ? near : far;
+                continue;
+            }
+        }
+
+        // Pop the next node, skipping the ones a closer hit has since ruled out.
+        while (top > 0 && stack[top - 1].t_enter > ray_t.max) {
+            --top;
+        }
+        if (top == 0) {
+            break;
+        }
+        current = stack[--top].node;
+    }
+
+    return hit_anything;
+}
+
+struct alignas(64) WideBvhNode {
+    // Four children in one cache line (after Ylitie, Karras and Laine 2017): each child's box
+    // is stored as 8-bit offsets on a grid spanning the node, with power-of-two steps so the
+    // grid points are cheap to rebuild. Quantizing rounds outwards, so a child's stored box
+    // always contains its real one. Empty slots have inverted boxes, which no ray hits.
+    float    origin[3];   // Minimum corner of the node
+    int8_t   exponent[3]; // The grid step along each axis is 2^exponent
+    uint8_t  count[4];    // Primitives in a leaf child, 0 for an interior or empty one
+    uint8_t  unused;
+    uint8_t  lo[3][4];    // Per axis, then per child
+    uint8_t  hi[3][4];
+    uint32_t child[4];    // Interior: node index. Leaf: first primitive. Empty: invalid_child
+    uint32_t padding;
+
+    static const uint32_t invalid_child = 0xffffffff;
+    static const int max_leaf_size = 255;
+
+    static float step(int8_t exponent) {
+        uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    float plane(int axis, uint8_t q) const {
+        // The same arithmetic as hit(), which the builder relies on to round outwards.
+        return origin[axis] + static_cast<float>(q) * step(exponent[axis]);
+    }
+
+    int hit(const float *ray_origin, const float *inv_direction, Interval ray_t, float *t_enter) const {
+        // Slab tests against all four children; returns a mask of the children hit and
+        // writes where the ray enters each of them.
+#ifdef RT_BVH_X86
+        const __m128i zero = _mm_setzero_si128();
+        __m128 t_min = _mm_set1_ps(ray_t.min);
+        __m128 t_max = _mm_set1_ps(ray_t.max);
+        for (int axis = 0; axis < 3; ++axis) {
+            __m128 base = _mm_set1_ps(origin[axis]);
+            __m128 scale = _mm_set1_ps(step(exponent[axis]));
+            int32_t lo_bytes, hi_bytes;
+            std::memcpy(&lo_bytes, lo[axis], sizeof(lo_bytes));
+            std::memcpy(&hi_bytes, hi[axis], sizeof(hi_bytes));
+            __m128i lo_q = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(lo_bytes), zero), zero);
+            __m128i hi_q = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(hi_bytes), zero), zero);
+            __m128 lo_plane = _mm_add_ps(base, _mm_mul_ps(_mm_cvtepi32_ps(lo_q), scale));
+            __m128 hi_plane = _mm_add_ps(base, _mm_mul_ps(_mm_cvtepi32_ps(hi_q), scale));
+            bool flip = inv_direction[axis] < 0;
+            __m128 o = _mm_set1_ps(ray_origin[axis]);
+            __m128 inv = _mm_set1_ps(inv_direction[axis]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(flip ? hi_plane : lo_plane, o), inv);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(flip ? lo_plane : hi_plane, o), inv);
+            // With the slab value first, a NaN (0 * inf, a ray in a slab's plane) is ignored.
+            t_min = _mm_max_ps(t0, t_min);
+            t_max = _mm_min_ps(t1, t_max);
+        }
+        _mm_storeu_ps(t_enter, t_min);
+        return _mm_movemask_ps(_mm_cmple_ps(t_min, t_max));
+#else
+        int mask = 0;
+        for (int i = 0; i < 4; ++i) {
+            Interval t = ray_t;
+            for (int axis = 0; axis < 3; ++axis) {
+                float t0 = (plane(axis, lo[axis][i]) - ray_origin[axis]) * inv_direction[axis];
+                float t1 = (plane(axis, hi[axis][i]) - ray_origin[axis]) * inv_direction[axis];
+                if (inv_direction[axis] < 0) {
+                    std::swap(t0, t1);
+                }
+                t.min = t0 > t.min ? t0 : t.min;
+                t.max = t1 < t.max ? t1 : t.max;
+            }
+            t_enter[i] = t.min;
+            mask |= t.min <= t.max ? 1 << i : 0;
+        }
+        return mask;
+#endif
+    }
+};
+
+inline void collapse_bvh(const aligned_vector<BvhNode> &binary, aligned_vector<WideBvhNode> &wide) {
+    // Turns a BvhBuilder tree into a 4-wide one by pulling the largest grandchildren up into
+    // each node, then quantizes the children's boxes. The leaves keep their primitive ranges,
+    // so the builder's order still applies; they must hold at most
+    // WideBvhNode::max_leaf_size primitives.
+    wide.clear();
+    if (binary.empty()) {
+        return;
+    }
+
+    struct Pending {
+        uint32_t binary;
+        uint32_t wide;
+    };
+    std::vector<Pending> stack;
+    stack.push_back({0, 0});
+    wide.push_back(WideBvhNode());
+
+    while (!stack.empty()) {
+        Pending item = stack.back();
+        stack.pop_back();
+        const BvhNode &parent = binary[item.binary];
+
+        uint32_t children[4];
+        int child_count = 0;
+        if (parent.is_leaf()) {
+            children[child_count++] = item.binary; // Only for a root that is a leaf
+        } else {
+            children[child_count++] = parent.left_first;
+            children[child_count++] = parent.left_first + 1;
+            while (child_count < 4) {
+                int largest = -1;
+                float largest_area = -1;
+                for (int i = 0; i < child_count; ++i) {
+                    const BvhNode &candidate = binary[children[i]];
+                    float area = candidate.bounds().surface_area();
+                    if (!candidate.is_leaf() && area > largest_area) {
+                        largest = i;
+                        largest_area = area;
+                    }
+                }
+                if (largest < 0) {
+                    break;
+                }
+                uint32_t left = binary[children[largest]].left_first;
+                for (int i = child_count; i > largest + 1; --i) {
+                    children[i] = children[i - 1];
+                }
+                children[largest] = left;
+                children[largest + 1] = left + 1;
+                ++child_count;
+            }
+        }
+
+        WideBvhNode node;
+        std::memset(&node, 0, sizeof(node));
+        for (int axis = 0; axis < 3; ++axis) {
+            float min = parent.min[axis];
+            float extent = parent.max[axis] - min;
+            int exponent = -100;
+            if (extent > 0) {
+                std::frexp(extent / 255, &exponent); // 2^exponent > extent / 255
+                exponent = std::max(exponent, -100);
+            }
+            node.origin[axis] = min;
+            node.exponent[axis] = static_cast<int8_t>(exponent);
+            while (node.plane(axis, 255) < parent.max[axis]) {
+                ++node.exponent[axis];
+            }
+        }
+
+        for (int i = 0; i < 4; ++i) {
+            if (i >= child_count) {
+                for (int axis = 0; axis < 3; ++axis) {
+                    node.lo[axis][i] = 255;
+                    node.hi[axis][i] = 0;
+                }
+                node.child[i] = WideBvhNode::invalid_child;
+                continue;
+            }
+
+            const BvhNode &child = binary[children[i]];
+            for (int axis = 0; axis < 3; ++axis) {
+                float inv_step = 1 / WideBvhNode::step(node.exponent[axis]);
+                float lo = std::floor((child.min[axis] - node.origin[axis]) * inv_step);
+                float hi = std::ceil((child.max[axis] - node.origin[axis]) * inv_step);
+                int lo_q = static_cast<int>(std::max(0.0f, std::min(lo, 255.0f)));
+                int hi_q = static_cast<int>(std::max(0.0f, std::min(hi, 255.0f)));
+                while (lo_q > 0 && node.plane(axis, static_cast<uint8_t>(lo_q)) > child.min[axis]) {
+                    --lo_q;
+                }
+                while (hi_q < 255 && node.plane(axis, static_cast<uint8_t>(hi_q)) < child.max[axis]) {
+                    ++hi_q;
+                }
+                node.lo[axis][i] = static_cast<uint8_t>(lo_q);
+                node.hi[axis][i] = static_cast<uint8_t>(hi_q);
+            }
+
+            if (child.is_leaf()) {
+                node.count[i] = static_cast<uint8_t>(child.count);
+                node.child[i] = child.left_first;
+            } else {
+                node.child[i] = static_cast<uint32_t>(wide.size());
+                wide.push_back(WideBvhNode());
+            }
+        }
+        for (int i = child_count - 1; i >= 0; --i) {
+            if (node.count[i] == 0) {
+                stack.push_back({children[i], node.child[i]});
+            }
+        }
+        wide[item.wide] = node;
+    }
+}
+
+template <bool AnyHit = false, typename LeafTest>
+inline bool traverse_wide_bvh(const aligned_vector<WideBvhNode> &nodes, const ray &r, Interval ray_t,
+                              LeafTest &&leaf_test) {
+    // As traverse_bvh(), over a collapsed tree: a node's children that the ray hits go on the
+    // stack nearest last, leaves included, and leaves are tested as they come off it.
+    static const int stack_size = 3 * 128 + 4; // Three siblings waiting at every level
+    if (nodes.empty()) {
+        return false;
+    }
+
+    point3 o = r.origin();
+    vec3 d = r.direction();
+    const float origin[3] = {o.x, o.y, o.z};
+    const float inv_direction[3] = {1 / d.x, 1 / d.y, 1 / d.z};
+
+    struct StackEntry {
+        uint32_t child;
+        uint32_t count; // 0 for a node
+        float t_enter;
+    };
+    StackEntry stack[stack_size];
+    int top = 0;
+
+    bool hit_anything = false;
+    uint32_t current = 0;
+
+    while (true) {
+        const WideBvhNode &node = nodes[current];
+        RT_COUNT(Counter::BvhNodesVisited);
+
+        float t_enter[4];
+        int mask = node.hit(origin, inv_direction, ray_t, t_enter);
+        int pushed = top;
+        for (int i = 0; i < 4; ++i) {
+            if (!(mask & (1 << i)) || node.child[i] == WideBvhNode::invalid_child) {
+                continue;
+            }
+            // Insertion sort into the new entries, farthest first.
+            StackEntry entry = {node.child[i], node.count[i], t_enter[i]};
+            int slot = top++;
+            while (slot > pushed && stack[slot - 1].t_enter < entry.t_enter) {
+                stack[slot] = stack[slot - 1];
+                --slot;
+            }
+            stack[slot] = entry;
+        }
+
+        // Pop the next node, testing leaves on the way and skipping whatever a closer hit has
+        // since ruled out.
+        bool found = false;
+        while (top > 0) {
+            StackEntry entry = stack[--top];
+            if (entry.t_enter > ray_t.max) {
+                continue;
+            }
+            if (entry.count == 0) {
+                current = entry.child;
+                found = true;
+                break;
+            }
+            if (leaf_test(entry.child, entry.count, ray_t)) {
+                if (AnyHit) {
+                    return true;
+                }
+                hit_anything = true;
+            }
+        }
+        if (!found) {
+            break;
+        }
+    }
+
+    return hit_anything;
+}
+
+// Bounding volume hierarchy over a set of hittables.
+class Bvh : public IHittable {
+    public:
+        explicit Bvh(const HittableList &list, int thread_count = 0)
+            : Bvh(list.objects, thread_count) {}
+
+        explicit Bvh(const std::vector<std::shared_ptr<IHittable>> &objects, int thread_count = 0) {
+            build(objects, thread_count);
+        }
+
+        float refit() {
+            // Recomputes every node's bounds from the objects' current bounding boxes, keeping
+            // the tree as it is: cheap, but the tree degrades as objects move away from where
+            // it was built for. Returns the SAH cost of the refitted tree, to compare with
+            // stats().sah_cost. Children always come after their parent in _nodes, so one
+            // backwards pass updates them before they are needed.
+            BvhBuilder costs;
+            float cost = 0;
+            for (size_t i = _nodes.size(); i-- > 0;) {
+                BvhNode &node = _nodes[i];
+                Aabb box;
+                if (node.is_leaf()) {
+                    for (uint32_t k = node.left_first; k < node.left_first + node.count; ++k) {
+                        box.expand(_objects[k]->bounding_box());
+                    }
+                    cost += box.surface_area() * costs.intersection_cost * node.count;
+                } else {
+                    box = _nodes[node.left_first].bounds();
+                    box.expand(_nodes[node.left_first + 1].bounds());
+                    cost += box.surface_area() * costs.traversal_cost;
+                }
+                node.set_bounds(box);
+            }
+            float root_area = _nodes.empty() ? 0 : _nodes[0].bounds().surface_area();
+            return root_area > 0 ? cost / root_area : 0;
+        }
+
+        void rebuild(int thread_count = 0) {
+            // A new tree over the same objects, at their current positions.
+            std::vector<std::shared_ptr<IHittable>> objects;
+            objects.swap(_objects);
+            build(objects, thread_count);
+        }
+
+        bool intersect(const ray &r, Interval ray_t, HitRecord &rec) const override {
+            return traverse_bvh(_nodes, r, ray_t, [&](uint32_t first, uint32_t count, Interval &leaf_t) {
+                bool hit = false;
+                for (uint32_t i = first; i < first + count; ++i) {
+                    if (_objects[i]->intersect(r, leaf_t, rec)) {
+                        hit = true;
+                        leaf_t.max = rec.t;
+                    }
+                }
+                return hit;
+            });
+        }
+
+        bool occluded(const ray &r, Interval ray_t) const override {
+            return traverse_bvh<true>(_nodes, r, ray_t, [&](uint32_t first, uint32_t count, Interval &leaf_t) {
+                for (uint32_t i = first; i < first + count; ++i) {
+                    if (_objects[i]->occluded(r, leaf_t)) {
+                        return true;
+                    }
+                }
+                return false;
+            });
+        }
+
+        Aabb bounding_box() const override {
+            return _nodes.empty() ? Aabb() : _nodes[0].bounds();
+        }
+
+        int instance_depth() const override { return _instance_depth; }
+
+        const BvhStats& stats() const { return _stats; }
+
+    private:
+        std::vector<std::shared_ptr<IHittable>> _objects;
+        int _instance_depth = 0;
+        aligned_vector<BvhNode> _nodes;
+        BvhStats _stats;
+
+        void build(const std::vector<std::shared_ptr<IHittable>> &objects, int thread_count) {
+            std::vector<Aabb> boxes(objects.size());
+            for (size_t i = 0; i < objects.size(); ++i) {
+                boxes[i] = objects[i]->bounding_box();
+            }
+
+            _instance_depth = 0;
+            for (const auto &object : objects) {
+                _instance_depth = std::max(_instance_depth, object->instance_depth());
+            }
+
+            BvhBuilder builder;
+            builder.thread_count = thread_count;
+            std::vector<uint32_t> order;
+            builder.build(boxes, _nodes, order, _stats);
+
+            // Reordered so every leaf is a contiguous range.
+            _objects.resize(objects.size());
+            for (size_t i = 0; i < objects.size(); ++i) {
+                _objects[i] = objects[order[i]];
+            }
+        }
+};
+
+#endif // BVH_H
@@ -1,17 +1,105 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
-#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cmath>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <ostream>
+#include <string>
+#include <vector>
 
 #include "rtweekend.hpp"
+#include "aov.hpp"
+#include "checkpoint.hpp"
 #include "color.hpp"
+#include "compiled_scene.hpp"
+#include "framebuffer.hpp"
 #include "hittable.hpp"
+#include "image_writer.hpp"
+#include "instrument.hpp"
+#include "thread_pool.hpp"
+#include "tile.hpp"
 #include "vec3.hpp"
+#include "light.hpp"
 #include "material.hpp"
+#include "random.hpp"
+#include "sampler.hpp"
+
+struct PathStats {
+    uint64_t rays = 0;                  // Rays traced: camera rays, bounces and shadow rays alike
+    uint64_t visibility_rays = 0;       // Of those, shadow and ambient occlusion rays, part of no path
+    std::vector<uint64_t> path_lengths; // path_lengths[n] counts the paths that traced n rays
+
+    explicit PathStats(int max_depth = 0) : path_lengths(max_depth + 1, 0) {}
+
+    void merge(const PathStats &other) {
+        rays += other.rays;
+        visibility_rays += other.visibility_rays;
+        for (size_t n = 0; n < path_lengths.size() && n < other.path_lengths.size(); ++n) {
+            path_lengths[n] += other.path_lengths[n];
+        }
+    }
+};
+
+inline std::ostream& operator<<(std::ostream &out, const PathStats &stats) {
+    // One line with the non-empty histogram bins and the mean path length, which counts the
+    // rays along the paths only.
+    uint64_t paths = 0;
+    out << "Path lengths:";
+    for (size_t n = 0; n < stats.path_lengths.size(); ++n) {
+        if (stats.path_lengths[n] > 0) {
+            out << " " << n << ":" << stats.path_lengths[n];
+            paths += stats.path_lengths[n];
+        }
+    }
+    return out << " (mean " << (paths > 0 ? static_cast<double>(stats.rays - stats.visibility_rays) / paths : 0.0) << ")";
+}
+
+template <typename World>
+struct PathKernel {
+    // How the integrator reaches a scene's geometry and materials. Any IHittable goes through
+    // its virtual calls and IMaterial's.
+    static bool hit(const World &world, const ray &r, Interval ray_t, HitRecord &rec) {
+        return world.hit(r, ray_t, rec);
+    }
+
+    static bool scatter(const World &, const ray &r_in, const HitRecord &rec, color &attenuation,
+                        ray &scattered) {
+        return rec.mat->scatter(r_in, rec, attenuation, scattered);
+    }
+
+    static color emitted(const World &, const HitRecord &rec) { return rec.mat->emitted(rec); }
+};
+
+template <>
+struct PathKernel<CompiledScene> {
+    // A closed set of types: both calls are resolved at compile time and inlined.
+    static bool hit(const CompiledScene &world, const ray &r, Interval ray_t, HitRecord &rec) {
+        return world.closest_hit(r, ray_t, rec);
+    }
+
+    static bool scatter(const CompiledScene &world, const ray &r_in, const HitRecord &rec, color &attenuation,
+                        ray &scattered) {
+        return world.scatter(r_in, rec, attenuation, scattered);
+    }
+
+    static color emitted(const CompiledScene &, const HitRecord &) { return color(0, 0, 0); } // No emitters
+};
+
+class WavefrontRenderer;
+class DistributedCoordinator;
+class DistributedWorker;
 
 class Camera {
+    friend class WavefrontRenderer;
+    friend class ProgressiveRenderer;
+    friend class DistributedCoordinator;
+    friend class DistributedWorker;
+
     public:
         float aspect_ratio      = 1.0f; // Ratio of image width over height 
         int   image_width       = 100;  // Rendered image width in pixel count
@@ -26,26 +114,107 @@ class Camera {
         float defocus_angle = 0; // Variation angle of rays through each pixel
         float focus_dist = 10;   // Distance from camera [look_from] point to plane of perfect focus
 
+        int thread_count = 0;  // Render threads, 0 uses every hardware thread
+        int tile_size    = 32; // Width and height of the square tiles handed to each thread
+        uint64_t seed    = 0;  // Seed for every random decision made while rendering
+        SamplerType sampler = SamplerType::Sobol; // Where camera and bounce samples come from
+
+        int roulette_depth = 3; // Bounces before Russian roulette may end a path, negative disables it
+
+        // Lighting: the sky, and emitting spheres. With lights set, every diffuse bounce also
+        // samples one of them directly (next-event estimation), weighted against the paths
+        // that find it by chance with multiple importance sampling. Without, emitters are only
+        // found by chance, which takes many samples for small ones.
+        float sky = 1;                     // Brightness of the sky gradient, 0 for a dark scene
+        const LightList *lights = nullptr; // Sampled emitters, outliving the render
+
+        // Ambient occlusion: with ao_distance set, the scene is not lit. A pixel instead shows
+        // the share of ao_samples cosine-weighted rays from the first hit that get ao_distance
+        // away unblocked. Those rays use IHittable::occluded(), or with ao_closest_hit the full
+        // closest-hit search, to compare the two.
+        float ao_distance = 0;       // Reach of the occlusion rays, 0 renders the lit scene
+        int   ao_samples = 4;        // Occlusion rays per camera ray
+        bool  ao_closest_hit = false;
+
+        // Adaptive sampling: pixels are sampled in rounds and stop once the 95% confidence
+        // interval of their mean luminance is within adaptive_threshold of the mean.
+        // samples_per_pixel becomes the cap.
+        float adaptive_threshold = 0;     // Relative error target, 0 samples every pixel fully
+        int   min_samples_per_pixel = 16; // Samples taken before a pixel may stop
+        int   adaptive_batch = 16;        // Samples added to each unconverged pixel per round
+
+        // Checkpoints: with a path set, the accumulation buffers are saved from a background
+        // thread every checkpoint_interval seconds and once more at the end. Sampling then runs
+        // in passes of checkpoint_pass samples, between which checkpoints are taken.
+        std::string checkpoint_path;
+        float checkpoint_interval = 300; // Seconds
+        int   checkpoint_pass = 16;      // Samples per pixel in each pass
+
+        bool collect_aovs = false; // Fill aovs() with first-hit albedo, normal and depth
+
         void render(const IHittable& world) {
-            initialize();
+            write_image(std::cout, render_frame(world), ImageFormat::P3);
+        }
 
-            std::clog << "width: " << image_width << " height: " << image_height << std::endl;
-            std::cout << "P3\n" << image_width << " " << image_height << "\n255\n";
+        Framebuffer render_frame(const IHittable& world, const Checkpoint *resume = nullptr) {
+            // Renders a frame, or with resume, adds samples to a checkpoint that can_resume()
+            // accepted until every pixel has samples_per_pixel of them.
+            return render_frame_with(world, resume);
+        }
 
-            for (int j = 0; j < image_height; ++j) {
-                std::clog << "\rScanlines remaining: " << std::setw(3) << image_height - j << std::flush;
-                for (int i = 0; i < image_width; ++i) {
-                    color pixel_color(0,0,0);
+        Framebuffer render_frame(const CompiledScene& world, const Checkpoint *resume = nullptr) {
+            // As above, with the integrator compiled for the scene's types.
+            return render_frame_with(world, resume);
+        }
 
-                    for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                        ray r = get_ray(i, j);
-                        pixel_color += ray_color(r, max_depth, world);
-                    }
-                    write_color(std::cout, pixel_color, samples_per_pixel);
+        const PathStats& stats() const {
+            // Ray count and path length histogram of the last render.
+            return _stats;
+        }
+
+        const AovBuffers& aovs() const {
+            // First-hit buffers of the last render, empty unless collect_aovs was set.
+            return _aovs;
+        }
+
+        uint64_t fingerprint(const IHittable &world) const {
+            // Hash of every setting that decides which sample values a pixel gets, and of the
+            // scene's bounds. samples_per_pixel is left out so a render can be extended, except
+            // with the stratified sampler, whose strata are sized by it.
+            uint64_t hash = 0xcbf29ce484222325ull;
+            auto mix = [&hash](const void *data, size_t size) {
+                const uint8_t *bytes = static_cast<const uint8_t*>(data);
+                for (size_t i = 0; i < size; ++i) {
+                    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
                 }
-            }
+            };
+            Aabb bounds = world.bounding_box();
+            float floats[] = {aspect_ratio, sky, vfov, look_from.x, look_from.y, look_from.z,
+                              look_at.x, look_at.y, look_at.z, vup.x, vup.y, vup.z,
+                              defocus_angle, focus_dist, adaptive_threshold, ao_distance,
+                              bounds.min.x, bounds.min.y, bounds.min.z, bounds.max.x, bounds.max.y, bounds.max.z};
+            int ints[] = {image_width, max_depth, roulette_depth, min_samples_per_pixel, adaptive_batch, ao_samples,
+                          static_cast<int>(sampler), sampler == SamplerType::Stratified ? samples_per_pixel : 0};
+            mix(floats, sizeof(floats));
+            mix(ints, sizeof(ints));
+            mix(&seed, sizeof(seed));
+            return hash;
+        }
 
-            std::clog << "\rDone.                       \n";
+        bool can_resume(const Checkpoint &checkpoint, const IHittable &world, std::string &error) {
+            // Whether render_frame() can continue from checkpoint with the current settings.
+            initialize();
+            if (checkpoint.image.width() != image_width || checkpoint.image.height() != image_height) {
+                error = "the checkpoint is " + std::to_string(checkpoint.image.width()) + "x"
+                      + std::to_string(checkpoint.image.height()) + ", the render "
+                      + std::to_string(image_width) + "x" + std::to_string(image_height);
+                return false;
+            }
+            if (checkpoint.fingerprint != fingerprint(world)) {
+                error = "the checkpoint was rendered with a different scene, camera or sampling settings";
+                return false;
+            }
+            return true;
         }
 
     private:
@@ -57,6 +226,9 @@ class Camera {
         vec3   u, v, w;        // Camera frame basis vectors
         vec3   defocus_disk_u; // Defocus disk horizontal radius
         vec3   defocus_disk_v; // Defocus disk vertical radius
+        PathStats _stats;      // Totals of the last render
+        AovBuffers _aovs;      // First-hit buffers of the last render
+        std::shared_ptr<const ISampler> _sampler;
 
         void initialize() {
             image_height = static_cast<int>(image_width / aspect_ratio);
@@ -86,34 +258,402 @@ class Camera {
 
             // Calculate the location of the upper left pixel.
             vec3 viewport_upper_left = center - (focus_dist * w) - viewport_u/2 - viewport_v/2;
-            pixel00_loc = viewport_upper_left + 0.5 * (pixel_delta_u + pixel_delta_v);
+            pixel00_loc = viewport_upper_left + 0.5f * (pixel_delta_u + pixel_delta_v);
 
             // Calculate the camera defocus disk basis vectors.
             float defocus_radius = focus_dist * tanf(degrees_to_radians(defocus_angle /2));
             defocus_disk_u = u * defocus_radius;
             defocus_disk_v = v * defocus_radius;
+
+            _sampler = make_sampler(sampler, seed, samples_per_pixel, image_width);
         }
 
-        color ray_color(const ray &r, int depth, const IHittable &world) {
-            HitRecord rec;
+        template <typename World>
+        int render_tile(const Tile &tile, const World &world, Framebuffer &image,
+                        int first_sample, int sample_count, uint8_t *converged, PathStats &stats,
+                        AovBuffers *aovs = nullptr, int image_x0 = 0, int image_y0 = 0) const {
+            // Takes samples [first_sample, first_sample + sample_count) for every pixel of the
+            // tile. With adaptive sampling, converged holds a flag per pixel: flagged pixels are
+            // skipped, and pixels whose error drops under the threshold get flagged. Returns the
+            // number of pixels in the tile that still want samples. image holds the frame from
+            // pixel (image_x0, image_y0) on, so a buffer of just the tile can be filled. With
+            // aovs, the first hits of the samples go there too.
+            int active = 0;
 
-            // If we've exceeded the ray bounce limit, no more light is gathered.
-            if (depth <= 0) {
-                return color(0, 0, 0);
+            for (int j = tile.y0; j < tile.y1; ++j) {
+                for (int i = tile.x0; i < tile.x1; ++i) {
+                    uint64_t pixel_index = static_cast<uint64_t>(j) * image_width + i;
+                    if (converged && converged[pixel_index]) {
+                        continue;
+                    }
+
+                    color pixel_color(0,0,0);
+                    float sq_luminance = 0;
+                    FirstHit first, first_sum;
+
+                    for (int sample = first_sample; sample < first_sample + sample_count; ++sample) {
+                        // Each sample owns its random sequence, so the image does not depend on
+                        // the tiling, the thread count or which thread picks the tile up.
+                        seed_sample(seed, pixel_index, sample);
+                        start_sample(_sampler.get(), pixel_index, sample);
+                        ray r = get_ray(i, j);
+                        color sample_color = ray_color(r, world, stats, aovs ? &first : nullptr);
+                        pixel_color += sample_color;
+                        sq_luminance += luminance(sample_color) * luminance(sample_color);
+                        if (aovs) {
+                            first_sum.albedo += first.albedo;
+                            first_sum.normal += first.normal;
+                            first_sum.depth += first.depth;
+                        }
+                    }
+                    image.add_samples(i - image_x0, j - image_y0, pixel_color, sample_count, sq_luminance);
+                    if (aovs) {
+                        aovs->add_samples(i - image_x0, j - image_y0, first_sum.albedo, first_sum.normal,
+                                          first_sum.depth, sample_count);
+                    }
+
+                    if (converged) {
+                        if (has_converged(image, i - image_x0, j - image_y0)) {
+                            converged[pixel_index] = 1;
+                        } else {
+                            ++active;
+                        }
+                    }
+                }
             }
 
-            if (world.hit(r, Interval(0.001, infinity), rec)) {
+            return active;
+        }
+
+        template <typename World>
+        Framebuffer render_frame_with(const World &world, const Checkpoint *resume) {
+            RT_TRACE_SCOPE("frame", "width", image_width);
+            initialize();
+
+            std::clog << "width: " << image_width << " height: " << image_height << std::endl;
+
+            Framebuffer image(image_width, image_height);
+            std::vector<Tile> tiles = make_tiles(image_width, image_height, tile_size);
+            _stats = PathStats(max_depth);
+            _aovs = collect_aovs ? AovBuffers(image_width, image_height) : AovBuffers();
+            AovBuffers *aovs = collect_aovs ? &_aovs : nullptr;
+            std::mutex stats_mutex;
+
+            bool adaptive = adaptive_threshold > 0;
+            std::vector<uint8_t> converged(adaptive ? image_width * image_height : 0, 0);
+            std::vector<uint8_t> tile_active(tiles.size(), 1);
+
+            int first_sample = 0;
+            if (resume) {
+                image = resume->image;
+                first_sample = resume->next_sample;
+                if (adaptive) {
+                    restore_converged(tiles, image, converged, tile_active);
+                }
+                std::clog << "Resuming at sample " << first_sample << std::endl;
+            }
+
+            std::unique_ptr<CheckpointWriter> checkpoints;
+            if (!checkpoint_path.empty()) {
+                checkpoints.reset(new CheckpointWriter(checkpoint_path));
+            }
+            uint64_t render_fingerprint = fingerprint(world);
+
+            auto start = std::chrono::steady_clock::now();
+            auto last_checkpoint = start;
+            {
+                ThreadPool pool(thread_count);
+                std::clog << "Rendering " << tiles.size() << " tiles on " << pool.size() << " threads" << std::endl;
+
+                bool any_active = std::find(tile_active.begin(), tile_active.end(), 1) != tile_active.end();
+                while (first_sample < samples_per_pixel && any_active) {
+                    // Without adaptive sampling or checkpoints, this is a single round of every sample.
+                    int round_samples = samples_per_pixel - first_sample;
+                    if (adaptive) {
+                        round_samples = std::min(round_samples,
+                            first_sample == 0 ? std::max(min_samples_per_pixel, 1) : std::max(adaptive_batch, 1));
+                    } else if (checkpoints) {
+                        round_samples = std::min(round_samples, std::max(checkpoint_pass, 1));
+                    }
+
+                    for (size_t t = 0; t < tiles.size(); ++t) {
+                        if (!tile_active[t]) {
+                            continue;
+                        }
+                        const Tile &tile = tiles[t];
+                        uint8_t *done = adaptive ? converged.data() : nullptr;
+                        uint8_t *active = &tile_active[t];
+                        pool.submit([this, &world, &image, &stats_mutex, &tile, first_sample, round_samples, done, active,
+                                     aovs]() {
+                            RT_TRACE_TILE(tile.id);
+                            PathStats tile_stats(max_depth);
+                            int remaining = render_tile(tile, world, image, first_sample, round_samples, done, tile_stats,
+                                                        aovs);
+                            if (done) {
+                                *active = remaining > 0; // Only the adaptive sampler retires tiles
+                            }
+                            std::lock_guard<std::mutex> lock(stats_mutex);
+                            _stats.merge(tile_stats);
+                        });
+                    }
+                    pool.wait();
+
+                    first_sample += round_samples;
+                    any_active = std::find(tile_active.begin(), tile_active.end(), 1) != tile_active.end();
+
+                    // The copy is the only cost on the render threads; the writer does the rest.
+                    std::chrono::duration<double> since = std::chrono::steady_clock::now() - last_checkpoint;
+                    if (checkpoints && since.count() >= checkpoint_interval) {
+                        checkpoints->submit(make_checkpoint(image, first_sample, render_fingerprint));
+                        last_checkpoint = std::chrono::steady_clock::now();
+                    }
+                }
+            }
+            if (checkpoints) {
+                checkpoints->submit(make_checkpoint(image, first_sample, render_fingerprint));
+                checkpoints->wait();
+                std::clog << "Checkpoint at sample " << first_sample << " written to " << checkpoint_path << std::endl;
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            std::clog << "Done in " << elapsed.count() << "s, "
+                      << _stats.rays << " rays, "
+                      << _stats.rays / elapsed.count() / 1e6 << " Mrays/s\n";
+            std::clog << _stats << "\n";
+            if (adaptive) {
+                uint64_t samples = 0;
+                for (uint64_t paths : _stats.path_lengths) {
+                    samples += paths;
+                }
+                double full = static_cast<double>(image_width) * image_height * samples_per_pixel;
+                std::clog << "Adaptive: " << samples / (static_cast<double>(image_width) * image_height)
+                          << " samples per pixel on average, " << 100 * samples / full << "% of the full budget\n";
+            }
+
+            return image;
+        }
+
+        static std::unique_ptr<Checkpoint> make_checkpoint(const Framebuffer &image, int next_sample,
+                                                           uint64_t render_fingerprint) {
+            std::unique_ptr<Checkpoint> checkpoint(new Checkpoint());
+            checkpoint->image = image;
+            checkpoint->next_sample = next_sample;
+            checkpoint->fingerprint = render_fingerprint;
+            return checkpoint;
+        }
+
+        void restore_converged(const std::vector<Tile> &tiles, const Framebuffer &image,
+                               std::vector<uint8_t> &converged, std::vector<uint8_t> &tile_active) const {
+            // Rebuilds the adaptive sampler's flags from resumed buffers. A pixel that had
+            // converged still has the statistics that made it converge.
+            for (size_t t = 0; t < tiles.size(); ++t) {
+                const Tile &tile = tiles[t];
+                int active = 0;
+                for (int j = tile.y0; j < tile.y1; ++j) {
+                    for (int i = tile.x0; i < tile.x1; ++i) {
+                        if (image.samples(i, j) > 0 && has_converged(image, i, j)) {
+                            converged[static_cast<size_t>(j) * image_width + i] = 1;
+                        } else {
+                            ++active;
+                        }
+                    }
+                }
+                tile_active[t] = active > 0;
+            }
+        }
+
+        bool has_converged(const Framebuffer &image, int i, int j) const {
+            uint32_t count = image.samples(i, j);
+            if (static_cast<int>(count) < min_samples_per_pixel) {
+                return false;
+            }
+            // Half-width of the 95% confidence interval, relative to the mean. The floor on the
+            // mean keeps nearly black pixels from chasing a relative error they will never reach.
+            float mean = luminance(image.sum(i, j)) / count;
+            float error = 1.96f * sqrtf(image.luminance_variance(i, j) / count);
+            return error <= adaptive_threshold * std::max(mean, 0.01f);
+        }
+
+        template <typename World>
+        color ray_color(const ray &r, const World &world, PathStats &stats, FirstHit *first = nullptr) const {
+            // Follows one path, carrying the product of the attenuations so far (the throughput)
+            // forward instead of multiplying it in on the way back up a recursion. With first,
+            // also reports what the camera ray hit.
+            if (ao_distance > 0) {
+                return ambient_occlusion(r, world, stats, first);
+            }
+
+            color radiance(0, 0, 0);
+            color throughput(1, 1, 1);
+            ray current = r;
+            int depth = 0;
+            bool sample_lights = lights && !lights->empty();
+            float bounce_pdf = 0; // Solid angle density of current's direction if lights were sampled where it started
+            point3 bounce_origin;
+
+            // If we've exceeded the ray bounce limit, no more light is gathered.
+            while (depth < max_depth) {
+                HitRecord rec;
+                ++depth;
+                RT_COUNT(depth == 1 ? Counter::PrimaryRays : Counter::SecondaryRays);
+
+                bool hit = PathKernel<World>::hit(world, current, Interval(0.001f, infinity), rec);
+                if (first && depth == 1) {
+                    first->albedo = hit ? rec.mat->albedo() : background(current);
+                    first->normal = hit ? rec.normal : vec3(0, 0, 0);
+                    first->depth = hit ? rec.t * current.direction().length() : 0.0f;
+                }
+                if (!hit) {
+                    RT_COUNT(Counter::PathsEscaped);
+                    stats.rays += depth;
+                    ++stats.path_lengths[depth];
+                    return radiance + throughput * background(current);
+                }
+
+                color emitted = PathKernel<World>::emitted(world, rec);
+                if (emitted.r > 0 || emitted.g > 0 || emitted.b > 0) {
+                    radiance += throughput * emitted * emission_weight(rec, bounce_origin, bounce_pdf);
+                }
+
                 ray scattered;
                 color attenuation;
-                if (rec.mat->scatter(r, rec, attenuation, scattered)) {
-                    return attenuation * ray_color(scattered, depth - 1, world);
+                set_sample_dimension(bounce_dimension(depth));
+                if (!PathKernel<World>::scatter(world, current, rec, attenuation, scattered)) {
+                    RT_COUNT(Counter::PathsAbsorbed);
+                    break;
+                }
+                bounce_pdf = 0;
+                if (sample_lights && rec.mat->type() == MaterialType::Lambertian) {
+                    radiance += throughput * direct_light(world, rec, attenuation, depth, stats);
+                    bounce_pdf = fmaxf(scattered.direction().unit().dot(rec.normal), 0.0f) / pi;
+                    bounce_origin = rec.p;
                 }
+                throughput = throughput * attenuation;
+                current = scattered;
+
+                if (!survives_roulette(throughput, depth)) {
+                    RT_COUNT(Counter::PathsRoulette);
+                    break;
+                }
+                if (depth == max_depth) {
+                    RT_COUNT(Counter::PathsDepthLimit);
+                }
+            }
+
+            stats.rays += depth;
+            ++stats.path_lengths[depth];
+            return radiance;
+        }
+
+        template <typename World>
+        color direct_light(const World &world, const HitRecord &rec, const color &albedo, int depth,
+                           PathStats &stats) const {
+            // Light arriving at a Lambertian hit straight from one light, picked by power, from
+            // a direction in the cone the light covers. Its weight against the bounce finding
+            // the same light is the power heuristic.
+            set_sample_dimension(light_dimension(depth));
+            const SphereLight &light = lights->pick(sample_1d());
+            float u, v;
+            sample_2d(u, v);
+            vec3 direction;
+            float cone_pdf;
+            if (!light.sample(rec.p, u, v, direction, cone_pdf)) {
+                return color(0, 0, 0);
+            }
+            float cosine = direction.dot(rec.normal);
+            float light_t;
+            ray shadow(rec.p, direction);
+            if (cosine <= 0 || !hit_sphere(light.center, light.radius, shadow, Interval(0.001f, infinity), light_t)) {
                 return color(0, 0, 0);
             }
 
+            // Anything in front of the light blocks it.
+            RT_COUNT(Counter::ShadowRays);
+            ++stats.rays;
+            ++stats.visibility_rays;
+            if (world.occluded(shadow, Interval(0.001f, light_t * (1 - 1e-4f)))) {
+                return color(0, 0, 0);
+            }
+
+            float light_pdf = light.select_pdf * cone_pdf;
+            float bsdf_pdf = cosine / pi;
+            float weight = light_pdf * light_pdf / (light_pdf * light_pdf + bsdf_pdf * bsdf_pdf);
+            return albedo * light.emission * (weight * bsdf_pdf / light_pdf);
+        }
+
+        template <typename World>
+        color ambient_occlusion(const ray &r, const World &world, PathStats &stats, FirstHit *first) const {
+            // The grey of the ambient occlusion mode: white for camera rays that miss.
+            HitRecord rec;
+            RT_COUNT(Counter::PrimaryRays);
+            bool hit = PathKernel<World>::hit(world, r, Interval(0.001f, infinity), rec);
+            if (first) {
+                first->albedo = hit ? rec.mat->albedo() : background(r);
+                first->normal = hit ? rec.normal : vec3(0, 0, 0);
+                first->depth = hit ? rec.t * r.direction().length() : 0.0f;
+            }
+            ++stats.rays;
+            ++stats.path_lengths[1];
+            if (!hit) {
+                RT_COUNT(Counter::PathsEscaped);
+                return color(1, 1, 1);
+            }
+
+            int open = 0;
+            for (int k = 0; k < ao_samples; ++k) {
+                set_sample_dimension(bounce_dimension(k + 1));
+                ray probe(rec.p, sample_cosine_direction(rec.normal));
+                Interval reach(0.001f, ao_distance / probe.direction().length());
+                RT_COUNT(Counter::OcclusionRays);
+                bool blocked;
+                if (ao_closest_hit) {
+                    HitRecord blocker;
+                    blocked = world.intersect(probe, reach, blocker);
+                } else {
+                    blocked = world.occluded(probe, reach);
+                }
+                open += !blocked;
+            }
+            stats.rays += ao_samples;
+            stats.visibility_rays += ao_samples;
+            float visible = ao_samples > 0 ? static_cast<float>(open) / ao_samples : 1.0f;
+            return color(visible, visible, visible);
+        }
+
+        float emission_weight(const HitRecord &rec, const point3 &bounce_origin, float bounce_pdf) const {
+            // Share of an emitter hit by a path that direct_light() did not already count: all
+            // of it after camera rays and non-diffuse bounces, and for emitters not in lights.
+            if (bounce_pdf <= 0) {
+                return 1;
+            }
+            const SphereLight *light = lights->find(rec.object, rec.primitive);
+            if (!light) {
+                return 1;
+            }
+            float light_pdf = light->select_pdf * light->pdf(bounce_origin);
+            return bounce_pdf * bounce_pdf / (bounce_pdf * bounce_pdf + light_pdf * light_pdf);
+        }
+
+        color background(const ray &r) const {
+            // Sky gradient seen by rays that leave the scene.
             vec3 unit_direction = r.direction().unit();
             float a = 0.5f * (unit_direction.y + 1.0f);
-            return (1.0f - a) * color(1.0f, 1.0f, 1.0f) + a * color(0.5f, 0.7f, 1.0f);
+            return sky * ((1.0f - a) * color(1.0f, 1.0f, 1.0f) + a * color(0.5f, 0.7f, 1.0f));
+        }
+
+        bool survives_roulette(color &throughput, int depth) const {
+            // Russian roulette: end dim paths early and boost the survivors by the inverse of
+            // their survival chance, which keeps the estimate unbiased. The cap keeps lossless
+            // paths (glass) from bouncing until max_depth.
+            if (roulette_depth < 0 || depth < roulette_depth) {
+                return true;
+            }
+            float survival = fminf(fmaxf(throughput.r, fmaxf(throughput.g, throughput.b)), 0.95f);
+            if (random_float() >= survival) {
+                return false;
+            }
+            throughput /= survival;
+            return true;
         }
 
         ray get_ray(int i, int j) const {
@@ -121,8 +661,10 @@ class Camera {
             // the camera defocus disk.
 
             point3 pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
+            set_sample_dimension(0);
             vec3 pixel_sample = pixel_center + pixel_sample_square();
 
+            set_sample_dimension(1);
             point3 ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
             vec3 ray_direction = pixel_sample - ray_origin;
 
@@ -131,15 +673,27 @@ class Camera {
 
         point3 defocus_disk_sample() const {
             // Returns a random point in the camera defocus disk.
-            point3 p = random_in_unit_disk();
+            point3 p = sample_in_unit_disk();
             return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
         }
 
         vec3 pixel_sample_square() const {
             // Returns a random point in the square surrounding a pixel at the origin.
-            float px = -0.5f + random_float();
-            float py = -0.5f + random_float();
-            return (px * pixel_delta_u) + (py * pixel_delta_v);
+            float px, py;
+            sample_2d(px, py);
+            return ((px - 0.5f) * pixel_delta_u) + ((py - 0.5f) * pixel_delta_v);
+        }
+
+        static uint32_t bounce_dimension(int depth) {
+            // Sampler dimension of the scatter at a path's depth-th hit; 0 and 1 are the
+            // pixel and lens positions.
+            return static_cast<uint32_t>(depth) + 1;
+        }
+
+        static uint32_t light_dimension(int depth) {
+            // First of the two dimensions of the light sample at the depth-th hit (which light,
+            // then where on it), well clear of the bounces.
+            return (1u << 16) + 2 * static_cast<uint32_t>(depth);
         }
 };
 
@@ -0,0 +1,170 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "framebuffer.hpp"
+
+// Render checkpoints: the float accumulation buffers of a frame plus where sampling stopped.
+//
+// Every camera sample is seeded from (seed, pixel, sample), so a render resumed from a
+// checkpoint takes exactly the samples the interrupted one would have taken next, and a
+// checkpoint of a finished render can be refined later by asking for more samples.
+struct Checkpoint {
+    Framebuffer image;
+    int next_sample = 0;      // Samples [0, next_sample) of every pixel are in image
+    uint64_t fingerprint = 0; // Camera::fingerprint() of the render, to refuse mismatched resumes
+};
+
+struct CheckpointHeader {
+    char     magic[8];   // "RTCKPT\0\0"
+    uint32_t version;    // 1
+    uint32_t byte_order; // 0x01020304 as written
+    int32_t  width;
+    int32_t  height;
+    int32_t  next_sample;
+    int32_t  reserved;
+    uint64_t fingerprint;
+};
+
+inline bool write_checkpoint(const std::string &path, const Checkpoint &checkpoint, std::string &error) {
+    // Writes next to path and renames over it, so a crash mid-write keeps the old checkpoint.
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        if (!out) {
+            error = "could not open " + temporary + " for writing";
+            return false;
+        }
+        CheckpointHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, "RTCKPT\0\0", 8);
+        header.version = 1;
+        header.byte_order = 0x01020304u;
+        header.width = checkpoint.image.width();
+        header.height = checkpoint.image.height();
+        header.next_sample = checkpoint.next_sample;
+        header.fingerprint = checkpoint.fingerprint;
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        checkpoint.image.write_raw(out);
+        out.flush();
+        if (!out) {
+            error = "could not write " + temporary;
+            return false;
+        }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        error = "could not replace " + path;
+        return false;
+    }
+    return true;
+}
+
+inline bool read_checkpoint(const std::string &path, Checkpoint &checkpoint, std::string &error) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        error = "could not open " + path;
+        return false;
+    }
+    CheckpointHeader header;
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in || std::memcmp(header.magic, "RTCKPT\0\0", 8) != 0) {
+        error = path + " is not a checkpoint";
+        return false;
+    }
+    if (header.version != 1 || header.byte_order != 0x01020304u) {
+        error = path + " was written by an incompatible build";
+        return false;
+    }
+    if (header.width <= 0 || header.height <= 0 || header.next_sample < 0) {
+        error = path + " has a corrupt header";
+        return false;
+    }
+
+    checkpoint.image = Framebuffer(header.width, header.height);
+    checkpoint.next_sample = header.next_sample;
+    checkpoint.fingerprint = header.fingerprint;
+    if (!checkpoint.image.read_raw(in)) {
+        error = path + " is truncated";
+        return false;
+    }
+    return true;
+}
+
+// Writes checkpoints on a background thread. Only the newest checkpoint matters, so one
+// submitted while an older one is still waiting simply replaces it.
+class CheckpointWriter {
+    public:
+        explicit CheckpointWriter(const std::string &path)
+            : _path(path), _stopping(false), _busy(false), _thread(&CheckpointWriter::run, this) {}
+
+        CheckpointWriter(const CheckpointWriter&) = delete;
+        CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+        ~CheckpointWriter() {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stopping = true;
+            }
+            _changed.notify_all();
+            _thread.join();
+        }
+
+        void submit(std::unique_ptr<Checkpoint> checkpoint) {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _pending = std::move(checkpoint);
+            }
+            _changed.notify_all();
+        }
+
+        void wait() {
+            // Blocks until the last submitted checkpoint is on disk.
+            std::unique_lock<std::mutex> lock(_mutex);
+            _changed.wait(lock, [this]() { return !_pending && !_busy; });
+        }
+
+    private:
+        std::string _path;
+        std::unique_ptr<Checkpoint> _pending;
+        std::mutex _mutex;
+        std::condition_variable _changed;
+        bool _stopping;
+        bool _busy;
+        std::thread _thread;
+
+        void run() {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (true) {
+                _changed.wait(lock, [this]() { return _stopping || _pending; });
+                if (!_pending) {
+                    return; // Stopping, and everything has been written
+                }
+
+                std::unique_ptr<Checkpoint> checkpoint = std::move(_pending);
+                _busy = true;
+                lock.unlock();
+
+                std::string error;
+                if (!write_checkpoint(_path, *checkpoint, error)) {
+                    std::cerr << "Checkpoint failed: " << error << "\n";
+                }
+
+                lock.lock();
+                _busy = false;
+                _changed.notify_all();
+            }
+        }
+};
+
+#endif // CHECKPOINT_H
@@ -4,19 +4,25 @@
 #include "interval.hpp"
 #include "vec3.hpp"
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 
-inline float linear_to_gama(double linear_component) {
+inline float linear_to_gama(float linear_component) {
     return sqrtf(linear_component);
 }
 
+inline float luminance(const color &c) {
+    // Rec. 709 relative luminance of a linear color.
+    return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+}
+
 inline void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
     float r = pixel_color.r;
     float g = pixel_color.g;
     float b = pixel_color.b;
 
-    // Divide the color by the number of samples.
-    float scale = 1.0f / samples_per_pixel;
+    // Divide the color by the number of samples; pixels without any yet are black.
+    float scale = samples_per_pixel > 0 ? 1.0f / samples_per_pixel : 0.0f;
     r *= scale;
     g *= scale;
     b *= scale;
@@ -27,10 +33,48 @@ inline void write_color(std::ostream &out, color pixel_color, int samples_per_pi
     b = linear_to_gama(b);
 
     // Write the translated [0,255] value of each color component.
-    static const Interval intensity(0.000, 0.999);
+    static const Interval intensity(0.000f, 0.999f);
     out << static_cast<int>(256 * intensity.clamp(r)) << ' '
         << static_cast<int>(256 * intensity.clamp(g)) << ' '
         << static_cast<int>(256 * intensity.clamp(b)) << '\n';
 }
 
+class GammaTable {
+    // Table-driven version of the gamma transform and quantization done by write_color().
+    // The linear value is scaled by 2^16 and truncated to index a table of 8-bit results,
+    // avoiding the sqrt, the clamp to [0, 0.999] and the float to int conversion per channel.
+    // Since floor(256 * sqrt(x)) == floor(sqrt(floor(65536 * x))), entries are exact integer
+    // square roots; only values within a float rounding step of a boundary may differ.
+    private:
+        uint8_t _table[65536];
+
+    public:
+        GammaTable() {
+            int root = 0;
+            for (int i = 0; i < 65536; ++i) {
+                while ((root + 1) * (root + 1) <= i) {
+                    ++root;
+                }
+                _table[i] = static_cast<uint8_t>(root > 255 ? 255 : root);
+            }
+        }
+
+        uint8_t quantize(float linear_component) const {
+            float scaled = linear_component * 65536.0f;
+            // Written so that NaN also lands on 0.
+            if (!(scaled > 0.0f)) {
+                return 0;
+            }
+            if (scaled >= 65535.0f) {
+                return 255;
+            }
+            return _table[static_cast<int>(scaled)];
+        }
+
+        static const GammaTable& instance() {
+            static const GammaTable table;
+            return table;
+        }
+};
+
 #endif
@@ -0,0 +1,200 @@
+#ifndef COMPILED_SCENE_H
+#define COMPILED_SCENE_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "aabb.hpp"
+#include "aligned.hpp"
+#include "bvh.hpp"
+#include "hittable.hpp"
+#include "instrument.hpp"
+#include "interval.hpp"
+#include "material.hpp"
+#include "sphere.hpp"
+#include "vec3.hpp"
+
+// The closed set of materials a CompiledScene holds by value.
+using CompiledMaterial = std::variant<Lambertian, Metal, Dielectric>;
+
+struct CompiledSceneStats {
+    size_t spheres = 0;
+    size_t materials[std::variant_size<CompiledMaterial>::value] = {}; // Per alternative, after dedup
+    BvhStats bvh;
+};
+
+inline std::ostream& operator<<(std::ostream &out, const CompiledSceneStats &stats) {
+    return out << "Compiled scene: " << stats.spheres << " spheres, " << stats.materials[0] << " lambertian, "
+               << stats.materials[1] << " metal and " << stats.materials[2] << " dielectric materials, "
+               << stats.bvh;
+}
+
+// A HittableList of Spheres flattened into a closed set of types, for the static dispatch path.
+//
+// The spheres are plain records in BVH leaf order and the materials live in one array of
+// CompiledMaterial, so closest_hit() and scatter() know every type they meet: the traversal,
+// the sphere quadratic and each material's scatter inline into Camera's integrator when it is
+// instantiated for this class (see PathKernel), and a path runs without an indirect call.
+//
+// It is also an IHittable, reached through the usual virtual calls by the renderers that are
+// not templated on the scene. Either way, it returns exactly what a Bvh over the same list
+// does, so the images match.
+class CompiledScene : public IHittable {
+    public:
+        int leaf_size = 8; // Most spheres per BVH leaf, for compile()
+
+        bool compile(const HittableList &world, int thread_count, std::string &error) {
+            // Fails on any object other than a Sphere, or a material outside CompiledMaterial.
+            _spheres.clear();
+            _materials.clear();
+            _nodes.clear();
+            _stats = CompiledSceneStats();
+            _bbox = Aabb();
+
+            std::unordered_map<const IMaterial*, uint32_t> material_ids;
+            std::vector<SphereRecord> spheres;
+            std::vector<Aabb> boxes;
+            spheres.reserve(world.objects.size());
+            boxes.reserve(world.objects.size());
+            for (const auto &object : world.objects) {
+                const Sphere *sphere = dynamic_cast<const Sphere*>(object.get());
+                if (!sphere) {
+                    error = "the compiled scene only holds spheres";
+                    return false;
+                }
+                std::shared_ptr<IMaterial> material = sphere->material();
+                auto found = material_ids.find(material.get());
+                uint32_t id;
+                if (found != material_ids.end()) {
+                    id = found->second;
+                } else {
+                    if (!add_material(material.get(), error)) {
+                        return false;
+                    }
+                    id = static_cast<uint32_t>(_materials.size() - 1);
+                    material_ids[material.get()] = id;
+                }
+                spheres.push_back(SphereRecord{sphere->center(), sphere->radius(), id});
+                boxes.push_back(sphere->bounding_box());
+                _bbox.expand(boxes.back());
+            }
+
+            BvhBuilder builder;
+            builder.max_leaf_size = leaf_size;
+            builder.thread_count = thread_count;
+            std::vector<uint32_t> order;
+            builder.build(boxes, _nodes, order, _stats.bvh);
+
+            _spheres.resize(spheres.size());
+            for (size_t i = 0; i < spheres.size(); ++i) {
+                _spheres[i] = spheres[order[i]];
+            }
+            _stats.spheres = _spheres.size();
+            return true;
+        }
+
+        const CompiledSceneStats& stats() const { return _stats; }
+
+        bool closest_hit(const ray &r, Interval ray_t, HitRecord &rec) const {
+            // IHittable::hit() without the virtual calls.
+            if (!find_closest(r, ray_t, rec)) {
+                return false;
+            }
+            fill_surface(r, rec);
+            return true;
+        }
+
+        bool scatter(const ray &r_in, const HitRecord &rec, color &attenuation, ray &scattered) const {
+            // The hit material's scatter(), called on its exact class so it inlines.
+            const CompiledMaterial &material = _materials[_spheres[rec.primitive].material];
+            return std::visit([&](const auto &m) {
+                using Material = std::decay_t<decltype(m)>;
+                return m.Material::scatter(r_in, rec, attenuation, scattered);
+            }, material);
+        }
+
+        bool intersect(const ray &r, Interval ray_t, HitRecord &rec) const override {
+            return find_closest(r, ray_t, rec);
+        }
+
+        bool occluded(const ray &r, Interval ray_t) const override {
+            return traverse_bvh<true>(_nodes, r, ray_t, [&](uint32_t first, uint32_t count, Interval &leaf_t) {
+                float t;
+                for (uint32_t i = first; i < first + count; ++i) {
+                    if (hit_sphere(_spheres[i].center, _spheres[i].radius, r, leaf_t, t)) {
+                        return true;
+                    }
+                }
+                return false;
+            });
+        }
+
+        void surface(const ray &r, HitRecord &rec) const override { fill_surface(r, rec); }
+
+        Aabb bounding_box() const override { return _bbox; }
+
+    private:
+        struct SphereRecord {
+            point3 center;
+            float radius;
+            uint32_t material; // Index into _materials
+        };
+
+        std::vector<SphereRecord> _spheres; // In BVH leaf order
+        std::vector<CompiledMaterial> _materials;
+        aligned_vector<BvhNode> _nodes;
+        CompiledSceneStats _stats;
+        Aabb _bbox;
+
+        bool add_material(const IMaterial *material, std::string &error) {
+            switch (material->type()) {
+                case MaterialType::Lambertian:
+                    _materials.emplace_back(*static_cast<const Lambertian*>(material));
+                    break;
+                case MaterialType::Metal:
+                    _materials.emplace_back(*static_cast<const Metal*>(material));
+                    break;
+                case MaterialType::Dielectric:
+                    _materials.emplace_back(*static_cast<const Dielectric*>(material));
+                    break;
+                default:
+                    error = "the compiled scene only holds lambertian, metal and dielectric materials";
+                    return false;
+            }
+            ++_stats.materials[_materials.back().index()];
+            return true;
+        }
+
+        bool find_closest(const ray &r, Interval ray_t, HitRecord &rec) const {
+            return traverse_bvh(_nodes, r, ray_t, [&](uint32_t first, uint32_t count, Interval &leaf_t) {
+                bool hit = false;
+                for (uint32_t i = first; i < first + count; ++i) {
+                    if (hit_sphere(_spheres[i].center, _spheres[i].radius, r, leaf_t, rec.t)) {
+                        hit = true;
+                        leaf_t.max = rec.t;
+                        rec.object = this;
+                        rec.primitive = i;
+                    }
+                }
+                return hit;
+            });
+        }
+
+        void fill_surface(const ray &r, HitRecord &rec) const {
+            const SphereRecord &sphere = _spheres[rec.primitive];
+            rec.p = r.at(rec.t);
+            vec3 outward_normal = (rec.p - sphere.center) / sphere.radius;
+            rec.set_face_normal(r, outward_normal);
+            rec.mat = std::visit([](const auto &m) -> const IMaterial* { return &m; }, _materials[sphere.material]);
+        }
+};
+
+#endif // COMPILED_SCENE_H
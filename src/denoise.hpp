@@ -0,0 +1,229 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#include "aligned.hpp"
+#include "aov.hpp"
+#include "color.hpp"
+#include "framebuffer.hpp"
+#include "thread_pool.hpp"
+
+inline float fast_exp_neg(float x) {
+    // e^-x for x >= 0, within 0.03%, in plain arithmetic the compiler can vectorize: 2^(-x log2 e)
+    // split into a power of two, added to the exponent bits, and a polynomial for the rest.
+    // Arguments past 80 (infinity and NaN included) are clamped to it with integer operations
+    // on the bits, which order like the values for positive floats; a compare or std::min
+    // would leave a branch that -ftrapping-math keeps out of vector loops.
+    const int32_t limit_bits = 0x42a00000; // 80.0f
+    int32_t x_bits;
+    std::memcpy(&x_bits, &x, sizeof(x_bits));
+    int32_t over = (limit_bits - x_bits) >> 31; // All ones past the limit
+    x_bits = (x_bits & ~over) | (limit_bits & over);
+    std::memcpy(&x, &x_bits, sizeof(x));
+
+    float y = x * -1.44269504f;
+    int32_t whole = static_cast<int32_t>(y); // Rounds toward zero, so the rest is in (-1, 0]
+    float f = y - static_cast<float>(whole);
+    float p = 1.0f + f * (0.69314718f + f * (0.24022651f + f * (0.05550411f + f * (0.00961813f + f * 0.00133336f))));
+    int32_t bits;
+    std::memcpy(&bits, &p, sizeof(bits));
+    bits += whole * (1 << 23);
+    std::memcpy(&p, &bits, sizeof(p));
+    return p;
+}
+
+// Edge-avoiding A-trous wavelet filter (Dammertz et al. 2010), guided by the AOVs and by the
+// per-pixel variance the Framebuffer already tracks (as in SVGF, Schied et al. 2017).
+//
+// The color is first divided by the albedo, so textures are kept out of the blur and put back
+// at the end. Each pass is a 5x5 B3-spline kernel whose taps spread out twice as far as in
+// the pass before, with the weight of every tap cut down by differences in normal, depth,
+// albedo and, relative to the noise expected at the pixel, luminance. The variance is
+// filtered along with the color, so later passes trust the already smoothed values more.
+//
+// The buffers are planes of floats; every pass runs rows in parallel on a ThreadPool, and the
+// loop over a row for one tap is straight-line arithmetic that vectorizes.
+class Denoiser {
+    public:
+        int   iterations   = 5;     // Passes; the last one reaches 2 * 2^(iterations - 1) pixels out
+        float sigma_color  = 3;     // Luminance difference, in standard deviations, that halves a weight
+        float sigma_normal = 0.3f;  // Distance between unit normals
+        float sigma_depth  = 0.05f; // Depth difference relative to depth, per pixel of distance
+        float sigma_albedo = 0.2f;  // Distance between albedo colors
+        int   thread_count = 0;     // 0 uses every hardware thread
+
+        Framebuffer denoise(const Framebuffer &image, const AovBuffers &aovs) const {
+            // Returns the filtered image, one sample per pixel.
+            auto start = std::chrono::steady_clock::now();
+            const int width = image.width();
+            const int height = image.height();
+            const size_t n = static_cast<size_t>(width) * height;
+
+            Planes current(n), next(n);
+            Guides guides(n);
+            for (int j = 0; j < height; ++j) {
+                for (int i = 0; i < width; ++i) {
+                    size_t k = static_cast<size_t>(j) * width + i;
+                    color albedo = aovs.albedo.average(i, j) + color(albedo_floor, albedo_floor, albedo_floor);
+                    color radiance = image.average(i, j);
+                    vec3 normal = aovs.normal.average(i, j);
+
+                    current.r[k] = radiance.r / albedo.r;
+                    current.g[k] = radiance.g / albedo.g;
+                    current.b[k] = radiance.b / albedo.b;
+                    float samples = static_cast<float>(std::max<uint32_t>(image.samples(i, j), 1));
+                    float albedo_luminance = luminance(albedo);
+                    current.variance[k] = image.luminance_variance(i, j) / samples
+                                        / (albedo_luminance * albedo_luminance);
+
+                    guides.nx[k] = normal.x;
+                    guides.ny[k] = normal.y;
+                    guides.nz[k] = normal.z;
+                    guides.depth[k] = aovs.depth.average(i, j).r;
+                    guides.inv_depth[k] = 1.0f / std::max(guides.depth[k], 1e-4f);
+                    guides.ar[k] = albedo.r;
+                    guides.ag[k] = albedo.g;
+                    guides.ab[k] = albedo.b;
+                }
+            }
+
+            {
+                ThreadPool pool(thread_count);
+                const int rows_per_task = 8;
+                for (int pass = 0; pass < iterations; ++pass) {
+                    int step = 1 << pass;
+                    for (int y0 = 0; y0 < height; y0 += rows_per_task) {
+                        int y1 = std::min(y0 + rows_per_task, height);
+                        pool.submit([this, &current, &next, &guides, width, height, step, y0, y1]() {
+                            for (int y = y0; y < y1; ++y) {
+                                filter_row(current, next, guides, width, height, step, y);
+                            }
+                        });
+                    }
+                    pool.wait();
+                    std::swap(current, next);
+                }
+            }
+
+            Framebuffer result(width, height);
+            for (int j = 0; j < height; ++j) {
+                for (int i = 0; i < width; ++i) {
+                    size_t k = static_cast<size_t>(j) * width + i;
+                    color filtered(current.r[k] * guides.ar[k], current.g[k] * guides.ag[k], current.b[k] * guides.ab[k]);
+                    result.add_samples(i, j, filtered, 1);
+                }
+            }
+
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::clog << "Denoised in " << elapsed.count() << "s, " << iterations << " passes" << std::endl;
+            return result;
+        }
+
+    private:
+        static constexpr float albedo_floor = 0.01f; // Keeps black surfaces from dividing by zero
+
+        struct Planes {
+            aligned_vector<float, 32> r, g, b; // Demodulated color
+            aligned_vector<float, 32> variance; // Of the mean luminance
+
+            explicit Planes(size_t n) : r(n), g(n), b(n), variance(n) {}
+        };
+
+        struct Guides {
+            aligned_vector<float, 32> nx, ny, nz;
+            aligned_vector<float, 32> depth, inv_depth;
+            aligned_vector<float, 32> ar, ag, ab;
+
+            explicit Guides(size_t n) : nx(n), ny(n), nz(n), depth(n), inv_depth(n), ar(n), ag(n), ab(n) {}
+        };
+
+        void filter_row(const Planes &in, Planes &out, const Guides &guides, int width, int height, int step,
+                        int y) const {
+            // The row goes in chunks whose sums live in local arrays: they cannot alias the
+            // planes, so the per-tap loops vectorize without runtime overlap checks.
+            static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+            const int chunk = 64;
+            const size_t row = static_cast<size_t>(y) * width;
+            const float normal_scale = 1.0f / (sigma_normal * sigma_normal);
+            const float albedo_scale = 1.0f / (sigma_albedo * sigma_albedo);
+
+            for (int c0 = 0; c0 < width; c0 += chunk) {
+                int c1 = std::min(c0 + chunk, width);
+                float sum_r[chunk] = {}, sum_g[chunk] = {}, sum_b[chunk] = {}, sum_v[chunk] = {}, sum_w[chunk] = {};
+                float color_scale[chunk];
+                for (int x = c0; x < c1; ++x) {
+                    // Wider passes see already smoothed, lower variance colors.
+                    color_scale[x - c0] = 1.0f / (sigma_color * sigma_color * in.variance[row + x] + 1e-6f);
+                }
+
+                for (int ty = -2; ty <= 2; ++ty) {
+                    int qy = y + ty * step;
+                    if (qy < 0 || qy >= height) {
+                        continue;
+                    }
+                    for (int tx = -2; tx <= 2; ++tx) {
+                        int offset = tx * step;
+                        int x_begin = std::max(c0, -offset);
+                        int x_end = std::min(c1, width - offset);
+                        float h = kernel[ty + 2] * kernel[tx + 2];
+                        float distance = step * std::sqrt(static_cast<float>(tx * tx + ty * ty));
+                        float depth_scale = 1.0f / (sigma_depth * sigma_depth * std::max(distance * distance, 1.0f));
+
+                        const size_t qrow = static_cast<size_t>(qy) * width + offset;
+                        const float *pr = in.r.data() + row, *qr = in.r.data() + qrow;
+                        const float *pg = in.g.data() + row, *qg = in.g.data() + qrow;
+                        const float *pb = in.b.data() + row, *qb = in.b.data() + qrow;
+                        const float *qv = in.variance.data() + qrow;
+                        const float *pnx = guides.nx.data() + row, *qnx = guides.nx.data() + qrow;
+                        const float *pny = guides.ny.data() + row, *qny = guides.ny.data() + qrow;
+                        const float *pnz = guides.nz.data() + row, *qnz = guides.nz.data() + qrow;
+                        const float *pd = guides.depth.data() + row, *qd = guides.depth.data() + qrow;
+                        const float *pid = guides.inv_depth.data() + row;
+                        const float *par = guides.ar.data() + row, *qar = guides.ar.data() + qrow;
+                        const float *pag = guides.ag.data() + row, *qag = guides.ag.data() + qrow;
+                        const float *pab = guides.ab.data() + row, *qab = guides.ab.data() + qrow;
+
+                        for (int x = x_begin; x < x_end; ++x) {
+                            float lp = 0.2126f * pr[x] + 0.7152f * pg[x] + 0.0722f * pb[x];
+                            float lq = 0.2126f * qr[x] + 0.7152f * qg[x] + 0.0722f * qb[x];
+                            float dl = lp - lq;
+                            float dnx = pnx[x] - qnx[x], dny = pny[x] - qny[x], dnz = pnz[x] - qnz[x];
+                            float dz = (pd[x] - qd[x]) * pid[x];
+                            float dar = par[x] - qar[x], dag = pag[x] - qag[x], dab = pab[x] - qab[x];
+
+                            int k = x - c0;
+                            float exponent = dl * dl * color_scale[k]
+                                           + (dnx * dnx + dny * dny + dnz * dnz) * normal_scale
+                                           + dz * dz * depth_scale
+                                           + (dar * dar + dag * dag + dab * dab) * albedo_scale;
+                            float w = h * fast_exp_neg(exponent);
+
+                            sum_r[k] += w * qr[x];
+                            sum_g[k] += w * qg[x];
+                            sum_b[k] += w * qb[x];
+                            sum_v[k] += w * w * qv[x];
+                            sum_w[k] += w;
+                        }
+                    }
+                }
+
+                for (int x = c0; x < c1; ++x) {
+                    // The center tap always has weight, so sum_w is never zero.
+                    int k = x - c0;
+                    float inv = 1.0f / sum_w[k];
+                    out.r[row + x] = sum_r[k] * inv;
+                    out.g[row + x] = sum_g[k] * inv;
+                    out.b[row + x] = sum_b[k] * inv;
+                    out.variance[row + x] = sum_v[k] * inv * inv;
+                }
+            }
+        }
+};
+
+#endif // DENOISE_H
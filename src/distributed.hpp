@@ -0,0 +1,623 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "camera.hpp"
+#include "framebuffer.hpp"
+#include "hittable.hpp"
+#include "instrument.hpp"
+#include "socket.hpp"
+#include "thread_pool.hpp"
+#include "tile.hpp"
+
+// Distributed rendering: one coordinator process hands work units (a tile and a range of its
+// samples) to worker processes over sockets and adds the float tiles they send back into the
+// frame. Workers build the scene once from their own command line and keep it for every
+// unit; the coordinator only accepts workers whose Camera::fingerprint() matches its own.
+//
+// Every sample is seeded from (seed, pixel, sample), so the merged frame is the one a single
+// process renders, whichever worker takes which unit. Units of a worker that disconnects go
+// back in the queue, and a unit outstanding for longer than the timeout is handed out again,
+// first result wins.
+//
+// Messages are a DistributedMessageHeader followed by its payload, in the byte order of the
+// coordinator; a worker with another byte order is turned away.
+
+enum class DistributedMessage : uint32_t {
+    Hello = 1, // Worker -> coordinator: DistributedHello
+    Reject,    // Coordinator -> worker: reason as text, then the connection closes
+    Work,      // Coordinator -> worker: DistributedWork
+    Result,    // Worker -> coordinator: DistributedResult, then the tile's Framebuffer::write_raw()
+    Shutdown   // Coordinator -> worker: the frame is done
+};
+
+struct DistributedMessageHeader {
+    uint32_t type; // DistributedMessage
+    uint32_t size; // Payload bytes that follow
+};
+
+struct DistributedHello {
+    char     magic[4];   // "RTDW"
+    uint32_t version;    // 1
+    uint32_t byte_order; // 0x01020304 as written
+    uint32_t threads;    // Units the worker renders at once
+    uint64_t fingerprint;
+};
+
+struct DistributedWork {
+    uint32_t unit;
+    int32_t  x0, y0, x1, y1;
+    int32_t  first_sample;
+    int32_t  sample_count;
+};
+
+struct DistributedResult {
+    uint32_t unit;
+    int32_t  width;
+    int32_t  height;
+    uint32_t reserved;
+    uint64_t rays;
+    double   seconds; // Time the worker spent rendering the unit
+};
+
+struct DistributedWorkerStats {
+    int      id = 0;
+    int      threads = 0;
+    uint64_t units = 0;           // Units whose result went into the frame
+    uint64_t duplicates = 0;      // Results that arrived after another worker's
+    uint64_t rays = 0;            // Rays of the accepted units
+    double   render_seconds = 0;  // Thread time spent on the accepted units
+    double   connected_seconds = 0;
+    bool     lost = false;        // Disconnected before the frame was done
+};
+
+struct DistributedStats {
+    double   seconds = 0; // Wall time from the first unit handed out to the last result
+    uint64_t units = 0;
+    uint64_t requeued = 0; // Units handed out again after a disconnect or a timeout
+    std::vector<DistributedWorkerStats> workers;
+
+    double efficiency() const {
+        // Fraction of the connected worker threads' time that went into accepted units. Idle
+        // time, transfers and duplicated units all lower it.
+        double available = 0, used = 0;
+        for (const DistributedWorkerStats &worker : workers) {
+            available += worker.connected_seconds * worker.threads;
+            used += worker.render_seconds;
+        }
+        return available > 0 ? used / available : 0.0;
+    }
+};
+
+inline std::ostream& operator<<(std::ostream &out, const DistributedStats &stats) {
+    uint64_t rays = 0;
+    for (const DistributedWorkerStats &worker : stats.workers) {
+        rays += worker.rays;
+    }
+    out << "Distributed: " << stats.units << " units on " << stats.workers.size() << " workers in "
+        << stats.seconds << "s, " << (stats.seconds > 0 ? rays / stats.seconds / 1e6 : 0.0) << " Mrays/s, "
+        << stats.requeued << " requeued, scaling efficiency " << 100 * stats.efficiency() << "%";
+    for (const DistributedWorkerStats &worker : stats.workers) {
+        double seconds = worker.connected_seconds;
+        out << "\n  worker " << worker.id << ": " << worker.threads << " threads, " << worker.units << " units, "
+            << worker.duplicates << " duplicates, " << (seconds > 0 ? worker.rays / seconds / 1e6 : 0.0)
+            << " Mrays/s, busy " << (seconds > 0 ? 100 * worker.render_seconds / (seconds * worker.threads) : 0.0)
+            << "%" << (worker.lost ? ", lost" : "");
+    }
+    return out;
+}
+
+inline bool send_message(Socket &socket, DistributedMessage type, const void *payload, size_t size) {
+    DistributedMessageHeader header;
+    header.type = static_cast<uint32_t>(type);
+    header.size = static_cast<uint32_t>(size);
+    return socket.send_all(&header, sizeof(header)) && (size == 0 || socket.send_all(payload, size));
+}
+
+class DistributedCoordinator {
+    public:
+        int   samples_per_unit = 0; // Samples in each work unit, 0 sends every sample of a tile at once
+        float unit_timeout = 0;     // Seconds before an outstanding unit is handed out again, 0 picks
+                                    // four times the mean round trip (at least 5s)
+        int   units_per_thread = 2; // Units kept in flight per worker thread, to hide latency
+
+        explicit DistributedCoordinator(Camera &camera) : _camera(camera) {}
+
+        bool render_frame(const IHittable &world, const std::string &address, Framebuffer &image,
+                          std::string &error) {
+            // Listens on address, renders the frame on whichever workers connect and returns
+            // once every unit is in image. Workers may join and leave at any time.
+            RT_TRACE_SCOPE("distributed frame", "width", _camera.image_width);
+            Camera &cam = _camera;
+            cam.initialize();
+            _fingerprint = cam.fingerprint(world);
+
+            Socket listener = Socket::listen_on(address, error);
+            if (!listener.valid()) {
+                return false;
+            }
+            Socket::ignore_broken_pipes();
+
+            image = Framebuffer(cam.image_width, cam.image_height);
+            make_units();
+            _stats = DistributedStats();
+            _stats.units = _units.size();
+            _connections.clear();
+            _round_trip_seconds = 0;
+            _round_trips = 0;
+            _remaining = _units.size();
+            _pending.clear();
+            for (uint32_t u = 0; u < _units.size(); ++u) {
+                _pending.push_back(u);
+            }
+
+            std::clog << "width: " << cam.image_width << " height: " << cam.image_height << std::endl;
+            std::clog << "Waiting for workers on " << address << " for " << _units.size() << " units" << std::endl;
+
+            bool started = false;
+            Clock::time_point start = Clock::now();
+            while (_remaining > 0) {
+                std::vector<pollfd> fds(1);
+                fds[0].fd = listener.fd();
+                fds[0].events = POLLIN;
+                for (const auto &connection : _connections) {
+                    pollfd fd;
+                    fd.fd = connection->socket.fd();
+                    fd.events = POLLIN;
+                    fds.push_back(fd);
+                }
+                if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR) {
+                    error = std::string("poll failed: ") + std::strerror(errno);
+                    return false;
+                }
+
+                for (size_t c = 0; c < _connections.size(); ++c) {
+                    if (fds[c + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                        receive(*_connections[c], image);
+                    }
+                }
+                if (fds[0].revents & POLLIN) {
+                    accept_worker(listener);
+                }
+
+                requeue_stragglers();
+                remove_closed();
+                for (const auto &connection : _connections) {
+                    if (!started && connection->ready) {
+                        started = true;
+                        start = Clock::now();
+                    }
+                    dispatch(*connection);
+                }
+            }
+            _stats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+            for (const auto &connection : _connections) {
+                send_message(connection->socket, DistributedMessage::Shutdown, nullptr, 0);
+                close(*connection, false);
+            }
+            _connections.clear();
+            std::sort(_stats.workers.begin(), _stats.workers.end(),
+                      [](const DistributedWorkerStats &a, const DistributedWorkerStats &b) { return a.id < b.id; });
+
+            cam._stats = PathStats(cam.max_depth);
+            for (const DistributedWorkerStats &worker : _stats.workers) {
+                cam._stats.rays += worker.rays;
+            }
+            std::clog << _stats << std::endl;
+            return true;
+        }
+
+        const DistributedStats& stats() const { return _stats; }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        struct Unit {
+            DistributedWork work;
+            int in_flight = 0;         // Workers currently holding it
+            bool done = false;
+            bool requeued = false;     // Already queued again for its latest hand-out
+            Clock::time_point sent_at; // Latest hand-out
+        };
+
+        struct Connection {
+            Socket socket;
+            std::vector<uint8_t> buffer; // Received bytes not parsed yet
+            std::vector<uint32_t> outstanding;
+            DistributedWorkerStats stats;
+            Clock::time_point connected_at;
+            bool ready = false;  // Said hello and was accepted
+            bool closed = false;
+        };
+
+        Camera &_camera;
+        uint64_t _fingerprint = 0;
+        std::vector<Unit> _units;
+        std::deque<uint32_t> _pending;
+        size_t _remaining = 0;
+        std::vector<std::unique_ptr<Connection>> _connections;
+        int _next_worker_id = 0;
+        double _round_trip_seconds = 0;
+        uint64_t _round_trips = 0;
+        DistributedStats _stats;
+
+        void make_units() {
+            // Every tile, split into sample ranges of samples_per_unit.
+            Camera &cam = _camera;
+            int spp = std::max(cam.samples_per_pixel, 1);
+            int per_unit = samples_per_unit > 0 ? std::min(samples_per_unit, spp) : spp;
+
+            _units.clear();
+            for (const Tile &tile : make_tiles(cam.image_width, cam.image_height, cam.tile_size)) {
+                for (int first = 0; first < spp; first += per_unit) {
+                    Unit unit;
+                    unit.work.unit = static_cast<uint32_t>(_units.size());
+                    unit.work.x0 = tile.x0;
+                    unit.work.y0 = tile.y0;
+                    unit.work.x1 = tile.x1;
+                    unit.work.y1 = tile.y1;
+                    unit.work.first_sample = first;
+                    unit.work.sample_count = std::min(per_unit, spp - first);
+                    _units.push_back(unit);
+                }
+            }
+        }
+
+        void accept_worker(Socket &listener) {
+            std::unique_ptr<Connection> connection(new Connection());
+            connection->socket = listener.accept_connection();
+            if (!connection->socket.valid()) {
+                return;
+            }
+            connection->stats.id = _next_worker_id++;
+            connection->connected_at = Clock::now();
+            _connections.push_back(std::move(connection));
+        }
+
+        void receive(Connection &connection, Framebuffer &image) {
+            if (!connection.socket.recv_some(connection.buffer)) {
+                close(connection, true);
+                return;
+            }
+
+            size_t offset = 0;
+            while (!connection.closed && connection.buffer.size() - offset >= sizeof(DistributedMessageHeader)) {
+                DistributedMessageHeader header;
+                std::memcpy(&header, connection.buffer.data() + offset, sizeof(header));
+                if (header.size > (1u << 30)) {
+                    std::cerr << "Worker " << connection.stats.id << " sent a corrupt message\n";
+                    close(connection, true);
+                    return;
+                }
+                if (connection.buffer.size() - offset < sizeof(header) + header.size) {
+                    break;
+                }
+                const uint8_t *payload = connection.buffer.data() + offset + sizeof(header);
+                handle(connection, static_cast<DistributedMessage>(header.type), payload, header.size, image);
+                offset += sizeof(header) + header.size;
+            }
+            if (!connection.closed) {
+                connection.buffer.erase(connection.buffer.begin(), connection.buffer.begin() + offset);
+            }
+        }
+
+        void handle(Connection &connection, DistributedMessage type, const uint8_t *payload, size_t size,
+                    Framebuffer &image) {
+            if (type == DistributedMessage::Hello && !connection.ready) {
+                DistributedHello hello;
+                std::string reason;
+                if (size != sizeof(hello)) {
+                    reason = "bad hello";
+                } else {
+                    std::memcpy(&hello, payload, sizeof(hello));
+                    if (std::memcmp(hello.magic, "RTDW", 4) != 0 || hello.version != 1
+                        || hello.byte_order != 0x01020304u) {
+                        reason = "incompatible build";
+                    } else if (hello.fingerprint != _fingerprint) {
+                        reason = "the worker's scene, camera or sampling settings differ from the coordinator's";
+                    }
+                }
+                if (!reason.empty()) {
+                    std::cerr << "Rejected worker " << connection.stats.id << ": " << reason << "\n";
+                    send_message(connection.socket, DistributedMessage::Reject, reason.data(), reason.size());
+                    connection.socket.close();
+                    connection.closed = true;
+                    return;
+                }
+                connection.ready = true;
+                connection.stats.threads = std::max<int>(hello.threads, 1);
+                std::clog << "Worker " << connection.stats.id << " joined with " << connection.stats.threads
+                          << " threads" << std::endl;
+                return;
+            }
+            if (type != DistributedMessage::Result || !connection.ready) {
+                std::cerr << "Worker " << connection.stats.id << " sent an unexpected message\n";
+                close(connection, true);
+                return;
+            }
+
+            DistributedResult result;
+            if (size < sizeof(result)) {
+                close(connection, true);
+                return;
+            }
+            std::memcpy(&result, payload, sizeof(result));
+            auto held = std::find(connection.outstanding.begin(), connection.outstanding.end(), result.unit);
+            if (held == connection.outstanding.end()) {
+                std::cerr << "Worker " << connection.stats.id << " returned a unit it was not given\n";
+                close(connection, true);
+                return;
+            }
+            connection.outstanding.erase(held);
+            Unit &unit = _units[result.unit];
+            --unit.in_flight;
+
+            _round_trip_seconds += std::chrono::duration<double>(Clock::now() - unit.sent_at).count();
+            ++_round_trips;
+
+            if (unit.done) {
+                ++connection.stats.duplicates;
+                return;
+            }
+            // The size comes off the network: it is checked against the unit before anything
+            // is allocated for it.
+            bool malformed = result.width != unit.work.x1 - unit.work.x0
+                          || result.height != unit.work.y1 - unit.work.y0;
+            Framebuffer tile;
+            if (!malformed) {
+                tile = Framebuffer(result.width, result.height);
+                std::istringstream in(std::string(reinterpret_cast<const char*>(payload) + sizeof(result),
+                                                  size - sizeof(result)));
+                malformed = !tile.read_raw(in);
+            }
+            if (malformed) {
+                std::cerr << "Worker " << connection.stats.id << " returned a malformed tile\n";
+                close(connection, true);
+                return;
+            }
+            image.add_buffer(unit.work.x0, unit.work.y0, tile);
+            unit.done = true;
+            --_remaining;
+
+            ++connection.stats.units;
+            connection.stats.rays += result.rays;
+            connection.stats.render_seconds += result.seconds;
+        }
+
+        void dispatch(Connection &connection) {
+            // Tops the worker up to its share of units in flight.
+            if (!connection.ready || connection.closed) {
+                return;
+            }
+            size_t capacity = static_cast<size_t>(connection.stats.threads) * std::max(units_per_thread, 1);
+            auto next = _pending.begin();
+            while (connection.outstanding.size() < capacity && next != _pending.end()) {
+                uint32_t u = *next;
+                Unit &unit = _units[u];
+                if (unit.done) {
+                    next = _pending.erase(next);
+                    continue;
+                }
+                if (std::find(connection.outstanding.begin(), connection.outstanding.end(), u)
+                    != connection.outstanding.end()) {
+                    ++next; // A straggler this worker already holds goes to someone else
+                    continue;
+                }
+                next = _pending.erase(next);
+                if (!send_message(connection.socket, DistributedMessage::Work, &unit.work, sizeof(unit.work))) {
+                    _pending.push_front(u);
+                    close(connection, true);
+                    return;
+                }
+                connection.outstanding.push_back(u);
+                ++unit.in_flight;
+                unit.requeued = false;
+                unit.sent_at = Clock::now();
+            }
+        }
+
+        void requeue_stragglers() {
+            // Units out for much longer than usual are probably on a slow or hung worker; another
+            // worker gets a copy, while the first may still finish it.
+            double timeout = unit_timeout;
+            if (timeout <= 0) {
+                timeout = _round_trips > 0 ? std::max(5.0, 4 * _round_trip_seconds / _round_trips) : 30.0;
+            }
+            Clock::time_point now = Clock::now();
+            for (Unit &unit : _units) {
+                if (!unit.done && unit.in_flight > 0 && !unit.requeued
+                    && std::chrono::duration<double>(now - unit.sent_at).count() > timeout) {
+                    unit.requeued = true;
+                    _pending.push_front(unit.work.unit);
+                    ++_stats.requeued;
+                }
+            }
+        }
+
+        void close(Connection &connection, bool lost) {
+            // Gives the connection's unfinished units back to the queue.
+            if (connection.ready) {
+                for (uint32_t u : connection.outstanding) {
+                    Unit &unit = _units[u];
+                    --unit.in_flight;
+                    if (!unit.done && unit.in_flight == 0) {
+                        _pending.push_front(u);
+                        ++_stats.requeued;
+                    }
+                }
+                connection.stats.lost = lost;
+                connection.stats.connected_seconds =
+                    std::chrono::duration<double>(Clock::now() - connection.connected_at).count();
+                _stats.workers.push_back(connection.stats);
+                if (lost) {
+                    std::cerr << "Lost worker " << connection.stats.id << ", requeued "
+                              << connection.outstanding.size() << " units\n";
+                }
+            }
+            connection.outstanding.clear();
+            connection.ready = false;
+            connection.closed = true;
+            connection.socket.close();
+        }
+
+        void remove_closed() {
+            _connections.erase(std::remove_if(_connections.begin(), _connections.end(),
+                                              [](const std::unique_ptr<Connection> &connection) {
+                                                  return connection->closed;
+                                              }),
+                               _connections.end());
+        }
+};
+
+class DistributedWorker {
+    public:
+        float connect_timeout = 30; // Seconds to keep trying while the coordinator starts up
+
+        explicit DistributedWorker(Camera &camera) : _camera(camera) {}
+
+        bool serve(const IHittable &world, const std::string &address, std::string &error) {
+            // Connects to the coordinator and renders the units it sends until it says the frame
+            // is done. The scene stays loaded across units.
+            Camera &cam = _camera;
+            cam.initialize();
+            Socket::ignore_broken_pipes();
+
+            Socket socket;
+            auto deadline = std::chrono::steady_clock::now()
+                          + std::chrono::milliseconds(static_cast<int64_t>(connect_timeout * 1000));
+            while (true) {
+                socket = Socket::connect_to(address, error);
+                if (socket.valid() || std::chrono::steady_clock::now() >= deadline) {
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            if (!socket.valid()) {
+                return false;
+            }
+
+            ThreadPool pool(cam.thread_count);
+            DistributedHello hello;
+            std::memcpy(hello.magic, "RTDW", 4);
+            hello.version = 1;
+            hello.byte_order = 0x01020304u;
+            hello.threads = static_cast<uint32_t>(pool.size());
+            hello.fingerprint = cam.fingerprint(world);
+            if (!send_message(socket, DistributedMessage::Hello, &hello, sizeof(hello))) {
+                error = "could not reach the coordinator";
+                return false;
+            }
+            std::clog << "Connected to " << address << " with " << pool.size() << " threads" << std::endl;
+
+            std::mutex send_mutex;
+            bool send_failed = false;
+            uint64_t units = 0;
+            bool ok = true;
+            while (true) {
+                DistributedMessageHeader header;
+                if (!socket.recv_all(&header, sizeof(header))) {
+                    error = "lost the coordinator";
+                    ok = false;
+                    break;
+                }
+                // The size comes off the network: it is checked before anything is allocated.
+                if (header.size > (1u << 20)) {
+                    error = "the coordinator sent a malformed message";
+                    ok = false;
+                    break;
+                }
+                std::vector<char> payload(header.size);
+                if (!socket.recv_all(payload.data(), payload.size())) {
+                    error = "lost the coordinator";
+                    ok = false;
+                    break;
+                }
+
+                DistributedMessage type = static_cast<DistributedMessage>(header.type);
+                if (type == DistributedMessage::Shutdown) {
+                    break;
+                }
+                if (type == DistributedMessage::Reject) {
+                    error = "the coordinator refused this worker: " + std::string(payload.begin(), payload.end());
+                    ok = false;
+                    break;
+                }
+                if (type != DistributedMessage::Work || payload.size() != sizeof(DistributedWork)) {
+                    error = "unexpected message from the coordinator";
+                    ok = false;
+                    break;
+                }
+
+                DistributedWork work;
+                std::memcpy(&work, payload.data(), sizeof(work));
+                ++units;
+                pool.submit([this, &world, &socket, &send_mutex, &send_failed, work]() {
+                    std::string message = render_unit(world, work);
+                    std::lock_guard<std::mutex> lock(send_mutex);
+                    if (!send_failed && !socket.send_all(message.data(), message.size())) {
+                        send_failed = true;
+                    }
+                });
+            }
+            pool.wait();
+            std::clog << "Rendered " << units << " units" << std::endl;
+            return ok;
+        }
+
+    private:
+        Camera &_camera;
+
+        std::string render_unit(const IHittable &world, const DistributedWork &work) const {
+            // The finished Result message for one unit.
+            RT_TRACE_TILE(static_cast<int64_t>(work.unit));
+            auto start = std::chrono::steady_clock::now();
+
+            Tile tile;
+            tile.id = static_cast<int>(work.unit);
+            tile.x0 = work.x0;
+            tile.y0 = work.y0;
+            tile.x1 = work.x1;
+            tile.y1 = work.y1;
+            Framebuffer image(tile.width(), tile.height());
+            PathStats stats(_camera.max_depth);
+            _camera.render_tile(tile, world, image, work.first_sample, work.sample_count, nullptr, stats,
+                                nullptr, tile.x0, tile.y0);
+
+            DistributedResult result;
+            result.unit = work.unit;
+            result.width = tile.width();
+            result.height = tile.height();
+            result.reserved = 0;
+            result.rays = stats.rays;
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::ostringstream out;
+            DistributedMessageHeader header;
+            header.type = static_cast<uint32_t>(DistributedMessage::Result);
+            header.size = 0;
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(&result), sizeof(result));
+            image.write_raw(out);
+
+            std::string message = out.str();
+            header.size = static_cast<uint32_t>(message.size() - sizeof(header));
+            std::memcpy(&message[0], &header, sizeof(header));
+            return message;
+        }
+};
+
+#endif // DISTRIBUTED_H
@@ -0,0 +1,121 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "color.hpp"
+#include "vec3.hpp"
+
+// Floating point accumulation buffer. Every pixel keeps the running sum of its samples in
+// linear color, plus how many samples went into it; output stages divide one by the other.
+class Framebuffer {
+    private:
+        int _width;
+        int _height;
+        std::vector<color> _sums;         // Sum of all samples taken for each pixel, row-major
+        std::vector<uint32_t> _samples;   // Number of samples in each sum
+        std::vector<float> _sq_luminance; // Sum of the squared luminance of those samples
+
+    public:
+        Framebuffer() : _width(0), _height(0) {}
+
+        Framebuffer(int width, int height)
+            : _width(width), _height(height), _sums(width * height), _samples(width * height, 0),
+              _sq_luminance(width * height, 0) {}
+
+        int width() const { return _width; }
+        int height() const { return _height; }
+
+        const color& sum(int i, int j) const { return _sums[j * _width + i]; }
+        uint32_t samples(int i, int j) const { return _samples[j * _width + i]; }
+        float sq_luminance(int i, int j) const { return _sq_luminance[j * _width + i]; }
+
+        void add_samples(int i, int j, const color &sum, uint32_t count, float sq_luminance = 0) {
+            _sums[j * _width + i] += sum;
+            _samples[j * _width + i] += count;
+            _sq_luminance[j * _width + i] += sq_luminance;
+        }
+
+        void add_buffer(int x0, int y0, const Framebuffer &other) {
+            // Adds every pixel of other, a smaller buffer placed with its corner at (x0, y0).
+            for (int j = 0; j < other.height(); ++j) {
+                for (int i = 0; i < other.width(); ++i) {
+                    add_samples(x0 + i, y0 + j, other.sum(i, j), other.samples(i, j), other.sq_luminance(i, j));
+                }
+            }
+        }
+
+        color average(int i, int j) const {
+            // Mean linear color of the pixel, black before any sample has arrived.
+            uint32_t count = samples(i, j);
+            return count > 0 ? sum(i, j) / static_cast<float>(count) : color(0, 0, 0);
+        }
+
+        float luminance_variance(int i, int j) const {
+            // Unbiased sample variance of the luminance of the pixel's samples.
+            uint32_t count = samples(i, j);
+            if (count < 2) {
+                return 0;
+            }
+            float mean = luminance(sum(i, j)) / count;
+            float mean_sq = _sq_luminance[j * _width + i] / count;
+            return std::max(0.0f, (mean_sq - mean * mean) * count / (count - 1));
+        }
+
+        void write_raw(std::ostream &out) const {
+            // The accumulation buffers, for checkpoints. Sums are written as three floats each,
+            // whatever the layout of color in this build.
+            std::vector<float> sums(_sums.size() * 3);
+            for (size_t k = 0; k < _sums.size(); ++k) {
+                sums[3 * k] = _sums[k].r;
+                sums[3 * k + 1] = _sums[k].g;
+                sums[3 * k + 2] = _sums[k].b;
+            }
+            out.write(reinterpret_cast<const char*>(sums.data()), sums.size() * sizeof(float));
+            out.write(reinterpret_cast<const char*>(_samples.data()), _samples.size() * sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(_sq_luminance.data()), _sq_luminance.size() * sizeof(float));
+        }
+
+        bool read_raw(std::istream &in) {
+            // Reverse of write_raw() for a buffer of the same size.
+            std::vector<float> sums(_sums.size() * 3);
+            in.read(reinterpret_cast<char*>(sums.data()), sums.size() * sizeof(float));
+            for (size_t k = 0; k < _sums.size(); ++k) {
+                _sums[k] = color(sums[3 * k], sums[3 * k + 1], sums[3 * k + 2]);
+            }
+            in.read(reinterpret_cast<char*>(_samples.data()), _samples.size() * sizeof(uint32_t));
+            in.read(reinterpret_cast<char*>(_sq_luminance.data()), _sq_luminance.size() * sizeof(float));
+            return static_cast<bool>(in);
+        }
+};
+
+inline Framebuffer sample_heatmap(const Framebuffer &image) {
+    // False-color image of how many samples each pixel took: blue for the fewest, through
+    // cyan, green and yellow, to red for the most.
+    uint32_t fewest = 0xffffffffu, most = 0;
+    for (int j = 0; j < image.height(); ++j) {
+        for (int i = 0; i < image.width(); ++i) {
+            fewest = std::min(fewest, image.samples(i, j));
+            most = std::max(most, image.samples(i, j));
+        }
+    }
+
+    Framebuffer heatmap(image.width(), image.height());
+    float range = most > fewest ? static_cast<float>(most - fewest) : 1.0f;
+    for (int j = 0; j < image.height(); ++j) {
+        for (int i = 0; i < image.width(); ++i) {
+            float t = (image.samples(i, j) - fewest) / range;
+            float r = std::min(1.0f, std::max(0.0f, 4 * t - 2));
+            float g = std::min(1.0f, std::max(0.0f, t < 0.75f ? 4 * t : 4 - 4 * t));
+            float b = std::min(1.0f, std::max(0.0f, 2 - 4 * t));
+            heatmap.add_samples(i, j, color(r, g, b), 1);
+        }
+    }
+    return heatmap;
+}
+
+#endif // FRAMEBUFFER_H
@@ -0,0 +1,292 @@
+#ifndef FROZEN_SCENE_H
+#define FROZEN_SCENE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "aabb.hpp"
+#include "aligned.hpp"
+#include "arena.hpp"
+#include "bvh.hpp"
+#include "hittable.hpp"
+#include "interval.hpp"
+#include "light.hpp"
+#include "material.hpp"
+#include "scene_file.hpp"
+#include "sphere.hpp"
+#include "thread_pool.hpp"
+#include "vec3.hpp"
+
+struct FrozenSceneStats {
+    size_t spheres = 0;
+    size_t materials_added = 0; // Materials handed to the builder
+    size_t materials = 0;       // Left after deduplication
+    size_t arena_bytes = 0;     // Spheres and materials
+    size_t bvh_bytes = 0;
+    BvhStats bvh;
+
+    double bytes_per_sphere() const {
+        return spheres ? static_cast<double>(arena_bytes + bvh_bytes) / spheres : 0;
+    }
+};
+
+inline std::ostream& operator<<(std::ostream &out, const FrozenSceneStats &stats) {
+    return out << "Frozen scene: " << stats.spheres << " spheres, " << stats.materials << " materials (of "
+               << stats.materials_added << " added), " << (stats.arena_bytes + stats.bvh_bytes) / 1024 << " KiB, "
+               << stats.bytes_per_sphere() << " bytes per sphere with the BVH, " << stats.bvh;
+}
+
+// Read-only spheres in one arena, made by SceneBuilder::freeze().
+//
+// The spheres are plain records in BVH leaf order, so the spheres of a leaf are adjacent and
+// the traversal walks memory forwards, and they point at their materials without owning
+// them. Everything is released at once with the scene.
+class FrozenScene : public IHittable {
+    friend class SceneBuilder;
+
+    public:
+        const FrozenSceneStats& stats() const { return _stats; }
+        const LightList& lights() const { return _lights; } // Spheres with a DiffuseLight
+
+        bool intersect(const ray &r, Interval ray_t, HitRecord &rec) const override {
+            return traverse_bvh(_nodes, r, ray_t, [&](uint32_t first, uint32_t count, Interval &leaf_t) {
+                bool hit = false;
+                for (uint32_t i = first; i < first + count; ++i) {
+                    if (hit_sphere(_spheres[i].center, _spheres[i].radius, r, leaf_t, rec.t)) {
+                        hit = true;
+                        leaf_t.max = rec.t;
+                        rec.object = this;
+                        rec.primitive = i;
+                    }
+                }
+                return hit;
+            });
+        }
+
+        bool occluded(const ray &r, Interval ray_t) const override {
+            return traverse_bvh<true>(_nodes, r, ray_t, [&](uint32_t first, uint32_t count, Interval &leaf_t) {
+                float t;
+                for (uint32_t i = first; i < first + count; ++i) {
+                    if (hit_sphere(_spheres[i].center, _spheres[i].radius, r, leaf_t, t)) {
+                        return true;
+                    }
+                }
+                return false;
+            });
+        }
+
+        void surface(const ray &r, HitRecord &rec) const override {
+            const Record &sphere = _spheres[rec.primitive];
+            rec.p = r.at(rec.t);
+            vec3 outward_normal = (rec.p - sphere.center) / sphere.radius;
+            rec.set_face_normal(r, outward_normal);
+            rec.mat = sphere.material;
+        }
+
+        Aabb bounding_box() const override { return _bbox; }
+
+    private:
+        struct Record {
+            point3 center;
+            float radius;
+            const IMaterial *material; // In the arena
+        };
+
+        std::unique_ptr<Arena> _arena;
+        const Record *_spheres = nullptr;
+        aligned_vector<BvhNode> _nodes;
+        LightList _lights;
+        FrozenSceneStats _stats;
+        Aabb _bbox;
+
+        FrozenScene() = default;
+};
+
+// Collects spheres and materials for a FrozenScene.
+//
+// Materials with the same class and parameters are created once, in the arena, and shared by
+// every sphere that asks for them: lambertian(), metal(), dielectric() and diffuse_light()
+// return the shared one. Spheres are staged until freeze(), which orders them for the BVH and moves them and
+// the materials into the scene. Nothing here is reference counted.
+class SceneBuilder {
+    public:
+        int leaf_size = 8; // Most spheres per BVH leaf
+
+        SceneBuilder() : _arena(new Arena()) {}
+
+        const IMaterial* lambertian(const color &albedo) {
+            SceneMaterial record = key(MaterialType::Lambertian, albedo, 0);
+            return material(record);
+        }
+
+        const IMaterial* metal(const color &albedo, float fuzz) {
+            // The fuzz is clamped first, as Metal does, so materials that render alike match.
+            SceneMaterial record = key(MaterialType::Metal, albedo, fuzz < 1 ? fuzz : 1);
+            return material(record);
+        }
+
+        const IMaterial* dielectric(float index_of_refraction) {
+            SceneMaterial record = key(MaterialType::Dielectric, color(0, 0, 0), index_of_refraction);
+            return material(record);
+        }
+
+        const IMaterial* diffuse_light(const color &emission) {
+            SceneMaterial record = key(MaterialType::Other, emission, 0);
+            return material(record);
+        }
+
+        const IMaterial* material(const SceneMaterial &record) {
+            ++_materials_added;
+            std::string bytes(reinterpret_cast<const char*>(&record), sizeof(record));
+            auto found = _materials.find(bytes);
+            if (found != _materials.end()) {
+                return found->second;
+            }
+            color albedo(record.albedo[0], record.albedo[1], record.albedo[2]);
+            const IMaterial *created;
+            switch (static_cast<MaterialType>(record.type)) {
+                case MaterialType::Metal:
+                    created = _arena->create<Metal>(albedo, record.param);
+                    break;
+                case MaterialType::Dielectric:
+                    created = _arena->create<Dielectric>(record.param);
+                    break;
+                case MaterialType::Other:
+                    created = _arena->create<DiffuseLight>(albedo);
+                    break;
+                default:
+                    created = _arena->create<Lambertian>(albedo);
+                    break;
+            }
+            _materials.emplace(std::move(bytes), created);
+            return created;
+        }
+
+        void sphere(const point3 &center, float radius, const IMaterial *material) {
+            _spheres.push_back(FrozenScene::Record{center, radius, material});
+        }
+
+        void add(const SceneDescription &description) {
+            // Every sphere of a loaded scene file.
+            std::vector<const IMaterial*> materials(description.material_count());
+            for (size_t m = 0; m < materials.size(); ++m) {
+                materials[m] = material(description.materials()[m]);
+            }
+            const SceneSphere *spheres = description.spheres();
+            _spheres.reserve(_spheres.size() + description.sphere_count());
+            for (size_t s = 0; s < description.sphere_count(); ++s) {
+                const SceneSphere &record = spheres[s];
+                sphere(point3(record.center[0], record.center[1], record.center[2]), record.radius,
+                       materials[record.material]);
+            }
+        }
+
+        bool add(const HittableList &world, std::string &error) {
+            // Copies a world of Spheres with the built-in materials; fails on anything else.
+            std::unordered_map<const IMaterial*, const IMaterial*> seen;
+            _spheres.reserve(_spheres.size() + world.objects.size());
+            for (const auto &object : world.objects) {
+                const Sphere *source = dynamic_cast<const Sphere*>(object.get());
+                if (!source) {
+                    error = "the frozen scene only holds spheres";
+                    return false;
+                }
+                const IMaterial *original = source->material().get();
+                auto found = seen.find(original);
+                if (found == seen.end()) {
+                    SceneMaterial record;
+                    if (!SceneDescription::describe_material(*original, record)) {
+                        error = "the frozen scene only holds lambertian, metal, dielectric and light materials";
+                        return false;
+                    }
+                    found = seen.emplace(original, material(record)).first;
+                }
+                sphere(source->center(), source->radius(), found->second);
+            }
+            return true;
+        }
+
+        size_t sphere_count() const { return _spheres.size(); }
+
+        std::unique_ptr<FrozenScene> freeze(int thread_count = 0) {
+            // Builds the BVH and hands everything over; the builder is empty afterwards.
+            std::unique_ptr<FrozenScene> scene(new FrozenScene());
+            FrozenSceneStats &stats = scene->_stats;
+
+            std::vector<Aabb> boxes(_spheres.size());
+            for (size_t i = 0; i < _spheres.size(); ++i) {
+                vec3 r(fabsf(_spheres[i].radius), fabsf(_spheres[i].radius), fabsf(_spheres[i].radius));
+                boxes[i] = Aabb(_spheres[i].center - r, _spheres[i].center + r);
+                scene->_bbox.expand(boxes[i]);
+            }
+            BvhBuilder builder;
+            builder.max_leaf_size = leaf_size;
+            builder.thread_count = thread_count;
+            std::vector<uint32_t> order;
+            builder.build(boxes, scene->_nodes, order, stats.bvh);
+
+            FrozenScene::Record *spheres = _arena->allocate_array<FrozenScene::Record>(_spheres.size());
+            for (size_t i = 0; i < _spheres.size(); ++i) {
+                spheres[i] = _spheres[order[i]];
+            }
+            scene->_spheres = spheres;
+
+            // The lights are listed in the order the spheres were added, as LightList::collect()
+            // lists a world's, so both pick the same light for the same sample.
+            std::vector<uint32_t> position(_spheres.size());
+            for (size_t i = 0; i < _spheres.size(); ++i) {
+                position[order[i]] = static_cast<uint32_t>(i);
+            }
+            for (size_t s = 0; s < _spheres.size(); ++s) {
+                const FrozenScene::Record &record = _spheres[s];
+                const DiffuseLight *light = record.material->type() == MaterialType::Other
+                                          ? dynamic_cast<const DiffuseLight*>(record.material) : nullptr;
+                if (light) {
+                    scene->_lights.add(record.center, record.radius, light->emission(), scene.get(), position[s]);
+                }
+            }
+            scene->_lights.finish();
+
+            stats.spheres = _spheres.size();
+            stats.materials_added = _materials_added;
+            stats.materials = _materials.size();
+            stats.arena_bytes = _arena->bytes_used();
+            stats.bvh_bytes = scene->_nodes.size() * sizeof(BvhNode);
+
+            scene->_arena = std::move(_arena);
+            reset();
+            return scene;
+        }
+
+    private:
+        std::unique_ptr<Arena> _arena;
+        std::vector<FrozenScene::Record> _spheres; // Staged, in the order they were added
+        std::unordered_map<std::string, const IMaterial*> _materials; // By SceneMaterial bytes
+        size_t _materials_added = 0;
+
+        static SceneMaterial key(MaterialType type, const color &albedo, float param) {
+            SceneMaterial record;
+            std::memset(&record, 0, sizeof(record));
+            record.type = static_cast<uint32_t>(type);
+            record.albedo[0] = albedo.x;
+            record.albedo[1] = albedo.y;
+            record.albedo[2] = albedo.z;
+            record.param = param;
+            return record;
+        }
+
+        void reset() {
+            _arena.reset(new Arena());
+            std::vector<FrozenScene::Record>().swap(_spheres);
+            _materials.clear();
+            _materials_added = 0;
+        }
+};
+
+#endif // FROZEN_SCENE_H
@@ -1,21 +1,38 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <vector>
 
+#include "aabb.hpp"
 #include "interval.hpp"
 #include "ray.hpp"
 
+class IHittable;
 class IMaterial;
 
+// Deepest nesting of Instances a HitRecord can describe, Instances inside lists or Bvhs inside
+// other Instances included.
+const int max_instance_depth = 4;
+
 struct HitRecord {
+    // Written while searching for the closest hit.
+    float t;
+    const IHittable *object;    // Primitive that was hit
+    uint32_t primitive;         // Which part of `object` was hit, for hittables holding many
+    // When `object` is an Instance: what each Instance on the way down found inside its child,
+    // by the Instance's depth. instanced[d - 1] belongs to the Instance of depth d, so the
+    // slots of one path never collide.
+    const IHittable *instanced[max_instance_depth];
+
+    // Written once the closest hit is known, by `object->surface()`.
     point3 p;
     vec3 normal;
-    float t;
     bool front_face;
-    std::shared_ptr<IMaterial> mat;
+    const IMaterial *mat;
 
     void set_face_normal(const ray &r, const vec3 &outward_normal) {
         // Sets the hit record normal vector.
@@ -30,13 +47,45 @@ struct HitRecord {
 class IHittable {
     public:
         // TODO: Might be better to return rec in some way, instead of using it as an out parameter.
-        // see the Sphere::hit() method in sphere.hpp for reference.
-        virtual bool hit(const ray &r, Interval ray_t, HitRecord &rec) const = 0;
+        // see the Sphere::intersect() method in sphere.hpp for reference.
+        bool hit(const ray &r, Interval ray_t, HitRecord &rec) const {
+            // Closest hit with its full surface description. The search only records t and
+            // the primitive; position, normal and material are worked out once, at the end.
+            if (!intersect(r, ray_t, rec)) {
+                return false;
+            }
+            rec.object->surface(r, rec);
+            return true;
+        }
+
+        // Finds the closest hit in ray_t and writes only t, object and primitive. On a miss
+        // rec is left untouched, so aggregates can hand the same record to every child.
+        virtual bool intersect(const ray &r, Interval ray_t, HitRecord &rec) const = 0;
+
+        // Fills in p, normal, front_face and mat for a hit intersect() reported on this
+        // object. Aggregates never end up in HitRecord::object, so they keep the default.
+        virtual void surface(const ray &, HitRecord &) const {}
+
+        // Whether anything lies in ray_t, for visibility tests that need no hit details. May
+        // return on the first hit found instead of the closest one; the default searches for
+        // the closest.
+        virtual bool occluded(const ray &r, Interval ray_t) const {
+            HitRecord rec;
+            return intersect(r, ray_t, rec);
+        }
+
+        virtual Aabb bounding_box() const = 0;
+
+        // Most Instances nested along any path into this object, 0 for none.
+        virtual int instance_depth() const { return 0; }
 
         virtual ~IHittable() = default;
 };
 
 class HittableList : public IHittable {
+    private:
+        Aabb _bbox;
+
     public:
         std::vector<std::shared_ptr<IHittable>> objects;
 
@@ -44,28 +93,56 @@ class HittableList : public IHittable {
         HittableList(size_t count) { objects.reserve(count); }
         HittableList(std::shared_ptr<IHittable> object) { add(object); }
 
-        void clear() { objects.clear(); }
+        void clear() {
+            objects.clear();
+            _bbox = Aabb();
+        }
 
         void add(std::shared_ptr<IHittable> object) { 
             objects.push_back(object); 
+            _bbox.expand(object->bounding_box());
         }
 
-        bool hit(const ray &r, Interval ray_t, HitRecord &rec) const override {
-            HitRecord temp_rec;
+        void refit() {
+            // Recomputes the bounds after objects have moved.
+            _bbox = Aabb();
+            for (const auto &object : objects) {
+                _bbox.expand(object->bounding_box());
+            }
+        }
+
+        Aabb bounding_box() const override { return _bbox; }
+
+        int instance_depth() const override {
+            // Worked out on demand: objects may be replaced in place.
+            int depth = 0;
+            for (const auto &object : objects) {
+                depth = std::max(depth, object->instance_depth());
+            }
+            return depth;
+        }
+
+        bool intersect(const ray &r, Interval ray_t, HitRecord &rec) const override {
             bool hit_anything = false;
-            float closest_so_far = ray_t.max;
 
             for (const auto &object : objects) {
-                bool hit = object->hit(r, Interval(ray_t.min, closest_so_far), temp_rec);
-                if (hit) {
+                if (object->intersect(r, ray_t, rec)) {
                     hit_anything = true;
-                    closest_so_far = temp_rec.t;
-                    rec = temp_rec;
+                    ray_t.max = rec.t;
                 }
             }
 
             return hit_anything;
         }
+
+        bool occluded(const ray &r, Interval ray_t) const override {
+            for (const auto &object : objects) {
+                if (object->occluded(r, ray_t)) {
+                    return true;
+                }
+            }
+            return false;
+        }
 };
 
 #endif // HITTABLE_H
@@ -0,0 +1,361 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "color.hpp"
+#include "framebuffer.hpp"
+#include "png.hpp"
+
+// Output stage: turns a Framebuffer into an image file.
+
+enum class ImageFormat {
+    P3,         // ASCII PPM, byte for byte what write_color() always produced
+    P6,         // Binary PPM
+    PFM,        // Portable float map, linear HDR
+    PNG,        // 8-bit RGB PNG with fast deflate
+    PNG_STORED, // 8-bit RGB PNG with uncompressed deflate blocks
+    EXR,        // Scanline OpenEXR, uncompressed half-float RGB
+};
+
+inline bool parse_image_format(const std::string &name, ImageFormat &format) {
+    if (name == "p3" || name == "ppm-ascii") { format = ImageFormat::P3;         return true; }
+    if (name == "p6" || name == "ppm")       { format = ImageFormat::P6;         return true; }
+    if (name == "pfm")                       { format = ImageFormat::PFM;        return true; }
+    if (name == "png")                       { format = ImageFormat::PNG;        return true; }
+    if (name == "png-stored")                { format = ImageFormat::PNG_STORED; return true; }
+    if (name == "exr")                       { format = ImageFormat::EXR;        return true; }
+    return false;
+}
+
+inline ImageFormat image_format_for_path(const std::string &path, ImageFormat fallback) {
+    // Picks the format matching the file extension, or fallback if there is none we know.
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos) {
+        return fallback;
+    }
+    std::string extension = path.substr(dot + 1);
+    ImageFormat format;
+    if (extension == "ppm") return ImageFormat::P6;
+    return parse_image_format(extension, format) ? format : fallback;
+}
+
+inline std::vector<uint8_t> quantize_rgb8(const Framebuffer &image) {
+    // Gamma corrects and quantizes the whole image to 8 bits per channel through the table.
+    const GammaTable &gamma = GammaTable::instance();
+    std::vector<uint8_t> rgb(static_cast<size_t>(image.width()) * image.height() * 3);
+    size_t k = 0;
+    for (int j = 0; j < image.height(); ++j) {
+        for (int i = 0; i < image.width(); ++i) {
+            color c = image.average(i, j);
+            rgb[k++] = gamma.quantize(c.r);
+            rgb[k++] = gamma.quantize(c.g);
+            rgb[k++] = gamma.quantize(c.b);
+        }
+    }
+    return rgb;
+}
+
+inline void write_p3(std::ostream &out, const Framebuffer &image) {
+    out << "P3\n" << image.width() << " " << image.height() << "\n255\n";
+    for (int j = 0; j < image.height(); ++j) {
+        for (int i = 0; i < image.width(); ++i) {
+            write_color(out, image.sum(i, j), image.samples(i, j));
+        }
+    }
+}
+
+inline void write_p6(std::ostream &out, const Framebuffer &image) {
+    std::vector<uint8_t> rgb = quantize_rgb8(image);
+    out << "P6\n" << image.width() << " " << image.height() << "\n255\n";
+    out.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+}
+
+inline void write_le32(std::vector<uint8_t> &out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+}
+
+inline void write_le_float(std::vector<uint8_t> &out, float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    write_le32(out, bits);
+}
+
+inline void write_pfm(std::ostream &out, const Framebuffer &image) {
+    // A negative scale marks little-endian data. Rows go from the bottom of the image up.
+    out << "PF\n" << image.width() << " " << image.height() << "\n-1.0\n";
+    std::vector<uint8_t> row;
+    row.reserve(static_cast<size_t>(image.width()) * 12);
+    for (int j = image.height() - 1; j >= 0; --j) {
+        row.clear();
+        for (int i = 0; i < image.width(); ++i) {
+            color c = image.average(i, j);
+            write_le_float(row, c.r);
+            write_le_float(row, c.g);
+            write_le_float(row, c.b);
+        }
+        out.write(reinterpret_cast<const char*>(row.data()), row.size());
+    }
+}
+
+inline uint16_t float_to_half(float value) {
+    // IEEE 754 binary16 conversion with round-to-nearest-even.
+    uint32_t x;
+    std::memcpy(&x, &value, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t exponent = (x >> 23) & 0xff;
+    uint32_t mantissa = x & 0x7fffff;
+
+    if (exponent == 0xff) {
+        return static_cast<uint16_t>(sign | 0x7c00 | (mantissa ? 0x200 : 0)); // Inf or NaN
+    }
+
+    int half_exponent = static_cast<int>(exponent) - 127 + 15;
+    if (half_exponent >= 31) {
+        return static_cast<uint16_t>(sign | 0x7c00); // Overflow to infinity
+    }
+
+    if (half_exponent <= 0) {
+        // Subnormal half, or zero.
+        if (half_exponent < -10) {
+            return static_cast<uint16_t>(sign);
+        }
+        mantissa |= 0x800000;
+        int shift = 14 - half_exponent;
+        uint32_t half_mantissa = mantissa >> shift;
+        uint32_t remainder = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half_mantissa & 1))) {
+            ++half_mantissa;
+        }
+        return static_cast<uint16_t>(sign | half_mantissa);
+    }
+
+    uint32_t half = sign | (half_exponent << 10) | (mantissa >> 13);
+    uint32_t remainder = mantissa & 0x1fff;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+        ++half; // A carry into the exponent is still the correctly rounded result
+    }
+    return static_cast<uint16_t>(half);
+}
+
+inline void exr_attribute(std::vector<uint8_t> &out, const char *name, const char *type,
+                          const std::vector<uint8_t> &value) {
+    out.insert(out.end(), name, name + std::strlen(name) + 1);
+    out.insert(out.end(), type, type + std::strlen(type) + 1);
+    write_le32(out, static_cast<uint32_t>(value.size()));
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+inline void write_exr(std::ostream &out, const Framebuffer &image) {
+    // The smallest useful OpenEXR: one scanline per block, no compression, half-float B, G, R
+    // channels (channels are stored in alphabetical order).
+    const int width = image.width();
+    const int height = image.height();
+
+    std::vector<uint8_t> header;
+    write_le32(header, 20000630); // Magic number
+    write_le32(header, 2);        // Version 2, scanline image
+
+    std::vector<uint8_t> channels;
+    const char *names[3] = {"B", "G", "R"};
+    for (const char *name : names) {
+        channels.insert(channels.end(), name, name + 2);
+        write_le32(channels, 1); // Pixel type HALF
+        write_le32(channels, 0); // pLinear and reserved bytes
+        write_le32(channels, 1); // x sampling
+        write_le32(channels, 1); // y sampling
+    }
+    channels.push_back(0);
+    exr_attribute(header, "channels", "chlist", channels);
+    exr_attribute(header, "compression", "compression", std::vector<uint8_t>(1, 0));
+
+    std::vector<uint8_t> window;
+    write_le32(window, 0);
+    write_le32(window, 0);
+    write_le32(window, static_cast<uint32_t>(width - 1));
+    write_le32(window, static_cast<uint32_t>(height - 1));
+    exr_attribute(header, "dataWindow", "box2i", window);
+    exr_attribute(header, "displayWindow", "box2i", window);
+    exr_attribute(header, "lineOrder", "lineOrder", std::vector<uint8_t>(1, 0));
+
+    std::vector<uint8_t> value;
+    write_le_float(value, 1.0f);
+    exr_attribute(header, "pixelAspectRatio", "float", value);
+    value.clear();
+    write_le_float(value, 0.0f);
+    write_le_float(value, 0.0f);
+    exr_attribute(header, "screenWindowCenter", "v2f", value);
+    value.clear();
+    write_le_float(value, 1.0f);
+    exr_attribute(header, "screenWindowWidth", "float", value);
+    header.push_back(0); // End of header
+
+    // Offset table: one absolute file offset per scanline block.
+    const uint64_t line_bytes = static_cast<uint64_t>(width) * 3 * 2;
+    const uint64_t block_bytes = 8 + line_bytes;
+    uint64_t offset = header.size() + static_cast<uint64_t>(height) * 8;
+    for (int j = 0; j < height; ++j) {
+        uint64_t block_offset = offset + j * block_bytes;
+        write_le32(header, static_cast<uint32_t>(block_offset));
+        write_le32(header, static_cast<uint32_t>(block_offset >> 32));
+    }
+    out.write(reinterpret_cast<const char*>(header.data()), header.size());
+
+    std::vector<uint8_t> block;
+    block.reserve(block_bytes);
+    std::vector<color> row(width);
+    for (int j = 0; j < height; ++j) {
+        block.clear();
+        write_le32(block, static_cast<uint32_t>(j));
+        write_le32(block, static_cast<uint32_t>(line_bytes));
+        for (int i = 0; i < width; ++i) {
+            row[i] = image.average(i, j);
+        }
+        for (int channel = 2; channel >= 0; --channel) {
+            for (int i = 0; i < width; ++i) {
+                uint16_t half = float_to_half(row[i][channel]);
+                block.push_back(static_cast<uint8_t>(half));
+                block.push_back(static_cast<uint8_t>(half >> 8));
+            }
+        }
+        out.write(reinterpret_cast<const char*>(block.data()), block.size());
+    }
+}
+
+inline void write_image(std::ostream &out, const Framebuffer &image, ImageFormat format) {
+    switch (format) {
+        case ImageFormat::P3:  write_p3(out, image);  break;
+        case ImageFormat::P6:  write_p6(out, image);  break;
+        case ImageFormat::PFM: write_pfm(out, image); break;
+        case ImageFormat::EXR: write_exr(out, image); break;
+        case ImageFormat::PNG:
+        case ImageFormat::PNG_STORED: {
+            std::vector<uint8_t> rgb = quantize_rgb8(image);
+            write_png(out, rgb.data(), image.width(), image.height(), format == ImageFormat::PNG);
+            break;
+        }
+    }
+    out.flush();
+}
+
+inline bool write_image(const std::string &path, const Framebuffer &image, ImageFormat format) {
+    // Writes to the file at path, or to stdout when path is "-".
+    if (path == "-") {
+        write_image(std::cout, image, format);
+        return static_cast<bool>(std::cout);
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Could not open " << path << " for writing\n";
+        return false;
+    }
+    write_image(file, image, format);
+    return static_cast<bool>(file);
+}
+
+// Encodes and writes images on a background thread, so the renderer can get on with the next
+// frame or tile batch while the previous result is being compressed and written.
+class AsyncImageWriter {
+    public:
+        AsyncImageWriter() : _stopping(false), _busy(false), _thread(&AsyncImageWriter::run, this) {}
+
+        AsyncImageWriter(const AsyncImageWriter&) = delete;
+        AsyncImageWriter& operator=(const AsyncImageWriter&) = delete;
+
+        ~AsyncImageWriter() {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stopping = true;
+            }
+            _changed.notify_all();
+            _thread.join();
+        }
+
+        void submit(Framebuffer image, ImageFormat format, const std::string &path) {
+            // Takes ownership of the image; pass a copy to keep rendering into the original.
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _jobs.push_back(Job{std::move(image), format, path});
+            }
+            _changed.notify_all();
+        }
+
+        void replace(Framebuffer image, ImageFormat format, const std::string &path) {
+            // As submit(), for an image that supersedes earlier ones at path: those still
+            // queued are dropped, and the file is written under another name and renamed into
+            // place, so a viewer watching it never reads a half-written image.
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _jobs.erase(std::remove_if(_jobs.begin(), _jobs.end(),
+                                           [&path](const Job &job) { return job.path == path; }),
+                            _jobs.end());
+                _jobs.push_back(Job{std::move(image), format, path, true});
+            }
+            _changed.notify_all();
+        }
+
+        void wait() {
+            // Blocks until every submitted image has been written.
+            std::unique_lock<std::mutex> lock(_mutex);
+            _changed.wait(lock, [this]() { return _jobs.empty() && !_busy; });
+        }
+
+    private:
+        struct Job {
+            Framebuffer image;
+            ImageFormat format;
+            std::string path;
+            bool replaces = false; // Written through a temporary file
+        };
+
+        std::deque<Job> _jobs;
+        std::mutex _mutex;
+        std::condition_variable _changed;
+        bool _stopping;
+        bool _busy;
+        std::thread _thread;
+
+        void run() {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (true) {
+                _changed.wait(lock, [this]() { return _stopping || !_jobs.empty(); });
+                if (_jobs.empty()) {
+                    return; // Stopping, and everything has been written
+                }
+
+                Job job = std::move(_jobs.front());
+                _jobs.pop_front();
+                _busy = true;
+                lock.unlock();
+
+                if (!job.replaces) {
+                    write_image(job.path, job.image, job.format);
+                } else if (write_image(job.path + ".part", job.image, job.format)
+                           && std::rename((job.path + ".part").c_str(), job.path.c_str()) != 0) {
+                    std::cerr << "Could not rename " << job.path << ".part to " << job.path << "\n";
+                }
+
+                lock.lock();
+                _busy = false;
+                _changed.notify_all();
+            }
+        }
+};
+
+#endif // IMAGE_WRITER_H
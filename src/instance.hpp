@@ -0,0 +1,99 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+
+#include "aabb.hpp"
+#include "hittable.hpp"
+#include "interval.hpp"
+#include "material.hpp"
+#include "ray.hpp"
+#include "transform.hpp"
+
+// A shared child hittable (a primitive, a list or a whole Bvh) placed in the world by an
+// affine transform, optionally with a material that replaces the child's. Rays are carried
+// into the child's space for traversal and their direction is not renormalized, so distances
+// along them stay the same in both spaces. Only the world to object transform is stored.
+//
+// An Instance of an Instance is folded into one at construction. Instances deeper inside the
+// child, under a list or Bvh, nest up to max_instance_depth levels; each level keeps what it
+// hit in its own HitRecord::instanced slot. Deeper nesting is refused at construction.
+class Instance : public IHittable {
+    public:
+        Instance(std::shared_ptr<IHittable> child, const Transform &object_to_world,
+                 std::shared_ptr<IMaterial> material = nullptr)
+            : _child(child), _material(material) {
+            Transform to_world = object_to_world;
+            if (const Instance *nested = dynamic_cast<const Instance*>(child.get())) {
+                // The outer material wins, as if it had been set on the nested instance.
+                _child = nested->_child;
+                to_world = object_to_world * nested->_world_to_object.inverse();
+                if (!_material) {
+                    _material = nested->_material;
+                }
+            }
+            _world_to_object = to_world.inverse();
+            _bbox = to_world.apply_box(_child->bounding_box());
+
+            _depth = _child->instance_depth() + 1;
+            if (_depth > max_instance_depth) {
+                std::cerr << "Instances are nested " << _depth << " deep, more than the "
+                          << max_instance_depth << " a HitRecord holds\n";
+                std::abort();
+            }
+        }
+
+        void set_transform(const Transform &object_to_world) {
+            // Moves the instance. A Bvh holding it needs a refit() before the next render.
+            _world_to_object = object_to_world.inverse();
+            _bbox = object_to_world.apply_box(_child->bounding_box());
+        }
+
+        const IHittable& child() const { return *_child; }
+        const Transform& world_to_object() const { return _world_to_object; }
+        std::shared_ptr<IMaterial> material() const { return _material; }
+
+        bool intersect(const ray &r, Interval ray_t, HitRecord &rec) const override {
+            // The child only writes rec on a hit, so it can be handed rec directly.
+            if (!_child->intersect(to_object(r), ray_t, rec)) {
+                return false;
+            }
+            rec.instanced[_depth - 1] = rec.object;
+            rec.object = this;
+            return true;
+        }
+
+        bool occluded(const ray &r, Interval ray_t) const override {
+            return _child->occluded(to_object(r), ray_t);
+        }
+
+        void surface(const ray &r, HitRecord &rec) const override {
+            // The child works out the surface in its own space; position and normal are then
+            // brought back. The side of the surface the ray is on does not change.
+            rec.instanced[_depth - 1]->surface(to_object(r), rec);
+            rec.p = r.at(rec.t);
+            rec.normal = _world_to_object.apply_transposed(rec.normal).unit();
+            if (_material) {
+                rec.mat = _material.get();
+            }
+        }
+
+        Aabb bounding_box() const override { return _bbox; }
+
+        int instance_depth() const override { return _depth; }
+
+    private:
+        std::shared_ptr<IHittable> _child;
+        std::shared_ptr<IMaterial> _material; // Replaces the child's materials when set
+        Transform _world_to_object;
+        Aabb _bbox;
+        int _depth; // 1 + the child's instance_depth()
+
+        ray to_object(const ray &r) const {
+            return ray(_world_to_object.apply_point(r.origin()), _world_to_object.apply_vector(r.direction()));
+        }
+};
+
+#endif // INSTANCE_H
@@ -0,0 +1,225 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Render instrumentation, compiled in with -DRAYTRACER_INSTRUMENT=ON (RT_INSTRUMENT).
+//
+// Every thread counts into its own ThreadCounters with plain increments, so the hot paths
+// take no locks and share no cache lines. The blocks are owned by a global registry and
+// outlive their threads, so the totals can be merged and written out once the render's
+// threads are gone. With tracing on, tiles and other scopes are also recorded as Chrome
+// trace_event "complete" events, one track per thread (load the file in chrome://tracing or
+// Perfetto). Without RT_INSTRUMENT the macros below expand to nothing.
+
+enum class Counter {
+    PrimaryRays,         // Camera rays intersected with the scene
+    SecondaryRays,       // Scattered rays intersected with the scene
+    SphereTests,         // Sphere::intersect calls
+    SphereHits,          // ... that found a hit
+    SphereSetTests,      // SphereSet::intersect calls
+    SphereSetHits,       // ... that found a hit
+    TriangleTests,       // Triangles put through the watertight test, SIMD lanes included
+    TriangleMeshHits,    // TriangleMesh::intersect calls that found a hit
+    BvhNodesVisited,     // Bvh nodes popped during traversal
+    ScatterLambertian,   // Lambertian::scatter calls
+    ScatterMetal,        // Metal::scatter calls
+    ScatterDielectric,   // Dielectric::scatter calls
+    PathsEscaped,        // Paths that left the scene and picked up the sky
+    PathsAbsorbed,       // Paths whose material did not scatter
+    PathsRoulette,       // Paths ended by Russian roulette
+    PathsDepthLimit,     // Paths cut off at max_depth
+    ShadowRays,          // Rays towards a sampled light
+    OcclusionRays,       // Ambient occlusion rays
+    CounterCount
+};
+
+inline const char* counter_name(Counter counter) {
+    static const char *names[static_cast<int>(Counter::CounterCount)] = {
+        "primary_rays", "secondary_rays", "sphere_tests", "sphere_hits", "sphere_set_tests",
+        "sphere_set_hits", "triangle_tests", "triangle_mesh_hits", "bvh_nodes_visited",
+        "scatter_lambertian", "scatter_metal", "scatter_dielectric", "paths_escaped", "paths_absorbed",
+        "paths_roulette", "paths_depth_limit", "shadow_rays", "occlusion_rays"};
+    return names[static_cast<int>(counter)];
+}
+
+struct TraceEvent {
+    const char *name;
+    int64_t start_us;
+    int64_t duration_us;
+    const char *arg_name; // One argument shown with the event, e.g. the tile id
+    int64_t arg;
+};
+
+struct ThreadCounters {
+    int thread_index = 0;
+    uint64_t counts[static_cast<int>(Counter::CounterCount)] = {};
+    uint64_t tiles = 0;       // Tiles this thread rendered
+    double tile_seconds = 0;  // Time spent in them
+    double tile_seconds_max = 0;
+    std::vector<TraceEvent> events;
+};
+
+class Instrumentation {
+    public:
+        static ThreadCounters& local() {
+            // This thread's block, registered on first use.
+            static thread_local ThreadCounters *counters = add_thread();
+            return *counters;
+        }
+
+        static void set_tracing(bool enabled) { registry().tracing = enabled; }
+        static bool tracing() { return registry().tracing; }
+
+        static int64_t now_us() {
+            // Microseconds since the registry was created, the time base of the trace.
+            return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - registry().epoch).count();
+        }
+
+        static void write_json(std::ostream &out, const std::vector<uint64_t> &path_lengths) {
+            // Summary of every thread's counters. Call once the threads have finished.
+            Registry &reg = registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+
+            ThreadCounters total;
+            for (const auto &counters : reg.threads) {
+                for (int c = 0; c < static_cast<int>(Counter::CounterCount); ++c) {
+                    total.counts[c] += counters->counts[c];
+                }
+                total.tiles += counters->tiles;
+                total.tile_seconds += counters->tile_seconds;
+                if (counters->tile_seconds_max > total.tile_seconds_max) {
+                    total.tile_seconds_max = counters->tile_seconds_max;
+                }
+            }
+
+            out << "{\n  \"counters\": {";
+            for (int c = 0; c < static_cast<int>(Counter::CounterCount); ++c) {
+                out << (c ? "," : "") << "\n    \"" << counter_name(static_cast<Counter>(c)) << "\": " << total.counts[c];
+            }
+            out << "\n  },\n";
+
+            out << "  \"path_lengths\": [";
+            for (size_t n = 0; n < path_lengths.size(); ++n) {
+                out << (n ? ", " : "") << path_lengths[n];
+            }
+            out << "],\n";
+
+            out << "  \"tiles\": {\"count\": " << total.tiles << ", \"seconds\": " << total.tile_seconds
+                << ", \"mean_seconds\": " << (total.tiles ? total.tile_seconds / total.tiles : 0.0)
+                << ", \"max_seconds\": " << total.tile_seconds_max << "},\n";
+
+            out << "  \"threads\": [";
+            bool first = true;
+            for (const auto &counters : reg.threads) {
+                if (counters->tiles == 0) {
+                    continue;
+                }
+                out << (first ? "" : ",") << "\n    {\"thread\": " << counters->thread_index
+                    << ", \"tiles\": " << counters->tiles << ", \"seconds\": " << counters->tile_seconds
+                    << ", \"rays\": " << counters->counts[static_cast<int>(Counter::PrimaryRays)]
+                                         + counters->counts[static_cast<int>(Counter::SecondaryRays)] << "}";
+                first = false;
+            }
+            out << "\n  ]\n}\n";
+        }
+
+        static void write_trace(std::ostream &out) {
+            // Chrome trace_event JSON of everything recorded while tracing was on.
+            Registry &reg = registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+
+            out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+            bool first = true;
+            for (const auto &counters : reg.threads) {
+                if (counters->events.empty()) {
+                    continue;
+                }
+                out << (first ? "" : ",") << "\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+                    << counters->thread_index << ", \"args\": {\"name\": \"thread " << counters->thread_index << "\"}}";
+                first = false;
+                for (const TraceEvent &event : counters->events) {
+                    out << ",\n{\"name\": \"" << event.name << "\", \"cat\": \"render\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                        << counters->thread_index << ", \"ts\": " << event.start_us << ", \"dur\": " << event.duration_us
+                        << ", \"args\": {\"" << event.arg_name << "\": " << event.arg << "}}";
+                }
+            }
+            out << "\n]}\n";
+        }
+
+    private:
+        struct Registry {
+            std::mutex mutex;
+            std::vector<std::unique_ptr<ThreadCounters>> threads;
+            std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+            bool tracing = false; // Set before rendering starts, only read while it runs
+        };
+
+        static Registry& registry() {
+            static Registry reg;
+            return reg;
+        }
+
+        static ThreadCounters* add_thread() {
+            Registry &reg = registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            reg.threads.emplace_back(new ThreadCounters());
+            reg.threads.back()->thread_index = static_cast<int>(reg.threads.size()) - 1;
+            return reg.threads.back().get();
+        }
+};
+
+class TraceScope {
+    // Times a scope on this thread and records it as a trace event while tracing is on.
+    // Tile scopes also add to the thread's tile totals.
+    public:
+        TraceScope(const char *name, const char *arg_name, int64_t arg, bool tile = false)
+            : _name(name), _arg_name(arg_name), _arg(arg), _tile(tile), _start(Instrumentation::now_us()) {}
+
+        ~TraceScope() {
+            int64_t duration = Instrumentation::now_us() - _start;
+            ThreadCounters &counters = Instrumentation::local();
+            if (_tile) {
+                double seconds = duration * 1e-6;
+                ++counters.tiles;
+                counters.tile_seconds += seconds;
+                if (seconds > counters.tile_seconds_max) {
+                    counters.tile_seconds_max = seconds;
+                }
+            }
+            if (Instrumentation::tracing()) {
+                counters.events.push_back(TraceEvent{_name, _start, duration, _arg_name, _arg});
+            }
+        }
+
+    private:
+        const char *_name;
+        const char *_arg_name;
+        int64_t _arg;
+        bool _tile;
+        int64_t _start;
+};
+
+#define RT_INSTRUMENT_CONCAT_(a, b) a##b
+#define RT_INSTRUMENT_CONCAT(a, b) RT_INSTRUMENT_CONCAT_(a, b)
+
+#ifdef RT_INSTRUMENT
+#define RT_COUNT(counter) (++Instrumentation::local().counts[static_cast<int>(counter)])
+#define RT_COUNT_N(counter, n) (Instrumentation::local().counts[static_cast<int>(counter)] += (n))
+#define RT_TRACE_SCOPE(name, arg_name, arg) \
+    TraceScope RT_INSTRUMENT_CONCAT(rt_trace_scope_, __LINE__)(name, arg_name, arg)
+#define RT_TRACE_TILE(id) TraceScope RT_INSTRUMENT_CONCAT(rt_trace_tile_, __LINE__)("tile", "id", id, true)
+#else
+#define RT_COUNT(counter) ((void)0)
+#define RT_COUNT_N(counter, n) ((void)0)
+#define RT_TRACE_SCOPE(name, arg_name, arg) ((void)0)
+#define RT_TRACE_TILE(id) ((void)0)
+#endif
+
+#endif // INSTRUMENT_H
@@ -0,0 +1,131 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "color.hpp"
+#include "hittable.hpp"
+#include "material.hpp"
+#include "random.hpp"
+#include "rtweekend.hpp"
+#include "sphere.hpp"
+#include "vec3.hpp"
+
+// An emitting sphere that the renderer samples directly.
+struct SphereLight {
+    point3 center;
+    float  radius;
+    color  emission;
+    const IHittable *object; // What a HitRecord names as object when a ray hits the light
+    uint32_t primitive;      // ... and as primitive
+    float select_pdf;        // Chance of LightList::pick() choosing it
+
+    bool sample(const point3 &p, float u, float v, vec3 &direction, float &density) const {
+        // A unit direction from p towards the light, uniform over the cone of directions the
+        // sphere covers, and the solid angle density of having picked it. False for points
+        // inside the sphere, which see it all around.
+        vec3 to_center = center - p;
+        float d2 = to_center.lengthsq();
+        float r2 = radius * radius;
+        if (d2 <= r2) {
+            return false;
+        }
+        float cos_max = sqrtf(1 - r2 / d2);
+        float one_minus_cos_max = (r2 / d2) / (1 + cos_max); // 1 - cos_max without cancellation
+        float cos_theta = 1 - u * one_minus_cos_max;
+        float sin_theta = sqrtf(fmaxf(0.0f, 1 - cos_theta * cos_theta));
+        float phi = 2 * pi * v;
+
+        vec3 w = to_center / sqrtf(d2);
+        vec3 t, b;
+        make_basis(w, t, b);
+        direction = (cosf(phi) * sin_theta) * t + (sinf(phi) * sin_theta) * b + cos_theta * w;
+        density = 1 / (2 * pi * one_minus_cos_max);
+        return true;
+    }
+
+    float pdf(const point3 &p) const {
+        // Solid angle density sample() gives every direction from p that hits the light.
+        float d2 = (center - p).lengthsq();
+        float r2 = radius * radius;
+        if (d2 <= r2) {
+            return 0;
+        }
+        float cos_max = sqrtf(1 - r2 / d2);
+        return 1 / (2 * pi * (r2 / d2) / (1 + cos_max));
+    }
+};
+
+// The scene's emitting spheres, for next-event estimation. Lights are picked in proportion to
+// their power, so a few bright lamps are not starved by many dim ones.
+class LightList {
+    public:
+        void add(const point3 &center, float radius, const color &emission, const IHittable *object,
+                 uint32_t primitive) {
+            _lights.push_back(SphereLight{center, fabsf(radius), emission, object, primitive, 0});
+            _index[std::make_pair(object, primitive)] = static_cast<uint32_t>(_lights.size() - 1);
+        }
+
+        void finish() {
+            // Works out the selection chances; call once every light has been added.
+            // Power is emitted luminance times surface area; black lights are picked uniformly.
+            double total = 0;
+            for (const SphereLight &light : _lights) {
+                total += luminance(light.emission) * light.radius * light.radius;
+            }
+            _cdf.resize(_lights.size());
+            double sum = 0;
+            for (size_t k = 0; k < _lights.size(); ++k) {
+                SphereLight &light = _lights[k];
+                double power = luminance(light.emission) * light.radius * light.radius;
+                light.select_pdf = static_cast<float>(total > 0 ? power / total : 1.0 / _lights.size());
+                sum += light.select_pdf;
+                _cdf[k] = static_cast<float>(sum);
+            }
+        }
+
+        void collect(const HittableList &world) {
+            // The Spheres directly in world with a DiffuseLight. Emitters deeper down, inside
+            // instances or nested lists, are still seen by paths that hit them, just not sampled.
+            for (const auto &object : world.objects) {
+                const Sphere *sphere = dynamic_cast<const Sphere*>(object.get());
+                if (!sphere) {
+                    continue;
+                }
+                const DiffuseLight *light = dynamic_cast<const DiffuseLight*>(sphere->material().get());
+                if (light) {
+                    add(sphere->center(), sphere->radius(), light->emission(), sphere, 0);
+                }
+            }
+            finish();
+        }
+
+        bool empty() const { return _lights.empty(); }
+        size_t size() const { return _lights.size(); }
+        const SphereLight& operator[](size_t index) const { return _lights[index]; }
+
+        const SphereLight& pick(float u) const {
+            // A light chosen with probability select_pdf, by u in [0,1).
+            size_t index = std::upper_bound(_cdf.begin(), _cdf.end(), u) - _cdf.begin();
+            return _lights[std::min(index, _lights.size() - 1)];
+        }
+
+        const SphereLight* find(const IHittable *object, uint32_t primitive) const {
+            // The light a ray hit, or null for emitters that are not in the list.
+            auto found = _index.find(std::make_pair(object, primitive));
+            return found == _index.end() ? nullptr : &_lights[found->second];
+        }
+
+    private:
+        std::vector<SphereLight> _lights;
+        std::vector<float> _cdf; // Running sum of select_pdf
+        std::map<std::pair<const IHittable*, uint32_t>, uint32_t> _index;
+};
+
+#endif // LIGHT_H
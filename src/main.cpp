@@ -1,8 +1,29 @@
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "animation.hpp"
+#include "bvh.hpp"
 #include "camera.hpp"
+#include "checkpoint.hpp"
+#include "compiled_scene.hpp"
+#include "distributed.hpp"
+#include "frozen_scene.hpp"
 #include "vec3.hpp"
 #include "hittable.hpp"
+#include "denoise.hpp"
+#include "image_writer.hpp"
+#include "instrument.hpp"
+#include "progressive.hpp"
 #include "sphere.hpp"
+#include "sphere_set.hpp"
+#include "wavefront.hpp"
 #include "material.hpp"
+#include "mesh_file.hpp"
+#include "scene.hpp"
+#include "scene_file.hpp"
 
 int main(int const argc, char const *const *const argv) {
     // World
@@ -25,63 +46,548 @@ int main(int const argc, char const *const *const argv) {
     // world.add(std::make_shared<Sphere>(point3(-1.0,    0.0, -1.0),  -0.4, material_left));
     // world.add(std::make_shared<Sphere>(point3( 1.0,    0.0, -1.0),   0.5, material_right));
 
-    auto ground_material = std::make_shared<Lambertian>(color(0.5, 0.5, 0.5));
-    world.add(std::make_shared<Sphere>(point3(0,-1000,0), 1000, ground_material));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_float();
-            point3 center(a + 0.9 * random_float(), 0.2, b + 0.9 * random_float());
-
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                std::shared_ptr<IMaterial> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = color::random() * color::random();
-                    sphere_material = std::make_shared<Lambertian>(albedo);
-                    world.add(std::make_shared<Sphere>(center, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_float(0, 0.5);
-                    sphere_material = std::make_shared<Metal>(albedo, fuzz);
-                    world.add(std::make_shared<Sphere>(center, 0.2, sphere_material));
-                } else {
-                    // glass
-                    sphere_material = std::make_shared<Dielectric>(1.5);
-                    world.add(std::make_shared<Sphere>(center, 0.2, sphere_material));
-                }
+    Camera cam;
+
+    std::string scene_path;
+    std::string save_scene;
+    int scene_grid = 11;
+    int instances = 0;
+    std::string mesh_path;
+    int width = 0;
+    int spp = 0;
+    int depth = 0;
+
+    std::string accel = "bvh";
+    std::string output = "-";
+    std::string format_name;
+    std::string heatmap;
+    std::string albedo_output;
+    std::string normal_output;
+    std::string depth_output;
+    std::string sampler_name;
+    std::string stats_json;
+    std::string resume;
+    std::string trace;
+    std::string coordinator;
+    std::string worker;
+    int unit_spp = 0;
+    float unit_timeout = 0;
+    bool denoise = false;
+    bool wavefront = false;
+    int wavefront_batch = 1 << 16;
+    std::string animation_path;
+    int turntable = 0;
+    int frames_in_flight = 2;
+    bool progressive = false;
+    float time_budget = 0;
+    float noise_target = 0;
+    int lamps = 0;
+    bool next_event = true;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+            scene_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--save-scene") == 0 && i + 1 < argc) {
+            save_scene = argv[++i];
+        } else if (std::strcmp(argv[i], "--scene-grid") == 0 && i + 1 < argc) {
+            scene_grid = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            instances = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+            mesh_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--accel") == 0 && i + 1 < argc) {
+            accel = argv[++i];
+        } else if (std::strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (std::strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            format_name = argv[++i];
+        } else if (std::strcmp(argv[i], "--adaptive") == 0 && i + 1 < argc) {
+            cam.adaptive_threshold = static_cast<float>(std::atof(argv[++i]));
+        } else if (std::strcmp(argv[i], "--min-spp") == 0 && i + 1 < argc) {
+            cam.min_samples_per_pixel = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--heatmap") == 0 && i + 1 < argc) {
+            heatmap = argv[++i];
+        } else if (std::strcmp(argv[i], "--denoise") == 0) {
+            denoise = true;
+        } else if (std::strcmp(argv[i], "--albedo") == 0 && i + 1 < argc) {
+            albedo_output = argv[++i];
+        } else if (std::strcmp(argv[i], "--normal") == 0 && i + 1 < argc) {
+            normal_output = argv[++i];
+        } else if (std::strcmp(argv[i], "--depth-aov") == 0 && i + 1 < argc) {
+            depth_output = argv[++i];
+        } else if (std::strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+            width = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--spp") == 0 && i + 1 < argc) {
+            spp = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+            depth = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--roulette-depth") == 0 && i + 1 < argc) {
+            cam.roulette_depth = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            stats_json = argv[++i];
+        } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (std::strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            cam.checkpoint_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc) {
+            cam.checkpoint_interval = static_cast<float>(std::atof(argv[++i]));
+        } else if (std::strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+            resume = argv[++i];
+        } else if (std::strcmp(argv[i], "--coordinator") == 0 && i + 1 < argc) {
+            coordinator = argv[++i];
+        } else if (std::strcmp(argv[i], "--worker") == 0 && i + 1 < argc) {
+            worker = argv[++i];
+        } else if (std::strcmp(argv[i], "--unit-spp") == 0 && i + 1 < argc) {
+            unit_spp = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--unit-timeout") == 0 && i + 1 < argc) {
+            unit_timeout = static_cast<float>(std::atof(argv[++i]));
+        } else if (std::strcmp(argv[i], "--wavefront") == 0) {
+            wavefront = true;
+        } else if (std::strcmp(argv[i], "--wavefront-batch") == 0 && i + 1 < argc) {
+            wavefront_batch = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--animation") == 0 && i + 1 < argc) {
+            animation_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--turntable") == 0 && i + 1 < argc) {
+            turntable = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc) {
+            frames_in_flight = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--progressive") == 0) {
+            progressive = true;
+        } else if (std::strcmp(argv[i], "--time-budget") == 0 && i + 1 < argc) {
+            time_budget = static_cast<float>(std::atof(argv[++i]));
+        } else if (std::strcmp(argv[i], "--noise-target") == 0 && i + 1 < argc) {
+            noise_target = static_cast<float>(std::atof(argv[++i]));
+        } else if (std::strcmp(argv[i], "--lights") == 0 && i + 1 < argc) {
+            lamps = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--sky") == 0 && i + 1 < argc) {
+            cam.sky = static_cast<float>(std::atof(argv[++i]));
+        } else if (std::strcmp(argv[i], "--no-nee") == 0) {
+            next_event = false;
+        } else if (std::strcmp(argv[i], "--ao") == 0 && i + 1 < argc) {
+            cam.ao_distance = static_cast<float>(std::atof(argv[++i]));
+        } else if (std::strcmp(argv[i], "--ao-samples") == 0 && i + 1 < argc) {
+            cam.ao_samples = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--ao-closest-hit") == 0) {
+            cam.ao_closest_hit = true;
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            cam.thread_count = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc) {
+            cam.tile_size = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            cam.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--sampler") == 0 && i + 1 < argc) {
+            sampler_name = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << "\n"
+                      << "  [--scene FILE] [--scene-grid N] [--instances N] [--save-scene FILE]\n"
+                      << "  [--mesh FILE.obj|FILE.ply]\n"
+                      << "  [--lights N] [--sky BRIGHTNESS] [--no-nee]\n"
+                      << "                       (N lamps over the scene; --no-nee leaves them to chance)\n"
+                      << "  [--ao DISTANCE] [--ao-samples N] [--ao-closest-hit]\n"
+                      << "                       (ambient occlusion instead of lighting)\n"
+                      << "  [--accel bvh|list|spheres|bvh-spheres|compiled|frozen]\n"
+                      << "  [--output FILE|-] [--format p3|p6|pfm|png|png-stored|exr]\n"
+                      << "  [--width N] [--spp N] [--depth N] [--roulette-depth N]\n"
+                      << "  [--adaptive THRESHOLD] [--min-spp N] [--heatmap FILE]\n"
+                      << "  [--denoise] [--albedo FILE] [--normal FILE] [--depth-aov FILE]\n"
+                      << "  [--wavefront] [--wavefront-batch N]\n"
+                      << "  [--progressive] [--time-budget SECONDS] [--noise-target ERROR]\n"
+                      << "                       (every pass overwrites --output; --spp is the cap)\n"
+                      << "  [--animation FILE] [--turntable FRAMES] [--frames-in-flight N]\n"
+                      << "                       (frames go to --output with their number added)\n"
+                      << "  [--checkpoint FILE] [--checkpoint-interval SECONDS] [--resume FILE]\n"
+                      << "  [--coordinator ADDRESS] [--unit-spp N] [--unit-timeout SECONDS]\n"
+                      << "  [--worker ADDRESS]   (ADDRESS is host:port, :port or unix:PATH)\n"
+                      << "  [--stats-json FILE] [--trace FILE]\n"
+                      << "  [--threads N] [--tile-size N] [--seed N]\n"
+                      << "  [--sampler random|independent|stratified|sobol|blue-noise]\n";
+            return 1;
+        }
+    }
+
+    // Without --format, the output file's extension decides, and stdout gets ASCII PPM.
+    ImageFormat format = image_format_for_path(output, ImageFormat::P3);
+    if (!format_name.empty() && !parse_image_format(format_name, format)) {
+        std::cerr << "Unknown image format: " << format_name << "\n";
+        return 1;
+    }
+
+    if (!sampler_name.empty() && !parse_sampler_type(sampler_name, cam.sampler)) {
+        std::cerr << "Unknown sampler: " << sampler_name << "\n";
+        return 1;
+    }
+
+    if (!scene_path.empty() && instances > 0) {
+        std::cerr << "--instances builds its own scene and cannot be combined with --scene\n";
+        return 1;
+    }
+
+    if (!mesh_path.empty() && (!scene_path.empty() || instances > 0)) {
+        std::cerr << "--mesh builds its own scene and cannot be combined with --scene or --instances\n";
+        return 1;
+    }
+
+    if (accel != "list" && accel != "bvh" && accel != "spheres" && accel != "bvh-spheres" && accel != "compiled"
+        && accel != "frozen") {
+        std::cerr << "Unknown acceleration structure: " << accel << "\n";
+        return 1;
+    }
+
+#ifndef RT_INSTRUMENT
+    if (!stats_json.empty() || !trace.empty()) {
+        std::cerr << "--stats-json and --trace need a build with -DRAYTRACER_INSTRUMENT=ON\n";
+        return 1;
+    }
+#endif
+    Instrumentation::set_tracing(!trace.empty());
+
+    bool animated = !animation_path.empty() || turntable > 0;
+    if (!animation_path.empty() && turntable > 0) {
+        std::cerr << "--animation and --turntable cannot be combined\n";
+        return 1;
+    }
+    if (animated && output == "-") {
+        std::cerr << "--animation and --turntable need a file --output\n";
+        return 1;
+    }
+    if (animated && (!cam.checkpoint_path.empty() || !resume.empty() || !coordinator.empty() || !worker.empty()
+                     || !heatmap.empty() || denoise || !albedo_output.empty() || !normal_output.empty()
+                     || !depth_output.empty())) {
+        std::cerr << "--animation and --turntable do not support --checkpoint, --resume, --coordinator, --worker, "
+                     "--heatmap, --denoise or the AOV outputs\n";
+        return 1;
+    }
+
+    if (progressive && output == "-") {
+        std::cerr << "--progressive needs a file --output\n";
+        return 1;
+    }
+    if (progressive && (animated || wavefront || cam.adaptive_threshold > 0 || !cam.checkpoint_path.empty()
+                        || !resume.empty() || !coordinator.empty() || !worker.empty() || denoise
+                        || !albedo_output.empty() || !normal_output.empty() || !depth_output.empty())) {
+        std::cerr << "--progressive does not support --animation, --turntable, --wavefront, --adaptive, "
+                     "--checkpoint, --resume, --coordinator, --worker, --denoise or the AOV outputs\n";
+        return 1;
+    }
+    if (!progressive && (time_budget > 0 || noise_target > 0)) {
+        std::cerr << "--time-budget and --noise-target need --progressive\n";
+        return 1;
+    }
+
+    if (accel == "frozen" && !save_scene.empty()) {
+        std::cerr << "--save-scene does not support --accel frozen\n";
+        return 1;
+    }
+    // --accel frozen reads scene files straight into its arena; generated scenes are copied.
+    std::unique_ptr<SceneBuilder> frozen_builder;
+    if (accel == "frozen") {
+        frozen_builder.reset(new SceneBuilder());
+    }
+
+    // The scene comes from --scene, or is the book's cover generated on the spot.
+    if (!scene_path.empty()) {
+        SceneDescription description;
+        std::string error;
+        if (!description.load(scene_path, cam.thread_count, error)) {
+            std::cerr << "Could not load scene: " << error << "\n";
+            return 1;
+        }
+        std::clog << description.stats() << std::endl;
+        description.camera.apply(cam);
+        if (frozen_builder) {
+            frozen_builder->add(description);
+        } else {
+            description.build(world, cam.thread_count);
+        }
+    } else if (!mesh_path.empty()) {
+        auto mesh = std::make_shared<TriangleMesh>(std::make_shared<Lambertian>(color(0.65, 0.6, 0.55)));
+        MeshLoader loader;
+        loader.thread_count = cam.thread_count;
+        std::string error;
+        if (!loader.load(mesh_path, *mesh, error) || !mesh->build(cam.thread_count, error)) {
+            std::cerr << "Could not load mesh: " << error << "\n";
+            return 1;
+        }
+        std::clog << loader.stats() << std::endl;
+        std::clog << mesh->stats() << " (" << TriangleMesh::simd_width() << " triangles per test)" << std::endl;
+        mesh_scene(world, mesh);
+        mesh_camera(cam);
+    } else if (instances > 0) {
+        // Many copies of the cover scene's spheres, sharing one Bvh.
+        size_t asset_spheres = instanced_spheres_scene(world, instances, scene_grid, cam.thread_count);
+        random_spheres_camera(cam);
+        std::clog << "Instanced " << instances << " copies of " << asset_spheres << " spheres ("
+                  << static_cast<size_t>(instances) * asset_spheres << " spheres in the scene)" << std::endl;
+    } else {
+        random_spheres_scene(world, scene_grid);
+        random_spheres_camera(cam);
+    }
+
+    if (lamps > 0) {
+        lamp_spheres(world, lamps);
+    }
+
+    if (width > 0) cam.image_width = width;
+    if (spp > 0) cam.samples_per_pixel = spp;
+    if (depth > 0) cam.max_depth = depth;
+
+    // --save-scene converts: the scene is written (binary for .rtsb) and nothing is rendered.
+    if (!save_scene.empty()) {
+        SceneDescription description;
+        std::string error;
+        if (!description.from_world(world, cam, error) || !description.save(save_scene, error)) {
+            std::cerr << "Could not save scene: " << error << "\n";
+            return 1;
+        }
+        std::clog << "Saved " << description.sphere_count() << " spheres to " << save_scene << std::endl;
+        return 0;
+    }
+
+    // Animated objects become Instances before anything is built over the scene.
+    Animation animation;
+    if (!animation_path.empty()) {
+        std::string error;
+        if (!animation.load(animation_path, error)) {
+            std::cerr << "Could not load animation: " << error << "\n";
+            return 1;
+        }
+    } else if (turntable > 0) {
+        animation = Animation::turntable(cam, turntable);
+    }
+    AnimationRenderer animator(animation);
+    animator.thread_count = cam.thread_count;
+    animator.frames_in_flight = frames_in_flight;
+    if (!animation.objects.empty()) {
+        if (accel != "bvh" && accel != "list") {
+            std::cerr << "An animation that moves objects needs --accel bvh or list\n";
+            return 1;
+        }
+        std::string error;
+        if (!animator.attach(world, error)) {
+            std::cerr << "Could not animate the scene: " << error << "\n";
+            return 1;
+        }
+    }
+
+    SphereSet spheres;
+    std::unique_ptr<Bvh> bvh;
+    std::unique_ptr<CompiledScene> compiled;
+    std::unique_ptr<FrozenScene> frozen;
+    const IHittable *scene = &world;
+
+    if (accel == "spheres" || accel == "bvh-spheres") {
+        for (const auto &object : world.objects) {
+            const Sphere *sphere = dynamic_cast<const Sphere*>(object.get());
+            if (!sphere) {
+                std::cerr << "--accel " << accel << " needs a scene made only of spheres\n";
+                return 1;
             }
+            spheres.add(*sphere);
         }
+        std::clog << "SphereSet: " << spheres.size() << " spheres, "
+                  << SphereSet::simd_width() << " per test" << std::endl;
+        scene = &spheres;
     }
 
-    auto material1 = std::make_shared<Dielectric>(1.5);
-    world.add(std::make_shared<Sphere>(point3(0, 1, 0), 1.0, material1));
+    if (accel == "bvh") {
+        bvh.reset(new Bvh(world, cam.thread_count));
+    } else if (accel == "bvh-spheres") {
+        bvh.reset(new Bvh(spheres.clusters(), cam.thread_count));
+    }
+    if (bvh) {
+        std::clog << bvh->stats() << std::endl;
+        scene = bvh.get();
+    }
 
-    auto material2 = std::make_shared<Lambertian>(color(0.4, 0.2, 0.1));
-    world.add(std::make_shared<Sphere>(point3(-4, 1, 0), 1.0, material2));
+    // The tiled renderer is instantiated for the compiled scene's types; the others reach it
+    // through IHittable.
+    if (accel == "compiled") {
+        compiled.reset(new CompiledScene());
+        std::string error;
+        if (!compiled->compile(world, cam.thread_count, error)) {
+            std::cerr << "--accel compiled: " << error << "\n";
+            return 1;
+        }
+        std::clog << compiled->stats() << std::endl;
+        scene = compiled.get();
+    }
 
-    auto material3 = std::make_shared<Metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(std::make_shared<Sphere>(point3(4, 1, 0), 1.0, material3));
+    // The shared_ptr objects are dropped once the frozen scene holds its own copies.
+    if (frozen_builder) {
+        std::string error;
+        if (!frozen_builder->add(world, error)) {
+            std::cerr << "--accel frozen: " << error << "\n";
+            return 1;
+        }
+        world.clear();
+        frozen = frozen_builder->freeze(cam.thread_count);
+        std::clog << frozen->stats() << std::endl;
+        scene = frozen.get();
+    }
 
+    // Emitting spheres at the top of the scene are sampled directly by the tiled renderer.
+    LightList world_lights;
+    if (frozen) {
+        world_lights = frozen->lights();
+    } else {
+        world_lights.collect(world);
+    }
+    if (!world_lights.empty()) {
+        if (wavefront || accel == "spheres" || accel == "bvh-spheres") {
+            std::cerr << "Scenes with lights do not support --wavefront or --accel spheres|bvh-spheres\n";
+            return 1;
+        }
+        std::clog << "Lights: " << world_lights.size() << " sampled"
+                  << (next_event ? "" : ", only found by chance (--no-nee)") << std::endl;
+        if (next_event) {
+            cam.lights = &world_lights;
+        }
+    }
 
-    Camera cam;
+    if (cam.ao_distance > 0 && (wavefront || cam.ao_samples < 1)) {
+        std::cerr << "--ao needs --ao-samples of at least 1 and does not support --wavefront\n";
+        return 1;
+    }
 
-    cam.aspect_ratio      = 16.0f / 9.0f;
-    cam.image_width       = 1920;
-    cam.samples_per_pixel = 500;
-    cam.max_depth         = 50;
+    if (wavefront && (!cam.checkpoint_path.empty() || !resume.empty() || cam.adaptive_threshold > 0
+                      || !heatmap.empty())) {
+        std::cerr << "--checkpoint, --resume, --adaptive and --heatmap are not supported with --wavefront\n";
+        return 1;
+    }
 
-    cam.vfov      = 20;
-    cam.look_from = point3(13, 2, 3);
-    cam.look_at   = point3(0, 0, 0);
-    cam.vup       = vec3(0, 1, 0);
+    // The wavefront renderer keeps each path's scalar generator, but not the wide one the
+    // random sampler draws from.
+    if (wavefront && cam.sampler == SamplerType::Random) {
+        std::cerr << "--sampler random is not supported with --wavefront\n";
+        return 1;
+    }
 
-    cam.defocus_angle = 0.6;
-    cam.focus_dist    = 10.0;
+    bool distributed = !coordinator.empty() || !worker.empty();
+    if (distributed && (wavefront || !cam.checkpoint_path.empty() || !resume.empty() || cam.adaptive_threshold > 0)) {
+        std::cerr << "--coordinator and --worker do not support --wavefront, --adaptive, --checkpoint or --resume\n";
+        return 1;
+    }
+    // The first-hit guides are only gathered by the tiled renderer, and not kept in checkpoints.
+    bool aovs = denoise || !albedo_output.empty() || !normal_output.empty() || !depth_output.empty();
+    if (aovs && (wavefront || distributed || !resume.empty())) {
+        std::cerr << "--denoise and the AOV outputs do not support --wavefront, --coordinator, --worker or --resume\n";
+        return 1;
+    }
+    cam.collect_aovs = aovs;
+    if (!coordinator.empty() && !worker.empty()) {
+        std::cerr << "A process is either the --coordinator or a --worker\n";
+        return 1;
+    }
 
-    cam.render(world);
+    // A worker renders units for a coordinator started with the same scene and settings.
+    if (!worker.empty()) {
+        DistributedWorker node(cam);
+        std::string error;
+        if (!node.serve(*scene, worker, error)) {
+            std::cerr << "Worker failed: " << error << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    // --resume continues a checkpointed render; a larger --spp refines a finished one.
+    Checkpoint checkpoint;
+    if (!resume.empty()) {
+        std::string error;
+        if (!read_checkpoint(resume, checkpoint, error) || !cam.can_resume(checkpoint, *scene, error)) {
+            std::cerr << "Could not resume: " << error << "\n";
+            return 1;
+        }
+    }
+
+    AsyncImageWriter writer;
+    if (animated) {
+        // Frames are written in the background while the next ones render.
+        animator.render(cam, world, accel == "bvh" ? bvh.get() : nullptr,
+            [&](Camera &frame_cam) {
+                if (wavefront) {
+                    WavefrontRenderer renderer(frame_cam);
+                    renderer.batch_size = wavefront_batch;
+                    return renderer.render_frame(*scene);
+                }
+                if (compiled) {
+                    return frame_cam.render_frame(*compiled);
+                }
+                return frame_cam.render_frame(*scene);
+            },
+            [&](int frame, Framebuffer &&frame_image) {
+                writer.submit(std::move(frame_image), format, frame_path(output, frame));
+            });
+        std::clog << animator.stats() << std::endl;
+        writer.wait();
+        return 0;
+    }
+
+    Framebuffer image;
+    if (!coordinator.empty()) {
+        DistributedCoordinator node(cam);
+        node.samples_per_unit = unit_spp;
+        node.unit_timeout = unit_timeout;
+        std::string error;
+        if (!node.render_frame(*scene, coordinator, image, error)) {
+            std::cerr << "Coordinator failed: " << error << "\n";
+            return 1;
+        }
+    } else if (progressive) {
+        // Each pass replaces the last in the output file as soon as it is done.
+        ProgressiveRenderer renderer(cam);
+        renderer.time_budget = time_budget;
+        renderer.noise_target = noise_target;
+        image = renderer.render_frame(*scene, [&](const Framebuffer &pass_image, const PreviewPass &) {
+            writer.replace(pass_image, format, output);
+        });
+    } else if (wavefront) {
+        WavefrontRenderer renderer(cam);
+        renderer.batch_size = wavefront_batch;
+        image = renderer.render_frame(*scene);
+    } else if (compiled) {
+        image = cam.render_frame(*compiled, resume.empty() ? nullptr : &checkpoint);
+    } else {
+        image = cam.render_frame(*scene, resume.empty() ? nullptr : &checkpoint);
+    }
+    if (!heatmap.empty()) {
+        writer.submit(sample_heatmap(image), image_format_for_path(heatmap, ImageFormat::P6), heatmap);
+    }
+    if (!albedo_output.empty()) {
+        writer.submit(cam.aovs().albedo, image_format_for_path(albedo_output, ImageFormat::P6), albedo_output);
+    }
+    if (!normal_output.empty()) {
+        writer.submit(normal_image(cam.aovs().normal), image_format_for_path(normal_output, ImageFormat::P6),
+                      normal_output);
+    }
+    if (!depth_output.empty()) {
+        // Raw distances; PFM keeps them as they are.
+        writer.submit(cam.aovs().depth, image_format_for_path(depth_output, ImageFormat::PFM), depth_output);
+    }
+    if (denoise) {
+        Denoiser denoiser;
+        denoiser.thread_count = cam.thread_count;
+        image = denoiser.denoise(image, cam.aovs());
+    }
+    if (!progressive) { // Otherwise its last pass is already on its way out
+        writer.submit(std::move(image), format, output);
+    }
+
+    if (!stats_json.empty()) {
+        std::ofstream out(stats_json);
+        Instrumentation::write_json(out, cam.stats().path_lengths);
+        if (!out) {
+            std::cerr << "Could not write " << stats_json << "\n";
+        }
+    }
+    if (!trace.empty()) {
+        std::ofstream out(trace);
+        Instrumentation::write_trace(out);
+        if (!out) {
+            std::cerr << "Could not write " << trace << "\n";
+        }
+    }
+    writer.wait();
 
     return 0;
 }
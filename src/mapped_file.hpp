@@ -0,0 +1,91 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define RT_MAPPED_FILE_POSIX 1
+#endif
+
+// Read-only view of a whole file. On POSIX systems the file is memory-mapped, so pages are
+// only read when touched and nothing is copied; elsewhere it is read into a buffer.
+class MappedFile {
+    public:
+        MappedFile() : _data(nullptr), _size(0), _mapped(false) {}
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() { close(); }
+
+        bool open(const std::string &path) {
+            close();
+#ifdef RT_MAPPED_FILE_POSIX
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            struct stat info;
+            if (fstat(fd, &info) != 0) {
+                ::close(fd);
+                return false;
+            }
+            _size = static_cast<size_t>(info.st_size);
+            if (_size > 0) {
+                void *address = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (address == MAP_FAILED) {
+                    ::close(fd);
+                    _size = 0;
+                    return false;
+                }
+                _data = static_cast<const uint8_t*>(address);
+                _mapped = true;
+            }
+            // The mapping keeps the file alive on its own.
+            ::close(fd);
+            return true;
+#else
+            std::ifstream in(path, std::ios::binary);
+            if (!in) {
+                return false;
+            }
+            _buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            _data = reinterpret_cast<const uint8_t*>(_buffer.data());
+            _size = _buffer.size();
+            return true;
+#endif
+        }
+
+        void close() {
+#ifdef RT_MAPPED_FILE_POSIX
+            if (_mapped) {
+                munmap(const_cast<uint8_t*>(_data), _size);
+            }
+#endif
+            _buffer.clear();
+            _data = nullptr;
+            _size = 0;
+            _mapped = false;
+        }
+
+        const uint8_t* data() const { return _data; }
+        size_t size() const { return _size; }
+        bool mapped() const { return _mapped; }
+
+    private:
+        const uint8_t *_data;
+        size_t _size;
+        bool _mapped;
+        std::vector<char> _buffer; // Only used where mapping is unavailable
+};
+
+#endif // MAPPED_FILE_H
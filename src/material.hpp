@@ -1,6 +1,9 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include "instrument.hpp"
+#include "random.hpp"
+#include "sampler.hpp"
 #include "ray.hpp"
 #include "rtweekend.hpp"
 #include "vec3.hpp"
@@ -8,10 +11,22 @@
 
 struct HitRecord;
 
+// Closed set of the material classes below, so batch renderers can group hits by material
+// and call each class's scatter() directly. Materials defined elsewhere report Other.
+enum class MaterialType { Lambertian, Metal, Dielectric, Other };
+
 class IMaterial {
     public:
         virtual ~IMaterial() = default;
 
+        virtual MaterialType type() const { return MaterialType::Other; }
+
+        // Surface color for the albedo AOV; white for materials without one, like glass.
+        virtual color albedo() const { return color(1, 1, 1); }
+
+        // Light given off at the hit, towards the ray that found it.
+        virtual color emitted(const HitRecord &) const { return color(0, 0, 0); }
+
         virtual bool 
         scatter(const ray &r_in, const HitRecord &rec, color &attenuation, ray &scattered) const = 0;
 };
@@ -23,15 +38,14 @@ class Lambertian : public IMaterial {
     public:
         Lambertian(const color &albedo) : _albedo(albedo) {}
 
-        bool
-        scatter(const ray &r_in, const HitRecord &rec, color &attenuation, ray &scattered) const override {
-            vec3 scatter_direction = rec.normal + random_unit_vector();
+        MaterialType type() const override { return MaterialType::Lambertian; }
 
-            if (scatter_direction.near_zero()) {
-                scatter_direction = rec.normal;
-            }
+        color albedo() const override { return _albedo; }
 
-            scattered = ray(rec.p, scatter_direction);
+        bool
+        scatter(const ray &r_in, const HitRecord &rec, color &attenuation, ray &scattered) const override {
+            RT_COUNT(Counter::ScatterLambertian);
+            scattered = ray(rec.p, sample_cosine_direction(rec.normal));
             attenuation = _albedo;
             return true;
         }
@@ -41,16 +55,22 @@ class Lambertian : public IMaterial {
 class Metal : public IMaterial {
     private:
         color _albedo;
-        double _fuzz;
+        float _fuzz;
 
     public:
-        Metal(const color &albedo, double fuzz) 
+        Metal(const color &albedo, float fuzz) 
             : _albedo(albedo), _fuzz(fuzz < 1 ? fuzz : 1) {}
 
+        MaterialType type() const override { return MaterialType::Metal; }
+
+        color albedo() const override { return _albedo; }
+        float fuzz() const { return _fuzz; }
+
         bool
         scatter(const ray &r_in, const HitRecord &rec, color &attenuation, ray &scattered) const override {
+            RT_COUNT(Counter::ScatterMetal);
             vec3 reflected = reflect(r_in.direction().unit(), rec.normal);
-            scattered = ray(rec.p, reflected + _fuzz * random_unit_vector());
+            scattered = ray(rec.p, reflected + _fuzz * sample_unit_vector());
             attenuation = _albedo;
             return (scattered.direction().dot(rec.normal) > 0);
         }
@@ -58,22 +78,27 @@ class Metal : public IMaterial {
 
 class Dielectric : public IMaterial {
     private:
-        double _index_of_refraction;
+        float _index_of_refraction;
     public:
         Dielectric(float index_of_refraction) 
             : _index_of_refraction(index_of_refraction) {}
 
+        MaterialType type() const override { return MaterialType::Dielectric; }
+
+        float index_of_refraction() const { return _index_of_refraction; }
+
         bool
         scatter(const ray &r_in, const HitRecord &rec, color &attenuation, ray &scattered) const override {
+            RT_COUNT(Counter::ScatterDielectric);
             attenuation = color(1.f, 1.f, 1.f);
-            float refraction_ratio = rec.front_face ? (1.0/_index_of_refraction) : _index_of_refraction;
+            float refraction_ratio = rec.front_face ? (1.0f / _index_of_refraction) : _index_of_refraction;
 
             vec3 unit_direction = r_in.direction().unit();
             float cos_theta = fminf((-unit_direction).dot(rec.normal), 1.0f);
             float sin_theta = sqrtf(1.f - cos_theta * cos_theta);
 
             bool cannot_refract = refraction_ratio * sin_theta > 1.f;
-            bool has_to_reflect = reflectance(cos_theta, refraction_ratio) > random_float();
+            bool has_to_reflect = reflectance(cos_theta, refraction_ratio) > sample_1d();
             vec3 direction;
 
             if (cannot_refract || has_to_reflect) {
@@ -95,4 +120,20 @@ class Dielectric : public IMaterial {
         }
 };
 
+class DiffuseLight : public IMaterial {
+    // Emits evenly from the front of the surface and reflects nothing. Reports the Other type:
+    // it never scatters, so batch renderers have nothing to specialize.
+    private:
+        color _emission;
+
+    public:
+        DiffuseLight(const color &emission) : _emission(emission) {}
+
+        color emission() const { return _emission; }
+
+        color emitted(const HitRecord &rec) const override { return rec.front_face ? _emission : color(0, 0, 0); }
+
+        bool scatter(const ray &, const HitRecord &, color &, ray &) const override { return false; }
+};
+
 #endif // MATERIAL_H
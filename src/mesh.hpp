@@ -0,0 +1,649 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "aabb.hpp"
+#include "aligned.hpp"
+#include "bvh.hpp"
+#include "hittable.hpp"
+#include "instrument.hpp"
+#include "interval.hpp"
+#include "material.hpp"
+#include "vec3.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define RT_MESH_X86 1
+#endif
+
+inline uint32_t encode_octahedral(const vec3 &n) {
+    // A unit vector as two 16-bit signed normalized coordinates on the octahedron unfolded onto
+    // a square (Cigolle et al. 2014): 4 bytes instead of 12, within about 0.005 degrees.
+    float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    if (!(l1 > 0)) {
+        return encode_octahedral(vec3(0, 0, 1));
+    }
+    float u = n.x / l1;
+    float v = n.y / l1;
+    if (n.z < 0) {
+        float folded_u = (1 - fabsf(v)) * (u >= 0 ? 1 : -1);
+        float folded_v = (1 - fabsf(u)) * (v >= 0 ? 1 : -1);
+        u = folded_u;
+        v = folded_v;
+    }
+    int32_t qu = static_cast<int32_t>(std::lround(std::max(-1.0f, std::min(1.0f, u)) * 32767));
+    int32_t qv = static_cast<int32_t>(std::lround(std::max(-1.0f, std::min(1.0f, v)) * 32767));
+    return static_cast<uint32_t>(static_cast<uint16_t>(qu)) | static_cast<uint32_t>(static_cast<uint16_t>(qv)) << 16;
+}
+
+inline vec3 decode_octahedral(uint32_t packed) {
+    float u = static_cast<int16_t>(packed & 0xffff) / 32767.0f;
+    float v = static_cast<int16_t>(packed >> 16) / 32767.0f;
+    vec3 n(u, v, 1 - fabsf(u) - fabsf(v));
+    float fold = std::max(-n.z, 0.0f);
+    n.x += n.x >= 0 ? -fold : fold;
+    n.y += n.y >= 0 ? -fold : fold;
+    return n.unit();
+}
+
+struct MeshStats {
+    size_t triangles   = 0;
+    size_t vertices    = 0;
+    size_t index_bytes = 0;
+    size_t vertex_bytes = 0; // Positions and, when present, quantized normals
+    size_t bvh_bytes   = 0;
+    size_t bvh_nodes   = 0; // In the collapsed, 4-wide tree
+    BvhStats bvh;           // Of the binary tree it was collapsed from
+};
+
+inline std::ostream& operator<<(std::ostream &out, const MeshStats &stats) {
+    double per_triangle = stats.triangles > 0 ? static_cast<double>(stats.bvh_bytes) / stats.triangles : 0;
+    return out << "Mesh: " << stats.triangles << " triangles, " << stats.vertices << " vertices, "
+               << (stats.index_bytes + stats.vertex_bytes) / (1024.0 * 1024.0) << " MiB of geometry, "
+               << "BVH " << stats.bvh_nodes << " 4-wide nodes (" << per_triangle << " bytes per triangle), "
+               << "SAH cost " << stats.bvh.sah_cost << ", built in " << stats.bvh.build_seconds * 1000 << " ms";
+}
+
+// Indexed triangles with one material: positions as structure-of-arrays, three 32-bit indices
+// per triangle and, optionally, per-vertex normals quantized to 4 bytes.
+//
+// The mesh carries its own BVH, whose leaves are runs of the (reordered) index buffer, so the
+// only memory added for ray tracing is the tree: built binary, then collapsed into 64-byte
+// nodes of four quantized children, it comes to a byte or two per triangle. Leaves are large
+// because a leaf is tested 4 (SSE) or 8 (AVX2, chosen at run time) triangles per instruction,
+// which also keeps the tree small. Intersection is
+// the watertight test of Woop, Benthin and Wald (2013): rays never slip through the shared
+// edge of two triangles, whatever the rounding.
+//
+// Fill the mesh with add_vertex()/add_triangle(), or resize() it and set elements in place
+// from several threads, then call build() once before rendering.
+class TriangleMesh : public IHittable {
+    public:
+        // How a leaf's triangles are tested. Widest is the fastest this CPU runs; the others
+        // are there to compare the paths, which must agree. Avx2 falls back to Sse on CPUs
+        // without it, and every choice is Scalar off x86.
+        enum class LeafTest { Widest, Scalar, Sse, Avx2 };
+
+        int   leaf_size      = 32;   // Most triangles per BVH leaf, for build()
+        float traversal_cost = 2.0f; // Of a node, in triangle tests; higher makes a smaller tree
+        LeafTest leaf_test   = LeafTest::Widest;
+
+        explicit TriangleMesh(std::shared_ptr<IMaterial> material) : _material(material), _built(false) {}
+
+        void resize(size_t vertex_count, size_t triangle_count, bool normals) {
+            for (int axis = 0; axis < 3; ++axis) {
+                _position[axis].resize(vertex_count);
+            }
+            _normals.assign(normals ? vertex_count : 0, 0);
+            _indices.resize(3 * triangle_count);
+            _built = false;
+        }
+
+        void reserve(size_t vertex_count, size_t triangle_count) {
+            for (int axis = 0; axis < 3; ++axis) {
+                _position[axis].reserve(vertex_count);
+            }
+            _indices.reserve(3 * triangle_count);
+        }
+
+        uint32_t add_vertex(const point3 &p) {
+            uint32_t index = static_cast<uint32_t>(vertex_count());
+            for (int axis = 0; axis < 3; ++axis) {
+                _position[axis].push_back(p[axis]);
+            }
+            if (!_normals.empty()) {
+                _normals.push_back(encode_octahedral(vec3(0, 0, 1)));
+            }
+            _built = false;
+            return index;
+        }
+
+        uint32_t add_vertex(const point3 &p, const vec3 &normal) {
+            // Normals are all or nothing: vertices added before the first normal get (0, 0, 1).
+            if (_normals.size() < vertex_count()) {
+                _normals.resize(vertex_count(), encode_octahedral(vec3(0, 0, 1)));
+            }
+            uint32_t index = add_vertex(p);
+            if (_normals.size() == index) {
+                _normals.push_back(0);
+            }
+            _normals[index] = encode_octahedral(normal);
+            return index;
+        }
+
+        void add_triangle(uint32_t a, uint32_t b, uint32_t c) {
+            _indices.push_back(a);
+            _indices.push_back(b);
+            _indices.push_back(c);
+            _built = false;
+        }
+
+        void set_vertex(size_t index, const point3 &p) {
+            for (int axis = 0; axis < 3; ++axis) {
+                _position[axis][index] = p[axis];
+            }
+        }
+
+        void set_normal(size_t index, const vec3 &normal) { _normals[index] = encode_octahedral(normal); }
+
+        void set_packed_normal(size_t index, uint32_t packed) { _normals[index] = packed; } // From encode_octahedral()
+
+        void set_triangle(size_t index, uint32_t a, uint32_t b, uint32_t c) {
+            _indices[3 * index] = a;
+            _indices[3 * index + 1] = b;
+            _indices[3 * index + 2] = c;
+        }
+
+        void clear_normals() { std::vector<uint32_t>().swap(_normals); }
+
+        size_t vertex_count() const { return _position[0].size(); }
+        size_t triangle_count() const { return _indices.size() / 3; }
+        bool has_normals() const { return !_normals.empty(); }
+
+        point3 vertex(uint32_t index) const {
+            return point3(_position[0][index], _position[1][index], _position[2][index]);
+        }
+
+        vec3 normal(uint32_t index) const { return decode_octahedral(_normals[index]); }
+
+        bool build(int thread_count, std::string &error) {
+            // Checks the indices and builds the BVH, reordering the triangles into leaf order.
+            size_t vertices = vertex_count();
+            size_t triangles = triangle_count();
+            if (triangles > std::numeric_limits<uint32_t>::max() / 3) {
+                error = "too many triangles";
+                return false;
+            }
+
+            std::vector<Aabb> boxes(triangles);
+            for (size_t i = 0; i < triangles; ++i) {
+                const uint32_t *v = &_indices[3 * i];
+                if (v[0] >= vertices || v[1] >= vertices || v[2] >= vertices) {
+                    error = "triangle " + std::to_string(i) + " refers to a vertex past the "
+                            + std::to_string(vertices) + " there are";
+                    return false;
+                }
+                Aabb box(vertex(v[0]), vertex(v[1]));
+                box.expand(vertex(v[2]));
+                boxes[i] = box;
+            }
+
+            BvhBuilder builder;
+            int largest_leaf = WideBvhNode::max_leaf_size; // Leaf sizes are stored in a byte
+            builder.max_leaf_size = std::max(1, std::min(leaf_size, largest_leaf));
+            builder.intersection_cost = 1.0f / simd_width(); // A leaf is tested a batch at a time
+            builder.traversal_cost = traversal_cost;
+            builder.thread_count = thread_count;
+            std::vector<uint32_t> order;
+            aligned_vector<BvhNode> binary;
+            builder.build(boxes, binary, order, _stats.bvh);
+            std::vector<Aabb>().swap(boxes);
+            collapse_bvh(binary, _nodes);
+            _bounds = binary.empty() ? Aabb() : binary[0].bounds();
+            aligned_vector<BvhNode>().swap(binary);
+
+            std::vector<uint32_t> reordered(_indices.size());
+            for (size_t i = 0; i < triangles; ++i) {
+                for (int k = 0; k < 3; ++k) {
+                    reordered[3 * i + k] = _indices[3 * order[i] + k];
+                }
+            }
+            _indices.swap(reordered);
+
+            _stats.triangles = triangles;
+            _stats.vertices = vertices;
+            _stats.index_bytes = _indices.size() * sizeof(uint32_t);
+            _stats.vertex_bytes = 3 * vertices * sizeof(float) + _normals.size() * sizeof(uint32_t);
+            _stats.bvh_bytes = _nodes.size() * sizeof(WideBvhNode);
+            _stats.bvh_nodes = _nodes.size();
+            _built = true;
+            return true;
+        }
+
+        const MeshStats& stats() const { return _stats; }
+
+        bool intersect(const ray &r, Interval ray_t, HitRecord &rec) const override {
+            if (!_built) {
+                return false;
+            }
+            WatertightRay w(r);
+            uint32_t best = 0;
+            float best_t = 0;
+            bool hit = traverse_wide_bvh(_nodes, r, ray_t, [&](uint32_t first, uint32_t count, Interval &leaf_t) {
+                if (!closest_in_leaf(w, first, count, leaf_t, best_t, best)) {
+                    return false;
+                }
+                leaf_t.max = best_t;
+                return true;
+            });
+            if (!hit) {
+                return false;
+            }
+
+            rec.t = best_t;
+            rec.object = this;
+            rec.primitive = best;
+            RT_COUNT(Counter::TriangleMeshHits);
+            return true;
+        }
+
+        bool occluded(const ray &r, Interval ray_t) const override {
+            // Any triangle of the first leaf with a hit will do.
+            if (!_built) {
+                return false;
+            }
+            WatertightRay w(r);
+            uint32_t best = 0;
+            float best_t = 0;
+            return traverse_wide_bvh<true>(_nodes, r, ray_t, [&](uint32_t first, uint32_t count, Interval &leaf_t) {
+                return closest_in_leaf(w, first, count, leaf_t, best_t, best);
+            });
+        }
+
+        void surface(const ray &r, HitRecord &rec) const override {
+            const uint32_t *v = &_indices[3 * rec.primitive];
+            point3 p0 = vertex(v[0]);
+            vec3 e1 = vertex(v[1]) - p0;
+            vec3 e2 = vertex(v[2]) - p0;
+            vec3 n = e1.cross(e2);
+
+            rec.p = r.at(rec.t);
+            rec.set_face_normal(r, n.unit());
+            if (!_normals.empty()) {
+                // Barycentrics of the hit point, then the interpolated normal, kept on the side
+                // of the surface the ray arrived from.
+                vec3 d = rec.p - p0;
+                float inv_area = 1 / n.lengthsq();
+                float b1 = d.cross(e2).dot(n) * inv_area;
+                float b2 = e1.cross(d).dot(n) * inv_area;
+                float b0 = 1 - b1 - b2;
+                vec3 shading = (b0 * normal(v[0]) + b1 * normal(v[1]) + b2 * normal(v[2])).unit();
+                rec.normal = shading.dot(rec.normal) < 0 ? -shading : shading;
+            }
+            rec.mat = _material.get();
+        }
+
+        Aabb bounding_box() const override { return _bounds; }
+
+        static int simd_width() {
+            // Number of triangles tested per instruction on this CPU.
+#ifdef RT_MESH_X86
+            static const int width = __builtin_cpu_supports("avx2") ? 8 : 4;
+            return width;
+#else
+            return 1;
+#endif
+        }
+
+    private:
+        aligned_vector<float, 32> _position[3]; // x, y and z of every vertex
+        std::vector<uint32_t> _normals;         // Octahedral, per vertex; empty without normals
+        std::vector<uint32_t> _indices;         // Three per triangle, in BVH leaf order once built
+        aligned_vector<WideBvhNode> _nodes;
+        Aabb _bounds;
+        std::shared_ptr<IMaterial> _material;
+        MeshStats _stats;
+        bool _built;
+
+        struct WatertightRay {
+            // The ray turned so its largest direction component is z, and the shear that
+            // makes it point straight down z: after it, a triangle is hit when the origin is
+            // inside its projection onto the xy plane, which needs no division.
+            float origin[3];
+            int kx, ky, kz;
+            float sx, sy, sz;
+
+            explicit WatertightRay(const ray &r) {
+                point3 o = r.origin();
+                vec3 d = r.direction();
+                origin[0] = o.x;
+                origin[1] = o.y;
+                origin[2] = o.z;
+                kz = fabsf(d.x) > fabsf(d.y) ? (fabsf(d.x) > fabsf(d.z) ? 0 : 2) : (fabsf(d.y) > fabsf(d.z) ? 1 : 2);
+                kx = (kz + 1) % 3;
+                ky = (kx + 1) % 3;
+                if (d[kz] < 0) {
+                    std::swap(kx, ky); // Keeps the winding, so U, V and W keep their signs
+                }
+                sx = d[kx] / d[kz];
+                sy = d[ky] / d[kz];
+                sz = 1 / d[kz];
+            }
+        };
+
+        bool hit_triangle(const WatertightRay &w, uint32_t triangle, Interval ray_t, float &t) const {
+            const uint32_t *v = &_indices[3 * triangle];
+            float a[3], b[3], c[3];
+            for (int axis = 0; axis < 3; ++axis) {
+                a[axis] = _position[axis][v[0]] - w.origin[axis];
+                b[axis] = _position[axis][v[1]] - w.origin[axis];
+                c[axis] = _position[axis][v[2]] - w.origin[axis];
+            }
+            float ax = a[w.kx] - w.sx * a[w.kz], ay = a[w.ky] - w.sy * a[w.kz];
+            float bx = b[w.kx] - w.sx * b[w.kz], by = b[w.ky] - w.sy * b[w.kz];
+            float cx = c[w.kx] - w.sx * c[w.kz], cy = c[w.ky] - w.sy * c[w.kz];
+
+            float u = cx * by - cy * bx;
+            float v_ = ax * cy - ay * cx;
+            float w_ = bx * ay - by * ax;
+            if (u == 0 || v_ == 0 || w_ == 0) {
+                // On an edge in float: decide it in double, so both triangles sharing the edge
+                // agree on which of them the ray hits.
+                u = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+                v_ = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+                w_ = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+            }
+            if ((u < 0 || v_ < 0 || w_ < 0) && (u > 0 || v_ > 0 || w_ > 0)) {
+                return false;
+            }
+            float det = u + v_ + w_;
+            if (det == 0) {
+                return false;
+            }
+            float t_scaled = u * (w.sz * a[w.kz]) + v_ * (w.sz * b[w.kz]) + w_ * (w.sz * c[w.kz]);
+            t = t_scaled / det;
+            return ray_t.surrounds(t);
+        }
+
+        static bool reduce_lanes(const float *lane_t, const int32_t *lane_index, int width,
+                                 float &t, uint32_t &index) {
+            // Horizontal min over the lanes. Ties go to the lowest triangle, like the scalar loop.
+            int best = -1;
+            for (int lane = 0; lane < width; ++lane) {
+                if (lane_index[lane] < 0) {
+                    continue;
+                }
+                if (best < 0 || lane_t[lane] < lane_t[best]
+                    || (lane_t[lane] == lane_t[best] && lane_index[lane] < lane_index[best])) {
+                    best = lane;
+                }
+            }
+            if (best < 0) {
+                return false;
+            }
+            t = lane_t[best];
+            index = static_cast<uint32_t>(lane_index[best]);
+            return true;
+        }
+
+        bool closest_in_leaf(const WatertightRay &w, uint32_t first, uint32_t count, Interval ray_t,
+                             float &t, uint32_t &index) const {
+#ifdef RT_MESH_X86
+            if (leaf_test == LeafTest::Scalar) {
+                return closest_scalar(w, first, count, ray_t, t, index);
+            }
+            if (leaf_test != LeafTest::Sse && simd_width() == 8) {
+                return closest_avx2(w, first, count, ray_t, t, index);
+            }
+            return closest_sse(w, first, count, ray_t, t, index);
+#else
+            return closest_scalar(w, first, count, ray_t, t, index);
+#endif
+        }
+
+        bool closest_scalar(const WatertightRay &w, uint32_t first, uint32_t count, Interval ray_t,
+                            float &t, uint32_t &index) const {
+            bool hit_anything = false;
+            for (uint32_t i = first; i < first + count; ++i) {
+                RT_COUNT(Counter::TriangleTests);
+                float candidate;
+                if (hit_triangle(w, i, ray_t, candidate)) {
+                    hit_anything = true;
+                    ray_t.max = candidate;
+                    t = candidate;
+                    index = i;
+                }
+            }
+            return hit_anything;
+        }
+
+#ifdef RT_MESH_X86
+        bool closest_sse(const WatertightRay &w, uint32_t first, uint32_t count, Interval ray_t,
+                         float &t, uint32_t &index) const {
+            const __m128 sx = _mm_set1_ps(w.sx), sy = _mm_set1_ps(w.sy), sz = _mm_set1_ps(w.sz);
+            const __m128 t_min = _mm_set1_ps(ray_t.min);
+            const __m128 zero = _mm_setzero_ps();
+            const float *px = _position[w.kx].data();
+            const float *py = _position[w.ky].data();
+            const float *pz = _position[w.kz].data();
+            const __m128 ox = _mm_set1_ps(w.origin[w.kx]), oy = _mm_set1_ps(w.origin[w.ky]);
+            const __m128 oz = _mm_set1_ps(w.origin[w.kz]);
+
+            __m128 best_t = _mm_set1_ps(ray_t.max);
+            __m128i best_index = _mm_set1_epi32(-1);
+            bool hit_anything = false;
+
+            for (uint32_t base = first; base < first + count; base += 4) {
+                // Gather the batch's corners, the last triangle standing in for missing lanes.
+                alignas(16) float corner[3][3][4];
+                alignas(16) int32_t lane_triangle[4];
+                uint32_t last = first + count - 1;
+                for (int lane = 0; lane < 4; ++lane) {
+                    uint32_t triangle = std::min(base + lane, last);
+                    lane_triangle[lane] = base + lane <= last ? static_cast<int32_t>(triangle) : -1;
+                    const uint32_t *v = &_indices[3 * triangle];
+                    for (int k = 0; k < 3; ++k) {
+                        corner[k][0][lane] = px[v[k]];
+                        corner[k][1][lane] = py[v[k]];
+                        corner[k][2][lane] = pz[v[k]];
+                    }
+                }
+                RT_COUNT_N(Counter::TriangleTests, 4);
+
+                __m128 az = _mm_sub_ps(_mm_load_ps(corner[0][2]), oz);
+                __m128 bz = _mm_sub_ps(_mm_load_ps(corner[1][2]), oz);
+                __m128 cz = _mm_sub_ps(_mm_load_ps(corner[2][2]), oz);
+                __m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(corner[0][0]), ox), _mm_mul_ps(sx, az));
+                __m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(corner[0][1]), oy), _mm_mul_ps(sy, az));
+                __m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(corner[1][0]), ox), _mm_mul_ps(sx, bz));
+                __m128 by = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(corner[1][1]), oy), _mm_mul_ps(sy, bz));
+                __m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(corner[2][0]), ox), _mm_mul_ps(sx, cz));
+                __m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(corner[2][1]), oy), _mm_mul_ps(sy, cz));
+
+                __m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+                __m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+                __m128 wv = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+                __m128 any_negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)),
+                                                _mm_cmplt_ps(wv, zero));
+                __m128 any_positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)),
+                                                _mm_cmpgt_ps(wv, zero));
+                __m128 det = _mm_add_ps(_mm_add_ps(u, v), wv);
+                __m128 t_scaled = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, _mm_mul_ps(sz, az)),
+                                                        _mm_mul_ps(v, _mm_mul_ps(sz, bz))),
+                                             _mm_mul_ps(wv, _mm_mul_ps(sz, cz)));
+                __m128 lane_t = _mm_div_ps(t_scaled, det);
+                __m128 inside = _mm_andnot_ps(_mm_and_ps(any_negative, any_positive), _mm_cmpneq_ps(det, zero));
+                __m128 hit = _mm_and_ps(inside, _mm_and_ps(_mm_cmpgt_ps(lane_t, t_min), _mm_cmplt_ps(lane_t, best_t)));
+
+                __m128i valid = _mm_cmpgt_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(lane_triangle)),
+                                                _mm_set1_epi32(-1));
+                hit = _mm_and_ps(hit, _mm_castsi128_ps(valid));
+                int on_edge = _mm_movemask_ps(_mm_and_ps(
+                    _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)), _mm_cmpeq_ps(wv, zero)),
+                    _mm_castsi128_ps(valid)));
+
+                __m128 previous_t = best_t;
+                __m128i previous_index = best_index;
+                best_t = _mm_or_ps(_mm_and_ps(hit, lane_t), _mm_andnot_ps(hit, best_t));
+                __m128i hit_i = _mm_castps_si128(hit);
+                __m128i lanes = _mm_load_si128(reinterpret_cast<const __m128i*>(lane_triangle));
+                best_index = _mm_or_si128(_mm_and_si128(hit_i, lanes), _mm_andnot_si128(hit_i, best_index));
+
+                if (on_edge) {
+                    // Rare: redo those lanes with the scalar test and its double precision path,
+                    // against what the lane held before this batch. The float test's verdict on
+                    // them is overruled either way.
+                    alignas(16) float lane_best_t[4];
+                    alignas(16) int32_t lane_best[4];
+                    alignas(16) float lane_previous_t[4];
+                    alignas(16) int32_t lane_previous[4];
+                    _mm_store_ps(lane_best_t, best_t);
+                    _mm_store_si128(reinterpret_cast<__m128i*>(lane_best), best_index);
+                    _mm_store_ps(lane_previous_t, previous_t);
+                    _mm_store_si128(reinterpret_cast<__m128i*>(lane_previous), previous_index);
+                    for (int lane = 0; lane < 4; ++lane) {
+                        if (!(on_edge & (1 << lane))) {
+                            continue;
+                        }
+                        float candidate;
+                        if (hit_triangle(w, static_cast<uint32_t>(lane_triangle[lane]),
+                                         Interval(ray_t.min, lane_previous_t[lane]), candidate)) {
+                            lane_best_t[lane] = candidate;
+                            lane_best[lane] = lane_triangle[lane];
+                        } else {
+                            lane_best_t[lane] = lane_previous_t[lane];
+                            lane_best[lane] = lane_previous[lane];
+                        }
+                    }
+                    best_t = _mm_load_ps(lane_best_t);
+                    best_index = _mm_load_si128(reinterpret_cast<const __m128i*>(lane_best));
+                }
+                hit_anything = true;
+            }
+
+            alignas(16) float lane_t[4];
+            alignas(16) int32_t lane_best[4];
+            _mm_store_ps(lane_t, best_t);
+            _mm_store_si128(reinterpret_cast<__m128i*>(lane_best), best_index);
+            return hit_anything && reduce_lanes(lane_t, lane_best, 4, t, index);
+        }
+
+        __attribute__((target("avx2")))
+        bool closest_avx2(const WatertightRay &w, uint32_t first, uint32_t count, Interval ray_t,
+                          float &t, uint32_t &index) const {
+            const __m256 sx = _mm256_set1_ps(w.sx), sy = _mm256_set1_ps(w.sy), sz = _mm256_set1_ps(w.sz);
+            const __m256 t_min = _mm256_set1_ps(ray_t.min);
+            const __m256 zero = _mm256_setzero_ps();
+            const float *px = _position[w.kx].data();
+            const float *py = _position[w.ky].data();
+            const float *pz = _position[w.kz].data();
+            const int *indices = reinterpret_cast<const int*>(_indices.data());
+            const __m256 ox = _mm256_set1_ps(w.origin[w.kx]), oy = _mm256_set1_ps(w.origin[w.ky]);
+            const __m256 oz = _mm256_set1_ps(w.origin[w.kz]);
+            const __m256i lane_offsets = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+            const __m256i last = _mm256_set1_epi32(static_cast<int>(first + count - 1));
+
+            __m256 best_t = _mm256_set1_ps(ray_t.max);
+            __m256i best_index = _mm256_set1_epi32(-1);
+
+            for (uint32_t base = first; base < first + count; base += 8) {
+                // Gather the batch's corners, the last triangle standing in for missing lanes.
+                __m256i lanes = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(base)), lane_offsets);
+                __m256i valid = _mm256_cmpgt_epi32(_mm256_add_epi32(last, _mm256_set1_epi32(1)), lanes);
+                __m256i triangle = _mm256_min_epi32(lanes, last);
+                __m256i corner0 = _mm256_mullo_epi32(triangle, _mm256_set1_epi32(3));
+                __m256i i0 = _mm256_i32gather_epi32(indices, corner0, 4);
+                __m256i i1 = _mm256_i32gather_epi32(indices + 1, corner0, 4);
+                __m256i i2 = _mm256_i32gather_epi32(indices + 2, corner0, 4);
+                RT_COUNT_N(Counter::TriangleTests, 8);
+
+                __m256 az = _mm256_sub_ps(_mm256_i32gather_ps(pz, i0, 4), oz);
+                __m256 bz = _mm256_sub_ps(_mm256_i32gather_ps(pz, i1, 4), oz);
+                __m256 cz = _mm256_sub_ps(_mm256_i32gather_ps(pz, i2, 4), oz);
+                __m256 ax = _mm256_sub_ps(_mm256_sub_ps(_mm256_i32gather_ps(px, i0, 4), ox), _mm256_mul_ps(sx, az));
+                __m256 ay = _mm256_sub_ps(_mm256_sub_ps(_mm256_i32gather_ps(py, i0, 4), oy), _mm256_mul_ps(sy, az));
+                __m256 bx = _mm256_sub_ps(_mm256_sub_ps(_mm256_i32gather_ps(px, i1, 4), ox), _mm256_mul_ps(sx, bz));
+                __m256 by = _mm256_sub_ps(_mm256_sub_ps(_mm256_i32gather_ps(py, i1, 4), oy), _mm256_mul_ps(sy, bz));
+                __m256 cx = _mm256_sub_ps(_mm256_sub_ps(_mm256_i32gather_ps(px, i2, 4), ox), _mm256_mul_ps(sx, cz));
+                __m256 cy = _mm256_sub_ps(_mm256_sub_ps(_mm256_i32gather_ps(py, i2, 4), oy), _mm256_mul_ps(sy, cz));
+
+                __m256 u = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+                __m256 v = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+                __m256 wv = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+
+                __m256 any_negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ),
+                                                                _mm256_cmp_ps(v, zero, _CMP_LT_OQ)),
+                                                   _mm256_cmp_ps(wv, zero, _CMP_LT_OQ));
+                __m256 any_positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ),
+                                                                _mm256_cmp_ps(v, zero, _CMP_GT_OQ)),
+                                                   _mm256_cmp_ps(wv, zero, _CMP_GT_OQ));
+                __m256 det = _mm256_add_ps(_mm256_add_ps(u, v), wv);
+                __m256 t_scaled = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, _mm256_mul_ps(sz, az)),
+                                                              _mm256_mul_ps(v, _mm256_mul_ps(sz, bz))),
+                                                _mm256_mul_ps(wv, _mm256_mul_ps(sz, cz)));
+                __m256 lane_t = _mm256_div_ps(t_scaled, det);
+                __m256 inside = _mm256_andnot_ps(_mm256_and_ps(any_negative, any_positive),
+                                                 _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ));
+                __m256 hit = _mm256_and_ps(inside, _mm256_and_ps(_mm256_cmp_ps(lane_t, t_min, _CMP_GT_OQ),
+                                                                 _mm256_cmp_ps(lane_t, best_t, _CMP_LT_OQ)));
+                hit = _mm256_and_ps(hit, _mm256_castsi256_ps(valid));
+                int on_edge = _mm256_movemask_ps(_mm256_and_ps(
+                    _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_EQ_OQ), _mm256_cmp_ps(v, zero, _CMP_EQ_OQ)),
+                                 _mm256_cmp_ps(wv, zero, _CMP_EQ_OQ)),
+                    _mm256_castsi256_ps(valid)));
+
+                __m256 previous_t = best_t;
+                __m256i previous_index = best_index;
+                best_t = _mm256_blendv_ps(best_t, lane_t, hit);
+                best_index = _mm256_blendv_epi8(best_index, lanes, _mm256_castps_si256(hit));
+
+                if (on_edge) {
+                    // Rare: redo those lanes as closest_sse() does.
+                    alignas(32) float lane_best_t[8];
+                    alignas(32) int32_t lane_best[8];
+                    alignas(32) float lane_previous_t[8];
+                    alignas(32) int32_t lane_previous[8];
+                    _mm256_store_ps(lane_best_t, best_t);
+                    _mm256_store_si256(reinterpret_cast<__m256i*>(lane_best), best_index);
+                    _mm256_store_ps(lane_previous_t, previous_t);
+                    _mm256_store_si256(reinterpret_cast<__m256i*>(lane_previous), previous_index);
+                    for (int lane = 0; lane < 8; ++lane) {
+                        if (!(on_edge & (1 << lane))) {
+                            continue;
+                        }
+                        float candidate;
+                        int32_t triangle_index = static_cast<int32_t>(base) + lane;
+                        if (hit_triangle(w, static_cast<uint32_t>(triangle_index),
+                                         Interval(ray_t.min, lane_previous_t[lane]), candidate)) {
+                            lane_best_t[lane] = candidate;
+                            lane_best[lane] = triangle_index;
+                        } else {
+                            lane_best_t[lane] = lane_previous_t[lane];
+                            lane_best[lane] = lane_previous[lane];
+                        }
+                    }
+                    best_t = _mm256_load_ps(lane_best_t);
+                    best_index = _mm256_load_si256(reinterpret_cast<const __m256i*>(lane_best));
+                }
+            }
+
+            alignas(32) float lane_t[8];
+            alignas(32) int32_t lane_best[8];
+            _mm256_store_ps(lane_t, best_t);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lane_best), best_index);
+            return reduce_lanes(lane_t, lane_best, 8, t, index);
+        }
+#endif
+};
+
+#endif // MESH_H
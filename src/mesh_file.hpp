@@ -0,0 +1,916 @@
+#ifndef MESH_FILE_H
+#define MESH_FILE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "mesh.hpp"
+#include "text_parse.hpp"
+#include "thread_pool.hpp"
+
+// Loads Wavefront OBJ and PLY (ascii and both binary byte orders) files into a TriangleMesh.
+//
+// The file is memory-mapped and parsed in place, in parallel: a first pass counts what every
+// slice of the file holds, prefix sums of the counts tell each slice where its elements go,
+// and a second pass writes them straight into the mesh. Nothing is kept per triangle besides
+// the mesh itself. Polygons are split into triangle fans.
+//
+// Only positions, per-vertex normals and faces are read. OBJ normals are indexed apart from
+// the positions; a position takes the normal of the lowest-numbered "vn" any face pairs it
+// with, and the normals are dropped unless every face corner names one.
+
+struct MeshLoadStats {
+    const char *format     = "";
+    size_t      file_bytes = 0;
+    size_t      vertices   = 0;
+    size_t      triangles  = 0;
+    bool        normals    = false;
+    int         threads    = 1;
+    double      load_seconds = 0;
+};
+
+inline std::ostream& operator<<(std::ostream &out, const MeshLoadStats &stats) {
+    return out << "Mesh file: " << stats.format << ", " << stats.file_bytes / 1024 << " KiB, "
+               << stats.vertices << " vertices, " << stats.triangles << " triangles"
+               << (stats.normals ? " with normals" : "") << ", "
+               << "loaded in " << stats.load_seconds * 1000 << " ms on " << stats.threads << " threads";
+}
+
+class MeshLoader {
+    public:
+        int thread_count = 0; // 0 uses every hardware thread
+
+        bool load(const std::string &path, TriangleMesh &mesh, std::string &error) {
+            // Fills mesh with the file's vertices and triangles. mesh.build() is left to the caller.
+            _stats = MeshLoadStats();
+            auto start = std::chrono::steady_clock::now();
+
+            MappedFile file;
+            if (!file.open(path)) {
+                error = "could not open " + path;
+                return false;
+            }
+            _stats.file_bytes = file.size();
+
+            ThreadPool pool(thread_count);
+            _stats.threads = pool.size();
+
+            const char *text = reinterpret_cast<const char*>(file.data());
+            bool ply = file.size() >= 4 && std::memcmp(text, "ply", 3) == 0 && (text[3] == '\n' || text[3] == '\r');
+            bool loaded = ply ? load_ply(file, mesh, pool, error) : load_obj(file, mesh, pool, error);
+            if (!loaded) {
+                error = path + ": " + error;
+                mesh.resize(0, 0, false);
+                return false;
+            }
+
+            _stats.vertices = mesh.vertex_count();
+            _stats.triangles = mesh.triangle_count();
+            _stats.normals = mesh.has_normals();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            _stats.load_seconds = elapsed.count();
+            return true;
+        }
+
+        const MeshLoadStats& stats() const { return _stats; }
+
+    private:
+        MeshLoadStats _stats;
+
+        static const uint32_t no_normal = 0xffffffffu;
+
+        static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+        static const char* skip_space(const char *p, const char *end) {
+            while (p < end && is_space(*p)) {
+                ++p;
+            }
+            return p;
+        }
+
+        static const char* line_end(const char *p, const char *end) {
+            const char *newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+            return newline ? newline : end;
+        }
+
+        // --- OBJ ---
+
+        enum class ObjStatement { Other, Vertex, Normal, Face };
+
+        struct ObjChunk {
+            const char *begin;
+            const char *end;
+            size_t lines = 0;
+            size_t vertices = 0;
+            size_t normals = 0;
+            size_t triangles = 0;
+            bool corner_without_normal = false;
+            size_t vertex_base = 0; // Where the chunk's elements go, from the prefix sums
+            size_t normal_base = 0;
+            size_t triangle_base = 0;
+            size_t error_line = 0;  // 1-based within the chunk
+            std::string error;
+        };
+
+        static ObjStatement obj_statement(const char *&p, const char *end) {
+            // Classifies a line by its keyword and moves p past it.
+            p = skip_space(p, end);
+            if (p + 1 < end && is_space(p[1])) {
+                if (p[0] == 'v') {
+                    p += 1;
+                    return ObjStatement::Vertex;
+                }
+                if (p[0] == 'f') {
+                    p += 1;
+                    return ObjStatement::Face;
+                }
+            } else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && is_space(p[2])) {
+                p += 2;
+                return ObjStatement::Normal;
+            }
+            return ObjStatement::Other; // Texture coordinates, groups, materials and comments
+        }
+
+        static void count_obj(ObjChunk &chunk) {
+            const char *cursor = chunk.begin;
+            while (cursor < chunk.end) {
+                const char *end = line_end(cursor, chunk.end);
+                ++chunk.lines;
+                const char *p = cursor;
+                cursor = end + 1;
+
+                switch (obj_statement(p, end)) {
+                    case ObjStatement::Vertex:
+                        ++chunk.vertices;
+                        break;
+                    case ObjStatement::Normal:
+                        ++chunk.normals;
+                        break;
+                    case ObjStatement::Face: {
+                        size_t corners = 0;
+                        for (p = skip_space(p, end); p < end; p = skip_space(p, end)) {
+                            const char *corner = p;
+                            while (p < end && !is_space(*p)) {
+                                ++p;
+                            }
+                            ++corners;
+                            // "v", "v/vt", "v//vn" or "v/vt/vn": a normal needs two slashes.
+                            const char *slash = static_cast<const char*>(std::memchr(corner, '/', p - corner));
+                            if (!slash || !std::memchr(slash + 1, '/', p - slash - 1)) {
+                                chunk.corner_without_normal = true;
+                            }
+                        }
+                        if (corners < 3) {
+                            chunk.error_line = chunk.lines;
+                            chunk.error = "a face needs at least 3 corners";
+                            return;
+                        }
+                        chunk.triangles += corners - 2;
+                        break;
+                    }
+                    default:
+                        break;
+                }
+            }
+        }
+
+        static bool obj_index(int64_t written, size_t defined, size_t total, uint32_t &index) {
+            // 1-based, or relative to the end of what the file has defined so far when negative.
+            int64_t resolved = written > 0 ? written - 1 : static_cast<int64_t>(defined) + written;
+            if (written == 0 || resolved < 0 || resolved >= static_cast<int64_t>(total)) {
+                return false;
+            }
+            index = static_cast<uint32_t>(resolved);
+            return true;
+        }
+
+        static void fill_obj(ObjChunk &chunk, TriangleMesh &mesh, size_t vertex_total, size_t normal_total,
+                             uint32_t *normals, std::atomic<uint32_t> *vertex_normal) {
+            size_t vertex = chunk.vertex_base;
+            size_t normal = chunk.normal_base;
+            size_t triangle = chunk.triangle_base;
+            size_t line = 0;
+            const char *cursor = chunk.begin;
+
+            while (cursor < chunk.end) {
+                const char *end = line_end(cursor, chunk.end);
+                ++line;
+                const char *p = cursor;
+                cursor = end + 1;
+
+                std::string message;
+                ObjStatement statement = obj_statement(p, end);
+                if (statement == ObjStatement::Vertex || statement == ObjStatement::Normal) {
+                    float xyz[3];
+                    for (int k = 0; k < 3 && message.empty(); ++k) {
+                        p = skip_space(p, end);
+                        if (!parse_float(p, end, xyz[k])) {
+                            message = statement == ObjStatement::Vertex ? "expected: v x y z" : "expected: vn x y z";
+                        }
+                    }
+                    if (message.empty() && statement == ObjStatement::Vertex) {
+                        mesh.set_vertex(vertex++, point3(xyz[0], xyz[1], xyz[2]));
+                    } else if (message.empty()) {
+                        normals[normal++] = encode_octahedral(vec3(xyz[0], xyz[1], xyz[2]));
+                    }
+                } else if (statement == ObjStatement::Face) {
+                    uint32_t first = 0, previous = 0;
+                    int corner = 0;
+                    for (p = skip_space(p, end); p < end && message.empty(); p = skip_space(p, end), ++corner) {
+                        int64_t written, texture, written_normal = 0;
+                        uint32_t index, normal_index = no_normal;
+                        if (!parse_int(p, end, written) || !obj_index(written, vertex, vertex_total, index)) {
+                            message = "face corner refers to a vertex that does not exist";
+                            break;
+                        }
+                        if (p < end && *p == '/') {
+                            ++p;
+                            if (p < end && *p != '/' && !parse_int(p, end, texture)) {
+                                message = "malformed face corner";
+                                break;
+                            }
+                            if (p < end && *p == '/') {
+                                ++p;
+                                if (!parse_int(p, end, written_normal)
+                                    || !obj_index(written_normal, normal, normal_total, normal_index)) {
+                                    message = "face corner refers to a normal that does not exist";
+                                    break;
+                                }
+                            }
+                        }
+                        if (p < end && !is_space(*p)) {
+                            message = "malformed face corner";
+                            break;
+                        }
+
+                        if (vertex_normal && normal_index != no_normal) {
+                            // The lowest normal wins, whichever thread gets there first.
+                            uint32_t seen = vertex_normal[index].load(std::memory_order_relaxed);
+                            while (normal_index < seen
+                                   && !vertex_normal[index].compare_exchange_weak(seen, normal_index,
+                                                                                  std::memory_order_relaxed)) {
+                            }
+                        }
+                        if (corner == 0) {
+                            first = index;
+                        } else if (corner >= 2) {
+                            mesh.set_triangle(triangle++, first, previous, index);
+                        }
+                        previous = index;
+                    }
+                }
+
+                if (!message.empty()) {
+                    chunk.error_line = line;
+                    chunk.error = message;
+                    return;
+                }
+            }
+        }
+
+        bool load_obj(const MappedFile &file, TriangleMesh &mesh, ThreadPool &pool, std::string &error) {
+            _stats.format = "OBJ";
+            const char *text = reinterpret_cast<const char*>(file.data());
+            std::vector<ObjChunk> chunks;
+            for (const TextSlice &slice : split_lines(text, text + file.size(), pool.size())) {
+                chunks.emplace_back();
+                chunks.back().begin = slice.begin;
+                chunks.back().end = slice.end;
+            }
+
+            for (auto &chunk : chunks) {
+                ObjChunk *c = &chunk;
+                pool.submit([c]() { count_obj(*c); });
+            }
+            pool.wait();
+
+            size_t vertices = 0, normals = 0, triangles = 0, lines = 0;
+            bool every_corner_has_normal = true;
+            for (auto &chunk : chunks) {
+                if (!chunk.error.empty()) {
+                    error = "line " + std::to_string(lines + chunk.error_line) + ": " + chunk.error;
+                    return false;
+                }
+                chunk.vertex_base = vertices;
+                chunk.normal_base = normals;
+                chunk.triangle_base = triangles;
+                vertices += chunk.vertices;
+                normals += chunk.normals;
+                triangles += chunk.triangles;
+                lines += chunk.lines;
+                every_corner_has_normal = every_corner_has_normal && !chunk.corner_without_normal;
+            }
+            if (vertices > no_normal || normals > no_normal) {
+                error = "more vertices than 32-bit indices can address";
+                return false;
+            }
+
+            bool use_normals = normals > 0 && every_corner_has_normal;
+            std::vector<uint32_t> packed_normals(normals);
+            std::unique_ptr<std::atomic<uint32_t>[]> vertex_normal;
+            if (use_normals) {
+                vertex_normal.reset(new std::atomic<uint32_t>[vertices]);
+                for (size_t v = 0; v < vertices; ++v) {
+                    vertex_normal[v].store(no_normal, std::memory_order_relaxed);
+                }
+            }
+            mesh.resize(vertices, triangles, use_normals);
+
+            for (auto &chunk : chunks) {
+                ObjChunk *c = &chunk;
+                uint32_t *n = packed_normals.data();
+                std::atomic<uint32_t> *vn = vertex_normal.get();
+                pool.submit([c, &mesh, vertices, normals, n, vn]() { fill_obj(*c, mesh, vertices, normals, n, vn); });
+            }
+            pool.wait();
+
+            lines = 0;
+            for (const auto &chunk : chunks) {
+                if (!chunk.error.empty()) {
+                    error = "line " + std::to_string(lines + chunk.error_line) + ": " + chunk.error;
+                    return false;
+                }
+                lines += chunk.lines;
+            }
+
+            if (use_normals) {
+                for (size_t v = 0; v < vertices; ++v) {
+                    uint32_t n = vertex_normal[v].load(std::memory_order_relaxed);
+                    if (n != no_normal) {
+                        mesh.set_packed_normal(v, packed_normals[n]);
+                    }
+                }
+            }
+            return true;
+        }
+
+        // --- PLY ---
+
+        enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+        struct PlyProperty {
+            std::string name;
+            PlyType type;
+            bool list = false;
+            PlyType count_type = PlyType::UInt8; // Lists only: type of the length that leads them
+        };
+
+        struct PlyElement {
+            std::string name;
+            size_t count = 0;
+            std::vector<PlyProperty> properties;
+            const uint8_t *data = nullptr; // Binary files: where its records start
+
+            bool fixed_size() const {
+                for (const auto &property : properties) {
+                    if (property.list) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            int find(const char *property) const {
+                for (size_t i = 0; i < properties.size(); ++i) {
+                    if (properties[i].name == property) {
+                        return static_cast<int>(i);
+                    }
+                }
+                return -1;
+            }
+        };
+
+        struct PlyHeader {
+            enum Format { Ascii, LittleEndian, BigEndian } format = Ascii;
+            std::vector<PlyElement> elements;
+            const char *body = nullptr;
+            int vertex = -1;   // Index of the vertex element
+            int face = -1;     // Index of the face element
+            int position[3];   // Properties of the vertex element
+            int normal[3];     // -1 when the file has no normals
+            int indices = -1;  // List property of the face element
+        };
+
+        struct FaceBlock {
+            // A run of faces that one task fills in.
+            const uint8_t *data;
+            size_t first_face;
+            size_t first_triangle;
+        };
+
+        static const size_t faces_per_block = 1 << 16;
+
+        static bool ply_type(const std::string &name, PlyType &type) {
+            static const struct { const char *name; PlyType type; } names[] = {
+                {"char", PlyType::Int8}, {"int8", PlyType::Int8}, {"uchar", PlyType::UInt8}, {"uint8", PlyType::UInt8},
+                {"short", PlyType::Int16}, {"int16", PlyType::Int16}, {"ushort", PlyType::UInt16},
+                {"uint16", PlyType::UInt16}, {"int", PlyType::Int32}, {"int32", PlyType::Int32},
+                {"uint", PlyType::UInt32}, {"uint32", PlyType::UInt32}, {"float", PlyType::Float32},
+                {"float32", PlyType::Float32}, {"double", PlyType::Float64}, {"float64", PlyType::Float64}};
+            for (const auto &entry : names) {
+                if (name == entry.name) {
+                    type = entry.type;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static size_t ply_size(PlyType type) {
+            static const size_t sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+            return sizes[static_cast<int>(type)];
+        }
+
+        static double read_binary(const uint8_t *p, PlyType type, bool swap) {
+            uint8_t bytes[8] = {};
+            size_t size = ply_size(type);
+            for (size_t i = 0; i < size; ++i) {
+                bytes[i] = swap ? p[size - 1 - i] : p[i];
+            }
+            switch (type) {
+                case PlyType::Int8:    { int8_t v;   std::memcpy(&v, bytes, 1); return v; }
+                case PlyType::UInt8:   { uint8_t v;  std::memcpy(&v, bytes, 1); return v; }
+                case PlyType::Int16:   { int16_t v;  std::memcpy(&v, bytes, 2); return v; }
+                case PlyType::UInt16:  { uint16_t v; std::memcpy(&v, bytes, 2); return v; }
+                case PlyType::Int32:   { int32_t v;  std::memcpy(&v, bytes, 4); return v; }
+                case PlyType::UInt32:  { uint32_t v; std::memcpy(&v, bytes, 4); return v; }
+                case PlyType::Float32: { float v;    std::memcpy(&v, bytes, 4); return v; }
+                default:               { double v;   std::memcpy(&v, bytes, 8); return v; }
+            }
+        }
+
+        static bool host_is_little_endian() {
+            const uint16_t probe = 1;
+            uint8_t first;
+            std::memcpy(&first, &probe, 1);
+            return first == 1;
+        }
+
+        static bool parse_ply_header(const char *text, const char *end, PlyHeader &header, std::string &error) {
+            const char *cursor = text;
+            bool has_format = false;
+            while (cursor < end) {
+                const char *eol = line_end(cursor, end);
+                std::vector<std::string> words;
+                for (const char *p = skip_space(cursor, eol); p < eol; p = skip_space(p, eol)) {
+                    const char *start = p;
+                    while (p < eol && !is_space(*p)) {
+                        ++p;
+                    }
+                    words.emplace_back(start, p);
+                }
+                cursor = eol + 1;
+                if (words.empty() || words[0] == "ply" || words[0] == "comment" || words[0] == "obj_info") {
+                    continue;
+                }
+
+                if (words[0] == "end_header") {
+                    header.body = std::min(cursor, end);
+                    break;
+                } else if (words[0] == "format" && words.size() >= 2) {
+                    has_format = true;
+                    if (words[1] == "ascii") {
+                        header.format = PlyHeader::Ascii;
+                    } else if (words[1] == "binary_little_endian") {
+                        header.format = PlyHeader::LittleEndian;
+                    } else if (words[1] == "binary_big_endian") {
+                        header.format = PlyHeader::BigEndian;
+                    } else {
+                        error = "unknown PLY format " + words[1];
+                        return false;
+                    }
+                } else if (words[0] == "element" && words.size() == 3) {
+                    PlyElement element;
+                    element.name = words[1];
+                    element.count = static_cast<size_t>(std::strtoull(words[2].c_str(), nullptr, 10));
+                    header.elements.push_back(element);
+                } else if (words[0] == "property" && !header.elements.empty()) {
+                    PlyProperty property;
+                    bool ok;
+                    if (words.size() == 5 && words[1] == "list") {
+                        property.list = true;
+                        property.name = words[4];
+                        ok = ply_type(words[2], property.count_type) && ply_type(words[3], property.type);
+                    } else {
+                        property.name = words.size() == 3 ? words[2] : "";
+                        ok = words.size() == 3 && ply_type(words[1], property.type);
+                    }
+                    if (!ok) {
+                        error = "unsupported PLY property: " + std::string(words.size() > 1 ? words[1] : "");
+                        return false;
+                    }
+                    header.elements.back().properties.push_back(property);
+                } else {
+                    error = "unexpected PLY header line starting with " + words[0];
+                    return false;
+                }
+            }
+            if (!header.body || !has_format) {
+                error = "incomplete PLY header";
+                return false;
+            }
+
+            for (size_t e = 0; e < header.elements.size(); ++e) {
+                if (header.elements[e].name == "vertex") {
+                    header.vertex = static_cast<int>(e);
+                } else if (header.elements[e].name == "face") {
+                    header.face = static_cast<int>(e);
+                }
+            }
+            if (header.vertex < 0 || header.face < 0) {
+                error = "a PLY mesh needs vertex and face elements";
+                return false;
+            }
+
+            const PlyElement &vertex = header.elements[header.vertex];
+            const char *position_names[3] = {"x", "y", "z"};
+            const char *normal_names[3] = {"nx", "ny", "nz"};
+            bool all_normals = true;
+            for (int k = 0; k < 3; ++k) {
+                header.position[k] = vertex.find(position_names[k]);
+                header.normal[k] = vertex.find(normal_names[k]);
+                if (header.position[k] < 0 || vertex.properties[header.position[k]].list) {
+                    error = "PLY vertices need x, y and z";
+                    return false;
+                }
+                all_normals = all_normals && header.normal[k] >= 0 && !vertex.properties[header.normal[k]].list;
+            }
+            if (!all_normals) {
+                header.normal[0] = header.normal[1] = header.normal[2] = -1;
+            }
+            if (!vertex.fixed_size()) {
+                error = "PLY vertices with list properties are not supported";
+                return false;
+            }
+
+            const PlyElement &face = header.elements[header.face];
+            header.indices = face.find("vertex_indices");
+            if (header.indices < 0) {
+                header.indices = face.find("vertex_index");
+            }
+            if (header.indices < 0 || !face.properties[header.indices].list) {
+                error = "PLY faces need a vertex_indices list";
+                return false;
+            }
+            return true;
+        }
+
+        static void set_ply_vertex(TriangleMesh &mesh, size_t v, const PlyHeader &header, const double *values) {
+            mesh.set_vertex(v, point3(static_cast<float>(values[header.position[0]]),
+                                      static_cast<float>(values[header.position[1]]),
+                                      static_cast<float>(values[header.position[2]])));
+            if (header.normal[0] >= 0) {
+                mesh.set_normal(v, vec3(static_cast<float>(values[header.normal[0]]),
+                                        static_cast<float>(values[header.normal[1]]),
+                                        static_cast<float>(values[header.normal[2]])));
+            }
+        }
+
+        bool load_ply(const MappedFile &file, TriangleMesh &mesh, ThreadPool &pool, std::string &error) {
+            const char *text = reinterpret_cast<const char*>(file.data());
+            const char *end = text + file.size();
+            PlyHeader header;
+            if (!parse_ply_header(text, end, header, error)) {
+                return false;
+            }
+            if (header.elements[header.vertex].count > no_normal) {
+                error = "more vertices than 32-bit indices can address";
+                return false;
+            }
+            if (header.format == PlyHeader::Ascii) {
+                _stats.format = "PLY (ascii)";
+                return load_ply_ascii(header, end, mesh, pool, error);
+            }
+            _stats.format = header.format == PlyHeader::LittleEndian ? "PLY (binary, little endian)"
+                                                                     : "PLY (binary, big endian)";
+            return load_ply_binary(header, reinterpret_cast<const uint8_t*>(end), mesh, pool, error);
+        }
+
+        // Binary PLY: fixed-size elements are located by arithmetic. Elements with lists, the
+        // faces among them, take one sequential pass that reads only the list lengths, noting
+        // where every block of faces starts; the blocks are then decoded in parallel.
+
+        static bool scan_list_element(PlyElement &element, const uint8_t *&p, const uint8_t *end, bool swap,
+                                      int indices, std::vector<FaceBlock> *blocks, size_t &triangles) {
+            for (size_t record = 0; record < element.count; ++record) {
+                if (blocks && record % faces_per_block == 0) {
+                    blocks->push_back(FaceBlock{p, record, triangles});
+                }
+                for (size_t k = 0; k < element.properties.size(); ++k) {
+                    const PlyProperty &property = element.properties[k];
+                    size_t length = 1;
+                    if (property.list) {
+                        if (static_cast<size_t>(end - p) < ply_size(property.count_type)) {
+                            return false;
+                        }
+                        double written = read_binary(p, property.count_type, swap);
+                        p += ply_size(property.count_type);
+                        length = written > 0 ? static_cast<size_t>(written) : 0;
+                        if (static_cast<int>(k) == indices) {
+                            if (length < 3) {
+                                return false;
+                            }
+                            triangles += length - 2;
+                        }
+                    }
+                    if (static_cast<size_t>(end - p) / ply_size(property.type) < length) {
+                        return false;
+                    }
+                    p += length * ply_size(property.type);
+                }
+            }
+            return true;
+        }
+
+        static void fill_ply_faces(const PlyElement &face, const FaceBlock &block, int indices, bool swap,
+                                   TriangleMesh &mesh) {
+            // The scan has already checked every length and bound.
+            const uint8_t *p = block.data;
+            size_t triangle = block.first_triangle;
+            size_t last = std::min(face.count, block.first_face + faces_per_block);
+            for (size_t record = block.first_face; record < last; ++record) {
+                for (size_t k = 0; k < face.properties.size(); ++k) {
+                    const PlyProperty &property = face.properties[k];
+                    size_t size = ply_size(property.type);
+                    if (!property.list) {
+                        p += size;
+                        continue;
+                    }
+                    size_t length = static_cast<size_t>(read_binary(p, property.count_type, swap));
+                    p += ply_size(property.count_type);
+                    if (static_cast<int>(k) == indices) {
+                        // Out-of-range (and negative) indices are caught by TriangleMesh::build().
+                        uint32_t first = static_cast<uint32_t>(static_cast<int64_t>(read_binary(p, property.type, swap)));
+                        uint32_t previous = static_cast<uint32_t>(static_cast<int64_t>(read_binary(p + size, property.type, swap)));
+                        for (size_t corner = 2; corner < length; ++corner) {
+                            uint32_t index = static_cast<uint32_t>(
+                                static_cast<int64_t>(read_binary(p + corner * size, property.type, swap)));
+                            mesh.set_triangle(triangle++, first, previous, index);
+                            previous = index;
+                        }
+                    }
+                    p += length * size;
+                }
+            }
+        }
+
+        bool load_ply_binary(PlyHeader &header, const uint8_t *end, TriangleMesh &mesh, ThreadPool &pool,
+                             std::string &error) {
+            bool swap = (header.format == PlyHeader::LittleEndian) != host_is_little_endian();
+            const uint8_t *p = reinterpret_cast<const uint8_t*>(header.body);
+            std::vector<FaceBlock> blocks;
+            size_t triangles = 0;
+
+            for (size_t e = 0; e < header.elements.size(); ++e) {
+                PlyElement &element = header.elements[e];
+                element.data = p;
+                if (element.fixed_size()) {
+                    size_t stride = 0;
+                    for (const auto &property : element.properties) {
+                        stride += ply_size(property.type);
+                    }
+                    if (stride > 0 && static_cast<size_t>(end - p) / stride < element.count) {
+                        error = "truncated " + element.name + " data";
+                        return false;
+                    }
+                    p += stride * element.count;
+                } else {
+                    bool is_face = static_cast<int>(e) == header.face;
+                    size_t element_triangles = 0;
+                    if (!scan_list_element(element, p, end, swap, is_face ? header.indices : -1,
+                                           is_face ? &blocks : nullptr, element_triangles)) {
+                        error = "truncated or malformed " + element.name + " data";
+                        return false;
+                    }
+                    if (is_face) {
+                        triangles = element_triangles;
+                    }
+                }
+            }
+
+            const PlyElement &vertex = header.elements[header.vertex];
+            const PlyElement &face = header.elements[header.face];
+            mesh.resize(vertex.count, triangles, header.normal[0] >= 0);
+
+            std::vector<size_t> offsets;
+            size_t stride = 0;
+            for (const auto &property : vertex.properties) {
+                offsets.push_back(stride);
+                stride += ply_size(property.type);
+            }
+            const size_t vertices_per_task = 1 << 16;
+            for (size_t begin = 0; begin < vertex.count; begin += vertices_per_task) {
+                size_t last = std::min(vertex.count, begin + vertices_per_task);
+                pool.submit([&header, &vertex, &offsets, &mesh, stride, swap, begin, last]() {
+                    std::vector<double> values(vertex.properties.size());
+                    for (size_t v = begin; v < last; ++v) {
+                        const uint8_t *record = vertex.data + v * stride;
+                        for (size_t k = 0; k < values.size(); ++k) {
+                            values[k] = read_binary(record + offsets[k], vertex.properties[k].type, swap);
+                        }
+                        set_ply_vertex(mesh, v, header, values.data());
+                    }
+                });
+            }
+            for (const FaceBlock &block : blocks) {
+                const FaceBlock *b = &block;
+                int indices = header.indices;
+                pool.submit([&face, &mesh, b, indices, swap]() { fill_ply_faces(face, *b, indices, swap, mesh); });
+            }
+            pool.wait();
+            return true;
+        }
+
+        // Ascii PLY: one record per line, so the body is split like the OBJ files. A first pass
+        // counts the records of every slice, which places each slice among the elements; a
+        // second counts the triangles of the face records, a third fills the mesh.
+
+        struct PlyChunk {
+            const char *begin;
+            const char *end;
+            size_t records = 0;
+            size_t first_record = 0;
+            size_t triangles = 0;
+            size_t first_triangle = 0;
+            size_t error_record = 0; // Absolute, 0-based
+            std::string error;
+        };
+
+        static void next_record(const char *&cursor, const char *end, const char *&record, const char *&record_end) {
+            // The next non-blank line, or record == end.
+            record = end;
+            while (cursor < end) {
+                const char *eol = line_end(cursor, end);
+                const char *p = skip_space(cursor, eol);
+                cursor = eol + 1;
+                if (p < eol) {
+                    record = p;
+                    record_end = eol;
+                    return;
+                }
+            }
+        }
+
+        static bool ascii_values(const char *&p, const char *end, size_t count, double *values) {
+            for (size_t k = 0; k < count; ++k) {
+                float value;
+                p = skip_space(p, end);
+                if (!parse_float(p, end, value)) {
+                    return false;
+                }
+                if (values) {
+                    values[k] = value;
+                }
+            }
+            return true;
+        }
+
+        static void process_ply_chunk(PlyChunk &chunk, const PlyHeader &header, const std::vector<size_t> &element_begin,
+                                      TriangleMesh *mesh) {
+            // Counts the chunk's triangles, or with a mesh, fills in its vertices and faces.
+            const PlyElement &vertex = header.elements[header.vertex];
+            const PlyElement &face = header.elements[header.face];
+            std::vector<double> values(vertex.properties.size());
+            size_t triangle = chunk.first_triangle;
+            const char *cursor = chunk.begin;
+
+            for (size_t record = chunk.first_record; ; ++record) {
+                const char *p, *end;
+                next_record(cursor, chunk.end, p, end);
+                if (p == chunk.end) {
+                    break;
+                }
+
+                bool ok = true;
+                if (record >= element_begin[header.vertex] && record < element_begin[header.vertex] + vertex.count) {
+                    ok = ascii_values(p, end, values.size(), values.data());
+                    if (ok && mesh) {
+                        set_ply_vertex(*mesh, record - element_begin[header.vertex], header, values.data());
+                    }
+                } else if (record >= element_begin[header.face] && record < element_begin[header.face] + face.count) {
+                    for (size_t k = 0; k < face.properties.size() && ok; ++k) {
+                        const PlyProperty &property = face.properties[k];
+                        if (!property.list) {
+                            ok = ascii_values(p, end, 1, nullptr);
+                            continue;
+                        }
+                        int64_t length;
+                        p = skip_space(p, end);
+                        ok = parse_int(p, end, length) && length >= 0;
+                        if (!ok) {
+                            break;
+                        }
+                        if (static_cast<int>(k) != header.indices) {
+                            ok = ascii_values(p, end, static_cast<size_t>(length), nullptr);
+                            continue;
+                        }
+                        if (length < 3) {
+                            ok = false;
+                            break;
+                        }
+                        if (!mesh) {
+                            chunk.triangles += length - 2;
+                            ok = ascii_values(p, end, static_cast<size_t>(length), nullptr);
+                            continue;
+                        }
+                        uint32_t first = 0, previous = 0;
+                        for (int64_t corner = 0; corner < length; ++corner) {
+                            int64_t index;
+                            p = skip_space(p, end);
+                            ok = parse_int(p, end, index);
+                            if (!ok) {
+                                break;
+                            }
+                            uint32_t current = static_cast<uint32_t>(index);
+                            if (corner == 0) {
+                                first = current;
+                            } else if (corner >= 2) {
+                                mesh->set_triangle(triangle++, first, previous, current);
+                            }
+                            previous = current;
+                        }
+                    }
+                }
+
+                if (!ok) {
+                    chunk.error_record = record;
+                    chunk.error = "malformed record";
+                    return;
+                }
+            }
+        }
+
+        bool load_ply_ascii(const PlyHeader &header, const char *text_end, TriangleMesh &mesh, ThreadPool &pool,
+                            std::string &error) {
+            std::vector<PlyChunk> chunks;
+            for (const TextSlice &slice : split_lines(header.body, text_end, pool.size())) {
+                chunks.emplace_back();
+                chunks.back().begin = slice.begin;
+                chunks.back().end = slice.end;
+            }
+
+            for (auto &chunk : chunks) {
+                PlyChunk *c = &chunk;
+                pool.submit([c]() {
+                    const char *cursor = c->begin, *record, *record_end;
+                    for (next_record(cursor, c->end, record, record_end); record != c->end;
+                         next_record(cursor, c->end, record, record_end)) {
+                        ++c->records;
+                    }
+                });
+            }
+            pool.wait();
+
+            std::vector<size_t> element_begin;
+            size_t records = 0;
+            for (const auto &element : header.elements) {
+                element_begin.push_back(records);
+                records += element.count;
+            }
+            size_t seen = 0;
+            for (auto &chunk : chunks) {
+                chunk.first_record = seen;
+                seen += chunk.records;
+            }
+            if (seen < records) {
+                error = "the file ends before its last " + header.elements.back().name;
+                return false;
+            }
+
+            for (int fill = 0; fill < 2; ++fill) {
+                TriangleMesh *target = fill ? &mesh : nullptr;
+                for (auto &chunk : chunks) {
+                    PlyChunk *c = &chunk;
+                    pool.submit([c, &header, &element_begin, target]() {
+                        process_ply_chunk(*c, header, element_begin, target);
+                    });
+                }
+                pool.wait();
+
+                size_t triangles = 0;
+                for (auto &chunk : chunks) {
+                    if (!chunk.error.empty()) {
+                        error = "record " + std::to_string(chunk.error_record + 1) + " after the header: " + chunk.error;
+                        return false;
+                    }
+                    chunk.first_triangle = triangles;
+                    triangles += chunk.triangles;
+                }
+                if (!fill) {
+                    mesh.resize(header.elements[header.vertex].count, triangles, header.normal[0] >= 0);
+                }
+            }
+            return true;
+        }
+};
+
+#endif // MESH_FILE_H
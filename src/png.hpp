@@ -0,0 +1,298 @@
+#ifndef PNG_H
+#define PNG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Self-contained PNG encoder for 8-bit RGB images, so writing PNGs needs no zlib.
+//
+// Rows are filtered with the usual minimum-sum-of-absolute-differences heuristic, then either
+// stored uncompressed or compressed with a fast single-probe LZ77 and the fixed Huffman code
+// from the deflate spec, which does well on the smooth gradients a renderer produces.
+
+inline uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length) {
+    static const struct CrcTable {
+        uint32_t entries[256];
+        CrcTable() {
+            for (uint32_t n = 0; n < 256; ++n) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; ++k) {
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                }
+                entries[n] = c;
+            }
+        }
+    } table;
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i) {
+        crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+inline uint32_t adler32(const uint8_t *data, size_t length) {
+    uint32_t a = 1, b = 0;
+    while (length > 0) {
+        // 5552 is the longest run that cannot overflow b before the modulo.
+        size_t block = length < 5552 ? length : 5552;
+        length -= block;
+        for (size_t i = 0; i < block; ++i) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+class BitWriter {
+    // Packs bits least significant first, as deflate expects.
+    private:
+        std::vector<uint8_t> &_out;
+        uint32_t _buffer;
+        int _bits;
+
+    public:
+        explicit BitWriter(std::vector<uint8_t> &out) : _out(out), _buffer(0), _bits(0) {}
+
+        void write(uint32_t value, int count) {
+            _buffer |= value << _bits;
+            _bits += count;
+            while (_bits >= 8) {
+                _out.push_back(static_cast<uint8_t>(_buffer));
+                _buffer >>= 8;
+                _bits -= 8;
+            }
+        }
+
+        void write_reversed(uint32_t code, int length) {
+            // Huffman codes are defined most significant bit first.
+            uint32_t reversed = 0;
+            for (int i = 0; i < length; ++i) {
+                reversed = (reversed << 1) | ((code >> i) & 1);
+            }
+            write(reversed, length);
+        }
+
+        void flush() {
+            if (_bits > 0) {
+                _out.push_back(static_cast<uint8_t>(_buffer));
+            }
+            _buffer = 0;
+            _bits = 0;
+        }
+};
+
+inline void deflate_fixed_literal(BitWriter &bits, int symbol) {
+    if (symbol < 144) {
+        bits.write_reversed(0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        bits.write_reversed(0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        bits.write_reversed(symbol - 256, 7);
+    } else {
+        bits.write_reversed(0xc0 + symbol - 280, 8);
+    }
+}
+
+inline void deflate_fixed_match(BitWriter &bits, int length, int distance) {
+    static const int length_base[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const int length_extra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const int distance_base[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static const int distance_extra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+    int l = 28;
+    while (length_base[l] > length) {
+        --l;
+    }
+    deflate_fixed_literal(bits, 257 + l);
+    bits.write(length - length_base[l], length_extra[l]);
+
+    int d = 29;
+    while (distance_base[d] > distance) {
+        --d;
+    }
+    bits.write_reversed(d, 5);
+    bits.write(distance - distance_base[d], distance_extra[d]);
+}
+
+inline std::vector<uint8_t> zlib_compress(const std::vector<uint8_t> &data, bool compress) {
+    std::vector<uint8_t> out;
+    out.reserve(compress ? data.size() / 2 + 64 : data.size() + data.size() / 65535 * 5 + 64);
+    out.push_back(0x78);
+    out.push_back(0x01);
+
+    if (!compress) {
+        // Stored blocks of at most 65535 bytes each.
+        size_t pos = 0;
+        do {
+            size_t block = data.size() - pos < 65535 ? data.size() - pos : 65535;
+            bool last = pos + block == data.size();
+            out.push_back(last ? 1 : 0);
+            out.push_back(static_cast<uint8_t>(block));
+            out.push_back(static_cast<uint8_t>(block >> 8));
+            out.push_back(static_cast<uint8_t>(~block));
+            out.push_back(static_cast<uint8_t>(~block >> 8));
+            out.insert(out.end(), data.begin() + pos, data.begin() + pos + block);
+            pos += block;
+        } while (pos < data.size());
+    } else {
+        // One fixed Huffman block. Each 3-byte hash remembers only its latest position.
+        const int hash_bits = 15;
+        const size_t window = 32768;
+        const size_t max_match = 258;
+        std::vector<int64_t> head(size_t(1) << hash_bits, -1);
+
+        BitWriter bits(out);
+        bits.write(1, 1); // BFINAL
+        bits.write(1, 2); // BTYPE = fixed Huffman
+
+        size_t pos = 0;
+        size_t size = data.size();
+        while (pos < size) {
+            size_t best_length = 0;
+            size_t best_distance = 0;
+
+            if (pos + 3 <= size) {
+                uint32_t key = (data[pos] << 16) | (data[pos + 1] << 8) | data[pos + 2];
+                uint32_t hash = (key * 2654435761u) >> (32 - hash_bits);
+                int64_t candidate = head[hash];
+                head[hash] = static_cast<int64_t>(pos);
+
+                if (candidate >= 0 && pos - candidate <= window) {
+                    size_t limit = size - pos < max_match ? size - pos : max_match;
+                    size_t length = 0;
+                    while (length < limit && data[candidate + length] == data[pos + length]) {
+                        ++length;
+                    }
+                    if (length >= 3) {
+                        best_length = length;
+                        best_distance = pos - candidate;
+                    }
+                }
+            }
+
+            if (best_length > 0) {
+                deflate_fixed_match(bits, static_cast<int>(best_length), static_cast<int>(best_distance));
+                pos += best_length;
+            } else {
+                deflate_fixed_literal(bits, data[pos]);
+                ++pos;
+            }
+        }
+        deflate_fixed_literal(bits, 256); // End of block
+        bits.flush();
+    }
+
+    uint32_t checksum = adler32(data.data(), data.size());
+    out.push_back(static_cast<uint8_t>(checksum >> 24));
+    out.push_back(static_cast<uint8_t>(checksum >> 16));
+    out.push_back(static_cast<uint8_t>(checksum >> 8));
+    out.push_back(static_cast<uint8_t>(checksum));
+    return out;
+}
+
+inline uint8_t png_paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return static_cast<uint8_t>(a);
+    if (pb <= pc) return static_cast<uint8_t>(b);
+    return static_cast<uint8_t>(c);
+}
+
+inline std::vector<uint8_t> png_filter_rows(const uint8_t *rgb, int width, int height) {
+    // Prefixes every row with the filter type that minimizes its sum of absolute residuals.
+    const int bpp = 3;
+    const size_t stride = static_cast<size_t>(width) * bpp;
+    std::vector<uint8_t> out;
+    out.reserve((stride + 1) * height);
+
+    std::vector<uint8_t> zero_row(stride, 0);
+    std::vector<uint8_t> candidate(stride);
+    std::vector<uint8_t> best(stride);
+
+    for (int y = 0; y < height; ++y) {
+        const uint8_t *row = rgb + y * stride;
+        const uint8_t *above = (y > 0) ? row - stride : zero_row.data();
+        long best_score = -1;
+        uint8_t best_filter = 0;
+
+        for (uint8_t filter = 0; filter < 5; ++filter) {
+            long score = 0;
+            for (size_t x = 0; x < stride; ++x) {
+                int a = (x >= bpp) ? row[x - bpp] : 0;
+                int b = above[x];
+                int c = (x >= bpp) ? above[x - bpp] : 0;
+                uint8_t predicted = 0;
+                switch (filter) {
+                    case 1: predicted = static_cast<uint8_t>(a); break;
+                    case 2: predicted = static_cast<uint8_t>(b); break;
+                    case 3: predicted = static_cast<uint8_t>((a + b) / 2); break;
+                    case 4: predicted = png_paeth(a, b, c); break;
+                }
+                uint8_t residual = static_cast<uint8_t>(row[x] - predicted);
+                candidate[x] = residual;
+                score += residual < 128 ? residual : 256 - residual;
+            }
+            if (best_score < 0 || score < best_score) {
+                best_score = score;
+                best_filter = filter;
+                best.swap(candidate);
+            }
+        }
+
+        out.push_back(best_filter);
+        out.insert(out.end(), best.begin(), best.end());
+    }
+    return out;
+}
+
+inline void png_write_chunk(std::ostream &out, const char *type, const std::vector<uint8_t> &data) {
+    uint8_t header[8] = {
+        static_cast<uint8_t>(data.size() >> 24), static_cast<uint8_t>(data.size() >> 16),
+        static_cast<uint8_t>(data.size() >> 8), static_cast<uint8_t>(data.size()),
+        static_cast<uint8_t>(type[0]), static_cast<uint8_t>(type[1]),
+        static_cast<uint8_t>(type[2]), static_cast<uint8_t>(type[3])};
+    out.write(reinterpret_cast<const char*>(header), 8);
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+
+    uint32_t crc = crc32_update(0, header + 4, 4);
+    crc = crc32_update(crc, data.data(), data.size());
+    uint8_t trailer[4] = {
+        static_cast<uint8_t>(crc >> 24), static_cast<uint8_t>(crc >> 16),
+        static_cast<uint8_t>(crc >> 8), static_cast<uint8_t>(crc)};
+    out.write(reinterpret_cast<const char*>(trailer), 4);
+}
+
+inline void write_png(std::ostream &out, const uint8_t *rgb, int width, int height, bool compress = true) {
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    out.write(reinterpret_cast<const char*>(signature), 8);
+
+    std::vector<uint8_t> ihdr = {
+        static_cast<uint8_t>(width >> 24), static_cast<uint8_t>(width >> 16),
+        static_cast<uint8_t>(width >> 8), static_cast<uint8_t>(width),
+        static_cast<uint8_t>(height >> 24), static_cast<uint8_t>(height >> 16),
+        static_cast<uint8_t>(height >> 8), static_cast<uint8_t>(height),
+        8, // Bit depth
+        2, // Color type: RGB
+        0, 0, 0};
+    png_write_chunk(out, "IHDR", ihdr);
+    png_write_chunk(out, "IDAT", zlib_compress(png_filter_rows(rgb, width, height), compress));
+    png_write_chunk(out, "IEND", std::vector<uint8_t>());
+}
+
+#endif // PNG_H
@@ -0,0 +1,252 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "camera.hpp"
+#include "framebuffer.hpp"
+#include "hittable.hpp"
+#include "instrument.hpp"
+#include "thread_pool.hpp"
+#include "tile.hpp"
+
+struct PreviewPass {
+    int    samples_per_pixel = 0; // Samples per pixel once the pass is done, 0 for the coarse pass
+    double seconds = 0;           // Time the pass took
+    double latency_seconds = 0;   // From the start of the render until the pass was published
+    float  noise = 0;             // Mean relative error over the pixels, 95% confidence
+    bool   complete = true;       // Every pixel got the pass's samples before the deadline
+};
+
+struct PreviewStats {
+    std::vector<PreviewPass> passes;
+    const char *stopped_by = ""; // What ended the render
+};
+
+inline std::ostream& operator<<(std::ostream &out, const PreviewStats &stats) {
+    out << "Progressive: " << stats.passes.size() << " passes, stopped by " << stats.stopped_by;
+    for (size_t k = 0; k < stats.passes.size(); ++k) {
+        const PreviewPass &pass = stats.passes[k];
+        out << "\n  ";
+        if (pass.samples_per_pixel == 0) {
+            out << "coarse";
+        } else {
+            out << pass.samples_per_pixel << " spp";
+        }
+        out << ": " << pass.seconds << "s, published at " << pass.latency_seconds << "s";
+        if (pass.samples_per_pixel > 0) {
+            out << ", noise " << pass.noise;
+        }
+        if (!pass.complete) {
+            out << " (cut short by the deadline)";
+        }
+    }
+    return out;
+}
+
+// Look-dev alternative to Camera::render_frame that shows an image early and improves it.
+//
+// A coarse pass first traces one sample per coarse_scale x coarse_scale block of pixels and
+// fills the block with it. Then every pass takes as many samples per pixel again as the
+// previous ones did (1, 2, 4, ...) up to the camera's samples_per_pixel, and each finished
+// pass is handed to publish. The render stops early once the image's noise is under
+// noise_target or at the time_budget deadline, which is checked between tile rows, so a pass
+// cut short by it leaves some pixels with fewer samples than others. The samples are the
+// ones render_frame would take, so a render left to finish gives the same image, up to the
+// rounding of summing them in passes.
+class ProgressiveRenderer {
+    public:
+        using Publish = std::function<void(const Framebuffer&, const PreviewPass&)>;
+
+        float time_budget = 0;  // Seconds until the render stops, 0 has no deadline
+        float noise_target = 0; // Mean relative error at which the render stops, 0 has none
+        int   coarse_scale = 8; // Width and height of the blocks of the coarse pass
+
+        explicit ProgressiveRenderer(Camera &camera) : _camera(camera) {}
+
+        Framebuffer render_frame(const IHittable &world, const Publish &publish) {
+            Camera &cam = _camera;
+            RT_TRACE_SCOPE("frame", "width", cam.image_width);
+            cam.initialize();
+
+            std::clog << "width: " << cam.image_width << " height: " << cam.image_height << std::endl;
+
+            Framebuffer image(cam.image_width, cam.image_height);
+            std::vector<Tile> tiles = make_tiles(cam.image_width, cam.image_height, cam.tile_size);
+            cam._stats = PathStats(cam.max_depth);
+            _stats = PreviewStats();
+
+            _start = std::chrono::steady_clock::now();
+            _deadline = _start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(time_budget));
+            {
+                ThreadPool pool(cam.thread_count);
+                std::clog << "Rendering " << tiles.size() << " tiles on " << pool.size() << " threads, progressively"
+                          << std::endl;
+
+                PreviewPass coarse;
+                Framebuffer preview = coarse_pass(world, tiles, pool);
+                coarse.seconds = seconds_since(_start);
+                finish_pass(preview, coarse, publish);
+
+                _stats.stopped_by = "samples_per_pixel";
+                int done = 0;
+                while (done < cam.samples_per_pixel) {
+                    if (past_deadline()) {
+                        _stats.stopped_by = "the time budget";
+                        break;
+                    }
+                    int target = std::min(std::max(2 * done, 1), cam.samples_per_pixel);
+                    auto pass_start = std::chrono::steady_clock::now();
+                    PreviewPass pass;
+                    pass.samples_per_pixel = target;
+                    pass.complete = sample_pass(world, tiles, pool, image, done, target - done);
+                    pass.seconds = seconds_since(pass_start);
+                    pass.noise = mean_noise(image);
+                    finish_pass(image, pass, publish);
+                    done = target;
+
+                    if (!pass.complete) {
+                        _stats.stopped_by = "the time budget";
+                        break;
+                    }
+                    if (noise_target > 0 && pass.noise <= noise_target) {
+                        _stats.stopped_by = "the noise target";
+                        break;
+                    }
+                }
+            }
+            double elapsed = seconds_since(_start);
+
+            std::clog << "Done in " << elapsed << "s, "
+                      << cam._stats.rays << " rays, "
+                      << cam._stats.rays / elapsed / 1e6 << " Mrays/s\n";
+            std::clog << cam._stats << "\n";
+            std::clog << _stats << "\n";
+
+            return image;
+        }
+
+        const PreviewStats& stats() const { return _stats; }
+
+    private:
+        Camera &_camera;
+        PreviewStats _stats;
+        std::chrono::steady_clock::time_point _start;
+        std::chrono::steady_clock::time_point _deadline;
+
+        bool past_deadline() const {
+            return time_budget > 0 && std::chrono::steady_clock::now() >= _deadline;
+        }
+
+        Framebuffer coarse_pass(const IHittable &world, const std::vector<Tile> &tiles, ThreadPool &pool) {
+            // The first sample of the pixel at the centre of each block, spread over the block.
+            Camera &cam = _camera;
+            Framebuffer preview(cam.image_width, cam.image_height);
+            int scale = std::max(coarse_scale, 1);
+            std::mutex stats_mutex;
+            for (const Tile &tile : tiles) {
+                pool.submit([this, &cam, &world, &preview, &stats_mutex, &tile, scale]() {
+                    RT_TRACE_TILE(tile.id);
+                    PathStats tile_stats(cam.max_depth);
+                    for (int y0 = tile.y0; y0 < tile.y1; y0 += scale) {
+                        for (int x0 = tile.x0; x0 < tile.x1; x0 += scale) {
+                            int x1 = std::min(x0 + scale, tile.x1);
+                            int y1 = std::min(y0 + scale, tile.y1);
+                            int i = (x0 + x1) / 2;
+                            int j = (y0 + y1) / 2;
+                            Framebuffer pixel(1, 1);
+                            cam.render_tile(Tile{tile.id, i, j, i + 1, j + 1}, world, pixel, 0, 1, nullptr,
+                                            tile_stats, nullptr, i, j);
+                            for (int y = y0; y < y1; ++y) {
+                                for (int x = x0; x < x1; ++x) {
+                                    preview.add_samples(x, y, pixel.sum(0, 0), 1);
+                                }
+                            }
+                        }
+                    }
+                    std::lock_guard<std::mutex> lock(stats_mutex);
+                    cam._stats.merge(tile_stats);
+                });
+            }
+            pool.wait();
+            return preview;
+        }
+
+        bool sample_pass(const IHittable &world, const std::vector<Tile> &tiles, ThreadPool &pool,
+                         Framebuffer &image, int first_sample, int sample_count) {
+            // Samples [first_sample, first_sample + sample_count) of every pixel, a tile row at
+            // a time until the deadline. Returns whether every row was done.
+            Camera &cam = _camera;
+            std::mutex stats_mutex;
+            bool complete = true;
+            for (const Tile &tile : tiles) {
+                pool.submit([this, &cam, &world, &image, &stats_mutex, &tile, &complete, first_sample,
+                             sample_count]() {
+                    RT_TRACE_TILE(tile.id);
+                    PathStats tile_stats(cam.max_depth);
+                    bool cut = false;
+                    for (int j = tile.y0; j < tile.y1; ++j) {
+                        if (past_deadline()) {
+                            cut = true;
+                            break;
+                        }
+                        cam.render_tile(Tile{tile.id, tile.x0, j, tile.x1, j + 1}, world, image, first_sample,
+                                        sample_count, nullptr, tile_stats);
+                    }
+                    std::lock_guard<std::mutex> lock(stats_mutex);
+                    cam._stats.merge(tile_stats);
+                    complete = complete && !cut;
+                });
+            }
+            pool.wait();
+            return complete;
+        }
+
+        float mean_noise(const Framebuffer &image) const {
+            // Camera::has_converged's error measure, averaged over the pixels. A pixel with fewer
+            // than two samples has no variance estimate yet and counts as 100% error.
+            double total = 0;
+            for (int j = 0; j < image.height(); ++j) {
+                for (int i = 0; i < image.width(); ++i) {
+                    uint32_t count = image.samples(i, j);
+                    if (count < 2) {
+                        total += 1;
+                        continue;
+                    }
+                    float mean = luminance(image.sum(i, j)) / count;
+                    float error = 1.96f * sqrtf(image.luminance_variance(i, j) / count);
+                    total += error / std::max(mean, 0.01f);
+                }
+            }
+            return static_cast<float>(total / (static_cast<double>(image.width()) * image.height()));
+        }
+
+        void finish_pass(const Framebuffer &image, PreviewPass &pass, const Publish &publish) {
+            pass.latency_seconds = seconds_since(_start);
+            if (publish) {
+                publish(image, pass);
+            }
+            _stats.passes.push_back(pass);
+            std::clog << "Pass " << _stats.passes.size() - 1 << ": "
+                      << (pass.samples_per_pixel == 0 ? std::string("coarse")
+                                                      : std::to_string(pass.samples_per_pixel) + " spp")
+                      << " published at " << pass.latency_seconds << "s" << std::endl;
+        }
+
+        static double seconds_since(std::chrono::steady_clock::time_point start) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            return elapsed.count();
+        }
+};
+
+#endif // PROGRESSIVE_H
@@ -0,0 +1,269 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Random number generation.
+//
+// Every thread owns one generator, reached through thread_rng(). The renderer reseeds it at
+// the start of each camera sample from (render seed, pixel, sample), so any single pixel can be
+// re-rendered on its own and gets exactly the same result as in the full frame, no matter
+// which thread ran it.
+//
+// The generator type is picked at build time: PCG32 by default, xoshiro128+ when
+// RT_RNG_XOSHIRO128PLUS is defined. Both expose the same seed()/next_uint()/next_float().
+//
+// random_floats() draws in bulk from a second, wide generator of the same kind: eight lanes
+// stepped in lockstep, filling a SIMD register of floats per step. seed_sample() seeds it
+// along with the scalar one, so bulk draws are just as reproducible per pixel.
+
+inline uint64_t splitmix64(uint64_t &state) {
+    // Used to expand a single seed into well mixed generator state.
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+inline float uint_to_float(uint32_t x) {
+    // Maps the top 24 bits to a float in [0,1). Exact, so it never rounds up to 1.
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+class Pcg32 {
+    private:
+        uint64_t _state;
+        uint64_t _inc;
+
+    public:
+        Pcg32() { seed(0x853c49e6748fea9bull); }
+
+        void seed(uint64_t seed, uint64_t stream = 0xda3e39cb94b95bdbull) {
+            _state = 0;
+            _inc = (stream << 1) | 1;
+            next_uint();
+            _state += seed;
+            next_uint();
+        }
+
+        uint32_t next_uint() {
+            uint64_t old_state = _state;
+            _state = old_state * 6364136223846793005ull + _inc;
+            uint32_t xorshifted = static_cast<uint32_t>(((old_state >> 18) ^ old_state) >> 27);
+            uint32_t rot = static_cast<uint32_t>(old_state >> 59);
+            return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+        }
+
+        float next_float() { return uint_to_float(next_uint()); }
+
+        uint64_t state() const { return _state; }
+        uint64_t increment() const { return _inc; }
+};
+
+class Xoshiro128Plus {
+    private:
+        uint32_t _s[4];
+
+        static uint32_t rotl(uint32_t x, int k) { return (x << k) | (x >> (32 - k)); }
+
+    public:
+        Xoshiro128Plus() { seed(0x853c49e6748fea9bull); }
+
+        void seed(uint64_t seed, uint64_t stream = 0) {
+            uint64_t sm = seed ^ (stream * 0xd1342543de82ef95ull);
+            uint64_t a = splitmix64(sm);
+            uint64_t b = splitmix64(sm);
+            _s[0] = static_cast<uint32_t>(a);
+            _s[1] = static_cast<uint32_t>(a >> 32);
+            _s[2] = static_cast<uint32_t>(b);
+            _s[3] = static_cast<uint32_t>(b >> 32) | 1; // The state must not be all zero
+        }
+
+        uint32_t next_uint() {
+            uint32_t result = _s[0] + _s[3];
+            uint32_t t = _s[1] << 9;
+
+            _s[2] ^= _s[0];
+            _s[3] ^= _s[1];
+            _s[1] ^= _s[2];
+            _s[0] ^= _s[3];
+            _s[2] ^= t;
+            _s[3] = rotl(_s[3], 11);
+
+            return result;
+        }
+
+        float next_float() { return uint_to_float(next_uint()); }
+};
+
+template <typename Wide>
+inline void fill_blocks(Wide &rng, float *out, size_t count) {
+    // Fills out[0..count) from a wide generator, a full block at a time.
+    size_t i = 0;
+    for (; i + Wide::width <= count; i += Wide::width) {
+        rng.next_floats(out + i);
+    }
+    if (i < count) {
+        float tail[Wide::width];
+        rng.next_floats(tail);
+        for (size_t k = 0; k < count - i; ++k) {
+            out[i + k] = tail[k];
+        }
+    }
+}
+
+// Eight independent PCG32 lanes stepped in lockstep, each on its own stream. The lane loops
+// are plain integer code the compiler vectorizes (the rotate is a variable shift per lane).
+class Pcg32Wide {
+    public:
+        static const int width = 8;
+
+    private:
+        alignas(64) uint64_t _state[width];
+        alignas(64) uint64_t _inc[width];
+
+    public:
+        Pcg32Wide() { seed(0x853c49e6748fea9bull); }
+
+        void seed(uint64_t seed, uint64_t stream = 0) {
+            uint64_t sm = seed ^ (stream * 0xd1342543de82ef95ull);
+            for (int lane = 0; lane < width; ++lane) {
+                Pcg32 rng;
+                uint64_t lane_seed = splitmix64(sm);
+                rng.seed(lane_seed, splitmix64(sm));
+                _state[lane] = rng.state();
+                _inc[lane] = rng.increment();
+            }
+        }
+
+        void next_floats(float *out) {
+            // Writes `width` floats in [0,1) to out.
+            for (int lane = 0; lane < width; ++lane) {
+                uint64_t old_state = _state[lane];
+                _state[lane] = old_state * 6364136223846793005ull + _inc[lane];
+                uint32_t xorshifted = static_cast<uint32_t>(((old_state >> 18) ^ old_state) >> 27);
+                uint32_t rot = static_cast<uint32_t>(old_state >> 59);
+                out[lane] = uint_to_float((xorshifted >> rot) | (xorshifted << ((32 - rot) & 31)));
+            }
+        }
+
+        void fill(float *out, size_t count) { fill_blocks(*this, out, count); }
+};
+
+// Eight independent xoshiro128+ lanes stepped in lockstep. The lane loops are plain 32-bit
+// integer code, so the compiler turns each step into a handful of SSE/AVX2 instructions.
+class Xoshiro128PlusWide {
+    public:
+        static const int width = 8;
+
+    private:
+        alignas(32) uint32_t _s0[width];
+        alignas(32) uint32_t _s1[width];
+        alignas(32) uint32_t _s2[width];
+        alignas(32) uint32_t _s3[width];
+
+    public:
+        Xoshiro128PlusWide() { seed(0x853c49e6748fea9bull); }
+
+        void seed(uint64_t seed, uint64_t stream = 0) {
+            uint64_t sm = seed ^ (stream * 0xd1342543de82ef95ull);
+            for (int lane = 0; lane < width; ++lane) {
+                uint64_t a = splitmix64(sm);
+                uint64_t b = splitmix64(sm);
+                _s0[lane] = static_cast<uint32_t>(a);
+                _s1[lane] = static_cast<uint32_t>(a >> 32);
+                _s2[lane] = static_cast<uint32_t>(b);
+                _s3[lane] = static_cast<uint32_t>(b >> 32) | 1;
+            }
+        }
+
+        void next_floats(float *out) {
+            // Writes `width` floats in [0,1) to out.
+            for (int lane = 0; lane < width; ++lane) {
+                uint32_t result = _s0[lane] + _s3[lane];
+                uint32_t t = _s1[lane] << 9;
+
+                _s2[lane] ^= _s0[lane];
+                _s3[lane] ^= _s1[lane];
+                _s1[lane] ^= _s2[lane];
+                _s0[lane] ^= _s3[lane];
+                _s2[lane] ^= t;
+                _s3[lane] = (_s3[lane] << 11) | (_s3[lane] >> 21);
+
+                out[lane] = uint_to_float(result);
+            }
+        }
+
+        void fill(float *out, size_t count) { fill_blocks(*this, out, count); }
+};
+
+#ifdef RT_RNG_XOSHIRO128PLUS
+using Rng = Xoshiro128Plus;
+using RngWide = Xoshiro128PlusWide;
+#else
+using Rng = Pcg32;
+using RngWide = Pcg32Wide;
+#endif
+
+inline Rng& thread_rng() {
+    static thread_local Rng rng;
+    return rng;
+}
+
+struct WideRngState {
+    RngWide rng;
+    uint64_t seed = 0;
+    bool pending = false; // seed_sample() has run since the lanes were last seeded
+};
+
+inline WideRngState& thread_wide_rng_state() {
+    static thread_local WideRngState state;
+    return state;
+}
+
+inline RngWide& thread_rng_wide() {
+    // This thread's wide generator. seed_sample() only records the seed; the lanes are seeded
+    // here on first use, so samples that never draw in bulk do not pay for it. Stream 1 keeps
+    // the lanes apart from thread_rng(), which gets the same seed.
+    WideRngState &state = thread_wide_rng_state();
+    if (state.pending) {
+        state.rng.seed(state.seed, 1);
+        state.pending = false;
+    }
+    return state.rng;
+}
+
+inline uint64_t sample_seed(uint64_t seed, uint64_t pixel_index, uint64_t sample_index) {
+    // Hashes a (render seed, pixel, sample) triple into a generator seed.
+    uint64_t state = seed;
+    state = splitmix64(state) ^ pixel_index;
+    state = splitmix64(state) ^ sample_index;
+    return splitmix64(state);
+}
+
+inline void seed_sample(uint64_t seed, uint64_t pixel_index, uint64_t sample_index) {
+    // Puts this thread's generators into the state owned by one camera sample of one pixel.
+    uint64_t state = sample_seed(seed, pixel_index, sample_index);
+    thread_rng().seed(state);
+    WideRngState &wide = thread_wide_rng_state();
+    wide.seed = state;
+    wide.pending = true;
+}
+
+inline float random_float() {
+    // Returns a random real in [0,1).
+    return thread_rng().next_float();
+}
+
+inline float random_float(float min, float max) {
+    // Returns a random real in [min,max).
+    return min + (max - min) * random_float();
+}
+
+inline void random_floats(float *out, size_t count) {
+    // Fills out[0..count) with random reals in [0,1), drawn SIMD-width blocks at a time.
+    thread_rng_wide().fill(out, count);
+}
+
+#endif // RANDOM_H
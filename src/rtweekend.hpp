@@ -1,26 +1,15 @@
 #ifndef RTWEEKEND_H
 #define RTWEEKEND_H
 
-#include <cstdlib>
 #include <limits>
 
 // Constants
 const float infinity = std::numeric_limits<float>::infinity();
-const float pi = 3.1415926535897932385;
+const float pi = 3.1415926535897932385f;
 
 // Utility Functions
 inline float degrees_to_radians(float degrees) {
-    return degrees * pi / 180.0;
-}
-
-inline float random_float() {
-    // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0f);
-}
-
-inline float random_float(float min, float max) {
-    // Returns a random real in [min,max).
-    return min + (max - min) * random_float();
+    return degrees * pi / 180.0f;
 }
 
 #endif // RTWEEKEND_H
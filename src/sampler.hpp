@@ -0,0 +1,453 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "random.hpp"
+#include "vec3.hpp"
+
+// Samplers: the values a camera sample uses for its random decisions, keyed by (pixel,
+// sample index, dimension). A dimension is one decision along the path, a 2D point or a
+// single number: the pixel position is dimension 0, the lens position 1, and bounce n scatters
+// with dimension n + 1. Keying by dimension instead of drawing in order keeps the samples
+// of one pixel lined up even when their paths branch differently.
+//
+// Random samples are drawn in order from the thread's generators, the classic way, so they
+// follow the path rather than the dimension. Independent samples are plain hashes. The
+// others spread the samples of a pixel evenly over each dimension, so the error falls
+// faster than the Monte Carlo rate:
+//   stratified  jittered strata in a shuffled order (Kensler's permutation)
+//   sobol       Owen-scrambled Sobol (0,2)-sequence, padded per dimension (Burley 2020)
+//   blue-noise  one Sobol set shared by every pixel, toroidally shifted by a blue-noise mask,
+//               so the leftover error looks like fine-grained noise rather than blotches
+
+enum class SamplerType { Random, Independent, Stratified, Sobol, BlueNoise };
+
+inline bool parse_sampler_type(const std::string &name, SamplerType &type) {
+    if (name == "random") {
+        type = SamplerType::Random;
+    } else if (name == "independent") {
+        type = SamplerType::Independent;
+    } else if (name == "stratified") {
+        type = SamplerType::Stratified;
+    } else if (name == "sobol") {
+        type = SamplerType::Sobol;
+    } else if (name == "blue-noise") {
+        type = SamplerType::BlueNoise;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline uint32_t sample_hash(uint64_t a, uint64_t b, uint64_t c = 0, uint64_t d = 0) {
+    uint64_t state = a;
+    state = splitmix64(state) ^ b;
+    state = splitmix64(state) ^ c;
+    state = splitmix64(state) ^ d;
+    return static_cast<uint32_t>(splitmix64(state) >> 32);
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x & 0xaaaaaaaau) >> 1) | ((x & 0x55555555u) << 1);
+    x = ((x & 0xccccccccu) >> 2) | ((x & 0x33333333u) << 2);
+    x = ((x & 0xf0f0f0f0u) >> 4) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x & 0xff00ff00u) >> 8) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    // Owen scrambling of the bits of x, most significant first, by Laine and Karras' hash
+    // on the reversed bits.
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+inline uint32_t sobol_dimension_1(uint32_t index) {
+    // Second Sobol dimension; the first is reverse_bits(index). The generator matrix is linear
+    // over the bits of the index, so it is applied a byte at a time from four tables.
+    struct Tables {
+        uint32_t bytes[4][256];
+
+        Tables() {
+            uint32_t columns[32];
+            columns[0] = 1u << 31;
+            for (int bit = 1; bit < 32; ++bit) {
+                columns[bit] = columns[bit - 1] ^ (columns[bit - 1] >> 1);
+            }
+            for (int b = 0; b < 4; ++b) {
+                for (uint32_t value = 0; value < 256; ++value) {
+                    uint32_t result = 0;
+                    for (int bit = 0; bit < 8; ++bit) {
+                        if (value & (1u << bit)) {
+                            result ^= columns[8 * b + bit];
+                        }
+                    }
+                    bytes[b][value] = result;
+                }
+            }
+        }
+    };
+    static const Tables tables;
+    return tables.bytes[0][index & 0xff] ^ tables.bytes[1][(index >> 8) & 0xff]
+         ^ tables.bytes[2][(index >> 16) & 0xff] ^ tables.bytes[3][index >> 24];
+}
+
+inline uint32_t permute_index(uint32_t i, uint32_t length, uint32_t p) {
+    // Element i of a random permutation of [0, length) picked by p (Kensler, "Correlated
+    // Multi-Jittered Sampling"). Walks the cycle until it lands inside the range.
+    uint32_t w = length - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p; i *= 0xe170893du;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8; i *= 0x0929eb3fu;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1; i *= 1 | p >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11; i *= 0x74dcb303u;
+        i ^= (i & w) >> 2; i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2; i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= length);
+    return (i + p) % length;
+}
+
+class ISampler {
+    public:
+        virtual ~ISampler() = default;
+
+        virtual float get_1d(uint64_t pixel, uint32_t sample, uint32_t dimension) const = 0;
+        virtual void get_2d(uint64_t pixel, uint32_t sample, uint32_t dimension, float &u, float &v) const = 0;
+};
+
+class IndependentSampler : public ISampler {
+    public:
+        explicit IndependentSampler(uint64_t seed) : _seed(seed) {}
+
+        float get_1d(uint64_t pixel, uint32_t sample, uint32_t dimension) const override {
+            return uint_to_float(sample_hash(_seed, pixel, sample, dimension));
+        }
+
+        void get_2d(uint64_t pixel, uint32_t sample, uint32_t dimension, float &u, float &v) const override {
+            u = uint_to_float(sample_hash(_seed, pixel, sample, 2 * uint64_t(dimension)));
+            v = uint_to_float(sample_hash(_seed, pixel, sample, 2 * uint64_t(dimension) + 1));
+        }
+
+    private:
+        uint64_t _seed;
+};
+
+class StratifiedSampler : public ISampler {
+    // Splits each dimension into as many strata as there are samples per pixel (a grid of
+    // nearly square cells in 2D). Every pixel and dimension visits the strata in its own
+    // order, and samples past the count start another round.
+    public:
+        StratifiedSampler(uint64_t seed, int samples_per_pixel)
+            : _seed(seed), _count(static_cast<uint32_t>(samples_per_pixel < 1 ? 1 : samples_per_pixel)) {
+            _nx = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(_count))));
+            _ny = (_count + _nx - 1) / _nx;
+        }
+
+        float get_1d(uint64_t pixel, uint32_t sample, uint32_t dimension) const override {
+            uint32_t key = sample_hash(_seed, pixel, dimension, 1);
+            uint32_t stratum = permute_index(sample % _count, _count, key + sample / _count);
+            float jitter = uint_to_float(sample_hash(_seed, pixel, sample, dimension));
+            return (stratum + jitter) / _count;
+        }
+
+        void get_2d(uint64_t pixel, uint32_t sample, uint32_t dimension, float &u, float &v) const override {
+            uint32_t cells = _nx * _ny;
+            uint32_t key = sample_hash(_seed, pixel, dimension, 2);
+            uint32_t cell = permute_index(sample % cells, cells, key + sample / cells);
+            u = ((cell % _nx) + uint_to_float(sample_hash(_seed, pixel, sample, 2 * uint64_t(dimension)))) / _nx;
+            v = ((cell / _nx) + uint_to_float(sample_hash(_seed, pixel, sample, 2 * uint64_t(dimension) + 1))) / _ny;
+        }
+
+    private:
+        uint64_t _seed;
+        uint32_t _count;
+        uint32_t _nx, _ny;
+};
+
+class SobolSampler : public ISampler {
+    public:
+        explicit SobolSampler(uint64_t seed) : _seed(seed) {}
+
+        float get_1d(uint64_t pixel, uint32_t sample, uint32_t dimension) const override {
+            uint32_t key = sample_hash(_seed, pixel, dimension, 1);
+            uint32_t index = nested_uniform_scramble(sample, key);
+            return uint_to_float(nested_uniform_scramble(reverse_bits(index), key ^ 0x5bd1e995u));
+        }
+
+        void get_2d(uint64_t pixel, uint32_t sample, uint32_t dimension, float &u, float &v) const override {
+            owen_sobol_2d(sample_hash(_seed, pixel, dimension, 2), sample, u, v);
+        }
+
+        static void owen_sobol_2d(uint32_t key, uint32_t sample, float &u, float &v) {
+            // The index is shuffled first (Burley's "shuffled scrambled Sobol"), so pixels do not
+            // share the order of their points, while every power-of-two prefix stays stratified.
+            uint32_t index = nested_uniform_scramble(sample, key);
+            u = uint_to_float(nested_uniform_scramble(reverse_bits(index), key ^ 0x5bd1e995u));
+            v = uint_to_float(nested_uniform_scramble(sobol_dimension_1(index), key ^ 0x27d4eb2du));
+        }
+
+    private:
+        uint64_t _seed;
+};
+
+class BlueNoiseSampler : public ISampler {
+    public:
+        static const int mask_size = 64;
+
+        BlueNoiseSampler(uint64_t seed, int image_width)
+            : _seed(seed), _width(static_cast<uint64_t>(image_width < 1 ? 1 : image_width)), _mask(&mask()) {}
+
+        float get_1d(uint64_t pixel, uint32_t sample, uint32_t dimension) const override {
+            uint32_t key = sample_hash(_seed, dimension, 1);
+            uint32_t index = nested_uniform_scramble(sample, key);
+            float x = uint_to_float(nested_uniform_scramble(reverse_bits(index), key ^ 0x5bd1e995u));
+            return wrap(x + shift(pixel, dimension, 0));
+        }
+
+        void get_2d(uint64_t pixel, uint32_t sample, uint32_t dimension, float &u, float &v) const override {
+            SobolSampler::owen_sobol_2d(sample_hash(_seed, dimension, 2), sample, u, v);
+            u = wrap(u + shift(pixel, dimension, 0));
+            v = wrap(v + shift(pixel, dimension, 1));
+        }
+
+        static const std::vector<float>& mask() {
+            // Built once on first use.
+            static const std::vector<float> values = void_and_cluster(mask_size);
+            return values;
+        }
+
+    private:
+        uint64_t _seed;
+        uint64_t _width;
+        const std::vector<float> *_mask;
+
+        static float wrap(float x) {
+            // Cranley-Patterson rotation back into [0,1).
+            x -= std::floor(x);
+            return x < 1.0f ? x : 0.0f;
+        }
+
+        float shift(uint64_t pixel, uint32_t dimension, uint32_t axis) const {
+            // The mask value under the pixel, with the mask offset differently for every
+            // dimension and axis so they do not correlate.
+            uint32_t offset = sample_hash(_seed, dimension, axis, 3);
+            uint64_t x = pixel % _width + (offset & 0xffff);
+            uint64_t y = pixel / _width + (offset >> 16);
+            return (*_mask)[(y % mask_size) * mask_size + (x % mask_size)];
+        }
+
+        static std::vector<float> void_and_cluster(int size) {
+            // Ulichney's void-and-cluster method: ranks every cell of a toroidal size x size
+            // grid so that the cells below any threshold are evenly spread. The ranks, scaled
+            // to [0,1), are the mask.
+            const int n = size * size;
+            const float sigma = 1.5f;
+
+            // Gaussian energy a set cell adds at every offset, wrapping around.
+            std::vector<float> kernel(n);
+            for (int dy = 0; dy < size; ++dy) {
+                for (int dx = 0; dx < size; ++dx) {
+                    int wx = std::min(dx, size - dx);
+                    int wy = std::min(dy, size - dy);
+                    kernel[dy * size + dx] = std::exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+                }
+            }
+
+            std::vector<uint8_t> pattern(n, 0);
+            std::vector<float> energy(n, 0);
+            auto toggle = [&](int cell, bool on) {
+                if (cell < 0) {
+                    return;
+                }
+                pattern[cell] = on;
+                int cx = cell % size, cy = cell / size;
+                float sign = on ? 1.0f : -1.0f;
+                for (int y = 0; y < size; ++y) {
+                    for (int x = 0; x < size; ++x) {
+                        int dx = (x - cx + size) % size, dy = (y - cy + size) % size;
+                        energy[y * size + x] += sign * kernel[dy * size + dx];
+                    }
+                }
+            };
+            auto extreme = [&](bool set, bool highest) {
+                // Tightest cluster among the set cells or largest void among the empty ones.
+                int best = -1;
+                for (int cell = 0; cell < n; ++cell) {
+                    if (pattern[cell] == set && (best < 0 || (highest ? energy[cell] > energy[best]
+                                                                      : energy[cell] < energy[best]))) {
+                        best = cell;
+                    }
+                }
+                return best;
+            };
+
+            // A random initial pattern of a tenth of the cells, relaxed until the tightest
+            // cluster is also the largest void.
+            uint64_t state = 0x5eed;
+            int ones = n / 10;
+            for (int placed = 0; placed < ones;) {
+                int cell = static_cast<int>(splitmix64(state) % n);
+                if (!pattern[cell]) {
+                    toggle(cell, true);
+                    ++placed;
+                }
+            }
+            while (true) {
+                int cluster = extreme(true, true);
+                toggle(cluster, false);
+                int hole = extreme(false, false);
+                toggle(hole, true);
+                if (hole == cluster) {
+                    break;
+                }
+            }
+            std::vector<uint8_t> initial = pattern;
+            std::vector<float> initial_energy = energy;
+
+            std::vector<int> rank(n, 0);
+            for (int r = ones - 1; r >= 0; --r) {
+                int cluster = extreme(true, true);
+                toggle(cluster, false);
+                rank[cluster] = r;
+            }
+            pattern = initial;
+            energy = initial_energy;
+            for (int r = ones; r < n; ++r) {
+                int hole = extreme(false, false);
+                toggle(hole, true);
+                rank[hole] = r;
+            }
+
+            std::vector<float> values(n);
+            for (int cell = 0; cell < n; ++cell) {
+                values[cell] = (rank[cell] + 0.5f) / n;
+            }
+            return values;
+        }
+};
+
+inline std::shared_ptr<const ISampler> make_sampler(SamplerType type, uint64_t seed, int samples_per_pixel,
+                                                    int image_width) {
+    switch (type) {
+        case SamplerType::Stratified: return std::make_shared<StratifiedSampler>(seed, samples_per_pixel);
+        case SamplerType::Sobol:      return std::make_shared<SobolSampler>(seed);
+        case SamplerType::BlueNoise:  return std::make_shared<BlueNoiseSampler>(seed, image_width);
+        case SamplerType::Random:     return nullptr;
+        default:                      return std::make_shared<IndependentSampler>(seed);
+    }
+}
+
+// The camera sample a thread is working on. Renderers start it with start_sample() and pick
+// the dimension of each decision; code along the path draws with sample_1d()/sample_2d().
+// Without a sampler, the draws come from the thread's wide generator, a block at a time.
+struct SampleStream {
+    const ISampler *sampler = nullptr;
+    uint64_t pixel = 0;
+    uint32_t sample = 0;
+    uint32_t dimension = 0;
+};
+
+inline SampleStream& thread_sample_stream() {
+    static thread_local SampleStream stream;
+    return stream;
+}
+
+struct RandomBlock {
+    float values[RngWide::width];
+    int next = RngWide::width;
+};
+
+inline RandomBlock& thread_random_block() {
+    static thread_local RandomBlock block;
+    return block;
+}
+
+inline float block_random_float() {
+    // The next number of the current block, refilled with random_floats() once used up.
+    RandomBlock &block = thread_random_block();
+    if (block.next == RngWide::width) {
+        random_floats(block.values, RngWide::width);
+        block.next = 0;
+    }
+    return block.values[block.next++];
+}
+
+inline void start_sample(const ISampler *sampler, uint64_t pixel, uint32_t sample) {
+    SampleStream &stream = thread_sample_stream();
+    stream.sampler = sampler;
+    stream.pixel = pixel;
+    stream.sample = sample;
+    stream.dimension = 0;
+    thread_random_block().next = RngWide::width; // Leftovers belong to the previous sample
+}
+
+inline void set_sample_dimension(uint32_t dimension) {
+    thread_sample_stream().dimension = dimension;
+}
+
+inline float sample_1d() {
+    // One number in [0,1) for the current dimension, which is then used up.
+    SampleStream &stream = thread_sample_stream();
+    if (!stream.sampler) {
+        return block_random_float();
+    }
+    return stream.sampler->get_1d(stream.pixel, stream.sample, stream.dimension++);
+}
+
+inline void sample_2d(float &u, float &v) {
+    // A point in [0,1)^2 for the current dimension, which is then used up.
+    SampleStream &stream = thread_sample_stream();
+    if (!stream.sampler) {
+        u = block_random_float();
+        v = block_random_float();
+        return;
+    }
+    stream.sampler->get_2d(stream.pixel, stream.sample, stream.dimension++, u, v);
+}
+
+inline vec3 sample_unit_vector() {
+    float u, v;
+    sample_2d(u, v);
+    return uniform_sphere(u, v);
+}
+
+inline vec3 sample_in_unit_disk() {
+    float u, v;
+    sample_2d(u, v);
+    return concentric_disk(u, v);
+}
+
+inline vec3 sample_cosine_direction(const vec3 &normal) {
+    // Cosine-weighted direction in the hemisphere around the unit vector normal.
+    float u, v;
+    sample_2d(u, v);
+    vec3 local = cosine_hemisphere(u, v);
+    vec3 t, b;
+    make_basis(normal, t, b);
+    return local.x * t + local.y * b + local.z * normal;
+}
+
+#endif // SAMPLER_H
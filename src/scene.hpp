@@ -0,0 +1,160 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "bvh.hpp"
+#include "camera.hpp"
+#include "hittable.hpp"
+#include "instance.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+#include "random.hpp"
+#include "sphere.hpp"
+#include "transform.hpp"
+#include "vec3.hpp"
+
+inline void random_spheres_grid(HittableList &world, int grid_extent = 11) {
+    // The spheres of the book's cover: three large ones surrounded by a (2 * grid_extent)^2
+    // grid of small ones with random materials, all resting on the y = 0 plane.
+    for (int a = -grid_extent; a < grid_extent; a++) {
+        for (int b = -grid_extent; b < grid_extent; b++) {
+            auto choose_mat = random_float();
+            point3 center(a + 0.9 * random_float(), 0.2, b + 0.9 * random_float());
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                std::shared_ptr<IMaterial> sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    auto albedo = color::random() * color::random();
+                    sphere_material = std::make_shared<Lambertian>(albedo);
+                    world.add(std::make_shared<Sphere>(center, 0.2, sphere_material));
+                } else if (choose_mat < 0.95) {
+                    // metal
+                    auto albedo = color::random(0.5, 1);
+                    auto fuzz = random_float(0, 0.5);
+                    sphere_material = std::make_shared<Metal>(albedo, fuzz);
+                    world.add(std::make_shared<Sphere>(center, 0.2, sphere_material));
+                } else {
+                    // glass
+                    sphere_material = std::make_shared<Dielectric>(1.5);
+                    world.add(std::make_shared<Sphere>(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    auto material1 = std::make_shared<Dielectric>(1.5);
+    world.add(std::make_shared<Sphere>(point3(0, 1, 0), 1.0, material1));
+
+    auto material2 = std::make_shared<Lambertian>(color(0.4, 0.2, 0.1));
+    world.add(std::make_shared<Sphere>(point3(-4, 1, 0), 1.0, material2));
+
+    auto material3 = std::make_shared<Metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(std::make_shared<Sphere>(point3(4, 1, 0), 1.0, material3));
+}
+
+inline void random_spheres_scene(HittableList &world, int grid_extent = 11) {
+    // The cover scene of the book: random_spheres_grid() on a ground sphere.
+    auto ground_material = std::make_shared<Lambertian>(color(0.5, 0.5, 0.5));
+    world.add(std::make_shared<Sphere>(point3(0,-1000,0), 1000, ground_material));
+    random_spheres_grid(world, grid_extent);
+}
+
+inline void lamp_spheres(HittableList &world, int lamp_count, float radius = 0.1f) {
+    // lamp_count small, bright, warm spheres hung in a ring above the middle of the cover
+    // scene, for lighting it with the sky turned down. Their emission grows as they shrink,
+    // so they give the same light whatever their size.
+    auto lamp = std::make_shared<DiffuseLight>(color(1.0, 0.85, 0.6) * (3.0f / (radius * radius * lamp_count)));
+    for (int k = 0; k < lamp_count; ++k) {
+        float angle = 2 * pi * k / lamp_count;
+        world.add(std::make_shared<Sphere>(point3(5 * cosf(angle), 3, 5 * sinf(angle)), radius, lamp));
+    }
+}
+
+inline size_t instanced_spheres_scene(HittableList &world, int instance_count, int grid_extent = 11,
+                                      int thread_count = 0) {
+    // instance_count copies of random_spheres_grid() on a ground sphere, laid out on a square
+    // grid around the original and turned randomly about the vertical axis; every fourth one
+    // is painted over with a single shared material. The spheres exist once, under a Bvh that
+    // every copy shares. Returns the number of spheres in that shared asset.
+    auto asset = std::make_shared<HittableList>();
+    random_spheres_grid(*asset, grid_extent);
+    auto asset_bvh = std::make_shared<Bvh>(*asset, thread_count);
+    auto chrome = std::make_shared<Metal>(color(0.8, 0.85, 0.9), 0.05);
+
+    int side = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(std::max(instance_count, 1)))));
+    float spacing = 2.0f * grid_extent + 2;
+    float ground_radius = std::max(1000.0f, 10 * side * spacing);
+    auto ground_material = std::make_shared<Lambertian>(color(0.5, 0.5, 0.5));
+    world.add(std::make_shared<Sphere>(point3(0, -ground_radius, 0), ground_radius, ground_material));
+
+    // The first copy sits at the origin unturned, where the camera of random_spheres_camera()
+    // looks; with one instance the image is the cover scene's.
+    std::vector<std::pair<int, int>> cells;
+    for (int a = 0; a < side; ++a) {
+        for (int b = 0; b < side; ++b) {
+            cells.push_back(std::make_pair(a - side / 2, b - side / 2));
+        }
+    }
+    std::stable_sort(cells.begin(), cells.end(), [](const std::pair<int, int> &p, const std::pair<int, int> &q) {
+        return std::abs(p.first) + std::abs(p.second) < std::abs(q.first) + std::abs(q.second);
+    });
+    for (int i = 0; i < instance_count; ++i) {
+        vec3 offset(cells[i].first * spacing, 0, cells[i].second * spacing);
+        float turn = i == 0 ? 0 : random_float(0, 360);
+        Transform placement = Transform::translate(offset) * Transform::rotate(vec3(0, 1, 0), turn);
+        world.add(std::make_shared<Instance>(asset_bvh, placement, i % 4 == 3 ? chrome : nullptr));
+    }
+    return asset->objects.size();
+}
+
+inline void mesh_scene(HittableList &world, std::shared_ptr<TriangleMesh> mesh) {
+    // A built mesh on the ground of the cover scene: scaled so its largest side is 3 units and
+    // stood on the ground at the origin, through an Instance so the mesh itself is untouched.
+    auto ground_material = std::make_shared<Lambertian>(color(0.5, 0.5, 0.5));
+    world.add(std::make_shared<Sphere>(point3(0,-1000,0), 1000, ground_material));
+
+    Aabb box = mesh->bounding_box();
+    if (box.is_empty()) {
+        return;
+    }
+    vec3 size = box.extent();
+    float largest = std::max(size.x, std::max(size.y, size.z));
+    float scale = largest > 0 ? 3 / largest : 1;
+    point3 center = box.centroid();
+    Transform placement = Transform::scale(scale) * Transform::translate(vec3(-center.x, -box.min.y, -center.z));
+    world.add(std::make_shared<Instance>(mesh, placement));
+}
+
+inline void random_spheres_camera(Camera &cam) {
+    // The view of random_spheres_scene() from the book, at full HD and 500 samples.
+    cam.aspect_ratio      = 16.0f / 9.0f;
+    cam.image_width       = 1920;
+    cam.samples_per_pixel = 500;
+    cam.max_depth         = 50;
+
+    cam.vfov      = 20;
+    cam.look_from = point3(13, 2, 3);
+    cam.look_at   = point3(0, 0, 0);
+    cam.vup       = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0.6;
+    cam.focus_dist    = 10.0;
+}
+
+inline void mesh_camera(Camera &cam) {
+    // random_spheres_camera() aimed at the middle of mesh_scene()'s model, all of it in focus.
+    random_spheres_camera(cam);
+    cam.look_at       = point3(0, 1.5f, 0);
+    cam.vfov          = 22;
+    cam.defocus_angle = 0;
+}
+
+#endif // SCENE_H
@@ -0,0 +1,761 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "camera.hpp"
+#include "hittable.hpp"
+#include "mapped_file.hpp"
+#include "material.hpp"
+#include "sphere.hpp"
+#include "text_parse.hpp"
+#include "thread_pool.hpp"
+
+// Scene files, so scenes can change without a recompile.
+//
+// The text form is one statement per line, '#' starts a comment:
+//
+//     camera look_from 13 2 3
+//     camera vfov 20
+//     material ground lambertian 0.5 0.5 0.5   (albedo)
+//     material gold metal 0.8 0.6 0.2 0.1      (albedo, fuzz)
+//     material glass dielectric 1.5            (index of refraction)
+//     material lamp light 4 4 4                (emitted radiance)
+//     sphere 0 -1000 0 1000 ground             (center, radius, material name)
+//
+// Camera statements take the name of a Camera field: aspect_ratio, image_width,
+// samples_per_pixel, max_depth, vfov, look_from, look_at, vup, defocus_angle or focus_dist.
+// Materials are defined once and may be referenced before their definition. The file is split
+// into newline-aligned chunks that are parsed in parallel, and names are resolved afterwards.
+//
+// The binary form is a SceneFileHeader followed by the SceneMaterial and then the SceneSphere
+// arrays, in host byte order. It is memory-mapped and the arrays are used in place.
+
+struct SceneMaterial {
+    uint32_t type;      // MaterialType, with Other standing for a DiffuseLight
+    float    albedo[3]; // The emission of a DiffuseLight, unused by Dielectric
+    float    param;     // Metal fuzz or Dielectric index of refraction
+};
+
+struct SceneSphere {
+    float    center[3];
+    float    radius;
+    uint32_t material; // Index into the scene's materials
+};
+
+struct SceneCamera {
+    float   aspect_ratio;
+    int32_t image_width;
+    int32_t samples_per_pixel;
+    int32_t max_depth;
+    float   vfov;
+    float   look_from[3];
+    float   look_at[3];
+    float   vup[3];
+    float   defocus_angle;
+    float   focus_dist;
+
+    static SceneCamera from(const Camera &cam) {
+        SceneCamera c;
+        c.aspect_ratio = cam.aspect_ratio;
+        c.image_width = cam.image_width;
+        c.samples_per_pixel = cam.samples_per_pixel;
+        c.max_depth = cam.max_depth;
+        c.vfov = cam.vfov;
+        for (int k = 0; k < 3; ++k) {
+            c.look_from[k] = cam.look_from[k];
+            c.look_at[k] = cam.look_at[k];
+            c.vup[k] = cam.vup[k];
+        }
+        c.defocus_angle = cam.defocus_angle;
+        c.focus_dist = cam.focus_dist;
+        return c;
+    }
+
+    void apply(Camera &cam) const {
+        cam.aspect_ratio = aspect_ratio;
+        cam.image_width = image_width;
+        cam.samples_per_pixel = samples_per_pixel;
+        cam.max_depth = max_depth;
+        cam.vfov = vfov;
+        cam.look_from = point3(look_from[0], look_from[1], look_from[2]);
+        cam.look_at = point3(look_at[0], look_at[1], look_at[2]);
+        cam.vup = vec3(vup[0], vup[1], vup[2]);
+        cam.defocus_angle = defocus_angle;
+        cam.focus_dist = focus_dist;
+    }
+};
+
+struct SceneFileHeader {
+    char        magic[8];        // "RTSCENE\0"
+    uint32_t    version;         // 1
+    uint32_t    byte_order;      // 0x01020304 as written by the host that made the file
+    uint64_t    material_count;
+    uint64_t    sphere_count;
+    SceneCamera camera;
+};
+
+static_assert(sizeof(SceneMaterial) == 20, "SceneMaterial is part of the binary scene format");
+static_assert(sizeof(SceneSphere) == 20, "SceneSphere is part of the binary scene format");
+static_assert(sizeof(SceneFileHeader) % 4 == 0, "Scene arrays must stay 4-byte aligned");
+
+struct SceneLoadStats {
+    bool   binary       = false;
+    bool   mapped       = false; // Arrays used in place from a memory-mapped file
+    size_t file_bytes   = 0;
+    size_t memory_bytes = 0;     // Scene data held in memory, outside any mapping
+    size_t materials    = 0;
+    size_t spheres      = 0;
+    int    threads      = 1;
+    double load_seconds = 0;
+};
+
+inline std::ostream& operator<<(std::ostream &out, const SceneLoadStats &stats) {
+    return out << "Scene: " << stats.spheres << " spheres, " << stats.materials << " materials, "
+               << (stats.binary ? "binary" : "text") << " file of " << stats.file_bytes / 1024 << " KiB"
+               << (stats.mapped ? " (mapped)" : "") << ", "
+               << stats.memory_bytes / 1024 << " KiB in memory, "
+               << "loaded in " << stats.load_seconds * 1000 << " ms on " << stats.threads << " threads";
+}
+
+class SceneDescription {
+    public:
+        SceneCamera camera;
+
+        SceneDescription() : _materials(nullptr), _material_count(0), _spheres(nullptr), _sphere_count(0) {
+            camera = SceneCamera::from(Camera());
+        }
+
+        SceneDescription(const SceneDescription&) = delete;
+        SceneDescription& operator=(const SceneDescription&) = delete;
+
+        const SceneMaterial* materials() const { return _materials; }
+        size_t material_count() const { return _material_count; }
+        const SceneSphere* spheres() const { return _spheres; }
+        size_t sphere_count() const { return _sphere_count; }
+        const SceneLoadStats& stats() const { return _stats; }
+
+        static bool describe_material(const IMaterial &material, SceneMaterial &record) {
+            // The record of a material of one of the built-in classes; false for others.
+            record.albedo[0] = record.albedo[1] = record.albedo[2] = 0;
+            record.param = 0;
+            record.type = static_cast<uint32_t>(material.type());
+
+            switch (material.type()) {
+                case MaterialType::Lambertian: {
+                    const color &albedo = static_cast<const Lambertian&>(material).albedo();
+                    std::copy(albedo.e, albedo.e + 3, record.albedo);
+                    return true;
+                }
+                case MaterialType::Metal: {
+                    const Metal &metal = static_cast<const Metal&>(material);
+                    std::copy(metal.albedo().e, metal.albedo().e + 3, record.albedo);
+                    record.param = metal.fuzz();
+                    return true;
+                }
+                case MaterialType::Dielectric:
+                    record.param = static_cast<const Dielectric&>(material).index_of_refraction();
+                    return true;
+                default: {
+                    const DiffuseLight *light = dynamic_cast<const DiffuseLight*>(&material);
+                    if (!light) {
+                        return false;
+                    }
+                    std::copy(light->emission().e, light->emission().e + 3, record.albedo);
+                    return true;
+                }
+            }
+        }
+
+        bool from_world(const HittableList &world, const Camera &cam, std::string &error) {
+            // Describes a world made of Spheres with the built-in materials, sharing a
+            // material between spheres whenever they share the object.
+            reset();
+            camera = SceneCamera::from(cam);
+            std::unordered_map<const IMaterial*, uint32_t> ids;
+
+            for (const auto &object : world.objects) {
+                const Sphere *sphere = dynamic_cast<const Sphere*>(object.get());
+                if (!sphere) {
+                    error = "only spheres can be saved to a scene file";
+                    return false;
+                }
+                const IMaterial *material = sphere->material().get();
+                auto found = ids.find(material);
+                if (found == ids.end()) {
+                    SceneMaterial record;
+                    if (!describe_material(*material, record)) {
+                        error = "only lambertian, metal, dielectric and light materials can be saved to a scene file";
+                        return false;
+                    }
+                    found = ids.emplace(material, static_cast<uint32_t>(_owned_materials.size())).first;
+                    _owned_materials.push_back(record);
+                }
+
+                SceneSphere record;
+                for (int k = 0; k < 3; ++k) {
+                    record.center[k] = sphere->center()[k];
+                }
+                record.radius = sphere->radius();
+                record.material = found->second;
+                _owned_spheres.push_back(record);
+            }
+
+            use_owned();
+            return true;
+        }
+
+        bool load(const std::string &path, int thread_count, std::string &error) {
+            reset();
+            auto start = std::chrono::steady_clock::now();
+
+            if (!_file.open(path)) {
+                error = "could not open " + path;
+                return false;
+            }
+            _stats.file_bytes = _file.size();
+
+            bool loaded;
+            if (_file.size() >= 8 && std::memcmp(_file.data(), binary_magic(), 8) == 0) {
+                loaded = load_binary(error);
+            } else {
+                loaded = load_text(thread_count, error);
+                _file.close(); // Everything was copied out
+            }
+            if (!loaded) {
+                error = path + ": " + error;
+                reset();
+                return false;
+            }
+
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            _stats.load_seconds = elapsed.count();
+            return true;
+        }
+
+        bool save(const std::string &path, std::string &error) const {
+            // Writes the binary form when path ends in ".rtsb", the text form otherwise.
+            std::ofstream out(path, std::ios::binary);
+            if (!out) {
+                error = "could not open " + path + " for writing";
+                return false;
+            }
+            bool binary = path.size() >= 5 && path.compare(path.size() - 5, 5, ".rtsb") == 0;
+            if (binary) {
+                write_binary(out);
+            } else {
+                write_text(out);
+            }
+            if (!out) {
+                error = "could not write " + path;
+                return false;
+            }
+            return true;
+        }
+
+        void build(HittableList &world, int thread_count = 0) const {
+            // Adds a Sphere per record to world. The objects are created in parallel.
+            std::vector<std::shared_ptr<IMaterial>> materials(_material_count);
+            for (size_t m = 0; m < _material_count; ++m) {
+                materials[m] = make_material(_materials[m]);
+            }
+
+            std::vector<std::shared_ptr<IHittable>> objects(_sphere_count);
+            {
+                ThreadPool pool(thread_count);
+                size_t chunk = std::max<size_t>(_sphere_count / (pool.size() * 4) + 1, 4096);
+                for (size_t begin = 0; begin < _sphere_count; begin += chunk) {
+                    size_t end = std::min(_sphere_count, begin + chunk);
+                    pool.submit([this, &objects, &materials, begin, end]() {
+                        for (size_t s = begin; s < end; ++s) {
+                            const SceneSphere &record = _spheres[s];
+                            point3 center(record.center[0], record.center[1], record.center[2]);
+                            objects[s] = std::make_shared<Sphere>(center, record.radius, materials[record.material]);
+                        }
+                    });
+                }
+                pool.wait();
+            }
+
+            world.objects.reserve(world.objects.size() + _sphere_count);
+            for (auto &object : objects) {
+                world.add(std::move(object));
+            }
+        }
+
+    private:
+        MappedFile _file;
+        std::vector<SceneMaterial> _owned_materials;
+        std::vector<SceneSphere> _owned_spheres;
+        const SceneMaterial *_materials;
+        size_t _material_count;
+        const SceneSphere *_spheres;
+        size_t _sphere_count;
+        SceneLoadStats _stats;
+
+        static const char* binary_magic() { return "RTSCENE"; } // With its terminator, 8 bytes
+
+        struct NameRef {
+            // A name in the text of the file, which stays mapped while it is parsed.
+            const char *data;
+            size_t size;
+
+            bool operator==(const NameRef &other) const {
+                return size == other.size && std::memcmp(data, other.data, size) == 0;
+            }
+
+            std::string str() const { return std::string(data, size); }
+        };
+
+        struct NameRefHash {
+            size_t operator()(const NameRef &name) const {
+                // FNV-1a
+                uint64_t hash = 0xcbf29ce484222325ull;
+                for (size_t i = 0; i < name.size; ++i) {
+                    hash = (hash ^ static_cast<uint8_t>(name.data[i])) * 0x100000001b3ull;
+                }
+                return static_cast<size_t>(hash);
+            }
+        };
+
+        struct LineCursor {
+            // Reads the whitespace separated fields of one line, in place.
+            const char *p;
+            const char *end;
+
+            void skip_space() {
+                while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+                    ++p;
+                }
+            }
+
+            bool word(NameRef &name) {
+                skip_space();
+                const char *start = p;
+                while (p < end && *p != ' ' && *p != '\t' && *p != '\r') {
+                    ++p;
+                }
+                name.data = start;
+                name.size = p - start;
+                return name.size > 0;
+            }
+
+            bool number(float &value) {
+                skip_space();
+                return parse_float(p, end, value);
+            }
+
+            bool done() {
+                skip_space();
+                return p == end;
+            }
+        };
+
+        struct TextChunk {
+            // What one thread found in its slice of a text file. Material names are resolved
+            // once every chunk is done.
+            const char *begin;
+            const char *end;
+            size_t lines = 0;
+            std::vector<SceneSphere> spheres;
+            std::vector<NameRef> sphere_materials; // Name of each sphere's material
+            std::vector<std::pair<NameRef, SceneMaterial>> materials;
+            std::vector<size_t> material_lines;
+            std::vector<std::pair<size_t, LineCursor>> camera_lines; // Applied in file order
+            size_t error_line = 0;                                   // 1-based within the chunk
+            std::string error;
+        };
+
+        void reset() {
+            _file.close();
+            _owned_materials.clear();
+            _owned_spheres.clear();
+            _materials = nullptr;
+            _material_count = 0;
+            _spheres = nullptr;
+            _sphere_count = 0;
+            _stats = SceneLoadStats();
+            camera = SceneCamera::from(Camera());
+        }
+
+        void use_owned() {
+            _materials = _owned_materials.data();
+            _material_count = _owned_materials.size();
+            _spheres = _owned_spheres.data();
+            _sphere_count = _owned_spheres.size();
+            _stats.materials = _material_count;
+            _stats.spheres = _sphere_count;
+            _stats.memory_bytes = _owned_materials.capacity() * sizeof(SceneMaterial)
+                                + _owned_spheres.capacity() * sizeof(SceneSphere);
+        }
+
+        bool load_binary(std::string &error) {
+            SceneFileHeader header;
+            if (_file.size() < sizeof(header)) {
+                error = "truncated header";
+                return false;
+            }
+            std::memcpy(&header, _file.data(), sizeof(header));
+            if (header.version != 1) {
+                error = "unsupported scene version " + std::to_string(header.version);
+                return false;
+            }
+            if (header.byte_order != 0x01020304u) {
+                error = "written on a host with a different byte order";
+                return false;
+            }
+            size_t payload = _file.size() - sizeof(header);
+            if (header.material_count > payload / sizeof(SceneMaterial)
+                || header.sphere_count > (payload - header.material_count * sizeof(SceneMaterial)) / sizeof(SceneSphere)) {
+                error = "truncated scene data";
+                return false;
+            }
+
+            camera = header.camera;
+            _materials = reinterpret_cast<const SceneMaterial*>(_file.data() + sizeof(header));
+            _material_count = header.material_count;
+            _spheres = reinterpret_cast<const SceneSphere*>(_materials + _material_count);
+            _sphere_count = header.sphere_count;
+
+            for (size_t m = 0; m < _material_count; ++m) {
+                if (_materials[m].type > static_cast<uint32_t>(MaterialType::Other)) {
+                    error = "material " + std::to_string(m) + " has an unknown type";
+                    return false;
+                }
+            }
+            for (size_t s = 0; s < _sphere_count; ++s) {
+                if (_spheres[s].material >= _material_count) {
+                    error = "sphere " + std::to_string(s) + " uses an undefined material";
+                    return false;
+                }
+            }
+
+            _stats.binary = true;
+            _stats.mapped = _file.mapped();
+            _stats.materials = _material_count;
+            _stats.spheres = _sphere_count;
+            _stats.memory_bytes = _file.mapped() ? 0 : _file.size();
+            return true;
+        }
+
+        bool load_text(int thread_count, std::string &error) {
+            const char *text = reinterpret_cast<const char*>(_file.data());
+            const char *text_end = text + _file.size();
+            std::vector<TextChunk> chunks;
+
+            ThreadPool pool(thread_count);
+            _stats.threads = pool.size();
+
+            for (const TextSlice &slice : split_lines(text, text_end, pool.size())) {
+                chunks.emplace_back();
+                chunks.back().begin = slice.begin;
+                chunks.back().end = slice.end;
+            }
+
+            for (auto &chunk : chunks) {
+                TextChunk *c = &chunk;
+                pool.submit([c]() { parse_chunk(*c); });
+            }
+            pool.wait();
+
+            // Report the first error in file order, with its absolute line number.
+            size_t line_base = 0;
+            size_t material_total = 0;
+            for (const auto &chunk : chunks) {
+                if (!chunk.error.empty()) {
+                    error = "line " + std::to_string(line_base + chunk.error_line) + ": " + chunk.error;
+                    return false;
+                }
+                line_base += chunk.lines;
+                material_total += chunk.materials.size();
+            }
+
+            // Materials get their ids in file order; camera statements apply in file order.
+            std::unordered_map<NameRef, uint32_t, NameRefHash> material_ids;
+            material_ids.reserve(material_total);
+            _owned_materials.reserve(material_total);
+            line_base = 0;
+            for (auto &chunk : chunks) {
+                for (size_t m = 0; m < chunk.materials.size(); ++m) {
+                    uint32_t id = static_cast<uint32_t>(_owned_materials.size());
+                    if (!material_ids.emplace(chunk.materials[m].first, id).second) {
+                        error = "line " + std::to_string(line_base + chunk.material_lines[m])
+                              + ": material " + chunk.materials[m].first.str() + " is already defined";
+                        return false;
+                    }
+                    _owned_materials.push_back(chunk.materials[m].second);
+                }
+                for (auto &line : chunk.camera_lines) {
+                    std::string message;
+                    if (!parse_camera(line.second, camera, message)) {
+                        error = "line " + std::to_string(line_base + line.first) + ": " + message;
+                        return false;
+                    }
+                }
+                line_base += chunk.lines;
+            }
+
+            // Resolve the names and concatenate the spheres, again in parallel.
+            std::vector<size_t> offsets(chunks.size() + 1, 0);
+            for (size_t c = 0; c < chunks.size(); ++c) {
+                offsets[c + 1] = offsets[c] + chunks[c].spheres.size();
+            }
+            _owned_spheres.resize(offsets.back());
+
+            std::vector<std::string> undefined(chunks.size());
+            for (size_t c = 0; c < chunks.size(); ++c) {
+                pool.submit([this, &chunks, &offsets, &material_ids, &undefined, c]() {
+                    TextChunk &chunk = chunks[c];
+                    SceneSphere *out = _owned_spheres.data() + offsets[c];
+                    for (size_t s = 0; s < chunk.spheres.size(); ++s) {
+                        auto found = material_ids.find(chunk.sphere_materials[s]);
+                        if (found == material_ids.end()) {
+                            undefined[c] = chunk.sphere_materials[s].str();
+                            return;
+                        }
+                        out[s] = chunk.spheres[s];
+                        out[s].material = found->second;
+                    }
+                    // Free the chunk's copy as soon as it is merged.
+                    std::vector<SceneSphere>().swap(chunk.spheres);
+                    std::vector<NameRef>().swap(chunk.sphere_materials);
+                });
+            }
+            pool.wait();
+
+            for (const auto &name : undefined) {
+                if (!name.empty()) {
+                    error = "material " + name + " is used but never defined";
+                    return false;
+                }
+            }
+
+            use_owned();
+            _stats.threads = pool.size();
+            return true;
+        }
+
+        static void parse_chunk(TextChunk &chunk) {
+            NameRef word;
+            const char *cursor = chunk.begin;
+
+            while (cursor < chunk.end) {
+                const char *line_end = static_cast<const char*>(std::memchr(cursor, '\n', chunk.end - cursor));
+                if (!line_end) {
+                    line_end = chunk.end;
+                }
+                ++chunk.lines;
+
+                const char *comment = static_cast<const char*>(std::memchr(cursor, '#', line_end - cursor));
+                LineCursor line = {cursor, comment ? comment : line_end};
+                cursor = line_end + 1;
+
+                if (!line.word(word)) {
+                    continue;
+                }
+
+                std::string message;
+                if (word == NameRef{"sphere", 6}) {
+                    SceneSphere sphere;
+                    NameRef material;
+                    bool ok = line.number(sphere.center[0]) && line.number(sphere.center[1])
+                           && line.number(sphere.center[2]) && line.number(sphere.radius);
+                    if (!ok || !line.word(material) || !line.done()) {
+                        message = "expected: sphere x y z radius material";
+                    } else {
+                        sphere.material = 0;
+                        chunk.spheres.push_back(sphere);
+                        chunk.sphere_materials.push_back(material);
+                    }
+                } else if (word == NameRef{"material", 8}) {
+                    NameRef name;
+                    SceneMaterial material;
+                    if (!line.word(name)) {
+                        message = "expected: material name type parameters";
+                    } else if (parse_material(line, material, message)) {
+                        chunk.materials.emplace_back(name, material);
+                        chunk.material_lines.push_back(chunk.lines);
+                    }
+                } else if (word == NameRef{"camera", 6}) {
+                    chunk.camera_lines.emplace_back(chunk.lines, line);
+                } else {
+                    message = "unknown statement " + word.str();
+                }
+
+                if (!message.empty()) {
+                    chunk.error_line = chunk.lines;
+                    chunk.error = message;
+                    return;
+                }
+            }
+        }
+
+        static bool parse_material(LineCursor &line, SceneMaterial &material, std::string &message) {
+            NameRef type;
+            line.word(type);
+            material.albedo[0] = material.albedo[1] = material.albedo[2] = 0;
+            material.param = 0;
+
+            bool ok;
+            if (type == NameRef{"lambertian", 10}) {
+                material.type = static_cast<uint32_t>(MaterialType::Lambertian);
+                ok = line.number(material.albedo[0]) && line.number(material.albedo[1])
+                  && line.number(material.albedo[2]);
+            } else if (type == NameRef{"metal", 5}) {
+                material.type = static_cast<uint32_t>(MaterialType::Metal);
+                ok = line.number(material.albedo[0]) && line.number(material.albedo[1])
+                  && line.number(material.albedo[2]) && line.number(material.param);
+            } else if (type == NameRef{"dielectric", 10}) {
+                material.type = static_cast<uint32_t>(MaterialType::Dielectric);
+                ok = line.number(material.param);
+            } else if (type == NameRef{"light", 5}) {
+                material.type = static_cast<uint32_t>(MaterialType::Other);
+                ok = line.number(material.albedo[0]) && line.number(material.albedo[1])
+                  && line.number(material.albedo[2]);
+            } else {
+                message = "unknown material type " + type.str();
+                return false;
+            }
+            if (!ok || !line.done()) {
+                message = "wrong parameters for a " + type.str() + " material";
+                return false;
+            }
+            return true;
+        }
+
+        static bool parse_camera(LineCursor &line, SceneCamera &camera, std::string &message) {
+            NameRef name;
+            line.word(name);
+            std::string key = name.str();
+
+            float *values = nullptr;
+            int count = 1;
+            int32_t *integer = nullptr;
+
+            if (key == "aspect_ratio") values = &camera.aspect_ratio;
+            else if (key == "vfov") values = &camera.vfov;
+            else if (key == "defocus_angle") values = &camera.defocus_angle;
+            else if (key == "focus_dist") values = &camera.focus_dist;
+            else if (key == "look_from") { values = camera.look_from; count = 3; }
+            else if (key == "look_at") { values = camera.look_at; count = 3; }
+            else if (key == "vup") { values = camera.vup; count = 3; }
+            else if (key == "image_width") integer = &camera.image_width;
+            else if (key == "samples_per_pixel") integer = &camera.samples_per_pixel;
+            else if (key == "max_depth") integer = &camera.max_depth;
+            else {
+                message = "unknown camera setting " + key;
+                return false;
+            }
+
+            float parsed[3];
+            for (int k = 0; k < count; ++k) {
+                if (!line.number(parsed[k])) {
+                    message = "camera " + key + " expects " + std::to_string(count) + " number(s)";
+                    return false;
+                }
+            }
+            if (!line.done()) {
+                message = "camera " + key + " expects " + std::to_string(count) + " number(s)";
+                return false;
+            }
+
+            if (integer) {
+                *integer = static_cast<int32_t>(parsed[0]);
+            } else {
+                std::copy(parsed, parsed + count, values);
+            }
+            return true;
+        }
+
+        static std::shared_ptr<IMaterial> make_material(const SceneMaterial &record) {
+            color albedo(record.albedo[0], record.albedo[1], record.albedo[2]);
+            switch (static_cast<MaterialType>(record.type)) {
+                case MaterialType::Metal:
+                    return std::make_shared<Metal>(albedo, record.param);
+                case MaterialType::Dielectric:
+                    return std::make_shared<Dielectric>(record.param);
+                case MaterialType::Other:
+                    return std::make_shared<DiffuseLight>(albedo);
+                default:
+                    return std::make_shared<Lambertian>(albedo);
+            }
+        }
+
+        void write_binary(std::ostream &out) const {
+            SceneFileHeader header;
+            std::memset(&header, 0, sizeof(header));
+            std::memcpy(header.magic, binary_magic(), 8);
+            header.version = 1;
+            header.byte_order = 0x01020304u;
+            header.material_count = _material_count;
+            header.sphere_count = _sphere_count;
+            header.camera = camera;
+
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(_materials), _material_count * sizeof(SceneMaterial));
+            out.write(reinterpret_cast<const char*>(_spheres), _sphere_count * sizeof(SceneSphere));
+        }
+
+        void write_text(std::ostream &out) const {
+            // Nine significant digits, so every float reads back exactly.
+            char line[256];
+            auto emit = [&out, &line](int length) { out.write(line, length); };
+
+            emit(std::snprintf(line, sizeof(line), "camera aspect_ratio %.9g\n", camera.aspect_ratio));
+            emit(std::snprintf(line, sizeof(line), "camera image_width %d\n", camera.image_width));
+            emit(std::snprintf(line, sizeof(line), "camera samples_per_pixel %d\n", camera.samples_per_pixel));
+            emit(std::snprintf(line, sizeof(line), "camera max_depth %d\n", camera.max_depth));
+            emit(std::snprintf(line, sizeof(line), "camera vfov %.9g\n", camera.vfov));
+            emit(std::snprintf(line, sizeof(line), "camera look_from %.9g %.9g %.9g\n",
+                               camera.look_from[0], camera.look_from[1], camera.look_from[2]));
+            emit(std::snprintf(line, sizeof(line), "camera look_at %.9g %.9g %.9g\n",
+                               camera.look_at[0], camera.look_at[1], camera.look_at[2]));
+            emit(std::snprintf(line, sizeof(line), "camera vup %.9g %.9g %.9g\n",
+                               camera.vup[0], camera.vup[1], camera.vup[2]));
+            emit(std::snprintf(line, sizeof(line), "camera defocus_angle %.9g\n", camera.defocus_angle));
+            emit(std::snprintf(line, sizeof(line), "camera focus_dist %.9g\n", camera.focus_dist));
+
+            for (size_t m = 0; m < _material_count; ++m) {
+                const SceneMaterial &material = _materials[m];
+                switch (static_cast<MaterialType>(material.type)) {
+                    case MaterialType::Metal:
+                        emit(std::snprintf(line, sizeof(line), "material m%zu metal %.9g %.9g %.9g %.9g\n", m,
+                                           material.albedo[0], material.albedo[1], material.albedo[2], material.param));
+                        break;
+                    case MaterialType::Dielectric:
+                        emit(std::snprintf(line, sizeof(line), "material m%zu dielectric %.9g\n", m, material.param));
+                        break;
+                    case MaterialType::Other:
+                        emit(std::snprintf(line, sizeof(line), "material m%zu light %.9g %.9g %.9g\n", m,
+                                           material.albedo[0], material.albedo[1], material.albedo[2]));
+                        break;
+                    default:
+                        emit(std::snprintf(line, sizeof(line), "material m%zu lambertian %.9g %.9g %.9g\n", m,
+                                           material.albedo[0], material.albedo[1], material.albedo[2]));
+                        break;
+                }
+            }
+
+            for (size_t s = 0; s < _sphere_count; ++s) {
+                const SceneSphere &sphere = _spheres[s];
+                emit(std::snprintf(line, sizeof(line), "sphere %.9g %.9g %.9g %.9g m%u\n",
+                                   sphere.center[0], sphere.center[1], sphere.center[2], sphere.radius,
+                                   sphere.material));
+            }
+        }
+};
+
+#endif // SCENE_FILE_H
@@ -0,0 +1,278 @@
+#ifndef SOCKET_H
+#define SOCKET_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define RT_SOCKETS 1
+#endif
+
+// Stream sockets for distributed rendering. Addresses are "unix:/path/to/socket" for a Unix
+// domain socket, or "host:port" (":port" or "port" to listen on every interface) for TCP.
+// Only POSIX systems are supported; elsewhere every call fails with an error message.
+class Socket {
+    public:
+        Socket() : _fd(-1) {}
+        explicit Socket(int fd) : _fd(fd) {}
+        Socket(Socket &&other) : _fd(other._fd) { other._fd = -1; }
+
+        Socket& operator=(Socket &&other) {
+            if (this != &other) {
+                close();
+                _fd = other._fd;
+                other._fd = -1;
+            }
+            return *this;
+        }
+
+        Socket(const Socket&) = delete;
+        Socket& operator=(const Socket&) = delete;
+
+        ~Socket() { close(); }
+
+        int fd() const { return _fd; }
+        bool valid() const { return _fd >= 0; }
+
+        void close() {
+#ifdef RT_SOCKETS
+            if (_fd >= 0) {
+                ::close(_fd);
+            }
+#endif
+            _fd = -1;
+        }
+
+        bool send_all(const void *data, size_t size) {
+            // Blocks until everything is sent. False once the peer is gone.
+#ifdef RT_SOCKETS
+            const char *bytes = static_cast<const char*>(data);
+            while (size > 0) {
+#ifdef MSG_NOSIGNAL
+                ssize_t sent = ::send(_fd, bytes, size, MSG_NOSIGNAL);
+#else
+                ssize_t sent = ::send(_fd, bytes, size, 0);
+#endif
+                if (sent < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (sent <= 0) {
+                    return false;
+                }
+                bytes += sent;
+                size -= static_cast<size_t>(sent);
+            }
+            return true;
+#else
+            (void)data;
+            (void)size;
+            return false;
+#endif
+        }
+
+        bool recv_all(void *data, size_t size) {
+            // Blocks until size bytes arrived. False on error or when the peer closed.
+#ifdef RT_SOCKETS
+            char *bytes = static_cast<char*>(data);
+            while (size > 0) {
+                ssize_t received = ::recv(_fd, bytes, size, 0);
+                if (received < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (received <= 0) {
+                    return false;
+                }
+                bytes += received;
+                size -= static_cast<size_t>(received);
+            }
+            return true;
+#else
+            (void)data;
+            (void)size;
+            return false;
+#endif
+        }
+
+        bool recv_some(std::vector<uint8_t> &buffer) {
+            // Appends whatever is available without blocking. False when the peer closed.
+#ifdef RT_SOCKETS
+            uint8_t chunk[65536];
+            while (true) {
+                ssize_t received = ::recv(_fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+                if (received > 0) {
+                    buffer.insert(buffer.end(), chunk, chunk + received);
+                    continue;
+                }
+                if (received < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return true;
+                }
+                return false;
+            }
+#else
+            (void)buffer;
+            return false;
+#endif
+        }
+
+        static Socket listen_on(const std::string &address, std::string &error) {
+#ifdef RT_SOCKETS
+            if (address.compare(0, 5, "unix:") == 0) {
+                std::string path = address.substr(5);
+                sockaddr_un addr;
+                if (!unix_address(path, addr, error)) {
+                    return Socket();
+                }
+                Socket socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+                ::unlink(path.c_str()); // A stale socket file from an earlier run
+                if (!socket.valid() || ::bind(socket._fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+                    || ::listen(socket._fd, 64) != 0) {
+                    error = "could not listen on " + address + ": " + std::strerror(errno);
+                    return Socket();
+                }
+                return socket;
+            }
+
+            std::string host, port;
+            split_host_port(address, host, port);
+            addrinfo hints;
+            std::memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE;
+            addrinfo *result = nullptr;
+            if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0 || !result) {
+                error = "could not resolve " + address;
+                return Socket();
+            }
+            Socket socket(::socket(result->ai_family, result->ai_socktype, result->ai_protocol));
+            int yes = 1;
+            bool ok = socket.valid()
+                && ::setsockopt(socket._fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == 0
+                && ::bind(socket._fd, result->ai_addr, result->ai_addrlen) == 0
+                && ::listen(socket._fd, 64) == 0;
+            freeaddrinfo(result);
+            if (!ok) {
+                error = "could not listen on " + address + ": " + std::strerror(errno);
+                return Socket();
+            }
+            return socket;
+#else
+            error = "sockets are not supported on this platform";
+            (void)address;
+            return Socket();
+#endif
+        }
+
+        static Socket connect_to(const std::string &address, std::string &error) {
+#ifdef RT_SOCKETS
+            if (address.compare(0, 5, "unix:") == 0) {
+                sockaddr_un addr;
+                if (!unix_address(address.substr(5), addr, error)) {
+                    return Socket();
+                }
+                Socket socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+                if (!socket.valid() || ::connect(socket._fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+                    error = "could not connect to " + address + ": " + std::strerror(errno);
+                    return Socket();
+                }
+                return socket;
+            }
+
+            std::string host, port;
+            split_host_port(address, host, port);
+            addrinfo hints;
+            std::memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo *result = nullptr;
+            if (getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &result) != 0) {
+                error = "could not resolve " + address;
+                return Socket();
+            }
+            for (addrinfo *candidate = result; candidate; candidate = candidate->ai_next) {
+                Socket socket(::socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol));
+                if (socket.valid() && ::connect(socket._fd, candidate->ai_addr, candidate->ai_addrlen) == 0) {
+                    freeaddrinfo(result);
+                    int yes = 1;
+                    ::setsockopt(socket._fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+                    return socket;
+                }
+            }
+            freeaddrinfo(result);
+            error = "could not connect to " + address + ": " + std::strerror(errno);
+            return Socket();
+#else
+            error = "sockets are not supported on this platform";
+            (void)address;
+            return Socket();
+#endif
+        }
+
+        Socket accept_connection() {
+#ifdef RT_SOCKETS
+            int fd = ::accept(_fd, nullptr, nullptr);
+            Socket socket(fd);
+            if (socket.valid()) {
+                int yes = 1;
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)); // Fails harmlessly on Unix sockets
+            }
+            return socket;
+#else
+            return Socket();
+#endif
+        }
+
+        static void ignore_broken_pipes() {
+            // Writing to a worker that died must fail with an error, not kill the process.
+#ifdef RT_SOCKETS
+            signal(SIGPIPE, SIG_IGN);
+#endif
+        }
+
+    private:
+        int _fd;
+
+        static void split_host_port(const std::string &address, std::string &host, std::string &port) {
+            size_t colon = address.rfind(':');
+            if (colon == std::string::npos) {
+                host.clear();
+                port = address;
+            } else {
+                host = address.substr(0, colon);
+                port = address.substr(colon + 1);
+            }
+        }
+
+#ifdef RT_SOCKETS
+        static bool unix_address(const std::string &path, sockaddr_un &addr, std::string &error) {
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+                error = "bad unix socket path " + path;
+                return false;
+            }
+            std::memcpy(addr.sun_path, path.c_str(), path.size());
+            return true;
+        }
+#endif
+};
+
+#endif // SOCKET_H
@@ -1,12 +1,44 @@
 #ifndef SPHERE_H
 #define SPHERE_H
 
+#include "aabb.hpp"
 #include "hittable.hpp"
+#include "instrument.hpp"
 #include "interval.hpp"
 #include "material.hpp"
 #include "vec3.hpp"
+#include <cmath>
 #include <memory>
 
+inline bool hit_sphere(const point3 &center, float radius, const ray &r, Interval ray_t, float &t) {
+    // Distance along r to the nearest intersection with the sphere inside ray_t, shared by
+    // every class that stores spheres.
+    RT_COUNT(Counter::SphereTests);
+    vec3 oc = r.origin() - center;
+    float a = r.direction().lengthsq();
+    float half_b = oc.dot(r.direction());
+    float c = oc.lengthsq() - radius * radius;
+
+    float discriminant = half_b * half_b - a * c;
+    if (discriminant < 0) {
+        return false;
+    }
+    float sqrtd = sqrtf(discriminant);
+
+    // Find the nearest root that lies in the acceptable range.
+    float root = (-half_b - sqrtd) / a;
+    if (!ray_t.surrounds(root)) {
+        root = (-half_b + sqrtd) / a;
+        if (!ray_t.surrounds(root)) {
+            return false;
+        }
+    }
+
+    t = root;
+    RT_COUNT(Counter::SphereHits);
+    return true;
+}
+
 class Sphere : public IHittable {
     private:
         point3 _center;
@@ -17,34 +49,35 @@ class Sphere : public IHittable {
         Sphere(point3 center, float radius, std::shared_ptr<IMaterial> material) 
             : _center(center), _radius(radius), _mat(material) {}
 
-        bool hit(const ray &r, Interval ray_t, HitRecord &rec) const override {
-            vec3 oc = r.origin() - _center;
-            float a = r.direction().lengthsq();
-            float half_b = oc.dot(r.direction());
-            float c = oc.lengthsq() - _radius * _radius;
+        point3 center() const { return _center; }
+        float radius() const { return _radius; }
+        std::shared_ptr<IMaterial> material() const { return _mat; }
 
-            float discriminant = half_b * half_b - a * c;
-            if (discriminant < 0) {
+        bool intersect(const ray &r, Interval ray_t, HitRecord &rec) const override {
+            if (!hit_sphere(_center, _radius, r, ray_t, rec.t)) {
                 return false;
             }
-            float sqrtd = sqrtf(discriminant);
-
-            // Find the nearest root that lies in the acceptable range.
-            float root = (-half_b - sqrtd) / a;
-            if (!ray_t.surrounds(root)) {
-                root = (-half_b + sqrtd) / a;
-                if (!ray_t.surrounds(root)) {
-                    return false;
-                }
-            }
+            rec.object = this;
+            rec.primitive = 0;
+            return true;
+        }
+
+        bool occluded(const ray &r, Interval ray_t) const override {
+            float t;
+            return hit_sphere(_center, _radius, r, ray_t, t);
+        }
 
-            rec.t = root;
+        void surface(const ray &r, HitRecord &rec) const override {
             rec.p = r.at(rec.t);
             vec3 outward_normal = (rec.p - _center) / _radius;
             rec.set_face_normal(r, outward_normal);
-            rec.mat = _mat;
+            rec.mat = _mat.get();
+        }
 
-            return true;
+        Aabb bounding_box() const override {
+            // The radius is negative for the inner wall of hollow spheres.
+            vec3 r(fabsf(_radius), fabsf(_radius), fabsf(_radius));
+            return Aabb(_center - r, _center + r);
         }
 };
 
@@ -0,0 +1,333 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <unordered_map>
+#include <vector>
+
+#include "aabb.hpp"
+#include "aligned.hpp"
+#include "hittable.hpp"
+#include "instrument.hpp"
+#include "interval.hpp"
+#include "material.hpp"
+#include "sphere.hpp"
+#include "vec3.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define RT_SPHERE_SET_X86 1
+#endif
+
+// Many spheres in one hittable, stored as structure-of-arrays.
+//
+// The quadratic from Sphere::intersect runs against 4 (SSE) or 8 (AVX2) spheres per instruction and
+// the closest hit is picked with a horizontal min; only that one sphere fills the HitRecord.
+// The AVX2 path is chosen at run time, so the same binary still runs on CPUs without it, and
+// non-x86 builds use the scalar loop. All paths return exactly what a HittableList of the same
+// Spheres would.
+class SphereSet : public IHittable {
+    public:
+        static const size_t lane_padding = 8; // Arrays are padded to a multiple of the widest SIMD
+
+        SphereSet() : _count(0) {}
+
+        void add(const point3 &center, float radius, std::shared_ptr<IMaterial> material) {
+            if (_count == _cx.size()) {
+                // Padding lanes hold NaN centers, which fail every comparison and never hit.
+                float nan = std::numeric_limits<float>::quiet_NaN();
+                _cx.resize(_count + lane_padding, nan);
+                _cy.resize(_count + lane_padding, nan);
+                _cz.resize(_count + lane_padding, nan);
+                _radius.resize(_count + lane_padding, nan);
+            }
+
+            _cx[_count] = center.x;
+            _cy[_count] = center.y;
+            _cz[_count] = center.z;
+            _radius[_count] = radius;
+            _material_ids.push_back(material_id(material));
+            ++_count;
+
+            vec3 r(fabsf(radius), fabsf(radius), fabsf(radius));
+            _bbox.expand(Aabb(center - r, center + r));
+        }
+
+        void add(const Sphere &sphere) {
+            add(sphere.center(), sphere.radius(), sphere.material());
+        }
+
+        size_t size() const { return _count; }
+
+        bool intersect(const ray &r, Interval ray_t, HitRecord &rec) const override {
+            RT_COUNT(Counter::SphereSetTests);
+            size_t index;
+            float t;
+            if (!closest(r, ray_t, t, index)) {
+                return false;
+            }
+
+            rec.t = t;
+            rec.object = this;
+            rec.primitive = static_cast<uint32_t>(index);
+            RT_COUNT(Counter::SphereSetHits);
+            return true;
+        }
+
+        void surface(const ray &r, HitRecord &rec) const override {
+            uint32_t index = rec.primitive;
+            point3 center(_cx[index], _cy[index], _cz[index]);
+            rec.p = r.at(rec.t);
+            vec3 outward_normal = (rec.p - center) / _radius[index];
+            rec.set_face_normal(r, outward_normal);
+            rec.mat = _materials[_material_ids[index]].get();
+        }
+
+        Aabb bounding_box() const override { return _bbox; }
+
+        std::vector<std::shared_ptr<IHittable>> clusters(size_t cluster_size = lane_padding) const {
+            // Splits the set into spatially coherent SphereSets of at most cluster_size spheres,
+            // ready to be used as the leaves of a Bvh.
+            std::vector<uint32_t> order(_count);
+            std::iota(order.begin(), order.end(), 0);
+
+            std::vector<std::shared_ptr<IHittable>> result;
+            split_clusters(order, 0, _count, cluster_size < 1 ? 1 : cluster_size, result);
+            return result;
+        }
+
+        static int simd_width() {
+            // Number of spheres tested per instruction on this CPU.
+#ifdef RT_SPHERE_SET_X86
+            static const int width = __builtin_cpu_supports("avx2") ? 8 : 4;
+            return width;
+#else
+            return 1;
+#endif
+        }
+
+    private:
+        aligned_vector<float, 32> _cx, _cy, _cz, _radius;
+        std::vector<uint32_t> _material_ids;
+        std::vector<std::shared_ptr<IMaterial>> _materials;
+        std::unordered_map<const IMaterial*, uint32_t> _material_lookup;
+        size_t _count;
+        Aabb _bbox;
+
+        uint32_t material_id(const std::shared_ptr<IMaterial> &material) {
+            auto found = _material_lookup.find(material.get());
+            if (found != _material_lookup.end()) {
+                return found->second;
+            }
+            uint32_t id = static_cast<uint32_t>(_materials.size());
+            _materials.push_back(material);
+            _material_lookup[material.get()] = id;
+            return id;
+        }
+
+        void split_clusters(std::vector<uint32_t> &order, size_t begin, size_t end, size_t cluster_size,
+                            std::vector<std::shared_ptr<IHittable>> &result) const {
+            if (end - begin <= cluster_size) {
+                auto cluster = std::make_shared<SphereSet>();
+                for (size_t i = begin; i < end; ++i) {
+                    uint32_t s = order[i];
+                    cluster->add(point3(_cx[s], _cy[s], _cz[s]), _radius[s], _materials[_material_ids[s]]);
+                }
+                result.push_back(cluster);
+                return;
+            }
+
+            Aabb centers;
+            for (size_t i = begin; i < end; ++i) {
+                centers.expand(point3(_cx[order[i]], _cy[order[i]], _cz[order[i]]));
+            }
+            const float *axis_values[3] = {_cx.data(), _cy.data(), _cz.data()};
+            const float *values = axis_values[centers.longest_axis()];
+
+            size_t mid = begin + (end - begin) / 2;
+            std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                             [values](uint32_t a, uint32_t b) { return values[a] < values[b]; });
+
+            split_clusters(order, begin, mid, cluster_size, result);
+            split_clusters(order, mid, end, cluster_size, result);
+        }
+
+        bool closest(const ray &r, Interval ray_t, float &t, size_t &index) const {
+#ifdef RT_SPHERE_SET_X86
+            if (simd_width() == 8) {
+                return closest_avx2(r, ray_t, t, index);
+            }
+            return closest_sse(r, ray_t, t, index);
+#else
+            return closest_scalar(r, ray_t, t, index);
+#endif
+        }
+
+        bool closest_scalar(const ray &r, Interval ray_t, float &t, size_t &index) const {
+            point3 origin = r.origin();
+            vec3 direction = r.direction();
+            float a = direction.lengthsq();
+            bool hit_anything = false;
+
+            for (size_t i = 0; i < _count; ++i) {
+                vec3 oc = origin - point3(_cx[i], _cy[i], _cz[i]);
+                float half_b = oc.dot(direction);
+                float c = oc.lengthsq() - _radius[i] * _radius[i];
+                float discriminant = half_b * half_b - a * c;
+                if (discriminant < 0) {
+                    continue;
+                }
+                float sqrtd = sqrtf(discriminant);
+
+                float root = (-half_b - sqrtd) / a;
+                if (!ray_t.surrounds(root)) {
+                    root = (-half_b + sqrtd) / a;
+                    if (!ray_t.surrounds(root)) {
+                        continue;
+                    }
+                }
+
+                hit_anything = true;
+                ray_t.max = root;
+                t = root;
+                index = i;
+            }
+
+            return hit_anything;
+        }
+
+        static bool reduce_lanes(const float *lane_t, const int32_t *lane_index, int width,
+                                 float &t, size_t &index) {
+            // Horizontal min over the lanes. Ties go to the lowest sphere index, like the scalar loop.
+            int best = -1;
+            for (int lane = 0; lane < width; ++lane) {
+                if (lane_index[lane] < 0) {
+                    continue;
+                }
+                if (best < 0 || lane_t[lane] < lane_t[best]
+                    || (lane_t[lane] == lane_t[best] && lane_index[lane] < lane_index[best])) {
+                    best = lane;
+                }
+            }
+            if (best < 0) {
+                return false;
+            }
+            t = lane_t[best];
+            index = static_cast<size_t>(lane_index[best]);
+            return true;
+        }
+
+#ifdef RT_SPHERE_SET_X86
+        bool closest_sse(const ray &r, Interval ray_t, float &t, size_t &index) const {
+            point3 origin = r.origin();
+            vec3 direction = r.direction();
+
+            const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+            const __m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+            const __m128 a = _mm_set1_ps(direction.lengthsq());
+            const __m128 t_min = _mm_set1_ps(ray_t.min);
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 sign = _mm_set1_ps(-0.0f);
+
+            __m128 best_t = _mm_set1_ps(ray_t.max);
+            __m128i best_index = _mm_set1_epi32(-1);
+            __m128i lane_index = _mm_setr_epi32(0, 1, 2, 3);
+            const __m128i step = _mm_set1_epi32(4);
+
+            for (size_t i = 0; i < _count; i += 4) {
+                __m128 ocx = _mm_sub_ps(ox, _mm_load_ps(&_cx[i]));
+                __m128 ocy = _mm_sub_ps(oy, _mm_load_ps(&_cy[i]));
+                __m128 ocz = _mm_sub_ps(oz, _mm_load_ps(&_cz[i]));
+                __m128 radius = _mm_load_ps(&_radius[i]);
+
+                __m128 half_b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+                __m128 oc_len = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz));
+                __m128 c = _mm_sub_ps(oc_len, _mm_mul_ps(radius, radius));
+                __m128 discriminant = _mm_sub_ps(_mm_mul_ps(half_b, half_b), _mm_mul_ps(a, c));
+                __m128 real = _mm_cmpge_ps(discriminant, zero);
+                __m128 sqrtd = _mm_sqrt_ps(_mm_max_ps(discriminant, zero));
+                __m128 neg_half_b = _mm_xor_ps(half_b, sign);
+
+                __m128 root_near = _mm_div_ps(_mm_sub_ps(neg_half_b, sqrtd), a);
+                __m128 root_far = _mm_div_ps(_mm_add_ps(neg_half_b, sqrtd), a);
+                __m128 near_ok = _mm_and_ps(real, _mm_and_ps(_mm_cmpgt_ps(root_near, t_min), _mm_cmplt_ps(root_near, best_t)));
+                __m128 far_ok = _mm_and_ps(real, _mm_and_ps(_mm_cmpgt_ps(root_far, t_min), _mm_cmplt_ps(root_far, best_t)));
+
+                __m128 root = _mm_or_ps(_mm_and_ps(near_ok, root_near), _mm_andnot_ps(near_ok, root_far));
+                __m128 hit = _mm_or_ps(near_ok, far_ok);
+
+                best_t = _mm_or_ps(_mm_and_ps(hit, root), _mm_andnot_ps(hit, best_t));
+                __m128i hit_i = _mm_castps_si128(hit);
+                best_index = _mm_or_si128(_mm_and_si128(hit_i, lane_index), _mm_andnot_si128(hit_i, best_index));
+                lane_index = _mm_add_epi32(lane_index, step);
+            }
+
+            alignas(16) float lane_t[4];
+            alignas(16) int32_t lane_best[4];
+            _mm_store_ps(lane_t, best_t);
+            _mm_store_si128(reinterpret_cast<__m128i*>(lane_best), best_index);
+            return reduce_lanes(lane_t, lane_best, 4, t, index);
+        }
+
+        __attribute__((target("avx2")))
+        bool closest_avx2(const ray &r, Interval ray_t, float &t, size_t &index) const {
+            point3 origin = r.origin();
+            vec3 direction = r.direction();
+
+            const __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+            const __m256 dx = _mm256_set1_ps(direction.x), dy = _mm256_set1_ps(direction.y), dz = _mm256_set1_ps(direction.z);
+            const __m256 a = _mm256_set1_ps(direction.lengthsq());
+            const __m256 t_min = _mm256_set1_ps(ray_t.min);
+            const __m256 zero = _mm256_setzero_ps();
+            const __m256 sign = _mm256_set1_ps(-0.0f);
+
+            __m256 best_t = _mm256_set1_ps(ray_t.max);
+            __m256i best_index = _mm256_set1_epi32(-1);
+            __m256i lane_index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+            const __m256i step = _mm256_set1_epi32(8);
+
+            for (size_t i = 0; i < _count; i += 8) {
+                __m256 ocx = _mm256_sub_ps(ox, _mm256_load_ps(&_cx[i]));
+                __m256 ocy = _mm256_sub_ps(oy, _mm256_load_ps(&_cy[i]));
+                __m256 ocz = _mm256_sub_ps(oz, _mm256_load_ps(&_cz[i]));
+                __m256 radius = _mm256_load_ps(&_radius[i]);
+
+                __m256 half_b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+                __m256 oc_len = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz));
+                __m256 c = _mm256_sub_ps(oc_len, _mm256_mul_ps(radius, radius));
+                __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(half_b, half_b), _mm256_mul_ps(a, c));
+                __m256 real = _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ);
+                __m256 sqrtd = _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero));
+                __m256 neg_half_b = _mm256_xor_ps(half_b, sign);
+
+                __m256 root_near = _mm256_div_ps(_mm256_sub_ps(neg_half_b, sqrtd), a);
+                __m256 root_far = _mm256_div_ps(_mm256_add_ps(neg_half_b, sqrtd), a);
+                __m256 near_ok = _mm256_and_ps(real, _mm256_and_ps(_mm256_cmp_ps(root_near, t_min, _CMP_GT_OQ),
+                                                                    _mm256_cmp_ps(root_near, best_t, _CMP_LT_OQ)));
+                __m256 far_ok = _mm256_and_ps(real, _mm256_and_ps(_mm256_cmp_ps(root_far, t_min, _CMP_GT_OQ),
+                                                                   _mm256_cmp_ps(root_far, best_t, _CMP_LT_OQ)));
+
+                __m256 root = _mm256_blendv_ps(root_far, root_near, near_ok);
+                __m256 hit = _mm256_or_ps(near_ok, far_ok);
+
+                best_t = _mm256_blendv_ps(best_t, root, hit);
+                best_index = _mm256_blendv_epi8(best_index, lane_index, _mm256_castps_si256(hit));
+                lane_index = _mm256_add_epi32(lane_index, step);
+            }
+
+            alignas(32) float lane_t[8];
+            alignas(32) int32_t lane_best[8];
+            _mm256_store_ps(lane_t, best_t);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lane_best), best_index);
+            return reduce_lanes(lane_t, lane_best, 8, t, index);
+        }
+#endif
+};
+
+#endif // SPHERE_SET_H
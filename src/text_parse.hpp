@@ -0,0 +1,154 @@
+#ifndef TEXT_PARSE_H
+#define TEXT_PARSE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Pieces shared by the text file loaders, which parse memory-mapped files in place and in
+// parallel.
+
+struct TextSlice {
+    const char *begin;
+    const char *end;
+};
+
+inline std::vector<TextSlice> split_lines(const char *text, const char *text_end, int thread_count) {
+    // Newline-aligned slices of roughly equal size, a few per thread to even out the load.
+    size_t size = static_cast<size_t>(text_end - text);
+    size_t target = std::max<size_t>(size / (static_cast<size_t>(std::max(thread_count, 1)) * 4) + 1, 1 << 16);
+    std::vector<TextSlice> slices;
+    const char *cursor = text;
+    while (cursor < text_end) {
+        const char *end = cursor + std::min<size_t>(target, text_end - cursor);
+        while (end < text_end && end[-1] != '\n') {
+            ++end;
+        }
+        slices.push_back(TextSlice{cursor, end});
+        cursor = end;
+    }
+    return slices;
+}
+
+inline bool parse_float(const char *&p, const char *end, float &value) {
+    // Plain decimals with up to 19 significant digits and a small exponent are
+    // assembled in a double and rounded once, which is what the text writer produces.
+    // Anything else (long mantissas, inf, nan, hex) goes through strtof.
+    static const double powers[23] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    const char *s = p;
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+')) {
+        negative = *s == '-';
+        ++s;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool any = false;
+    bool exact = true;
+    for (; s < end && *s >= '0' && *s <= '9'; ++s) {
+        any = true;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*s - '0');
+            digits += mantissa > 0;
+        } else {
+            ++exponent;
+            exact = false;
+        }
+    }
+    if (s < end && *s == '.') {
+        for (++s; s < end && *s >= '0' && *s <= '9'; ++s) {
+            any = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*s - '0');
+                digits += mantissa > 0;
+                --exponent;
+            } else {
+                exact = false;
+            }
+        }
+    }
+    if (any && s < end && (*s == 'e' || *s == 'E')) {
+        const char *e = s + 1;
+        bool negative_exponent = false;
+        if (e < end && (*e == '-' || *e == '+')) {
+            negative_exponent = *e == '-';
+            ++e;
+        }
+        int written = 0;
+        bool exponent_digits = false;
+        for (; e < end && *e >= '0' && *e <= '9'; ++e) {
+            exponent_digits = true;
+            written = std::min(written * 10 + (*e - '0'), 10000);
+        }
+        if (exponent_digits) {
+            exponent += negative_exponent ? -written : written;
+            s = e;
+        } else {
+            exact = false;
+        }
+    }
+
+    bool terminated = s == end || *s == ' ' || *s == '\t' || *s == '\r';
+    if (any && terminated && exact && mantissa < (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+        double d = static_cast<double>(mantissa);
+        d = exponent < 0 ? d / powers[-exponent] : d * powers[exponent];
+        value = static_cast<float>(negative ? -d : d);
+        p = s;
+        return true;
+    }
+
+    // Slow path over a terminated copy of the field.
+    const char *field_end = p;
+    while (field_end < end && *field_end != ' ' && *field_end != '\t' && *field_end != '\r') {
+        ++field_end;
+    }
+    char field[64];
+    size_t length = field_end - p;
+    if (length == 0 || length >= sizeof(field)) {
+        return false;
+    }
+    std::memcpy(field, p, length);
+    field[length] = '\0';
+    char *parsed_end;
+    value = std::strtof(field, &parsed_end);
+    if (parsed_end != field + length) {
+        return false;
+    }
+    p = field_end;
+    return true;
+}
+
+inline bool parse_int(const char *&p, const char *end, int64_t &value) {
+    // A decimal integer with an optional sign. Stops at the first other character, which the
+    // caller checks, so OBJ's "7/2/7" reads as 7 followed by "/2/7".
+    const char *s = p;
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+')) {
+        negative = *s == '-';
+        ++s;
+    }
+    const char *digits = s;
+    uint64_t magnitude = 0;
+    for (; s < end && *s >= '0' && *s <= '9'; ++s) {
+        magnitude = magnitude * 10 + (*s - '0');
+        if (magnitude > (uint64_t(1) << 62)) {
+            return false;
+        }
+    }
+    if (s == digits) {
+        return false;
+    }
+    value = negative ? -static_cast<int64_t>(magnitude) : static_cast<int64_t>(magnitude);
+    p = s;
+    return true;
+}
+
+#endif // TEXT_PARSE_H
@@ -0,0 +1,160 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A small work-stealing thread pool.
+//
+// Every worker owns a deque of tasks. A worker pops from the back of its own
+// deque and, when that runs dry, steals from the front of the other workers'
+// deques. Tasks submitted from outside the pool are dealt out round-robin.
+class ThreadPool {
+    public:
+        using Task = std::function<void()>;
+
+        explicit ThreadPool(int thread_count = 0)
+            : _queued(0), _pending(0), _next_queue(0), _stopping(false) {
+            if (thread_count <= 0) {
+                thread_count = static_cast<int>(std::thread::hardware_concurrency());
+            }
+            thread_count = (thread_count < 1) ? 1 : thread_count;
+
+            for (int i = 0; i < thread_count; ++i) {
+                _queues.emplace_back(new WorkQueue());
+            }
+            for (int i = 0; i < thread_count; ++i) {
+                _workers.emplace_back(&ThreadPool::worker_loop, this, i);
+            }
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stopping = true;
+            }
+            _work_available.notify_all();
+
+            for (auto &worker : _workers) {
+                worker.join();
+            }
+        }
+
+        int size() const { return static_cast<int>(_workers.size()); }
+
+        void submit(Task task) {
+            // Tasks spawned by a worker go to its own deque, so they stay warm in its cache.
+            size_t index = (current_pool() == this)
+                ? static_cast<size_t>(current_index())
+                : _next_queue++ % _queues.size();
+
+            ++_pending;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                ++_queued;
+            }
+            {
+                std::lock_guard<std::mutex> lock(_queues[index]->mutex);
+                _queues[index]->tasks.push_back(std::move(task));
+            }
+            _work_available.notify_one();
+        }
+
+        void wait() {
+            // Blocks until every submitted task has finished running.
+            std::unique_lock<std::mutex> lock(_mutex);
+            _all_done.wait(lock, [this]() { return _pending.load() == 0; });
+        }
+
+    private:
+        struct WorkQueue {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        std::vector<std::unique_ptr<WorkQueue>> _queues;
+        std::vector<std::thread> _workers;
+
+        size_t _queued;                  // Tasks sitting in any deque, guarded by _mutex
+        std::atomic<size_t> _pending;    // Tasks submitted but not yet finished
+        std::atomic<size_t> _next_queue; // Round-robin cursor for external submissions
+        bool _stopping;
+
+        std::mutex _mutex;
+        std::condition_variable _work_available;
+        std::condition_variable _all_done;
+
+        static ThreadPool*& current_pool() {
+            static thread_local ThreadPool *pool = nullptr;
+            return pool;
+        }
+
+        static int& current_index() {
+            static thread_local int index = -1;
+            return index;
+        }
+
+        bool try_pop(size_t index, Task &task) {
+            WorkQueue &queue = *_queues[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) {
+                return false;
+            }
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            return true;
+        }
+
+        bool try_steal(size_t thief, Task &task) {
+            for (size_t offset = 1; offset < _queues.size(); ++offset) {
+                WorkQueue &queue = *_queues[(thief + offset) % _queues.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (!queue.tasks.empty()) {
+                    task = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void worker_loop(int index) {
+            current_pool() = this;
+            current_index() = index;
+
+            while (true) {
+                Task task;
+                if (try_pop(index, task) || try_steal(index, task)) {
+                    {
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        --_queued;
+                    }
+                    task();
+
+                    if (--_pending == 0) {
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        _all_done.notify_all();
+                    }
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(_mutex);
+                _work_available.wait(lock, [this]() { return _stopping || _queued > 0; });
+                if (_stopping && _queued == 0) {
+                    return;
+                }
+            }
+        }
+};
+
+#endif // THREAD_POOL_H
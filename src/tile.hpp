@@ -0,0 +1,63 @@
+#ifndef TILE_H
+#define TILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+struct Tile {
+    int id;     // Row-major index of the tile in the tile grid, stable across schedules
+    int x0, y0; // Upper left pixel (inclusive)
+    int x1, y1; // Lower right pixel (exclusive)
+
+    int width() const { return x1 - x0; }
+    int height() const { return y1 - y0; }
+    int pixel_count() const { return width() * height(); }
+};
+
+inline uint32_t morton_part_1by1(uint32_t x) {
+    // Spreads the lower 16 bits of x so that there is a zero bit between each of them.
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+inline uint32_t morton_encode(uint32_t x, uint32_t y) {
+    return morton_part_1by1(x) | (morton_part_1by1(y) << 1);
+}
+
+inline std::vector<Tile> make_tiles(int image_width, int image_height, int tile_size) {
+    // Splits the image into tile_size x tile_size tiles (smaller along the right and bottom
+    // edges) and returns them in Morton (Z-curve) order, so neighbouring tiles are scheduled
+    // close together and share the parts of the scene they touch.
+    tile_size = (tile_size < 1) ? 1 : tile_size;
+    int tiles_x = (image_width + tile_size - 1) / tile_size;
+    int tiles_y = (image_height + tile_size - 1) / tile_size;
+
+    std::vector<Tile> tiles;
+    tiles.reserve(tiles_x * tiles_y);
+
+    for (int ty = 0; ty < tiles_y; ++ty) {
+        for (int tx = 0; tx < tiles_x; ++tx) {
+            Tile tile;
+            tile.id = ty * tiles_x + tx;
+            tile.x0 = tx * tile_size;
+            tile.y0 = ty * tile_size;
+            tile.x1 = std::min(tile.x0 + tile_size, image_width);
+            tile.y1 = std::min(tile.y0 + tile_size, image_height);
+            tiles.push_back(tile);
+        }
+    }
+
+    std::sort(tiles.begin(), tiles.end(), [tile_size](const Tile &a, const Tile &b) {
+        return morton_encode(a.x0 / tile_size, a.y0 / tile_size)
+             < morton_encode(b.x0 / tile_size, b.y0 / tile_size);
+    });
+
+    return tiles;
+}
+
+#endif // TILE_H
@@ -0,0 +1,134 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <cmath>
+
+#include "aabb.hpp"
+#include "rtweekend.hpp"
+#include "vec3.hpp"
+
+// Affine transform of column vectors: a 3x3 linear part in the first three columns of m and
+// a translation in the last. 48 bytes, so it can be kept per instance.
+class Transform {
+    public:
+        float m[3][4];
+
+        Transform() {
+            for (int row = 0; row < 3; ++row) {
+                for (int col = 0; col < 4; ++col) {
+                    m[row][col] = row == col ? 1.0f : 0.0f;
+                }
+            }
+        }
+
+        static Transform translate(const vec3 &offset) {
+            Transform t;
+            t.m[0][3] = offset.x;
+            t.m[1][3] = offset.y;
+            t.m[2][3] = offset.z;
+            return t;
+        }
+
+        static Transform scale(const vec3 &factors) {
+            Transform t;
+            t.m[0][0] = factors.x;
+            t.m[1][1] = factors.y;
+            t.m[2][2] = factors.z;
+            return t;
+        }
+
+        static Transform scale(float factor) { return scale(vec3(factor, factor, factor)); }
+
+        static Transform rotate(const vec3 &axis, float degrees) {
+            // Counterclockwise looking down the axis (Rodrigues' formula).
+            vec3 a = axis.unit();
+            float s = std::sin(degrees_to_radians(degrees));
+            float c = std::cos(degrees_to_radians(degrees));
+            float k = 1 - c;
+            Transform t;
+            t.m[0][0] = c + a.x * a.x * k;       t.m[0][1] = a.x * a.y * k - a.z * s; t.m[0][2] = a.x * a.z * k + a.y * s;
+            t.m[1][0] = a.y * a.x * k + a.z * s; t.m[1][1] = c + a.y * a.y * k;       t.m[1][2] = a.y * a.z * k - a.x * s;
+            t.m[2][0] = a.z * a.x * k - a.y * s; t.m[2][1] = a.z * a.y * k + a.x * s; t.m[2][2] = c + a.z * a.z * k;
+            return t;
+        }
+
+        Transform operator*(const Transform &b) const {
+            // Applies b first, then this.
+            Transform t;
+            for (int row = 0; row < 3; ++row) {
+                for (int col = 0; col < 4; ++col) {
+                    float sum = col == 3 ? m[row][3] : 0.0f;
+                    for (int k = 0; k < 3; ++k) {
+                        sum += m[row][k] * b.m[k][col];
+                    }
+                    t.m[row][col] = sum;
+                }
+            }
+            return t;
+        }
+
+        Transform inverse() const {
+            // The linear part through its adjugate, then the translation undone. A singular
+            // transform (a zero scale) gives infinities, like a division by zero would.
+            float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+            float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+            float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+            float inv_det = 1 / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+
+            Transform t;
+            t.m[0][0] = c00 * inv_det;
+            t.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+            t.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+            t.m[1][0] = c01 * inv_det;
+            t.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+            t.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+            t.m[2][0] = c02 * inv_det;
+            t.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+            t.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+            for (int row = 0; row < 3; ++row) {
+                t.m[row][3] = -(t.m[row][0] * m[0][3] + t.m[row][1] * m[1][3] + t.m[row][2] * m[2][3]);
+            }
+            return t;
+        }
+
+        point3 apply_point(const point3 &p) const {
+            return point3(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                          m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                          m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+        }
+
+        vec3 apply_vector(const vec3 &v) const {
+            return vec3(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                        m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                        m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+        }
+
+        vec3 apply_transposed(const vec3 &v) const {
+            // The transposed linear part. Applied with the inverse of a transform, it carries
+            // normals through that transform.
+            return vec3(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+                        m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+                        m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+        }
+
+        Aabb apply_box(const Aabb &box) const {
+            // Bounds of the transformed box (Arvo 1990): per output axis, each input axis
+            // adds whichever of its two extremes gives the smaller and the larger value.
+            if (box.is_empty()) {
+                return box;
+            }
+            float lo[3], hi[3];
+            for (int row = 0; row < 3; ++row) {
+                lo[row] = hi[row] = m[row][3];
+                for (int k = 0; k < 3; ++k) {
+                    float a = m[row][k] * box.min[k];
+                    float b = m[row][k] * box.max[k];
+                    lo[row] += fminf(a, b);
+                    hi[row] += fmaxf(a, b);
+                }
+            }
+            return Aabb(point3(lo[0], lo[1], lo[2]), point3(hi[0], hi[1], hi[2]));
+        }
+};
+
+#endif // TRANSFORM_H
@@ -1,85 +1,374 @@
 #ifndef VEC3_H
 #define VEC3_H
 
+#include "random.hpp"
 #include "rtweekend.hpp"
-#include <iostream>
 #include <cmath>
+#include <cstddef>
+#include <iostream>
+#include <type_traits>
+
+#if defined(RT_VEC3_SSE) || defined(RT_VEC3_AVX)
+#include <immintrin.h>
+#endif
+
+// 3D vectors, as a template over the scalar type and a SIMD backend picked at build time with
+// -DRAYTRACER_SIMD (SCALAR, SSE or AVX; see CMakeLists.txt):
+//   ScalarBackend  three plain scalars, 12 bytes for float
+//   SseBackend     float vectors in one 16-byte aligned __m128, the fourth lane kept at zero
+//   AvxBackend     SSE vectors compiled with AVX, and 8-wide packets
+// Other scalar types (double) always use the generic scalar code. The renderer itself works
+// in float throughout; vec3, point3 and color are the float vector of the chosen backend.
+//
+// basic_vec3xN holds N vectors as structure-of-arrays for packet code: one vector per lane,
+// with every operation applied to all lanes in loops the compiler vectorizes.
+
+struct ScalarBackend {
+    static const bool simd = false;
+    static const int width = 4; // Lanes of the packet type
+};
+
+struct SseBackend {
+    static const bool simd = true;
+    static const int width = 4;
+};
+
+struct AvxBackend {
+    static const bool simd = true;
+    static const int width = 8;
+};
+
+#if defined(RT_VEC3_AVX)
+using Vec3Backend = AvxBackend;
+#elif defined(RT_VEC3_SSE)
+using Vec3Backend = SseBackend;
+#else
+using Vec3Backend = ScalarBackend;
+#endif
+
+template <typename T, typename Backend, typename Enable = void>
+struct basic_vec3 {
+    using value_type = T;
 
-struct vec3 {
     union {
         struct {
-            float x, y, z;
+            T x, y, z;
         };
         struct {
-            float r, g, b;
+            T r, g, b;
         };
-        float e[3];
+        T e[3];
     };
 
-    vec3() : e{0, 0, 0} {}
-    vec3(float x, float y, float z) : e{x, y, z} {}
+    basic_vec3() : e{0, 0, 0} {}
+    basic_vec3(T x, T y, T z) : e{x, y, z} {}
 
-    vec3 operator-() const { return vec3(-x, -y, -z); }
-    float operator[](int i) const { return e[i]; }
-    float& operator[](int i) { return e[i]; }
+    basic_vec3 operator-() const { return basic_vec3(-x, -y, -z); }
+    T operator[](int i) const { return e[i]; }
+    T& operator[](int i) { return e[i]; }
 
-    vec3& operator+=(const vec3 &v) {
+    basic_vec3& operator+=(const basic_vec3 &v) {
         x += v.x;
         y += v.y;
         z += v.z;
         return *this;
     }
 
-    vec3& operator*=(float t) {
+    basic_vec3& operator*=(T t) {
         x *= t;
         y *= t;
         z *= t;
         return *this;
     }
 
-    vec3& operator/=(float t) {
+    basic_vec3& operator/=(T t) {
         x /= t;
         y /= t;
         z /= t;
         return *this;
     }
 
-    float dot(const vec3 &v) const {
+    T dot(const basic_vec3 &v) const {
         return x*v.x + y*v.y + z*v.z;
     }
 
-    vec3 cross(const vec3 &v) {
-        return vec3(y*v.z - z*v.y,
-                    z*v.x - x*v.z,
-                    x*v.y - y*v.x);
+    basic_vec3 cross(const basic_vec3 &v) const {
+        return basic_vec3(y*v.z - z*v.y,
+                          z*v.x - x*v.z,
+                          x*v.y - y*v.x);
     }
 
-    vec3 unit() const {
-        const float len = length();
-        return vec3(x / len,
-                    y / len,
-                    z / len);
+    basic_vec3 unit() const {
+        const T len = length();
+        return basic_vec3(x / len,
+                          y / len,
+                          z / len);
     }
 
-    float length() const { return sqrtf(x*x + y*y + z*z); }
+    T length() const { return std::sqrt(x*x + y*y + z*z); }
 
-    float lengthsq() const { return x*x + y*y + z*z; }
+    T lengthsq() const { return x*x + y*y + z*z; }
 
     bool near_zero() const {
         // Return true if the vector is close to zero in all dimentions.
-        float s = 1e-8;
-        return (fabsf(e[0]) < s) && (fabsf(e[1]) < s) && (fabsf(e[2]) < s);
+        T s = T(1e-8);
+        return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) && (std::fabs(e[2]) < s);
+    }
+
+    static basic_vec3 random() {
+        // Drawn in x, y, z order; the order of evaluation of constructor arguments is not.
+        T x = random_float();
+        T y = random_float();
+        return basic_vec3(x, y, random_float());
+    }
+
+    static basic_vec3 random(T min, T max) {
+        T x = random_float(min, max);
+        T y = random_float(min, max);
+        return basic_vec3(x, y, random_float(min, max));
+    }
+
+    friend basic_vec3 operator+(const basic_vec3 &u, const basic_vec3 &v) {
+        return basic_vec3(u.x + v.x, u.y + v.y, u.z + v.z);
+    }
+
+    friend basic_vec3 operator-(const basic_vec3 &u, const basic_vec3 &v) {
+        return basic_vec3(u.x - v.x, u.y - v.y, u.z - v.z);
+    }
+
+    friend basic_vec3 operator*(const basic_vec3 &u, const basic_vec3 &v) {
+        return basic_vec3(u.x * v.x, u.y * v.y, u.z * v.z);
+    }
+
+    friend basic_vec3 operator*(T t, const basic_vec3 &v) {
+        return basic_vec3(t * v.x, t * v.y, t * v.z);
     }
 
-    static vec3 random() {
-        return vec3(random_float(), random_float(), random_float());
+    friend basic_vec3 operator*(const basic_vec3 &v, T t) {
+        return t * v;
     }
 
-    static vec3 random(float min, float max) {
-        return vec3(random_float(min, max), random_float(min, max), random_float(min, max));
+    friend basic_vec3 operator/(const basic_vec3 &v, T t) {
+        return basic_vec3(v.x / t,
+                          v.y / t,
+                          v.z / t);
     }
 };
 
+#if defined(RT_VEC3_SSE) || defined(RT_VEC3_AVX)
+template <typename Backend>
+struct alignas(16) basic_vec3<float, Backend, typename std::enable_if<Backend::simd>::type> {
+    using value_type = float;
+
+    union {
+        __m128 m; // x, y, z, 0
+        struct {
+            float x, y, z, w;
+        };
+        struct {
+            float r, g, b, a;
+        };
+        float e[4];
+    };
+
+    basic_vec3() : m(_mm_setzero_ps()) {}
+    basic_vec3(float x, float y, float z) : m(_mm_setr_ps(x, y, z, 0.0f)) {}
+    explicit basic_vec3(__m128 v) : m(v) {}
+
+    basic_vec3 operator-() const { return basic_vec3(_mm_sub_ps(_mm_setzero_ps(), m)); }
+    float operator[](int i) const { return e[i]; }
+    float& operator[](int i) { return e[i]; }
+
+    basic_vec3& operator+=(const basic_vec3 &v) {
+        m = _mm_add_ps(m, v.m);
+        return *this;
+    }
+
+    basic_vec3& operator*=(float t) {
+        m = _mm_mul_ps(m, _mm_set1_ps(t));
+        return *this;
+    }
+
+    basic_vec3& operator/=(float t) {
+        // The fourth lane is divided by one so it stays zero.
+        m = _mm_div_ps(m, _mm_setr_ps(t, t, t, 1.0f));
+        return *this;
+    }
+
+    float dot(const basic_vec3 &v) const {
+        // Summed in the order x, y, z like the scalar backend, so both round the same way.
+        __m128 p = _mm_mul_ps(m, v.m);
+        __m128 xy = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+        return _mm_cvtss_f32(_mm_add_ss(xy, _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2))));
+    }
+
+    basic_vec3 cross(const basic_vec3 &v) const {
+        __m128 a_yzx = _mm_shuffle_ps(m, m, _MM_SHUFFLE(3, 0, 2, 1));
+        __m128 b_yzx = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(3, 0, 2, 1));
+        __m128 c = _mm_sub_ps(_mm_mul_ps(m, b_yzx), _mm_mul_ps(a_yzx, v.m));
+        return basic_vec3(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+    }
+
+    basic_vec3 unit() const {
+        return *this / length();
+    }
+
+    float length() const { return sqrtf(lengthsq()); }
+
+    float lengthsq() const { return dot(*this); }
+
+    bool near_zero() const {
+        // Return true if the vector is close to zero in all dimentions.
+        __m128 magnitude = _mm_andnot_ps(_mm_set1_ps(-0.0f), m);
+        return (_mm_movemask_ps(_mm_cmplt_ps(magnitude, _mm_set1_ps(1e-8f))) & 7) == 7;
+    }
+
+    static basic_vec3 random() {
+        float x = random_float();
+        float y = random_float();
+        return basic_vec3(x, y, random_float());
+    }
+
+    static basic_vec3 random(float min, float max) {
+        float x = random_float(min, max);
+        float y = random_float(min, max);
+        return basic_vec3(x, y, random_float(min, max));
+    }
+
+    friend basic_vec3 operator+(const basic_vec3 &u, const basic_vec3 &v) {
+        return basic_vec3(_mm_add_ps(u.m, v.m));
+    }
+
+    friend basic_vec3 operator-(const basic_vec3 &u, const basic_vec3 &v) {
+        return basic_vec3(_mm_sub_ps(u.m, v.m));
+    }
+
+    friend basic_vec3 operator*(const basic_vec3 &u, const basic_vec3 &v) {
+        return basic_vec3(_mm_mul_ps(u.m, v.m));
+    }
+
+    friend basic_vec3 operator*(float t, const basic_vec3 &v) {
+        return basic_vec3(_mm_mul_ps(_mm_set1_ps(t), v.m));
+    }
+
+    friend basic_vec3 operator*(const basic_vec3 &v, float t) {
+        return t * v;
+    }
+
+    friend basic_vec3 operator/(const basic_vec3 &v, float t) {
+        return basic_vec3(_mm_div_ps(v.m, _mm_setr_ps(t, t, t, 1.0f)));
+    }
+};
+#endif
+
+template <typename T, int N>
+struct alignas(N * sizeof(T) >= 32 ? 32 : N * sizeof(T)) basic_vec3xN {
+    static const int width = N;
+
+    T x[N], y[N], z[N];
+
+    basic_vec3xN() {
+        for (int i = 0; i < N; ++i) {
+            x[i] = y[i] = z[i] = 0;
+        }
+    }
+
+    template <typename Backend>
+    static basic_vec3xN broadcast(const basic_vec3<T, Backend> &v) {
+        basic_vec3xN result;
+        for (int i = 0; i < N; ++i) {
+            result.x[i] = v.x;
+            result.y[i] = v.y;
+            result.z[i] = v.z;
+        }
+        return result;
+    }
+
+    template <typename Backend>
+    void set(int lane, const basic_vec3<T, Backend> &v) {
+        x[lane] = v.x;
+        y[lane] = v.y;
+        z[lane] = v.z;
+    }
+
+    template <typename Backend = Vec3Backend>
+    basic_vec3<T, Backend> get(int lane) const {
+        return basic_vec3<T, Backend>(x[lane], y[lane], z[lane]);
+    }
+
+    void dot(const basic_vec3xN &v, T *out) const {
+        for (int i = 0; i < N; ++i) {
+            out[i] = x[i]*v.x[i] + y[i]*v.y[i] + z[i]*v.z[i];
+        }
+    }
+
+    void lengthsq(T *out) const { dot(*this, out); }
+
+    basic_vec3xN cross(const basic_vec3xN &v) const {
+        basic_vec3xN result;
+        for (int i = 0; i < N; ++i) {
+            result.x[i] = y[i]*v.z[i] - z[i]*v.y[i];
+            result.y[i] = z[i]*v.x[i] - x[i]*v.z[i];
+            result.z[i] = x[i]*v.y[i] - y[i]*v.x[i];
+        }
+        return result;
+    }
+
+    basic_vec3xN unit() const {
+        basic_vec3xN result;
+        for (int i = 0; i < N; ++i) {
+            T len = std::sqrt(x[i]*x[i] + y[i]*y[i] + z[i]*z[i]);
+            result.x[i] = x[i] / len;
+            result.y[i] = y[i] / len;
+            result.z[i] = z[i] / len;
+        }
+        return result;
+    }
+
+    friend basic_vec3xN operator+(const basic_vec3xN &u, const basic_vec3xN &v) {
+        basic_vec3xN result;
+        for (int i = 0; i < N; ++i) {
+            result.x[i] = u.x[i] + v.x[i];
+            result.y[i] = u.y[i] + v.y[i];
+            result.z[i] = u.z[i] + v.z[i];
+        }
+        return result;
+    }
+
+    friend basic_vec3xN operator-(const basic_vec3xN &u, const basic_vec3xN &v) {
+        basic_vec3xN result;
+        for (int i = 0; i < N; ++i) {
+            result.x[i] = u.x[i] - v.x[i];
+            result.y[i] = u.y[i] - v.y[i];
+            result.z[i] = u.z[i] - v.z[i];
+        }
+        return result;
+    }
+
+    friend basic_vec3xN operator*(const basic_vec3xN &u, const basic_vec3xN &v) {
+        basic_vec3xN result;
+        for (int i = 0; i < N; ++i) {
+            result.x[i] = u.x[i] * v.x[i];
+            result.y[i] = u.y[i] * v.y[i];
+            result.z[i] = u.z[i] * v.z[i];
+        }
+        return result;
+    }
+
+    friend basic_vec3xN operator*(T t, const basic_vec3xN &v) {
+        basic_vec3xN result;
+        for (int i = 0; i < N; ++i) {
+            result.x[i] = t * v.x[i];
+            result.y[i] = t * v.y[i];
+            result.z[i] = t * v.z[i];
+        }
+        return result;
+    }
+};
+
+using vec3 = basic_vec3<float, Vec3Backend>;
+using vec3xN = basic_vec3xN<float, Vec3Backend::width>;
+
 // Type aliases for vec3
 using point3 = vec3; // 3D point
 using color = vec3; // RGB color
@@ -88,62 +377,71 @@ inline std::ostream& operator<<(std::ostream &out, const vec3 &v) {
     return out << v.x << ' ' << v.y << ' ' << v.z;
 }
 
-inline vec3 operator+(const vec3 &u, const vec3 &v) {
-    return vec3(u.x + v.x, u.y + v.y, u.z + v.z);
-}
-
-inline vec3 operator-(const vec3 &u, const vec3 &v) {
-    return vec3(u.x - v.x, u.y - v.y, u.z - v.z);
+inline float dot(const vec3 &u, const vec3 &v) {
+    return u.dot(v);
 }
 
-inline vec3 operator*(const vec3 &u, const vec3 &v) {
-    return vec3(u.x * v.x, u.y * v.y, u.z * v.z);
+inline vec3 cross(const vec3 &u, const vec3 &v) {
+    return u.cross(v);
 }
 
-inline vec3 operator*(float t, const vec3 &v) {
-    return vec3(t * v.x, t * v.y, t * v.z); 
-}
+// Closed-form warps from the unit square [0,1)^2. They keep the stratification of their
+// inputs, which the rejection loops they replace threw away, and cost a fixed amount of work.
 
-inline vec3 operator*(const vec3 &v, float t) {
-    return t * v; 
+inline vec3 concentric_disk(float u, float v) {
+    // Shirley and Chiu's concentric map onto the unit disk (z = 0): squares become rings, so
+    // neighbouring points stay neighbours.
+    float a = 2 * u - 1;
+    float b = 2 * v - 1;
+    if (a == 0 && b == 0) {
+        return vec3(0, 0, 0);
+    }
+    float r, phi;
+    if (a * a > b * b) {
+        r = a;
+        phi = (pi / 4) * (b / a);
+    } else {
+        r = b;
+        phi = (pi / 2) - (pi / 4) * (a / b);
+    }
+    return vec3(r * cosf(phi), r * sinf(phi), 0);
 }
 
-inline vec3 operator/(const vec3 &v, float t) {
-    return vec3(v.x / t,
-                v.y / t,
-                v.z / t);
+inline vec3 uniform_sphere(float u, float v) {
+    // Uniform direction on the unit sphere, by Archimedes' hat-box theorem.
+    float z = 1 - 2 * u;
+    float r = sqrtf(fmaxf(0.0f, 1 - z * z));
+    float phi = 2 * pi * v;
+    return vec3(r * cosf(phi), r * sinf(phi), z);
 }
 
-inline float dot(const vec3 &u, const vec3 &v) {
-    return u.x*v.x + u.y*v.y + u.z*v.z;
+inline vec3 cosine_hemisphere(float u, float v) {
+    // Cosine-weighted direction around +z: a concentric disk point lifted onto the hemisphere.
+    vec3 d = concentric_disk(u, v);
+    return vec3(d.x, d.y, sqrtf(fmaxf(0.0f, 1 - d.x * d.x - d.y * d.y)));
 }
 
-inline vec3 cross(const vec3 &u, const vec3 &v) {
-    return vec3(u.y*v.z - u.z*v.y,
-                u.z*v.x - u.x*v.z,
-                u.x*v.y - u.y*v.x);
+inline void make_basis(const vec3 &n, vec3 &t, vec3 &b) {
+    // Tangents t and b completing the unit vector n to an orthonormal basis, without branches
+    // on n's largest axis (Duff et al., "Building an Orthonormal Basis, Revisited").
+    float sign = copysignf(1.0f, n.z);
+    float a = -1.0f / (sign + n.z);
+    float c = n.x * n.y * a;
+    t = vec3(1.0f + sign * n.x * n.x * a, sign * c, -sign * n.x);
+    b = vec3(c, sign + n.y * n.y * a, -n.y);
 }
 
 inline vec3 random_in_unit_disk() {
-    while(true) {
-        vec3 p = vec3(random_float(-1, 1), random_float(-1, 1), 0);
-        if (p.lengthsq() < 1) {
-            return p;
-        }
-    }
+    return concentric_disk(random_float(), random_float());
 }
 
-inline vec3 random_in_unit_sphere() {
-    while (true) {
-        vec3 p = vec3::random(-1, 1);
-        if (p.lengthsq() < 1) {
-            return p;
-        }
-    }
+inline vec3 random_unit_vector() {
+    return uniform_sphere(random_float(), random_float());
 }
 
-inline vec3 random_unit_vector() {
-    return random_in_unit_sphere().unit();
+inline vec3 random_in_unit_sphere() {
+    // The cube root spreads the radii so the points are uniform in volume.
+    return cbrtf(random_float()) * random_unit_vector();
 }
 
 inline vec3 random_on_hemisphere(const vec3& normal) {
@@ -159,8 +457,8 @@ inline vec3 reflect(const vec3& v, const vec3& n) {
     return v - 2 * v.dot(n) * n;
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
-    float cos_theta = fminf((-uv).dot(n), 1.0);
+inline vec3 refract(const vec3& uv, const vec3& n, float etai_over_etat) {
+    float cos_theta = fminf((-uv).dot(n), 1.0f);
     vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
     vec3 r_out_parallel = -sqrtf(fabsf(1.0f - r_out_perp.lengthsq())) * n;
     return r_out_perp + r_out_parallel;
@@ -0,0 +1,396 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "aligned.hpp"
+#include "camera.hpp"
+#include "framebuffer.hpp"
+#include "hittable.hpp"
+#include "instrument.hpp"
+#include "material.hpp"
+#include "random.hpp"
+#include "sampler.hpp"
+#include "thread_pool.hpp"
+#include "tile.hpp"
+
+struct WavefrontStats {
+    enum Stage { Generate, Intersect, Sort, Shade, Compact, StageCount };
+
+    double   seconds[StageCount] = {}; // Time spent in each stage, summed over threads
+    uint64_t items[StageCount] = {};   // Paths each stage processed
+    uint64_t shaded[4] = {};           // Hits shaded per MaterialType
+
+    void merge(const WavefrontStats &other) {
+        for (int stage = 0; stage < StageCount; ++stage) {
+            seconds[stage] += other.seconds[stage];
+            items[stage] += other.items[stage];
+        }
+        for (int type = 0; type < 4; ++type) {
+            shaded[type] += other.shaded[type];
+        }
+    }
+};
+
+inline std::ostream& operator<<(std::ostream &out, const WavefrontStats &stats) {
+    static const char *names[WavefrontStats::StageCount] = {"generate", "intersect", "sort", "shade", "compact"};
+    for (int stage = 0; stage < WavefrontStats::StageCount; ++stage) {
+        double seconds = stats.seconds[stage];
+        out << "  " << names[stage] << ": " << stats.items[stage] << " paths in " << seconds << "s, "
+            << (seconds > 0 ? stats.items[stage] / seconds / 1e6 : 0.0) << " Mpaths/s per thread\n";
+    }
+    return out << "  shaded: " << stats.shaded[0] << " lambertian, " << stats.shaded[1] << " metal, "
+               << stats.shaded[2] << " dielectric, " << stats.shaded[3] << " other";
+}
+
+template <typename Material>
+struct WavefrontScatter {
+    // Calls the scatter() of a known material class directly, so it can be inlined.
+    static bool call(const IMaterial &material, const ray &r_in, const HitRecord &rec,
+                     color &attenuation, ray &scattered) {
+        return static_cast<const Material&>(material).Material::scatter(r_in, rec, attenuation, scattered);
+    }
+};
+
+template <>
+struct WavefrontScatter<IMaterial> {
+    // Materials outside the closed set go through the virtual call.
+    static bool call(const IMaterial &material, const ray &r_in, const HitRecord &rec,
+                     color &attenuation, ray &scattered) {
+        return material.scatter(r_in, rec, attenuation, scattered);
+    }
+};
+
+// Breadth-first ("wavefront") alternative to Camera::render_frame.
+//
+// Instead of following one path to the end before starting the next, every thread keeps a
+// large batch of paths in structure-of-arrays buffers and pushes the whole batch through one
+// stage at a time: generate camera rays, intersect them all, bin the hits by material type,
+// run each material's scatter over its bin, then compact the surviving paths. Every stage is
+// one tight loop over similar work, which keeps the instruction cache and branch predictors
+// on one kind of code at a time.
+//
+// Each path carries its own generator state, so it draws exactly the random numbers it would
+// draw in Camera::render_frame, and the two renderers produce the same image.
+class WavefrontRenderer {
+    public:
+        int batch_size = 1 << 16; // Paths in flight per thread
+
+        explicit WavefrontRenderer(Camera &camera) : _camera(camera) {}
+
+        Framebuffer render_frame(const IHittable &world) {
+            Camera &cam = _camera;
+            RT_TRACE_SCOPE("frame", "width", cam.image_width);
+            cam.initialize();
+
+            std::clog << "width: " << cam.image_width << " height: " << cam.image_height << std::endl;
+
+            Framebuffer image(cam.image_width, cam.image_height);
+            std::vector<Tile> tiles = make_tiles(cam.image_width, cam.image_height, cam.tile_size);
+            cam._stats = PathStats(cam.max_depth);
+            _stats = WavefrontStats();
+            std::mutex stats_mutex;
+
+            auto start = std::chrono::steady_clock::now();
+            {
+                ThreadPool pool(cam.thread_count);
+                std::clog << "Rendering " << tiles.size() << " tiles on " << pool.size()
+                          << " threads, wavefront batches of " << batch_size << " paths" << std::endl;
+
+                for (const Tile &tile : tiles) {
+                    pool.submit([this, &cam, &world, &image, &stats_mutex, &tile]() {
+                        RT_TRACE_TILE(tile.id);
+                        PathStats path_stats(cam.max_depth);
+                        WavefrontStats stage_stats;
+                        render_tile(tile, world, image, path_stats, stage_stats);
+
+                        std::lock_guard<std::mutex> lock(stats_mutex);
+                        cam._stats.merge(path_stats);
+                        _stats.merge(stage_stats);
+                    });
+                }
+                pool.wait();
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            std::clog << "Done in " << elapsed.count() << "s, "
+                      << cam._stats.rays << " rays, "
+                      << cam._stats.rays / elapsed.count() / 1e6 << " Mrays/s\n";
+            std::clog << cam._stats << "\n";
+            std::clog << "Wavefront stages:\n" << _stats << "\n";
+
+            return image;
+        }
+
+        const WavefrontStats& stats() const { return _stats; }
+
+    private:
+        Camera &_camera;
+        WavefrontStats _stats;
+
+        struct PathBuffer {
+            aligned_vector<float, 32> ox, oy, oz; // Ray origins
+            aligned_vector<float, 32> dx, dy, dz; // Ray directions
+            aligned_vector<float, 32> tr, tg, tb; // Throughput
+            std::vector<uint32_t> slot;           // Where the path's radiance goes in the chunk
+            std::vector<int> depth;               // Rays traced so far
+            std::vector<Rng> rng;                 // The path's own random sequence
+            std::vector<SampleStream> stream;     // ... and its camera sample
+
+            void resize(size_t n) {
+                ox.resize(n); oy.resize(n); oz.resize(n);
+                dx.resize(n); dy.resize(n); dz.resize(n);
+                tr.resize(n); tg.resize(n); tb.resize(n);
+                slot.resize(n);
+                depth.resize(n);
+                rng.resize(n);
+                stream.resize(n);
+            }
+
+            void move(size_t from, size_t to) {
+                ox[to] = ox[from]; oy[to] = oy[from]; oz[to] = oz[from];
+                dx[to] = dx[from]; dy[to] = dy[from]; dz[to] = dz[from];
+                tr[to] = tr[from]; tg[to] = tg[from]; tb[to] = tb[from];
+                slot[to] = slot[from];
+                depth[to] = depth[from];
+                rng[to] = rng[from];
+                stream[to] = stream[from];
+            }
+
+            ray get_ray(size_t k) const {
+                return ray(point3(ox[k], oy[k], oz[k]), vec3(dx[k], dy[k], dz[k]));
+            }
+
+            void set_ray(size_t k, const ray &r) {
+                point3 o = r.origin();
+                vec3 d = r.direction();
+                ox[k] = o.x; oy[k] = o.y; oz[k] = o.z;
+                dx[k] = d.x; dy[k] = d.y; dz[k] = d.z;
+            }
+
+            color throughput(size_t k) const { return color(tr[k], tg[k], tb[k]); }
+
+            void set_throughput(size_t k, const color &c) {
+                tr[k] = c.r; tg[k] = c.g; tb[k] = c.b;
+            }
+        };
+
+        struct Batch {
+            PathBuffer paths;
+            std::vector<HitRecord> hits;
+            std::vector<uint8_t> alive;
+            std::vector<uint32_t> bins[4]; // Indices of the paths that hit each MaterialType
+            std::vector<color> radiance;   // Result of every path in the chunk, by slot
+        };
+
+        static double seconds_since(std::chrono::steady_clock::time_point &mark) {
+            // Returns the time since mark and moves mark to now.
+            auto now = std::chrono::steady_clock::now();
+            std::chrono::duration<double> elapsed = now - mark;
+            mark = now;
+            return elapsed.count();
+        }
+
+        void render_tile(const Tile &tile, const IHittable &world, Framebuffer &image,
+                         PathStats &path_stats, WavefrontStats &stats) const {
+            const Camera &cam = _camera;
+            const size_t spp = static_cast<size_t>(cam.samples_per_pixel);
+            const size_t total = static_cast<size_t>(tile.pixel_count()) * spp;
+            const size_t batch = static_cast<size_t>(std::max(batch_size, 1));
+
+            // Reused by every tile this thread renders.
+            static thread_local Batch state;
+            state.paths.resize(batch);
+            state.hits.resize(batch);
+            state.alive.resize(batch);
+
+            std::vector<color> pixel_sums(tile.pixel_count());
+            std::vector<float> pixel_sq_luminance(tile.pixel_count(), 0);
+
+            // Path p of the tile is sample p % spp of pixel p / spp, so a chunk of consecutive
+            // paths holds the samples of each pixel in order.
+            for (size_t chunk_begin = 0; chunk_begin < total; chunk_begin += batch) {
+                size_t chunk_size = std::min(batch, total - chunk_begin);
+                auto mark = std::chrono::steady_clock::now();
+
+                size_t live = generate(tile, chunk_begin, chunk_size, state, path_stats);
+                stats.items[WavefrontStats::Generate] += chunk_size;
+                stats.seconds[WavefrontStats::Generate] += seconds_since(mark);
+
+                while (live > 0) {
+                    size_t hit_count = intersect(world, live, state, path_stats);
+                    stats.items[WavefrontStats::Intersect] += live;
+                    stats.seconds[WavefrontStats::Intersect] += seconds_since(mark);
+
+                    bin_by_material(live, state);
+                    stats.items[WavefrontStats::Sort] += hit_count;
+                    stats.seconds[WavefrontStats::Sort] += seconds_since(mark);
+
+                    shade<Lambertian>(state.bins[0], state, path_stats);
+                    shade<Metal>(state.bins[1], state, path_stats);
+                    shade<Dielectric>(state.bins[2], state, path_stats);
+                    shade<IMaterial>(state.bins[3], state, path_stats);
+                    for (int type = 0; type < 4; ++type) {
+                        stats.shaded[type] += state.bins[type].size();
+                    }
+                    stats.items[WavefrontStats::Shade] += hit_count;
+                    stats.seconds[WavefrontStats::Shade] += seconds_since(mark);
+
+                    stats.items[WavefrontStats::Compact] += live;
+                    live = compact(live, state);
+                    stats.seconds[WavefrontStats::Compact] += seconds_since(mark);
+                }
+
+                for (size_t k = 0; k < chunk_size; ++k) {
+                    size_t local_pixel = (chunk_begin + k) / spp;
+                    float l = luminance(state.radiance[k]);
+                    pixel_sums[local_pixel] += state.radiance[k];
+                    pixel_sq_luminance[local_pixel] += l * l;
+                }
+            }
+
+            for (int local_pixel = 0; local_pixel < tile.pixel_count(); ++local_pixel) {
+                int i = tile.x0 + local_pixel % tile.width();
+                int j = tile.y0 + local_pixel / tile.width();
+                image.add_samples(i, j, pixel_sums[local_pixel], static_cast<uint32_t>(spp),
+                                  pixel_sq_luminance[local_pixel]);
+            }
+        }
+
+        size_t generate(const Tile &tile, size_t chunk_begin, size_t chunk_size, Batch &state,
+                        PathStats &path_stats) const {
+            // Stage 1: one camera ray per path. Returns the number of live paths.
+            const Camera &cam = _camera;
+            const size_t spp = static_cast<size_t>(cam.samples_per_pixel);
+            PathBuffer &paths = state.paths;
+            state.radiance.assign(chunk_size, color(0, 0, 0));
+
+            if (cam.max_depth <= 0) {
+                path_stats.path_lengths[0] += chunk_size;
+                return 0;
+            }
+
+            for (size_t k = 0; k < chunk_size; ++k) {
+                size_t path = chunk_begin + k;
+                int local_pixel = static_cast<int>(path / spp);
+                int i = tile.x0 + local_pixel % tile.width();
+                int j = tile.y0 + local_pixel / tile.width();
+
+                uint64_t pixel_index = static_cast<uint64_t>(j) * cam.image_width + i;
+                seed_sample(cam.seed, pixel_index, path % spp);
+                start_sample(cam._sampler.get(), pixel_index, static_cast<uint32_t>(path % spp));
+                paths.set_ray(k, cam.get_ray(i, j));
+                paths.set_throughput(k, color(1, 1, 1));
+                paths.slot[k] = static_cast<uint32_t>(k);
+                paths.depth[k] = 0;
+                paths.rng[k] = thread_rng();
+                paths.stream[k] = thread_sample_stream();
+            }
+            return chunk_size;
+        }
+
+        size_t intersect(const IHittable &world, size_t live, Batch &state, PathStats &path_stats) const {
+            // Stage 2: closest hit for every live path. Paths that escape pick up the sky and
+            // are done. Returns the number of hits.
+            PathBuffer &paths = state.paths;
+            size_t hit_count = 0;
+
+            for (size_t k = 0; k < live; ++k) {
+                ray r = paths.get_ray(k);
+                ++paths.depth[k];
+                RT_COUNT(paths.depth[k] == 1 ? Counter::PrimaryRays : Counter::SecondaryRays);
+
+                if (world.hit(r, Interval(0.001f, infinity), state.hits[k])) {
+                    state.alive[k] = 1;
+                    ++hit_count;
+                } else {
+                    RT_COUNT(Counter::PathsEscaped);
+                    state.radiance[paths.slot[k]] = paths.throughput(k) * _camera.background(r);
+                    finish(paths.depth[k], path_stats);
+                    state.alive[k] = 0;
+                }
+            }
+            return hit_count;
+        }
+
+        void bin_by_material(size_t live, Batch &state) const {
+            // Stage 3: group the hits by material type, keeping path order within each group.
+            for (int type = 0; type < 4; ++type) {
+                state.bins[type].clear();
+            }
+            for (size_t k = 0; k < live; ++k) {
+                if (state.alive[k]) {
+                    int type = static_cast<int>(state.hits[k].mat->type());
+                    state.bins[type].push_back(static_cast<uint32_t>(k));
+                }
+            }
+        }
+
+        template <typename Material>
+        void shade(const std::vector<uint32_t> &bin, Batch &state, PathStats &path_stats) const {
+            // Stage 4: scatter every hit of one material type, then apply Russian roulette and
+            // the depth limit.
+            const Camera &cam = _camera;
+            PathBuffer &paths = state.paths;
+            Rng &rng = thread_rng();
+            SampleStream &stream = thread_sample_stream();
+
+            for (uint32_t k : bin) {
+                const HitRecord &rec = state.hits[k];
+                rng = paths.rng[k];
+                stream = paths.stream[k];
+                set_sample_dimension(Camera::bounce_dimension(paths.depth[k]));
+
+                ray scattered;
+                color attenuation;
+                bool alive = WavefrontScatter<Material>::call(*rec.mat, paths.get_ray(k), rec, attenuation, scattered);
+
+                if (alive) {
+                    color throughput = paths.throughput(k) * attenuation;
+                    bool survives = cam.survives_roulette(throughput, paths.depth[k]);
+                    alive = survives && paths.depth[k] < cam.max_depth;
+                    paths.set_throughput(k, throughput);
+                    paths.set_ray(k, scattered);
+                    if (!alive) {
+                        RT_COUNT(survives ? Counter::PathsDepthLimit : Counter::PathsRoulette);
+                    }
+                } else {
+                    RT_COUNT(Counter::PathsAbsorbed);
+                }
+
+                if (!alive) {
+                    finish(paths.depth[k], path_stats);
+                    state.alive[k] = 0;
+                }
+                paths.rng[k] = rng;
+            }
+        }
+
+        static size_t compact(size_t live, Batch &state) {
+            // Stage 5: squeeze the surviving paths to the front of the buffers, in order.
+            size_t kept = 0;
+            for (size_t k = 0; k < live; ++k) {
+                if (state.alive[k]) {
+                    if (kept != k) {
+                        state.paths.move(k, kept);
+                    }
+                    ++kept;
+                }
+            }
+            return kept;
+        }
+
+        static void finish(int depth, PathStats &path_stats) {
+            path_stats.rays += depth;
+            ++path_stats.path_lengths[depth];
+        }
+};
+
+#endif // WAVEFRONT_H